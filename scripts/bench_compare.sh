@@ -0,0 +1,107 @@
+#!/bin/sh
+
+# Compare microbenchmark samples against a baseline
+#
+#   bench_compare.sh <baseline-file> <run-file>
+#
+#   baseline-file, run-file: output of 'device-coap --bench-json', one JSON
+#   line of samples per benchmark, from the same machine
+#
+# For each benchmark in both files, tests whether the run is slower than the
+# baseline with a one-sided Mann-Whitney U test, which does not assume the
+# samples are normally distributed. Fails if any benchmark is significantly
+# slower and its median has grown beyond the tolerance, so noise alone and
+# significant but negligible changes both pass.
+#
+# Environment, with defaults:
+#   TOLERANCE  max % growth of median time (5)
+#   ALPHA      significance level (0.01)
+set -e
+
+if [ $# -lt 2 ]
+then
+  echo "Usage: $0 <baseline-file> <run-file>" >&2
+  exit 1
+fi
+
+TOLERANCE=${TOLERANCE:-5}
+ALPHA=${ALPHA:-0.01}
+
+awk -v tolerance="$TOLERANCE" -v alpha="$ALPHA" '
+# Reads the name and samples of a JSON line into set s; returns the name
+function parse(line, s,    name, list, count, i, v) {
+  if (!match(line, /"name":"[^"]*"/)) return ""
+  name = substr(line, RSTART + 8, RLENGTH - 9)
+  if (!match(line, /"samples":\[[^]]*\]/)) return ""
+  list = substr(line, RSTART + 11, RLENGTH - 12)
+  count = split(list, v, ",")
+  for (i = 1; i <= count; i++) samples[s, name, i] = v[i] + 0
+  n[s, name] = count
+  return name
+}
+
+# Sorts a[1..count] ascending, with b[] kept in step
+function sort(a, b, count,    i, j, x, y) {
+  for (i = 2; i <= count; i++) {
+    x = a[i]; y = b[i]
+    for (j = i - 1; j >= 1 && a[j] > x; j--) { a[j + 1] = a[j]; b[j + 1] = b[j] }
+    a[j + 1] = x; b[j + 1] = y
+  }
+}
+
+function median(s, name,    count, i, v, tag) {
+  count = n[s, name]
+  for (i = 1; i <= count; i++) { v[i] = samples[s, name, i]; tag[i] = 0 }
+  sort(v, tag, count)
+  return (count % 2) ? v[(count + 1) / 2] : (v[count / 2] + v[count / 2 + 1]) / 2
+}
+
+# Upper tail of the standard normal distribution; Abramowitz and Stegun 7.1.26
+function upper_tail(z,    t, x, erfc) {
+  x = (z < 0 ? -z : z) / sqrt(2)
+  t = 1 / (1 + 0.3275911 * x)
+  erfc = t * (0.254829592 + t * (-0.284496736 + t * (1.421413741 + t * (-1.453152027 + t * 1.061405429)))) * exp(-x * x)
+  return (z < 0) ? 1 - erfc / 2 : erfc / 2
+}
+
+# One-sided p-value that run samples are larger than baseline samples
+function mann_whitney(name,    n1, n2, total, i, j, k, v, from_run, ranks, rank, ties, u, mean, var) {
+  n1 = n["run", name]; n2 = n["base", name]; total = n1 + n2
+  for (i = 1; i <= n1; i++) { v[i] = samples["run", name, i]; from_run[i] = 1 }
+  for (i = 1; i <= n2; i++) { v[n1 + i] = samples["base", name, i]; from_run[n1 + i] = 0 }
+  sort(v, from_run, total)
+
+  # tied samples share their mean rank
+  ranks = 0; ties = 0
+  for (i = 1; i <= total; i = j) {
+    for (j = i + 1; j <= total && v[j] == v[i]; j++) ;
+    rank = (i + j - 1) / 2
+    for (k = i; k < j; k++) if (from_run[k]) ranks += rank
+    ties += (j - i) ^ 3 - (j - i)
+  }
+  u = ranks - n1 * (n1 + 1) / 2
+  mean = n1 * n2 / 2
+  var = n1 * n2 / 12 * ((total + 1) - ties / (total * (total - 1)))
+  if (var <= 0) return (u > mean) ? 0 : 1
+  return upper_tail((u - mean - 0.5) / sqrt(var))
+}
+
+FNR == NR { name = parse($0, "base"); if (name != "") base_names[++base_count] = name; next }
+{ name = parse($0, "run"); if (name != "") in_run[name] = 1 }
+
+END {
+  failed = 0
+  printf "%-24s %12s %12s %8s %10s  %s\n", "benchmark", "base ns", "run ns", "change", "p", "result"
+  for (i = 1; i <= base_count; i++) {
+    name = base_names[i]
+    if (!(name in in_run)) { printf "%-24s not in run\n", name; continue }
+    base_median = median("base", name); run_median = median("run", name)
+    change = base_median ? (run_median - base_median) * 100 / base_median : 0
+    p = mann_whitney(name)
+    result = (p < alpha && change > tolerance) ? "SLOWER" : "ok"
+    if (result != "ok") failed = 1
+    printf "%-24s %12.2f %12.2f %+7.1f%% %10.2g  %s\n", name, base_median, run_median, change, p, result
+  }
+  exit failed
+}
+' "$1" "$2"
@@ -7,6 +7,11 @@
 #   Options:
 #   build-csdk: 1 to build EdgeX C SDK, 0 to skip
 #
+#   Environment:
+#   DTLS_BACKEND: DTLS library for libcoap; 'tinydtls' (default) supports
+#   PSK only, while 'openssl' or 'gnutls' also support the X509 and RPK
+#   security modes, and must be installed with headers
+#
 # Assumes WORKDIR is /device-coap
 set -e -x
 
@@ -16,6 +21,7 @@ TINYDTLS_VERSION=b0e230d
 LIBCOAP_VERSION=1739507
 CBOR_VERSION=0.7.0
 CSDK_VERSION=2.0.0
+DTLS_BACKEND=${DTLS_BACKEND:-tinydtls}
 
 if [ -d deps ]
 then
@@ -55,7 +61,7 @@ patch -p1 < /device-coap/scripts/FindTinyDTLS_cmake_patch
 patch -p1 < /device-coap/scripts/config_h_in_patch
 
 mkdir -p build && cd build
-cmake -DWITH_EPOLL=OFF -DDTLS_BACKEND=tinydtls -DUSE_VENDORED_TINYDTLS=OFF \
+cmake -DWITH_EPOLL=OFF -DDTLS_BACKEND=${DTLS_BACKEND} -DUSE_VENDORED_TINYDTLS=OFF \
       -DENABLE_TESTS=OFF -DENABLE_EXAMPLES=OFF -DENABLE_DOCS=OFF \
       -DCMAKE_BUILD_TYPE=Release -DBUILD_SHARED_LIBS=ON \
       ..
@@ -0,0 +1,110 @@
+#!/bin/sh
+
+# Measure the cost of DTLS handshakes to a running device-coap service
+#
+#   handshake_bench.sh <server-host>
+#
+# Posts readings one at a time, each from a new coap-client process and so a
+# new DTLS session, and reads /stats before and after. Reports the server CPU
+# time per handshake, and the median and 99th percentile time for a client
+# to handshake and post. Run it once against a server in each SecurityMode to
+# compare them; the client time includes starting coap-client, which is the
+# same for each mode. In X509 mode it also reports the hits and misses in the
+# server's cache of accepted common names. The first handshake from a device
+# misses; later ones hit until the entry expires.
+#
+# Environment, with defaults:
+#   COUNT             handshakes (200)
+#   DEVICE            device for readings, with an Int32 resource 'int' (d1)
+#   SERVER_PORT       server port (5684)
+#   PSK_USER, PSK_KEY DTLS PSK identity and key, for PSK mode
+#   CLIENT_CERT       PEM file with the client certificate and private key,
+#                     for X509 or RPK mode
+#
+# Requires libcoap's coap-client, built with a DTLS library that supports
+# the mode.
+set -e
+
+if [ $# -lt 1 ]
+then
+  echo "Usage: $0 <server-host>" >&2
+  exit 1
+fi
+
+HOST=$1
+COUNT=${COUNT:-200}
+DEVICE=${DEVICE:-d1}
+SERVER_PORT=${SERVER_PORT:-5684}
+
+if [ -n "$PSK_KEY" ]
+then
+  MODE=PSK
+  SECURITY="-u ${PSK_USER:-bench} -k $PSK_KEY"
+elif [ -n "$CLIENT_CERT" ]
+then
+  MODE=certificate
+  SECURITY="-c $CLIENT_CERT"
+else
+  echo "FAIL: set PSK_KEY or CLIENT_CERT" >&2
+  exit 1
+fi
+
+# Extracts a numeric member from JSON text; first match wins, 0 if absent
+json_value() {
+  VALUE=$(echo "$1" | grep -o "\"$2\":[0-9]*" | head -n 1 | cut -d: -f2)
+  echo ${VALUE:-0}
+}
+
+# Extracts the members of the certificate cache object from /stats
+certs_json() {
+  echo "$1" | sed -n 's/.*"certs":{\([^}]*\)}.*/\1/p'
+}
+
+get_stats() {
+  coap-client -m get $SECURITY coaps://$HOST:$SERVER_PORT/stats 2>/dev/null < /dev/null
+}
+
+TIMES=$(mktemp)
+trap 'rm -f $TIMES' EXIT
+
+BEFORE=$(get_stats)
+if [ -z "$BEFORE" ]
+then
+  echo "FAIL: no response from coaps://$HOST:$SERVER_PORT/stats" >&2
+  exit 1
+fi
+
+N=0
+FAILED=0
+while [ $N -lt $COUNT ]
+do
+  START=$(date +%s%N)
+  if ! coap-client -m post -t 0 -e "$((N % 1000))" $SECURITY \
+                   coaps://$HOST:$SERVER_PORT/a1r/$DEVICE/int > /dev/null 2>&1 < /dev/null
+  then
+    FAILED=$((FAILED + 1))
+  fi
+  echo $(( ($(date +%s%N) - START) / 1000 )) >> $TIMES
+  N=$((N + 1))
+done
+AFTER=$(get_stats)
+
+# one more handshake for the second /stats request
+HANDSHAKES=$((COUNT + 1))
+CPU_USEC=$(($(json_value "$AFTER" userUsec) + $(json_value "$AFTER" systemUsec) \
+            - $(json_value "$BEFORE" userUsec) - $(json_value "$BEFORE" systemUsec)))
+HITS=$(($(json_value "$(certs_json "$AFTER")" hits) - $(json_value "$(certs_json "$BEFORE")" hits)))
+MISSES=$(($(json_value "$(certs_json "$AFTER")" misses) - $(json_value "$(certs_json "$BEFORE")" misses)))
+
+echo "$MODE: $COUNT handshakes to $HOST:$SERVER_PORT, $FAILED failed"
+sort -n $TIMES | awk -v cpu=$CPU_USEC -v handshakes=$HANDSHAKES '
+{ t[NR] = $1 }
+END {
+  printf "server CPU %.1f us per handshake\n", cpu / handshakes
+  printf "client handshake and post: median %.1f ms, p99 %.1f ms\n",
+         t[int((NR + 1) / 2)] / 1000, t[int(NR * 0.99 + 0.5) ? int(NR * 0.99 + 0.5) : 1] / 1000
+}'
+if [ -n "$(certs_json "$AFTER")" ]
+then
+  echo "certificate cache: $HITS hits, $MISSES misses"
+fi
@@ -0,0 +1,88 @@
+#!/bin/sh
+
+# Compare request latency of device-coap in low latency and default modes
+#
+#   latency_compare.sh <server-host> <default-port> <low-latency-port>
+#
+# Runs loopback_bench against two NoSec device-coap services on the same
+# host: one with the default settings, and one with LowLatency enabled. They
+# take turns, ROUNDS times, so a change in machine load affects both alike.
+# Then compares the low latency run against the default one with
+# bench_compare.sh, which prints the median mean and p99 round trip of each
+# and fails if low latency mode is significantly slower. Run the services
+# with the same configuration apart from the low latency settings, on an
+# otherwise quiet machine; the low latency service spins a CPU, so give it
+# IoCpu on a separate core from the default service.
+#
+# Environment, with defaults:
+#   ROUNDS            turns for each service (5)
+#   SAMPLES           samples per benchmark in each turn (4)
+#   REQUESTS          requests per sample (1000)
+#   DEVICE            device for readings, with an Int32 resource 'int' (d1)
+#   LOOPBACK_BENCH    benchmark executable (build/loopback_bench; built if
+#                     missing)
+#   OUT               directory for the samples, kept for later comparison
+#                     (a temporary directory)
+#
+# Both services must know the device, as for soak.sh.
+set -e
+
+if [ $# -lt 3 ]
+then
+  echo "Usage: $0 <server-host> <default-port> <low-latency-port>" >&2
+  exit 1
+fi
+
+ROOT=$(dirname $(dirname $(readlink -f $0)))
+HOST=$1
+DEFAULT_PORT=$2
+LOW_LATENCY_PORT=$3
+ROUNDS=${ROUNDS:-5}
+SAMPLES=${SAMPLES:-4}
+REQUESTS=${REQUESTS:-1000}
+DEVICE=${DEVICE:-d1}
+LOOPBACK_BENCH=${LOOPBACK_BENCH:-$ROOT/build/loopback_bench}
+
+if [ ! -x "$LOOPBACK_BENCH" ]
+then
+  mkdir -p $(dirname $LOOPBACK_BENCH)
+  ${CC:-cc} -O2 -o $LOOPBACK_BENCH $ROOT/scripts/loopback_bench.c
+fi
+
+if [ -z "$OUT" ]
+then
+  OUT=$(mktemp -d)
+  trap 'rm -rf $OUT' EXIT
+fi
+mkdir -p $OUT
+
+# Appends each benchmark's samples from a turn to those of earlier turns
+merge() {
+  if [ -s "$1" ]
+  then
+    paste -d '\n' "$1" "$2" | awk '
+NR % 2 == 1 { line = $0; next }
+{
+  match($0, /"samples":\[[^]]*\]/)
+  sub(/\]\}$/, "," substr($0, RSTART + 11, RLENGTH - 12) "]}", line)
+  print line
+}' > "$1.new"
+    mv "$1.new" "$1"
+  else
+    cp "$2" "$1"
+  fi
+}
+
+rm -f $OUT/default.jsonl $OUT/low_latency.jsonl
+N=0
+while [ $N -lt $ROUNDS ]
+do
+  $LOOPBACK_BENCH -n $SAMPLES -r $REQUESTS -d $DEVICE $HOST $DEFAULT_PORT > $OUT/turn.jsonl
+  merge $OUT/default.jsonl $OUT/turn.jsonl
+  $LOOPBACK_BENCH -n $SAMPLES -r $REQUESTS -d $DEVICE $HOST $LOW_LATENCY_PORT > $OUT/turn.jsonl
+  merge $OUT/low_latency.jsonl $OUT/turn.jsonl
+  N=$((N + 1))
+done
+
+echo "default mode as base, low latency mode as run"
+$ROOT/scripts/bench_compare.sh $OUT/default.jsonl $OUT/low_latency.jsonl
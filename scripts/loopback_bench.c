@@ -0,0 +1,318 @@
+/* End-to-end benchmark of a device-coap service over loopback
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Posts Int32 readings as CON requests to a NoSec server, and times the round
+ * trip from request to 2.04 response. Prints samples as JSON lines, like
+ * 'device-coap --bench-json', so scripts/bench_compare.sh can compare runs:
+ *
+ *   loopback_rtt            ns per request, one request outstanding
+ *   loopback_rtt_p99        99th percentile round trip of a request, in ns
+ *   loopback_pipelined      ns per request, with a window of requests outstanding
+ *   loopback_pipelined_p99  99th percentile round trip, with the window
+ *
+ * Each sample of a _p99 benchmark is the percentile over the requests of one
+ * sample, so bench_compare.sh tests a change in tail latency, like jitter
+ * from wakeups, as well as in the mean.
+ *
+ *   cc -O2 -o loopback_bench scripts/loopback_bench.c
+ *   loopback_bench [options] <server-host> [<server-port>]
+ *
+ * Options, with defaults:
+ *   -n samples              samples per benchmark (20)
+ *   -r requests             requests per sample (1000)
+ *   -w window               requests outstanding when pipelined (16)
+ *   -d device               device for readings, with an Int32 resource (d1)
+ *   -p resource             resource name (int)
+ *
+ * Fails if any request is refused or times out, since a sample would then
+ * time the failure rather than the server.
+ */
+
+#define _GNU_SOURCE
+#include <netdb.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define MAX_WINDOW 256
+#define MAX_MESSAGE 256
+#define RESPONSE_TIMEOUT_MSEC 2000
+#define COAP_CON 0
+#define COAP_ACK 2
+#define COAP_POST 0x02
+#define COAP_CHANGED 0x44
+#define OPTION_URI_PATH 11
+
+/* Request awaiting its response */
+typedef struct pending
+{
+  uint16_t mid;
+  uint64_t sent;               /* ns */
+} pending;
+
+typedef struct bench_params
+{
+  unsigned samples;
+  unsigned requests;
+  unsigned window;
+  const char *device;
+  const char *resource;
+} bench_params;
+
+static uint16_t next_mid;
+static uint64_t failures;
+
+static uint64_t
+now_nsec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+/* Appends an option with a delta below 13 and a value shorter than 13 bytes */
+static size_t
+add_option (uint8_t *msg, size_t len, unsigned delta, const char *value)
+{
+  size_t value_len = strlen (value);
+  msg[len++] = (uint8_t)(delta << 4 | value_len);
+  memcpy (msg + len, value, value_len);
+  return len + value_len;
+}
+
+/* Encodes a CON POST of value to /a1r/{device}/{resource} */
+static size_t
+encode_post (uint8_t *msg, uint16_t mid, const bench_params *params, unsigned value)
+{
+  size_t len = 0;
+  msg[len++] = 0x40 | COAP_CON << 4;
+  msg[len++] = COAP_POST;
+  msg[len++] = mid >> 8;
+  msg[len++] = mid & 0xFF;
+  len = add_option (msg, len, OPTION_URI_PATH, "a1r");
+  len = add_option (msg, len, 0, params->device);
+  len = add_option (msg, len, 0, params->resource);
+  msg[len++] = 0xFF;
+  len += sprintf ((char *)msg + len, "%u", value % 1000);
+  return len;
+}
+
+static bool
+send_post (int fd, const bench_params *params, pending *request)
+{
+  uint8_t msg[MAX_MESSAGE];
+  request->mid = next_mid++;
+  size_t len = encode_post (msg, request->mid, params, request->mid);
+  request->sent = now_nsec ();
+  if (send (fd, msg, len, 0) < 0)
+  {
+    perror ("send");
+    return false;
+  }
+  return true;
+}
+
+/*
+ * Receives a response, and removes its request from the outstanding ones.
+ *
+ * @param[out] rtt  round trip of the request, in ns
+ * @return false on timeout
+ */
+static bool
+receive_response (int fd, pending *outstanding, unsigned *count, uint64_t *rtt)
+{
+  struct pollfd pfd = { .fd = fd, .events = POLLIN };
+  uint8_t msg[MAX_MESSAGE];
+  while (true)
+  {
+    if (poll (&pfd, 1, RESPONSE_TIMEOUT_MSEC) <= 0)
+    {
+      return false;
+    }
+    ssize_t len = recv (fd, msg, sizeof (msg), 0);
+    if (len < 4 || (msg[0] >> 4 & 0x03) != COAP_ACK)
+    {
+      continue;
+    }
+    uint16_t mid = msg[2] << 8 | msg[3];
+    for (unsigned i = 0; i < *count; i++)
+    {
+      if (outstanding[i].mid == mid)
+      {
+        *rtt = now_nsec () - outstanding[i].sent;
+        if (msg[1] != COAP_CHANGED)
+        {
+          failures++;
+        }
+        outstanding[i] = outstanding[--*count];
+        return true;
+      }
+    }
+  }
+}
+
+static int
+compare_rtt (const void *a, const void *b)
+{
+  uint64_t x = *(const uint64_t *)a;
+  uint64_t y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+/*
+ * Sends requests with up to window outstanding, and waits for all responses.
+ *
+ * @param[out] p99  99th percentile round trip, in ns
+ * @return nanoseconds per request, or a negative value on timeout
+ */
+static double
+run_sample (int fd, const bench_params *params, unsigned window, double *p99)
+{
+  pending outstanding[MAX_WINDOW];
+  uint64_t *rtt = malloc (params->requests * sizeof (uint64_t));
+  unsigned received = 0;
+  if (!rtt)
+  {
+    perror ("malloc");
+    return -1;
+  }
+  unsigned count = 0;
+  unsigned sent = 0;
+  uint64_t start = now_nsec ();
+  while (sent < params->requests || count)
+  {
+    while (sent < params->requests && count < window)
+    {
+      if (!send_post (fd, params, &outstanding[count]))
+      {
+        free (rtt);
+        return -1;
+      }
+      count++;
+      sent++;
+    }
+    if (!receive_response (fd, outstanding, &count, &rtt[received++]))
+    {
+      fprintf (stderr, "timeout with %u requests outstanding\n", count);
+      free (rtt);
+      return -1;
+    }
+  }
+  double nsec = (double)(now_nsec () - start) / params->requests;
+  qsort (rtt, received, sizeof (uint64_t), compare_rtt);
+  *p99 = rtt[(received * 99 + 99) / 100 - 1];
+  free (rtt);
+  return nsec;
+}
+
+static void
+print_samples (const char *name, const char *suffix, const double *samples, unsigned count)
+{
+  printf ("{\"name\":\"%s%s\",\"unit\":\"ns\",\"samples\":[", name, suffix);
+  for (unsigned s = 0; s < count; s++)
+  {
+    printf ("%s%.2f", s ? "," : "", samples[s]);
+  }
+  printf ("]}\n");
+}
+
+static bool
+run_bench (int fd, const bench_params *params, const char *name, unsigned window)
+{
+  /* warm up the server's route cache and the client's */
+  bench_params warmup = *params;
+  warmup.requests = params->requests / 10 + 1;
+  double p99;
+  if (run_sample (fd, &warmup, window, &p99) < 0)
+  {
+    return false;
+  }
+
+  double *mean = calloc (params->samples, sizeof (double));
+  double *tail = calloc (params->samples, sizeof (double));
+  bool ok = mean && tail;
+  for (unsigned s = 0; ok && s < params->samples; s++)
+  {
+    ok = (mean[s] = run_sample (fd, params, window, &tail[s])) >= 0;
+  }
+  if (ok)
+  {
+    print_samples (name, "", mean, params->samples);
+    print_samples (name, "_p99", tail, params->samples);
+    fflush (stdout);
+  }
+  free (mean);
+  free (tail);
+  return ok;
+}
+
+static void
+usage (const char *prog)
+{
+  fprintf (stderr, "Usage: %s [-n samples] [-r requests] [-w window] [-d device] [-p resource] "
+           "<server-host> [<server-port>]\n", prog);
+}
+
+int
+main (int argc, char *argv[])
+{
+  bench_params params = { .samples = 20, .requests = 1000, .window = 16, .device = "d1",
+                          .resource = "int" };
+  int opt;
+  while ((opt = getopt (argc, argv, "n:r:w:d:p:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'n': params.samples = atoi (optarg); break;
+      case 'r': params.requests = atoi (optarg); break;
+      case 'w': params.window = atoi (optarg); break;
+      case 'd': params.device = optarg; break;
+      case 'p': params.resource = optarg; break;
+      default: usage (argv[0]); return 1;
+    }
+  }
+  if (optind >= argc || !params.samples || !params.requests || !params.window ||
+      params.window > MAX_WINDOW || strlen (params.device) > 12 || strlen (params.resource) > 12)
+  {
+    usage (argv[0]);
+    return 1;
+  }
+  const char *port = (optind + 1 < argc) ? argv[optind + 1] : "5683";
+
+  struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_DGRAM };
+  struct addrinfo *server;
+  int err = getaddrinfo (argv[optind], port, &hints, &server);
+  if (err)
+  {
+    fprintf (stderr, "%s: %s\n", argv[optind], gai_strerror (err));
+    return 1;
+  }
+  int fd = socket (server->ai_family, SOCK_DGRAM, 0);
+  if (fd < 0 || connect (fd, server->ai_addr, server->ai_addrlen) < 0)
+  {
+    perror ("socket");
+    return 1;
+  }
+  freeaddrinfo (server);
+  srand (time (NULL));
+  next_mid = rand ();
+
+  bool ok = run_bench (fd, &params, "loopback_rtt", 1) &&
+            run_bench (fd, &params, "loopback_pipelined", params.window);
+  close (fd);
+  if (failures)
+  {
+    fprintf (stderr, "%lu requests not answered with 2.04\n", (unsigned long)failures);
+    ok = false;
+  }
+  return ok ? 0 : 1;
+}
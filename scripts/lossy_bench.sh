@@ -0,0 +1,132 @@
+#!/bin/sh
+
+# Benchmark a running device-coap service over an emulated lossy link
+#
+#   lossy_bench.sh <server-host>
+#
+# Starts lossy_proxy between coap-client and the server, posts readings
+# through it at a steady rate, and reads /stats directly before and after.
+# Reports offered readings, goodput (readings accepted per second), and the
+# server CPU time per accepted reading, so retransmission, duplicate and
+# handshake costs show up as they would on an LPWAN or cellular link. Other
+# traffic to the server during the run is counted too, so use a quiet server.
+#
+# Environment, with defaults:
+#   DURATION          seconds of load (60)
+#   RATE              readings posted per second (20)
+#   LOSS              % of datagrams dropped, each direction (10)
+#   DELAY             one way delay in msec (100)
+#   JITTER            delay varies by +/- msec (30)
+#   REORDER           % of datagrams reordered (5)
+#   DUPLICATE         % of datagrams duplicated (2)
+#   DEVICE            device for readings, with an Int32 resource 'int' (d1)
+#   SERVER_PORT       server port (5683, or 5684 with PSK)
+#   PROXY_PORT        local port for the proxy (15683)
+#   PSK_USER, PSK_KEY DTLS PSK identity and key; if set, uses coaps, and each
+#                     reading opens a new DTLS session through the proxy
+#   LOSSY_PROXY       proxy executable (build/lossy_proxy; built if missing)
+#
+# Requires libcoap's coap-client, and a C compiler to build the proxy.
+set -e
+
+if [ $# -lt 1 ]
+then
+  echo "Usage: $0 <server-host>" >&2
+  exit 1
+fi
+
+ROOT=$(dirname $(dirname $(readlink -f $0)))
+HOST=$1
+DURATION=${DURATION:-60}
+RATE=${RATE:-20}
+LOSS=${LOSS:-10}
+DELAY=${DELAY:-100}
+JITTER=${JITTER:-30}
+REORDER=${REORDER:-5}
+DUPLICATE=${DUPLICATE:-2}
+DEVICE=${DEVICE:-d1}
+PROXY_PORT=${PROXY_PORT:-15683}
+LOSSY_PROXY=${LOSSY_PROXY:-$ROOT/build/lossy_proxy}
+
+if [ -n "$PSK_KEY" ]
+then
+  SCHEME=coaps
+  SERVER_PORT=${SERVER_PORT:-5684}
+  SECURITY="-u ${PSK_USER:-bench} -k $PSK_KEY"
+else
+  SCHEME=coap
+  SERVER_PORT=${SERVER_PORT:-5683}
+  SECURITY=""
+fi
+
+if [ ! -x "$LOSSY_PROXY" ]
+then
+  mkdir -p $(dirname $LOSSY_PROXY)
+  ${CC:-cc} -O2 -o $LOSSY_PROXY $ROOT/scripts/lossy_proxy.c
+fi
+
+# Extracts a numeric member from JSON text; first match wins
+json_value() {
+  echo "$1" | grep -o "\"$2\":[0-9]*" | head -n 1 | cut -d: -f2
+}
+
+get_stats() {
+  coap-client -m get $SECURITY $SCHEME://$HOST:$SERVER_PORT/stats 2>/dev/null < /dev/null
+}
+
+PROXY_LOG=$(mktemp)
+$LOSSY_PROXY -l $LOSS -d $DELAY -j $JITTER -r $REORDER -u $DUPLICATE \
+             $PROXY_PORT $HOST $SERVER_PORT > $PROXY_LOG &
+PROXY_PID=$!
+trap 'kill $PROXY_PID 2>/dev/null; rm -f $PROXY_LOG' EXIT
+
+BEFORE=$(get_stats)
+if [ -z "$BEFORE" ]
+then
+  echo "FAIL: no response from $SCHEME://$HOST:$SERVER_PORT/stats" >&2
+  exit 1
+fi
+
+START=$(date +%s)
+N=0
+while [ $(($(date +%s) - START)) -lt $DURATION ]
+do
+  i=0
+  while [ $i -lt $RATE ]
+  do
+    # CON, so the client retransmits a lost request or response; gives up after 60s
+    coap-client -m post -t 0 -B 60 -e "$((N % 1000))" $SECURITY \
+                $SCHEME://127.0.0.1:$PROXY_PORT/a1r/$DEVICE/int > /dev/null 2>&1 < /dev/null &
+    N=$((N + 1))
+    i=$((i + 1))
+  done
+  sleep 1
+done
+# retransmissions continue after the last reading is offered
+while pgrep -P $$ coap-client > /dev/null
+do
+  sleep 1
+done
+ELAPSED=$(($(date +%s) - START))
+AFTER=$(get_stats)
+
+kill -INT $PROXY_PID
+wait $PROXY_PID || true
+
+READINGS=$(($(json_value "$AFTER" readings) - $(json_value "$BEFORE" readings)))
+REQUESTS=$(($(json_value "$AFTER" requests) - $(json_value "$BEFORE" requests)))
+REJECTED=$(($(json_value "$AFTER" rejected) - $(json_value "$BEFORE" rejected)))
+CPU_USEC=$(($(json_value "$AFTER" userUsec) + $(json_value "$AFTER" systemUsec) \
+            - $(json_value "$BEFORE" userUsec) - $(json_value "$BEFORE" systemUsec)))
+
+echo "link: loss ${LOSS}%, delay ${DELAY}+/-${JITTER} ms, reorder ${REORDER}%, duplicate ${DUPLICATE}%"
+cat $PROXY_LOG
+awk -v offered=$N -v readings=$READINGS -v requests=$REQUESTS -v rejected=$REJECTED \
+    -v cpu=$CPU_USEC -v elapsed=$ELAPSED 'BEGIN {
+  printf "offered %d readings in %d s; server handled %d requests, rejected %d\n",
+         offered, elapsed, requests, rejected
+  printf "accepted %d readings (%.1f%%), goodput %.2f readings/s\n",
+         readings, offered ? readings * 100 / offered : 0, elapsed ? readings / elapsed : 0
+  printf "server CPU %.3f s, %.1f us per accepted reading\n",
+         cpu / 1e6, readings ? cpu / readings : 0
+}'
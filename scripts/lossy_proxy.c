@@ -0,0 +1,419 @@
+/* UDP proxy that emulates a lossy link, for benchmarking device-coap
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ * Forwards datagrams between clients and a server, and drops, delays,
+ * reorders and duplicates them at random, in both directions. Each client
+ * address gets its own socket toward the server, so the server sees one peer
+ * per client, and responses are returned to the right client. Works for
+ * CoAP and DTLS alike, since it does not look inside a datagram.
+ *
+ *   cc -O2 -o lossy_proxy scripts/lossy_proxy.c
+ *   lossy_proxy [options] <listen-port> <server-host> <server-port>
+ *
+ * Prints counts per direction on SIGINT or SIGTERM, and each -i seconds.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#define MAX_CLIENTS 1024
+#define MAX_DATAGRAM 65536
+#define RECV_BUFFER_SIZE (4 * 1024 * 1024)
+
+/* Link behavior, for each direction */
+typedef struct link_params
+{
+  double loss;                 /* probability a datagram is dropped */
+  double duplicate;            /* probability a datagram is sent twice */
+  double reorder;              /* probability a datagram is held for reorder_gap */
+  uint64_t delay_usec;         /* one way delay */
+  uint64_t jitter_usec;        /* delay varies uniformly by +/- jitter */
+  uint64_t reorder_gap_usec;   /* extra delay of a reordered datagram */
+} link_params;
+
+typedef struct link_counts
+{
+  uint64_t received;
+  uint64_t bytes;
+  uint64_t dropped;
+  uint64_t duplicated;
+  uint64_t reordered;
+  uint64_t sent;
+} link_counts;
+
+/* Client, and its socket toward the server */
+typedef struct client
+{
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  int fd;
+} client;
+
+/* Datagram waiting to be sent */
+typedef struct pending
+{
+  uint64_t due_usec;
+  int fd;                      /* socket to send from */
+  const client *to;            /* client to send to; NULL for the server */
+  size_t len;
+  uint8_t data[];
+} pending;
+
+static link_params params;
+static link_counts upstream;   /* client to server */
+static link_counts downstream; /* server to client */
+static client clients[MAX_CLIENTS];
+static unsigned client_count;
+static struct sockaddr_storage server_addr;
+static socklen_t server_addr_len;
+
+/* min-heap of datagrams by due time */
+static pending **heap;
+static size_t heap_len;
+static size_t heap_cap;
+
+static volatile sig_atomic_t stop;
+
+static void
+handle_sig (int signum)
+{
+  (void)signum;
+  stop = 1;
+}
+
+static uint64_t
+now_usec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double
+random_unit (void)
+{
+  return (double)random () / ((double)RAND_MAX + 1);
+}
+
+static bool
+heap_push (pending *p)
+{
+  if (heap_len == heap_cap)
+  {
+    size_t cap = heap_cap ? heap_cap * 2 : 256;
+    pending **grown = realloc (heap, cap * sizeof (*heap));
+    if (!grown)
+    {
+      return false;
+    }
+    heap = grown;
+    heap_cap = cap;
+  }
+  size_t i = heap_len++;
+  while (i && heap[(i - 1) / 2]->due_usec > p->due_usec)
+  {
+    heap[i] = heap[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  heap[i] = p;
+  return true;
+}
+
+static pending *
+heap_pop (void)
+{
+  pending *top = heap[0];
+  pending *last = heap[--heap_len];
+  size_t i = 0;
+  for (;;)
+  {
+    size_t child = 2 * i + 1;
+    if (child >= heap_len)
+    {
+      break;
+    }
+    if (child + 1 < heap_len && heap[child + 1]->due_usec < heap[child]->due_usec)
+    {
+      child++;
+    }
+    if (heap[child]->due_usec >= last->due_usec)
+    {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  if (heap_len)
+  {
+    heap[i] = last;
+  }
+  return top;
+}
+
+/* Queues a copy of a datagram to send after the link delay */
+static void
+schedule (const uint8_t *data, size_t len, int fd, const client *to, uint64_t now, bool reorder,
+          link_counts *counts)
+{
+  pending *p = malloc (sizeof (*p) + len);
+  if (!p)
+  {
+    counts->dropped++;
+    return;
+  }
+  int64_t delay = (int64_t)params.delay_usec;
+  if (params.jitter_usec)
+  {
+    delay += (int64_t)(random_unit () * 2 * params.jitter_usec) - (int64_t)params.jitter_usec;
+  }
+  if (reorder)
+  {
+    delay += params.reorder_gap_usec;
+  }
+  p->due_usec = now + (delay > 0 ? (uint64_t)delay : 0);
+  p->fd = fd;
+  p->to = to;
+  p->len = len;
+  memcpy (p->data, data, len);
+  if (!heap_push (p))
+  {
+    free (p);
+    counts->dropped++;
+  }
+}
+
+/* Applies the link to a received datagram */
+static void
+forward (const uint8_t *data, size_t len, int fd, const client *to, uint64_t now, link_counts *counts)
+{
+  counts->received++;
+  counts->bytes += len;
+  if (random_unit () < params.loss)
+  {
+    counts->dropped++;
+    return;
+  }
+  bool reorder = random_unit () < params.reorder;
+  counts->reordered += reorder;
+  schedule (data, len, fd, to, now, reorder, counts);
+  if (random_unit () < params.duplicate)
+  {
+    counts->duplicated++;
+    schedule (data, len, fd, to, now, false, counts);
+  }
+}
+
+/* Finds the client for an address, and adds it with a new socket if not found */
+static client *
+find_client (const struct sockaddr_storage *addr, socklen_t addr_len)
+{
+  for (unsigned i = 0; i < client_count; i++)
+  {
+    if (clients[i].addr_len == addr_len && !memcmp (&clients[i].addr, addr, addr_len))
+    {
+      return &clients[i];
+    }
+  }
+  if (client_count == MAX_CLIENTS)
+  {
+    return NULL;
+  }
+  int fd = socket (server_addr.ss_family, SOCK_DGRAM, 0);
+  if (fd < 0 || connect (fd, (struct sockaddr *)&server_addr, server_addr_len) < 0)
+  {
+    perror ("server socket");
+    if (fd >= 0)
+    {
+      close (fd);
+    }
+    return NULL;
+  }
+  client *c = &clients[client_count++];
+  memcpy (&c->addr, addr, addr_len);
+  c->addr_len = addr_len;
+  c->fd = fd;
+  return c;
+}
+
+static void
+print_counts (const char *name, const link_counts *counts)
+{
+  printf ("%s: received %lu (%lu bytes), dropped %lu, duplicated %lu, reordered %lu, sent %lu\n",
+          name, (unsigned long)counts->received, (unsigned long)counts->bytes,
+          (unsigned long)counts->dropped, (unsigned long)counts->duplicated,
+          (unsigned long)counts->reordered, (unsigned long)counts->sent);
+  fflush (stdout);
+}
+
+static void
+usage (const char *name)
+{
+  fprintf (stderr,
+           "Usage: %s [options] <listen-port> <server-host> <server-port>\n"
+           "  -l <percent>  loss (0)\n"
+           "  -d <msec>     one way delay (0)\n"
+           "  -j <msec>     jitter, +/- around the delay (0)\n"
+           "  -r <percent>  reordering (0)\n"
+           "  -g <msec>     extra delay of a reordered datagram (20)\n"
+           "  -u <percent>  duplication (0)\n"
+           "  -s <seed>     random seed (1)\n"
+           "  -i <sec>      print counts at this interval (0, only at exit)\n", name);
+}
+
+int
+main (int argc, char *argv[])
+{
+  unsigned seed = 1;
+  unsigned interval = 0;
+  params.reorder_gap_usec = 20000;
+
+  int opt;
+  while ((opt = getopt (argc, argv, "l:d:j:r:g:u:s:i:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'l': params.loss = atof (optarg) / 100; break;
+      case 'd': params.delay_usec = (uint64_t)(atof (optarg) * 1000); break;
+      case 'j': params.jitter_usec = (uint64_t)(atof (optarg) * 1000); break;
+      case 'r': params.reorder = atof (optarg) / 100; break;
+      case 'g': params.reorder_gap_usec = (uint64_t)(atof (optarg) * 1000); break;
+      case 'u': params.duplicate = atof (optarg) / 100; break;
+      case 's': seed = (unsigned)strtoul (optarg, NULL, 10); break;
+      case 'i': interval = (unsigned)strtoul (optarg, NULL, 10); break;
+      default: usage (argv[0]); return EXIT_FAILURE;
+    }
+  }
+  if (argc - optind != 3)
+  {
+    usage (argv[0]);
+    return EXIT_FAILURE;
+  }
+  srandom (seed);
+
+  struct addrinfo hints = { .ai_socktype = SOCK_DGRAM };
+  struct addrinfo *info;
+  int rc = getaddrinfo (argv[optind + 1], argv[optind + 2], &hints, &info);
+  if (rc)
+  {
+    fprintf (stderr, "%s: %s\n", argv[optind + 1], gai_strerror (rc));
+    return EXIT_FAILURE;
+  }
+  memcpy (&server_addr, info->ai_addr, info->ai_addrlen);
+  server_addr_len = info->ai_addrlen;
+  freeaddrinfo (info);
+
+  hints.ai_family = server_addr.ss_family;
+  hints.ai_flags = AI_PASSIVE;
+  if ((rc = getaddrinfo (NULL, argv[optind], &hints, &info)))
+  {
+    fprintf (stderr, "%s: %s\n", argv[optind], gai_strerror (rc));
+    return EXIT_FAILURE;
+  }
+  int listen_fd = socket (info->ai_family, SOCK_DGRAM, 0);
+  if (listen_fd < 0 || bind (listen_fd, info->ai_addr, info->ai_addrlen) < 0)
+  {
+    perror ("listen socket");
+    return EXIT_FAILURE;
+  }
+  freeaddrinfo (info);
+  /* absorb bursts from a load generator; limited by net.core.rmem_max */
+  int rcvbuf = RECV_BUFFER_SIZE;
+  setsockopt (listen_fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+
+  struct sigaction sa = { .sa_handler = handle_sig };
+  sigemptyset (&sa.sa_mask);
+  sigaction (SIGINT, &sa, NULL);
+  sigaction (SIGTERM, &sa, NULL);
+
+  static struct pollfd fds[MAX_CLIENTS + 1];
+  static uint8_t buf[MAX_DATAGRAM];
+  uint64_t next_print = interval ? now_usec () + interval * 1000000ull : UINT64_MAX;
+  while (!stop)
+  {
+    uint64_t now = now_usec ();
+    while (heap_len && heap[0]->due_usec <= now)
+    {
+      pending *p = heap_pop ();
+      ssize_t sent = p->to ? sendto (p->fd, p->data, p->len, 0, (struct sockaddr *)&p->to->addr,
+                                     p->to->addr_len)
+                           : send (p->fd, p->data, p->len, 0);
+      if (sent >= 0)
+      {
+        (p->to ? &downstream : &upstream)->sent++;
+      }
+      free (p);
+    }
+    if (now >= next_print)
+    {
+      print_counts ("upstream", &upstream);
+      print_counts ("downstream", &downstream);
+      next_print = now + interval * 1000000ull;
+    }
+
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    for (unsigned i = 0; i < client_count; i++)
+    {
+      fds[i + 1].fd = clients[i].fd;
+      fds[i + 1].events = POLLIN;
+    }
+    uint64_t wake = next_print;
+    if (heap_len && heap[0]->due_usec < wake)
+    {
+      wake = heap[0]->due_usec;
+    }
+    int timeout = (wake == UINT64_MAX) ? -1 : (int)((wake - now + 999) / 1000);
+    if (poll (fds, client_count + 1, timeout) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror ("poll");
+      break;
+    }
+
+    now = now_usec ();
+    if (fds[0].revents & POLLIN)
+    {
+      struct sockaddr_storage from;
+      socklen_t from_len = sizeof (from);
+      ssize_t len = recvfrom (listen_fd, buf, sizeof (buf), 0, (struct sockaddr *)&from, &from_len);
+      client *c = (len >= 0) ? find_client (&from, from_len) : NULL;
+      if (c)
+      {
+        forward (buf, (size_t)len, c->fd, NULL, now, &upstream);
+      }
+    }
+    /* clients added above have no revents yet */
+    for (unsigned i = 0; i < client_count; i++)
+    {
+      if (fds[i + 1].fd == clients[i].fd && (fds[i + 1].revents & POLLIN))
+      {
+        ssize_t len = recv (clients[i].fd, buf, sizeof (buf), 0);
+        if (len >= 0)
+        {
+          forward (buf, (size_t)len, listen_fd, &clients[i], now, &downstream);
+        }
+      }
+    }
+  }
+
+  print_counts ("upstream", &upstream);
+  print_counts ("downstream", &downstream);
+  return 0;
+}
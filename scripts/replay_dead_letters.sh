@@ -0,0 +1,60 @@
+#!/bin/sh
+
+# Replay rejected requests from a dead letter file
+#
+#   replay_dead_letters.sh <dead-letter-file> <server-uri> [coap-client options]
+#
+#   dead-letter-file: file named by DeadLetterFile in Driver configuration
+#   server-uri: base URI for requests, like coap://127.0.0.1
+#   coap-client options: passed through, for example '-u r17 -k <key>' for PSK
+#
+# Each record is POSTed with its original URI path, Content-Format and
+# payload prefix, using libcoap's coap-client. A payload longer than the
+# stored prefix is replayed truncated, with a warning. A record whose URI path
+# was truncated is skipped, with a warning, since its path is not the one the
+# device used.
+set -e
+
+if [ $# -lt 2 ]
+then
+  echo "Usage: $0 <dead-letter-file> <server-uri> [coap-client options]" >&2
+  exit 1
+fi
+
+ROOT=$(dirname $(dirname $(readlink -f $0)))
+DEVICE_COAP=${DEVICE_COAP:-$ROOT/build/release/device-coap}
+FILE=$1
+SERVER=$2
+shift 2
+
+PAYLOAD=$(mktemp)
+trap 'rm -f $PAYLOAD' EXIT
+
+$DEVICE_COAP --dead-letter-dump $FILE | \
+while IFS="$(printf '\t')" read -r seq time code format peer uri uri_truncated len payload
+do
+  if [ "$uri_truncated" != "-" ]
+  then
+    echo "warning: record $seq skipped; URI path truncated to $uri" >&2
+    continue
+  fi
+
+  # convert hex payload to octal escapes for printf
+  printf "%b" "$(echo "$payload" | sed 's/../&\n/g' | \
+                 awk 'NF { printf "\\0%03o", index("0123456789abcdef", substr($0,1,1)) * 16 \
+                           + index("0123456789abcdef", substr($0,2,1)) - 17 }')" > $PAYLOAD
+
+  if [ $(( ${#payload} / 2 )) -lt $len ]
+  then
+    echo "warning: record $seq payload truncated to $(( ${#payload} / 2 )) of $len bytes" >&2
+  fi
+
+  FORMAT_OPT=""
+  if [ "$format" != "-" ]
+  then
+    FORMAT_OPT="-t $format"
+  fi
+
+  echo "replay $seq ($code from $peer at $time): $uri"
+  coap-client -m post $FORMAT_OPT -f $PAYLOAD "$@" "$SERVER$uri" < /dev/null || true
+done
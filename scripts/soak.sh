@@ -0,0 +1,182 @@
+#!/bin/sh
+
+# Soak test a running device-coap service
+#
+#   soak.sh <server-host>
+#
+# Sends a steady mix of valid and invalid readings for hours, while devices
+# are added and removed, and samples the /stats resource over time. Fails if
+# resident memory, free heap (fragmentation) or handler p99 latency grows
+# beyond its threshold between the first sample after warmup and the last.
+#
+# Environment, with defaults:
+#   DURATION          test length in seconds (14400)
+#   INTERVAL          seconds between /stats samples (60)
+#   WARMUP            seconds before the baseline sample (300)
+#   RATE              requests per second (20)
+#   PSK_USER, PSK_KEY DTLS PSK identity and key; if set, uses coaps, and each
+#                     request opens a new DTLS session
+#   METADATA          core-metadata URL, like http://localhost:59881; if set,
+#                     soak devices are added and removed each interval
+#   CHURN_DEVICES     number of soak devices (10)
+#   RSS_GROWTH        max % growth of RSS (20)
+#   HEAP_FREE_GROWTH  max % growth of free heap bytes (50)
+#   P99_GROWTH        max % growth of handler p99 latency (100)
+#   OUT               CSV file for samples (soak.csv)
+#
+# Requires libcoap's coap-client, and curl for device churn.
+set -e
+
+if [ $# -lt 1 ]
+then
+  echo "Usage: $0 <server-host>" >&2
+  exit 1
+fi
+
+HOST=$1
+DURATION=${DURATION:-14400}
+INTERVAL=${INTERVAL:-60}
+WARMUP=${WARMUP:-300}
+RATE=${RATE:-20}
+CHURN_DEVICES=${CHURN_DEVICES:-10}
+RSS_GROWTH=${RSS_GROWTH:-20}
+HEAP_FREE_GROWTH=${HEAP_FREE_GROWTH:-50}
+P99_GROWTH=${P99_GROWTH:-100}
+OUT=${OUT:-soak.csv}
+
+if [ -n "$PSK_KEY" ]
+then
+  BASE="coaps://$HOST"
+  SECURITY="-u ${PSK_USER:-soak} -k $PSK_KEY"
+else
+  BASE="coap://$HOST"
+  SECURITY=""
+fi
+
+# Extracts a numeric member from JSON text; first match wins
+json_value() {
+  echo "$1" | grep -o "\"$2\":[0-9]*" | head -n 1 | cut -d: -f2
+}
+
+# Extracts the p99 member of a histogram object
+json_p99() {
+  echo "$1" | sed -n "s/.*\"$2\":{[^}]*\"p99\":\([0-9]*\).*/\1/p"
+}
+
+add_device() {
+  curl -s -o /dev/null -X POST "$METADATA/api/v2/device" -H 'Content-Type: application/json' \
+       -d "[{\"apiVersion\":\"v2\",\"device\":{\"name\":\"$1\",\"serviceName\":\"device-coap\",
+             \"profileName\":\"example-datatype\",\"adminState\":\"UNLOCKED\",
+             \"operatingState\":\"UP\",\"protocols\":{\"other\":{}}}}]" || true
+}
+
+remove_device() {
+  curl -s -o /dev/null -X DELETE "$METADATA/api/v2/device/name/$1" || true
+}
+
+# Posts one reading; cycles through valid and invalid payloads of each type
+post_reading() {
+  DEVICE=d1
+  if [ -n "$METADATA" ] && [ $(($1 % 4)) -eq 0 ]
+  then
+    DEVICE=soak$(($1 % CHURN_DEVICES))
+  fi
+  case $(($1 % 7)) in
+    0|1) coap-client -m post -t 0 -e "$(($1 % 1000))" $SECURITY $BASE/a1r/$DEVICE/int ;;
+    2|3) coap-client -m post -t 0 -e "$(($1 % 100)).25" $SECURITY $BASE/a1r/$DEVICE/float ;;
+    4)   coap-client -m post -t 50 -e "{\"seq\":$1,\"pad\":\"$(printf '%*s' $(($1 % 200)) '')\"}" \
+                     $SECURITY $BASE/a1r/$DEVICE/json ;;
+    5)   coap-client -m post -t 0 -e "not-a-number" $SECURITY $BASE/a1r/$DEVICE/int ;;
+    6)   coap-client -m post -t 0 -e "1" $SECURITY $BASE/a1r/$DEVICE/missing ;;
+  esac > /dev/null 2>&1 < /dev/null &
+}
+
+echo "elapsed,requests,readings,rejected,rss,peakRss,heapArena,heapFree,handlerP50,handlerP99,drops" > $OUT
+
+START=$(date +%s)
+NEXT_SAMPLE=$START
+N=0
+BASE_RSS=""
+while [ $(($(date +%s) - START)) -lt $DURATION ]
+do
+  i=0
+  while [ $i -lt $RATE ]
+  do
+    post_reading $N
+    N=$((N + 1))
+    i=$((i + 1))
+  done
+  wait
+  sleep 1
+
+  NOW=$(date +%s)
+  if [ $NOW -ge $NEXT_SAMPLE ]
+  then
+    NEXT_SAMPLE=$((NOW + INTERVAL))
+    if [ -n "$METADATA" ]
+    then
+      d=0
+      while [ $d -lt $CHURN_DEVICES ]
+      do
+        remove_device soak$d
+        add_device soak$d
+        d=$((d + 1))
+      done
+    fi
+
+    STATS=$(coap-client -m get $SECURITY $BASE/stats 2>/dev/null < /dev/null || true)
+    if [ -z "$STATS" ]
+    then
+      echo "warning: no response from $BASE/stats" >&2
+      continue
+    fi
+    ELAPSED=$((NOW - START))
+    RSS=$(json_value "$STATS" rss)
+    HEAP_FREE=$(json_value "$STATS" free)
+    P99=$(json_p99 "$STATS" handlerUsec)
+    echo "$ELAPSED,$(json_value "$STATS" requests),$(json_value "$STATS" readings),$(json_value "$STATS" rejected),$RSS,$(json_value "$STATS" peakRss),$(json_value "$STATS" arena),$HEAP_FREE,$(echo "$STATS" | sed -n 's/.*"handlerUsec":{[^}]*"p50":\([0-9]*\).*/\1/p'),$P99,$(json_value "$STATS" drops)" >> $OUT
+
+    if [ -z "$BASE_RSS" ] && [ $ELAPSED -ge $WARMUP ]
+    then
+      BASE_RSS=$RSS
+      BASE_HEAP_FREE=${HEAP_FREE:-0}
+      BASE_P99=${P99:-0}
+      echo "baseline at ${ELAPSED}s: rss $BASE_RSS, heap free $BASE_HEAP_FREE, p99 ${BASE_P99}us"
+    fi
+    LAST_RSS=$RSS
+    LAST_HEAP_FREE=${HEAP_FREE:-0}
+    LAST_P99=${P99:-0}
+  fi
+done
+wait
+
+if [ -z "$BASE_RSS" ]
+then
+  echo "FAIL: no baseline sample; DURATION must exceed WARMUP" >&2
+  exit 1
+fi
+
+# Checks growth from baseline to last sample; small baselines are floored to
+# avoid failing on noise
+RESULT=0
+check_growth() {
+  if ! awk -v name="$1" -v base="$2" -v last="$3" -v limit="$4" -v floor="$5" 'BEGIN {
+         if (base < floor) base = floor
+         growth = (last - base) * 100 / base
+         printf "%s: %d -> %d (%+.1f%%, limit %d%%)\n", name, base, last, growth, limit
+         exit (growth > limit) }'
+  then
+    RESULT=1
+  fi
+}
+check_growth "rss" $BASE_RSS $LAST_RSS $RSS_GROWTH 1
+check_growth "heap free" $BASE_HEAP_FREE $LAST_HEAP_FREE $HEAP_FREE_GROWTH 65536
+check_growth "handler p99 us" $BASE_P99 $LAST_P99 $P99_GROWTH 100
+
+if [ $RESULT -ne 0 ]
+then
+  echo "FAIL: growth beyond threshold; see $OUT"
+else
+  echo "PASS; samples in $OUT"
+fi
+exit $RESULT
@@ -0,0 +1,280 @@
+/* Pending writes for sleepy devices
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coap-actuation.h"
+
+/* Buckets for devices with pending writes */
+#define ACTUATION_BUCKETS 256
+/* Bytes of JSON around a member: quotes, colon and comma, plus braces */
+#define MEMBER_OVERHEAD 4
+#define OBJECT_OVERHEAD 2
+
+/* Queue for one device; freed when empty */
+typedef struct actuation_device
+{
+  struct actuation_device *next;       /* hash chain */
+  coap_actuation_write *head;
+  coap_actuation_write **tail;
+  uint32_t count;
+  char name[];
+} actuation_device;
+
+struct coap_actuation
+{
+  pthread_mutex_t lock;
+  actuation_device *buckets[ACTUATION_BUCKETS];
+  uint32_t per_device;
+  uint32_t pending;            /* writes in all queues; read without lock */
+  uint64_t queued;
+  uint64_t replaced;           /* pending writes superseded by a newer value */
+  uint64_t refused;            /* queue full or value too long */
+  uint64_t delivered;
+};
+
+/* FNV-1a */
+static uint32_t
+hash_name (const char *name)
+{
+  uint32_t hash = 2166136261u;
+  for (const uint8_t *p = (const uint8_t *)name; *p; p++)
+  {
+    hash = (hash ^ *p) * 16777619u;
+  }
+  return hash;
+}
+
+coap_actuation *
+coap_actuation_new (uint32_t per_device)
+{
+  if (!per_device)
+  {
+    return NULL;
+  }
+  coap_actuation *table = calloc (1, sizeof (*table));
+  if (!table)
+  {
+    return NULL;
+  }
+  pthread_mutex_init (&table->lock, NULL);
+  table->per_device = per_device;
+  return table;
+}
+
+void
+coap_actuation_write_free (coap_actuation_write *writes)
+{
+  while (writes)
+  {
+    coap_actuation_write *next = writes->next;
+    iot_data_free (writes->value);
+    free (writes->resource);
+    free (writes->json);
+    free (writes);
+    writes = next;
+  }
+}
+
+void
+coap_actuation_free (coap_actuation *table)
+{
+  if (!table)
+  {
+    return;
+  }
+  for (uint32_t i = 0; i < ACTUATION_BUCKETS; i++)
+  {
+    actuation_device *dev = table->buckets[i];
+    while (dev)
+    {
+      actuation_device *next = dev->next;
+      coap_actuation_write_free (dev->head);
+      free (dev);
+      dev = next;
+    }
+  }
+  pthread_mutex_destroy (&table->lock);
+  free (table);
+}
+
+/* Finds the queue for a device, with the link that points to it */
+static actuation_device *
+find_device (coap_actuation *table, const char *device, actuation_device ***link)
+{
+  actuation_device **dev = &table->buckets[hash_name (device) % ACTUATION_BUCKETS];
+  for (; *dev; dev = &(*dev)->next)
+  {
+    if (!strcmp ((*dev)->name, device))
+    {
+      break;
+    }
+  }
+  *link = dev;
+  return *dev;
+}
+
+bool
+coap_actuation_queue (coap_actuation *table, const char *device, const char *resource,
+                      const iot_data_t *value)
+{
+  /* build the write outside the lock */
+  coap_actuation_write *write = calloc (1, sizeof (*write));
+  if (!write)
+  {
+    return false;
+  }
+  write->resource = strdup (resource);
+  write->json = iot_data_to_json (value);
+  write->value = iot_data_add_ref (value);
+  if (!write->resource || !write->json)
+  {
+    coap_actuation_write_free (write);
+    return false;
+  }
+  write->json_len = strlen (write->json);
+
+  pthread_mutex_lock (&table->lock);
+  bool ok = false;
+  actuation_device **link;
+  actuation_device *dev = find_device (table, device, &link);
+  /* a write must fit in a response by itself, or it would block the queue */
+  if (strlen (resource) + write->json_len + MEMBER_OVERHEAD + OBJECT_OVERHEAD > ACTUATION_PAYLOAD_MAX)
+  {
+    goto finish;
+  }
+  if (!dev)
+  {
+    size_t name_len = strlen (device);
+    if (!(dev = calloc (1, sizeof (*dev) + name_len + 1)))
+    {
+      goto finish;
+    }
+    memcpy (dev->name, device, name_len + 1);
+    dev->tail = &dev->head;
+    *link = dev;
+  }
+
+  /* replace a pending write for the resource, in place */
+  for (coap_actuation_write **prev = &dev->head; *prev; prev = &(*prev)->next)
+  {
+    coap_actuation_write *old = *prev;
+    if (!strcmp (old->resource, resource))
+    {
+      write->next = old->next;
+      *prev = write;
+      if (dev->tail == &old->next)
+      {
+        dev->tail = &write->next;
+      }
+      old->next = NULL;
+      coap_actuation_write_free (old);
+      table->replaced++;
+      table->queued++;
+      write = NULL;
+      ok = true;
+      goto finish;
+    }
+  }
+
+  if (dev->count < table->per_device)
+  {
+    *dev->tail = write;
+    dev->tail = &write->next;
+    dev->count++;
+    __atomic_add_fetch (&table->pending, 1, __ATOMIC_RELAXED);
+    table->queued++;
+    write = NULL;
+    ok = true;
+  }
+
+ finish:
+  if (!ok)
+  {
+    table->refused++;
+  }
+  pthread_mutex_unlock (&table->lock);
+  if (write)
+  {
+    coap_actuation_write_free (write);
+  }
+  return ok;
+}
+
+coap_actuation_write *
+coap_actuation_take (coap_actuation *table, const char *device, coap_metrics_buf *buf)
+{
+  if (!__atomic_load_n (&table->pending, __ATOMIC_RELAXED))
+  {
+    return NULL;
+  }
+
+  pthread_mutex_lock (&table->lock);
+  actuation_device **link;
+  actuation_device *dev = find_device (table, device, &link);
+  coap_actuation_write *taken = NULL;
+  if (dev)
+  {
+    size_t len = OBJECT_OVERHEAD;
+    uint32_t count = 0;
+    coap_actuation_write **end = &dev->head;
+    for (; *end; end = &(*end)->next, count++)
+    {
+      size_t member = strlen ((*end)->resource) + (*end)->json_len + MEMBER_OVERHEAD;
+      if (len + member > ACTUATION_PAYLOAD_MAX)
+      {
+        break;
+      }
+      len += member;
+    }
+
+    /* detach the writes that fit */
+    taken = dev->head;
+    dev->head = *end;
+    *end = NULL;
+    if (!dev->head)
+    {
+      dev->tail = &dev->head;
+    }
+    dev->count -= count;
+    __atomic_sub_fetch (&table->pending, count, __ATOMIC_RELAXED);
+    table->delivered += count;
+    if (!dev->count)
+    {
+      *link = dev->next;
+      free (dev);
+    }
+  }
+  pthread_mutex_unlock (&table->lock);
+  if (!taken)
+  {
+    return NULL;
+  }
+
+  /* resource names are EdgeX names, which need no escaping */
+  coap_metrics_printf (buf, "{");
+  for (coap_actuation_write *w = taken; w; w = w->next)
+  {
+    coap_metrics_printf (buf, "%s\"%s\":%s", w == taken ? "" : ",", w->resource, w->json);
+  }
+  coap_metrics_printf (buf, "}");
+  return taken;
+}
+
+void
+coap_actuation_write_json (coap_actuation *table, coap_metrics_buf *buf)
+{
+  pthread_mutex_lock (&table->lock);
+  coap_metrics_printf (buf, ",\"writes\":{\"pending\":%u,\"queued\":%lu,\"replaced\":%lu,"
+                       "\"refused\":%lu,\"delivered\":%lu}",
+                       table->pending, (unsigned long)table->queued,
+                       (unsigned long)table->replaced, (unsigned long)table->refused,
+                       (unsigned long)table->delivered);
+  pthread_mutex_unlock (&table->lock);
+}
@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_ACTUATION_H_
+#define _COAP_ACTUATION_H_ 1
+
+/**
+ * @file
+ * @brief Queue of pending writes for each device, delivered in the response
+ * to the device's next POST.
+ *
+ * A sleepy device is reachable only briefly after it sends a reading, so the
+ * server does not initiate requests to it. Instead EdgeX writes are queued
+ * here, and the server takes them when the device next POSTs. The table is
+ * written by SDK command threads and read by the server thread, so it is
+ * locked.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "devsdk/devsdk.h"
+#include "coap-metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Largest response payload for delivered writes */
+#define ACTUATION_PAYLOAD_MAX 1024
+
+/** A write taken for delivery */
+typedef struct coap_actuation_write
+{
+  struct coap_actuation_write *next;
+  char *resource;                      /**< resource name */
+  iot_data_t *value;                   /**< value to write */
+  char *json;                          /**< value as JSON */
+  size_t json_len;                     /**< bytes in json */
+} coap_actuation_write;
+
+typedef struct coap_actuation coap_actuation;
+
+/**
+ * Creates an empty table.
+ *
+ * @param per_device  capacity of each device queue
+ * @return table, or NULL if memory not available
+ */
+coap_actuation *coap_actuation_new (uint32_t per_device);
+
+/** Frees a table and its pending writes. */
+void coap_actuation_free (coap_actuation *table);
+
+/**
+ * Queues a write to a device resource. A write still pending for the same
+ * resource is replaced, so the device receives only the newest value.
+ *
+ * @param value  value to write; the table takes a reference
+ * @return false if the device queue is full, the value is too long for a
+ *         response, or memory not available
+ */
+bool coap_actuation_queue (coap_actuation *table, const char *device, const char *resource,
+                           const iot_data_t *value);
+
+/**
+ * Takes pending writes for a device, oldest first, and renders them as a JSON
+ * object of resource names to values, like '{"Switch":true}'. Takes only as
+ * many writes as fit in ACTUATION_PAYLOAD_MAX bytes; the rest remain queued.
+ * Cheap if the table is empty.
+ *
+ * @param buf  buffer of at least ACTUATION_PAYLOAD_MAX bytes for the JSON
+ * @return writes taken, to free with coap_actuation_write_free(); NULL if none
+ */
+coap_actuation_write *coap_actuation_take (coap_actuation *table, const char *device,
+                                           coap_metrics_buf *buf);
+
+/** Frees a list of writes from coap_actuation_take(). */
+void coap_actuation_write_free (coap_actuation_write *writes);
+
+/**
+ * Renders table counters as a "writes" member of a JSON object, preceded by a
+ * comma.
+ */
+void coap_actuation_write_json (coap_actuation *table, coap_metrics_buf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
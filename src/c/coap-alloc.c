@@ -0,0 +1,348 @@
+/* Allocator for transient server objects
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "coap-alloc.h"
+#include "coap-pool.h"
+
+#define ALLOC_CLASSES 6
+#define ALLOC_MIN_CLASS_SHIFT 6          /* 64 bytes */
+/* Class index in header for a block from libc */
+#define ALLOC_CLASS_LIBC UINT32_MAX
+/* Blocks cached per class, per thread, for tcache */
+#define TCACHE_DEPTH 64
+/* Bytes preallocated per class, for slab */
+#define SLAB_CLASS_BYTES (256 * 1024)
+/* Blocks each benchmark thread keeps live */
+#define BENCH_LIVE 8
+/* Up to this many threads run the benchmark */
+#define BENCH_MAX_THREADS 64
+
+/*
+ * Precedes each block, to find its class on release. Sized to keep the
+ * caller's memory 16 byte aligned.
+ */
+typedef union alloc_header
+{
+  uint32_t size_class;
+  uint8_t pad[16];
+} alloc_header;
+
+/* Cached free block for tcache, linked through its memory after the header */
+typedef struct tcache_block
+{
+  struct tcache_block *next;
+} tcache_block;
+
+typedef struct tcache_bin
+{
+  tcache_block *head;
+  uint32_t count;
+} tcache_bin;
+
+static coap_alloc_backend_t backend = ALLOC_BACKEND_LIBC;
+
+/* Hit is served from a cache or pool; miss falls back to libc */
+static uint64_t hits;
+static uint64_t misses;
+
+/* tcache state */
+static __thread tcache_bin tcache[ALLOC_CLASSES];
+static __thread bool tcache_registered;
+static pthread_key_t tcache_key;
+
+/* slab state */
+static coap_pool *slabs[ALLOC_CLASSES];
+
+coap_alloc_backend_t
+coap_alloc_find_backend (const char *name)
+{
+  if (!strcmp (name, "libc"))
+  {
+    return ALLOC_BACKEND_LIBC;
+  }
+  else if (!strcmp (name, "tcache"))
+  {
+    return ALLOC_BACKEND_TCACHE;
+  }
+  else if (!strcmp (name, "slab"))
+  {
+    return ALLOC_BACKEND_SLAB;
+  }
+  return ALLOC_BACKEND_UNKNOWN;
+}
+
+static const char *
+backend_name (void)
+{
+  switch (backend)
+  {
+    case ALLOC_BACKEND_TCACHE:
+      return "tcache";
+    case ALLOC_BACKEND_SLAB:
+      return "slab";
+    default:
+      return "libc";
+  }
+}
+
+/* Usable bytes in a class */
+static size_t
+class_size (uint32_t size_class)
+{
+  return (size_t)1 << (size_class + ALLOC_MIN_CLASS_SHIFT);
+}
+
+/* Smallest class for a size; ALLOC_CLASSES if none */
+static uint32_t
+find_class (size_t size)
+{
+  uint32_t size_class = 0;
+  while (size_class < ALLOC_CLASSES && class_size (size_class) < size)
+  {
+    size_class++;
+  }
+  return size_class;
+}
+
+/* Frees a thread's cached blocks when it exits. */
+static void
+tcache_flush (void *arg)
+{
+  tcache_bin *bins = arg;
+  for (unsigned i = 0; i < ALLOC_CLASSES; i++)
+  {
+    while (bins[i].head)
+    {
+      tcache_block *block = bins[i].head;
+      bins[i].head = block->next;
+      free ((alloc_header *)block - 1);
+    }
+    bins[i].count = 0;
+  }
+}
+
+bool
+coap_alloc_init (coap_alloc_backend_t new_backend)
+{
+  hits = 0;
+  misses = 0;
+  switch (new_backend)
+  {
+    case ALLOC_BACKEND_TCACHE:
+      if (pthread_key_create (&tcache_key, tcache_flush))
+      {
+        return false;
+      }
+      break;
+
+    case ALLOC_BACKEND_SLAB:
+      for (uint32_t i = 0; i < ALLOC_CLASSES; i++)
+      {
+        size_t block = sizeof (alloc_header) + class_size (i);
+        if (!(slabs[i] = coap_pool_new (block, SLAB_CLASS_BYTES / block)))
+        {
+          coap_alloc_fini ();
+          return false;
+        }
+      }
+      break;
+
+    case ALLOC_BACKEND_LIBC:
+      break;
+
+    default:
+      return false;
+  }
+  backend = new_backend;
+  return true;
+}
+
+void
+coap_alloc_fini (void)
+{
+  if (backend == ALLOC_BACKEND_TCACHE)
+  {
+    tcache_flush (tcache);
+    pthread_key_delete (tcache_key);
+  }
+  for (unsigned i = 0; i < ALLOC_CLASSES; i++)
+  {
+    coap_pool_free (slabs[i]);
+    slabs[i] = NULL;
+  }
+  backend = ALLOC_BACKEND_LIBC;
+}
+
+/* Allocates from libc, with a header for the given class. */
+static void *
+libc_alloc (size_t size, uint32_t size_class)
+{
+  alloc_header *hdr = malloc (sizeof (alloc_header) + size);
+  if (!hdr)
+  {
+    return NULL;
+  }
+  hdr->size_class = size_class;
+  return hdr + 1;
+}
+
+void *
+coap_alloc (size_t size)
+{
+  uint32_t size_class = find_class (size);
+
+  if (backend == ALLOC_BACKEND_LIBC || size_class == ALLOC_CLASSES)
+  {
+    return libc_alloc (size, ALLOC_CLASS_LIBC);
+  }
+
+  if (backend == ALLOC_BACKEND_TCACHE)
+  {
+    tcache_bin *bin = &tcache[size_class];
+    if (bin->head)
+    {
+      tcache_block *block = bin->head;
+      bin->head = block->next;
+      bin->count--;
+      __atomic_add_fetch (&hits, 1, __ATOMIC_RELAXED);
+      return block;
+    }
+    __atomic_add_fetch (&misses, 1, __ATOMIC_RELAXED);
+    /* allocate the full class size so the block may be cached on release */
+    return libc_alloc (class_size (size_class), size_class);
+  }
+
+  /* slab */
+  alloc_header *hdr = coap_pool_alloc (slabs[size_class]);
+  if (hdr)
+  {
+    __atomic_add_fetch (&hits, 1, __ATOMIC_RELAXED);
+    hdr->size_class = size_class;
+    return hdr + 1;
+  }
+  __atomic_add_fetch (&misses, 1, __ATOMIC_RELAXED);
+  return libc_alloc (size, ALLOC_CLASS_LIBC);
+}
+
+void
+coap_free (void *ptr)
+{
+  if (!ptr)
+  {
+    return;
+  }
+  alloc_header *hdr = (alloc_header *)ptr - 1;
+  uint32_t size_class = hdr->size_class;
+
+  if (size_class != ALLOC_CLASS_LIBC)
+  {
+    if (backend == ALLOC_BACKEND_TCACHE)
+    {
+      tcache_bin *bin = &tcache[size_class];
+      if (bin->count < TCACHE_DEPTH)
+      {
+        if (!tcache_registered)
+        {
+          /* so the cache is flushed when this thread exits */
+          pthread_setspecific (tcache_key, tcache);
+          tcache_registered = true;
+        }
+        tcache_block *block = ptr;
+        block->next = bin->head;
+        bin->head = block;
+        bin->count++;
+        return;
+      }
+    }
+    else if (backend == ALLOC_BACKEND_SLAB)
+    {
+      coap_pool_release (slabs[size_class], hdr);
+      return;
+    }
+  }
+  free (hdr);
+}
+
+static void *
+bench_thread (void *arg)
+{
+  /* sizes of String payloads and their copies, from small to near a block */
+  static const size_t sizes[] = { 24, 100, 40, 300, 16, 700, 60, 1100 };
+  uint32_t iterations = *(uint32_t *)arg;
+  void *live[BENCH_LIVE] = { NULL };
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    unsigned slot = i % BENCH_LIVE;
+    coap_free (live[slot]);
+    if ((live[slot] = coap_alloc (sizes[i % (sizeof (sizes) / sizeof (sizes[0]))])))
+    {
+      /* touch the block, as a payload copy would */
+      *(volatile uint8_t *)live[slot] = (uint8_t)i;
+    }
+  }
+  for (unsigned slot = 0; slot < BENCH_LIVE; slot++)
+  {
+    coap_free (live[slot]);
+  }
+  return NULL;
+}
+
+double
+coap_alloc_bench (unsigned threads, uint32_t iterations)
+{
+  pthread_t workers[BENCH_MAX_THREADS];
+  unsigned started = 0;
+  if (threads > BENCH_MAX_THREADS)
+  {
+    threads = BENCH_MAX_THREADS;
+  }
+
+  struct timespec start, end;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  while (started < threads && !pthread_create (&workers[started], NULL, bench_thread, &iterations))
+  {
+    started++;
+  }
+  for (unsigned i = 0; i < started; i++)
+  {
+    pthread_join (workers[i], NULL);
+  }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  if (started < threads)
+  {
+    return -1;
+  }
+  double nsec = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  return (threads && iterations) ? nsec / ((double)threads * iterations) : 0;
+}
+
+void
+coap_alloc_write_json (coap_metrics_buf *buf)
+{
+  coap_metrics_printf (buf, ",\"allocator\":{\"backend\":\"%s\",\"hits\":%lu,\"misses\":%lu",
+                       backend_name (), (unsigned long)__atomic_load_n (&hits, __ATOMIC_RELAXED),
+                       (unsigned long)__atomic_load_n (&misses, __ATOMIC_RELAXED));
+  if (backend == ALLOC_BACKEND_SLAB)
+  {
+    coap_metrics_printf (buf, ",\"slabs\":[");
+    for (uint32_t i = 0; i < ALLOC_CLASSES; i++)
+    {
+      coap_pool_stats stats;
+      coap_pool_get_stats (slabs[i], &stats);
+      coap_metrics_printf (buf, "%s{\"size\":%lu,\"blocks\":%u,\"inUse\":%u,\"peak\":%u}",
+                           i ? "," : "", (unsigned long)class_size (i), stats.blocks,
+                           stats.in_use, stats.peak);
+    }
+    coap_metrics_printf (buf, "]");
+  }
+  coap_metrics_printf (buf, "}");
+}
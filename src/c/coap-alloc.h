@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_ALLOC_H_
+#define _COAP_ALLOC_H_ 1
+
+/**
+ * @file
+ * @brief Allocator for transient server objects, with a choice of backend.
+ *
+ * Backends are:
+ *   - libc: malloc() and free()
+ *   - tcache: per-thread caches of freed blocks by size class, over libc
+ *   - slab: preallocated pools of blocks by size class, over libc for sizes
+ *     or counts beyond the pools
+ *
+ * Size classes are 64, 128, 256, 512, 1024 and 2048 bytes. Memory from
+ * coap_alloc() must be released with coap_free(), from any thread.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "coap-metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Allocator backend */
+typedef enum
+{
+  ALLOC_BACKEND_LIBC,          /**< malloc() and free() */
+  ALLOC_BACKEND_TCACHE,        /**< thread caching over libc */
+  ALLOC_BACKEND_SLAB,          /**< slab pools over libc */
+  ALLOC_BACKEND_UNKNOWN        /**< not a backend; just means name not known */
+} coap_alloc_backend_t;
+
+/**
+ * Looks up a backend by name: 'libc', 'tcache' or 'slab'.
+ */
+coap_alloc_backend_t coap_alloc_find_backend (const char *name);
+
+/**
+ * Selects and initializes the backend. Must be called before any allocation,
+ * and only once.
+ *
+ * @return false if backend could not be initialized; libc remains in use
+ */
+bool coap_alloc_init (coap_alloc_backend_t backend);
+
+/**
+ * Releases backend resources. No blocks may be in use.
+ */
+void coap_alloc_fini (void);
+
+/**
+ * Allocates memory.
+ *
+ * @return memory, or NULL if not available
+ */
+void *coap_alloc (size_t size);
+
+/**
+ * Releases memory from coap_alloc(); NULL is ignored.
+ */
+void coap_free (void *ptr);
+
+/**
+ * Times allocation and release from several threads at once, with payload
+ * sized blocks, for the --bench-json option. Each thread keeps a few blocks
+ * live, so blocks are not simply reused at once.
+ *
+ * @param threads     worker threads
+ * @param iterations  allocations per thread
+ * @return mean nanoseconds of wall time per allocation and release, across
+ *         all threads; negative if a thread could not be started
+ */
+double coap_alloc_bench (unsigned threads, uint32_t iterations);
+
+/**
+ * Renders backend name and counters as an "allocator" member of a JSON
+ * object, preceded by a comma.
+ */
+void coap_alloc_write_json (coap_metrics_buf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,55 @@
+/* Memory budget plan for the CoAP server
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <string.h>
+
+#include "coap-budget.h"
+#include "coap-deadletter.h"
+
+/*
+ * Estimated cost of a libcoap session, including the DTLS peer state and a
+ * PDU in flight. libcoap allocates these itself, so the budget bounds them by
+ * count rather than by pool.
+ */
+#define SESSION_COST 4096
+
+/*
+ * Estimated cost of a route: the route, its libcoap resource, and a value
+ * of up to a payload buffer.
+ */
+#define ROUTE_COST (2 * BUDGET_PAYLOAD_BUF_SIZE)
+
+/* Shares of the budget, in eighths */
+#define SESSION_SHARE    4
+#define PAYLOAD_SHARE    2
+#define DEADLETTER_SHARE 1
+#define ROUTE_SHARE      1
+
+bool
+coap_budget_plan_init (uint64_t budget, bool deadletter, size_t route_extra,
+                       uint64_t publish_bytes, coap_budget_plan *plan)
+{
+  memset (plan, 0, sizeof (*plan));
+  if (budget < publish_bytes || budget - publish_bytes < BUDGET_MIN)
+  {
+    return false;
+  }
+
+  uint64_t eighth = (budget - publish_bytes) / 8;
+  plan->budget = budget;
+  plan->publish_bytes = publish_bytes;
+  plan->sessions = eighth * SESSION_SHARE / SESSION_COST;
+  /* handshakes are the expensive, unauthenticated part; allow a quarter */
+  plan->handshakes = plan->sessions / 4;
+  plan->payload_buffers = eighth * PAYLOAD_SHARE / BUDGET_PAYLOAD_BUF_SIZE;
+  if (deadletter)
+  {
+    plan->deadletter_records = eighth * DEADLETTER_SHARE / sizeof (coap_deadletter_record);
+  }
+  plan->routes = eighth * ROUTE_SHARE / (ROUTE_COST + route_extra);
+  return true;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_BUDGET_H_
+#define _COAP_BUDGET_H_ 1
+
+/**
+ * @file
+ * @brief Sizes the server's pools and tables from a single memory budget.
+ *
+ * In memory budget mode, each component receives a fixed share of the
+ * budget at startup, and refuses work rather than allocate beyond it.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Usable bytes in a payload buffer; larger payloads are refused in budget mode */
+#define BUDGET_PAYLOAD_BUF_SIZE 1024
+
+/** Smallest budget accepted, so each component receives a useful share */
+#define BUDGET_MIN (1024 * 1024)
+
+/** Capacities derived from the memory budget */
+typedef struct coap_budget_plan
+{
+  uint64_t budget;                /**< total budget in bytes */
+  uint32_t sessions;              /**< maximum idle libcoap sessions */
+  uint32_t handshakes;            /**< maximum sessions in DTLS handshake */
+  uint32_t payload_buffers;       /**< buffers for request payloads */
+  uint32_t deadletter_records;    /**< dead letter ring records; 0 if not enabled */
+  uint32_t routes;                /**< route table capacity */
+  uint64_t publish_bytes;         /**< reserved for the publish queue ring */
+} coap_budget_plan;
+
+/**
+ * Divides a budget among the server's components. The publish queue ring has
+ * a configured capacity, so its bytes are reserved before the rest is
+ * divided.
+ *
+ * @param budget         total bytes
+ * @param deadletter     true if the dead letter ring is enabled
+ * @param route_extra    bytes per route beyond the base estimate, like history
+ * @param publish_bytes  bytes for the publish queue ring; 0 if not enabled
+ * @param[out] plan      derived capacities
+ * @return false if budget less publish_bytes is less than BUDGET_MIN
+ */
+bool coap_budget_plan_init (uint64_t budget, bool deadletter, size_t route_extra,
+                            uint64_t publish_bytes, coap_budget_plan *plan);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
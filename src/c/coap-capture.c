@@ -0,0 +1,555 @@
+/* Sampled capture ring file of CoAP messages
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#include "coap-capture.h"
+
+#define CAPTURE_MAGIC "CCAP"
+#define CAPTURE_VERSION 1
+/* Server port written to pcapng, so a decrypted message decodes as CoAP */
+#define CAPTURE_COAP_PORT 5683
+/* Devices given their own socket on replay; later devices share them */
+#define CAPTURE_REPLAY_PEERS 256
+
+/* pcapng block types and link type */
+#define PCAPNG_SECTION_HEADER 0x0A0D0D0A
+#define PCAPNG_INTERFACE 0x00000001
+#define PCAPNG_ENHANCED_PACKET 0x00000006
+#define PCAPNG_BYTE_ORDER 0x1A2B3C4D
+#define LINKTYPE_RAW 101
+
+/* File header; padded so records are cache line aligned */
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t capacity;
+  uint64_t head;                  /* sequence of most recent reservation */
+  uint8_t reserved[40];
+} capture_header;
+
+struct coap_capture
+{
+  int fd;
+  size_t map_len;
+  capture_header *header;
+  coap_capture_record *records;
+  uint32_t sample;
+  uint32_t seconds;
+  uint32_t count;                 /* requests seen while active */
+  uint64_t until_usec;            /* end of capture; 0 if not active */
+  int triggered;                  /* set by signal */
+};
+
+_Static_assert (sizeof (capture_header) == 64, "header size");
+_Static_assert (sizeof (coap_capture_record) == 512, "record size");
+
+/* Enhanced Packet Block body, for a raw IP packet of at most an IPv6 and UDP header and a record */
+typedef struct
+{
+  uint32_t interface;
+  uint32_t ts_high;
+  uint32_t ts_low;
+  uint32_t cap_len;
+  uint32_t orig_len;
+  uint8_t packet[40 + 8 + CAPTURE_SNAPLEN];
+} pcapng_packet;
+
+/* Called for each committed record, oldest first */
+typedef void (*record_fn) (const coap_capture_record *rec, void *ctx);
+
+static size_t
+file_size (uint32_t records)
+{
+  return sizeof (capture_header) + (size_t)records * sizeof (coap_capture_record);
+}
+
+static bool
+header_valid (const capture_header *hdr)
+{
+  return !memcmp (hdr->magic, CAPTURE_MAGIC, sizeof (hdr->magic))
+         && hdr->version == CAPTURE_VERSION
+         && hdr->record_size == sizeof (coap_capture_record)
+         && hdr->capacity > 0;
+}
+
+coap_capture *
+coap_capture_open (const char *path, uint32_t records, uint32_t sample, uint32_t seconds)
+{
+  if (records == 0 || sample == 0 || seconds == 0)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  int fd = open (path, O_RDWR | O_CREAT, 0640);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+
+  size_t len = file_size (records);
+  struct stat st;
+  bool reuse = (fstat (fd, &st) == 0) && ((size_t)st.st_size == len);
+  if (!reuse && ftruncate (fd, len) < 0)
+  {
+    goto fail;
+  }
+
+  void *map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    goto fail;
+  }
+
+  coap_capture *capture = calloc (1, sizeof (*capture));
+  if (!capture)
+  {
+    munmap (map, len);
+    goto fail;
+  }
+  capture->fd = fd;
+  capture->map_len = len;
+  capture->header = map;
+  capture->records = (coap_capture_record *)((uint8_t *)map + sizeof (capture_header));
+  capture->sample = sample;
+  capture->seconds = seconds;
+
+  if (!reuse || !header_valid (capture->header) || capture->header->capacity != records)
+  {
+    memset (map, 0, len);
+    memcpy (capture->header->magic, CAPTURE_MAGIC, sizeof (capture->header->magic));
+    capture->header->version = CAPTURE_VERSION;
+    capture->header->record_size = sizeof (coap_capture_record);
+    capture->header->capacity = records;
+  }
+  return capture;
+
+ fail:
+  {
+    int err = errno;
+    close (fd);
+    errno = err;
+  }
+  return NULL;
+}
+
+void
+coap_capture_close (coap_capture *capture)
+{
+  if (capture)
+  {
+    munmap (capture->header, capture->map_len);
+    close (capture->fd);
+    free (capture);
+  }
+}
+
+void
+coap_capture_trigger (coap_capture *capture)
+{
+  __atomic_store_n (&capture->triggered, 1, __ATOMIC_RELAXED);
+}
+
+void
+coap_capture_start (coap_capture *capture, uint32_t seconds, uint64_t now)
+{
+  capture->until_usec = now + (uint64_t)(seconds ? seconds : capture->seconds) * 1000000;
+  capture->count = 0;
+}
+
+void
+coap_capture_stop (coap_capture *capture)
+{
+  capture->until_usec = 0;
+}
+
+bool
+coap_capture_sample (coap_capture *capture, uint64_t now)
+{
+  if (__atomic_load_n (&capture->triggered, __ATOMIC_RELAXED))
+  {
+    __atomic_store_n (&capture->triggered, 0, __ATOMIC_RELAXED);
+    coap_capture_start (capture, 0, now);
+  }
+  if (now >= capture->until_usec)
+  {
+    capture->until_usec = 0;
+    return false;
+  }
+  return capture->count++ % capture->sample == 0;
+}
+
+coap_capture_record *
+coap_capture_reserve (coap_capture *capture, uint64_t *seq)
+{
+  *seq = __atomic_add_fetch (&capture->header->head, 1, __ATOMIC_RELAXED);
+  coap_capture_record *rec = &capture->records[(*seq - 1) % capture->header->capacity];
+
+  /* mark slot in update until committed */
+  __atomic_store_n (&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  return rec;
+}
+
+void
+coap_capture_commit (coap_capture_record *rec, uint64_t seq)
+{
+  __atomic_store_n (&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+void
+coap_capture_write_json (coap_capture *capture, uint64_t now, coap_metrics_buf *buf)
+{
+  bool active = now < capture->until_usec;
+  uint64_t head = __atomic_load_n (&capture->header->head, __ATOMIC_RELAXED);
+  coap_metrics_printf (buf, "{\"active\":%s,\"remainingSec\":%lu,\"sample\":%u,\"seconds\":%u,"
+                       "\"recorded\":%lu,\"capacity\":%u}", active ? "true" : "false",
+                       active ? (unsigned long)((capture->until_usec - now + 999999) / 1000000) : 0,
+                       capture->sample, capture->seconds, (unsigned long)head,
+                       capture->header->capacity);
+}
+
+/* Maps a ring file and calls fn for each committed record, oldest first */
+static int
+read_records (const char *path, record_fn fn, void *ctx)
+{
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
+  {
+    fprintf (stderr, "cannot open %s: %s\n", path, strerror (errno));
+    return -1;
+  }
+
+  int result = -1;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat (fd, &st) < 0 || (size_t)st.st_size < sizeof (capture_header))
+  {
+    fprintf (stderr, "%s is not a capture file\n", path);
+    goto finish;
+  }
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    fprintf (stderr, "cannot map %s: %s\n", path, strerror (errno));
+    goto finish;
+  }
+
+  const capture_header *hdr = map;
+  if (!header_valid (hdr) || (size_t)st.st_size != file_size (hdr->capacity))
+  {
+    fprintf (stderr, "%s is not a capture file\n", path);
+    goto finish;
+  }
+  const coap_capture_record *records =
+      (const coap_capture_record *)((const uint8_t *)map + sizeof (capture_header));
+
+  uint64_t head = __atomic_load_n (&hdr->head, __ATOMIC_ACQUIRE);
+  uint64_t first = (head > hdr->capacity) ? head - hdr->capacity + 1 : 1;
+  for (uint64_t seq = first; seq <= head; seq++)
+  {
+    const coap_capture_record *slot = &records[(seq - 1) % hdr->capacity];
+    coap_capture_record copy;
+
+    /* skip a slot that is mid-update, or was overwritten while copying */
+    if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != seq)
+    {
+      continue;
+    }
+    memcpy (&copy, slot, sizeof (copy));
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != seq || copy.cap_len > CAPTURE_SNAPLEN)
+    {
+      continue;
+    }
+    fn (&copy, ctx);
+  }
+  result = 0;
+
+ finish:
+  if (map != MAP_FAILED)
+  {
+    munmap (map, st.st_size);
+  }
+  close (fd);
+  return result;
+}
+
+/* Writes a pcapng block: type, total length, body padded to 32 bits, total length */
+static void
+write_block (FILE *out, uint32_t type, const void *body, size_t len)
+{
+  static const uint8_t pad[4];
+  size_t padded = (len + 3) & ~(size_t)3;
+  uint32_t total = (uint32_t)(12 + padded);
+  fwrite (&type, 4, 1, out);
+  fwrite (&total, 4, 1, out);
+  fwrite (body, 1, len, out);
+  fwrite (pad, 1, padded - len, out);
+  fwrite (&total, 4, 1, out);
+}
+
+/* Internet checksum of an IPv4 header */
+static uint16_t
+ip_checksum (const uint8_t *data, size_t len)
+{
+  uint32_t sum = 0;
+  for (size_t i = 0; i + 1 < len; i += 2)
+  {
+    sum += (uint32_t)data[i] << 8 | data[i + 1];
+  }
+  while (sum >> 16)
+  {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+  }
+  return (uint16_t)~sum;
+}
+
+/*
+ * Writes a record as an Enhanced Packet Block of a raw IP packet. The UDP
+ * checksum is 0, which Wireshark does not check by default.
+ */
+static void
+dump_record (const coap_capture_record *rec, void *ctx)
+{
+  FILE *out = ctx;
+  pcapng_packet epb;
+
+  bool sent = rec->direction == CAPTURE_SENT;
+  const uint8_t *src = sent ? rec->local_addr : rec->peer_addr;
+  const uint8_t *dst = sent ? rec->peer_addr : rec->local_addr;
+  uint16_t src_port = sent ? CAPTURE_COAP_PORT : rec->peer_port;
+  uint16_t dst_port = sent ? rec->peer_port : CAPTURE_COAP_PORT;
+  uint16_t udp_len = 8 + rec->msg_len;
+  uint8_t *ip = epb.packet;
+  size_t ip_len;
+  if (rec->ip_version == 6)
+  {
+    ip_len = 40;
+    memset (ip, 0, ip_len);
+    ip[0] = 0x60;
+    ip[4] = udp_len >> 8;
+    ip[5] = udp_len & 0xFF;
+    ip[6] = IPPROTO_UDP;
+    ip[7] = 64;
+    memcpy (ip + 8, src, 16);
+    memcpy (ip + 24, dst, 16);
+  }
+  else
+  {
+    ip_len = 20;
+    uint16_t total = ip_len + udp_len;
+    memset (ip, 0, ip_len);
+    ip[0] = 0x45;
+    ip[2] = total >> 8;
+    ip[3] = total & 0xFF;
+    ip[6] = 0x40;               /* don't fragment */
+    ip[8] = 64;
+    ip[9] = IPPROTO_UDP;
+    memcpy (ip + 12, src, 4);
+    memcpy (ip + 16, dst, 4);
+    uint16_t sum = ip_checksum (ip, ip_len);
+    ip[10] = sum >> 8;
+    ip[11] = sum & 0xFF;
+  }
+  uint8_t *udp = ip + ip_len;
+  udp[0] = src_port >> 8;
+  udp[1] = src_port & 0xFF;
+  udp[2] = dst_port >> 8;
+  udp[3] = dst_port & 0xFF;
+  udp[4] = udp_len >> 8;
+  udp[5] = udp_len & 0xFF;
+  udp[6] = 0;
+  udp[7] = 0;
+  memcpy (udp + 8, rec->data, rec->cap_len);
+
+  /* default timestamp resolution is microseconds */
+  uint64_t usec = rec->timestamp / 1000;
+  epb.interface = 0;
+  epb.ts_high = (uint32_t)(usec >> 32);
+  epb.ts_low = (uint32_t)usec;
+  epb.cap_len = ip_len + 8 + rec->cap_len;
+  epb.orig_len = ip_len + udp_len;
+  write_block (out, PCAPNG_ENHANCED_PACKET, &epb, offsetof (pcapng_packet, packet) + epb.cap_len);
+}
+
+int
+coap_capture_dump (const char *path, FILE *out)
+{
+  struct
+  {
+    uint32_t byte_order;
+    uint16_t major;
+    uint16_t minor;
+    int64_t section_len;
+  } shb = { PCAPNG_BYTE_ORDER, 1, 0, -1 };
+  struct
+  {
+    uint16_t link_type;
+    uint16_t reserved;
+    uint32_t snap_len;
+  } idb = { LINKTYPE_RAW, 0, 0 };
+
+  write_block (out, PCAPNG_SECTION_HEADER, &shb, sizeof (shb));
+  write_block (out, PCAPNG_INTERFACE, &idb, sizeof (idb));
+  if (read_records (path, dump_record, out) < 0)
+  {
+    return -1;
+  }
+  return fflush (out) ? -1 : 0;
+}
+
+/* Device and its socket, for replay */
+typedef struct replay_peer
+{
+  uint8_t addr[16];
+  uint16_t port;
+  int fd;
+} replay_peer;
+
+typedef struct replay_ctx
+{
+  struct sockaddr_storage server;
+  socklen_t server_len;
+  double speed;
+  replay_peer peers[CAPTURE_REPLAY_PEERS];
+  unsigned peer_count;
+  uint64_t first_ts;              /* ns, of first request */
+  uint64_t start_ns;              /* monotonic, at first request */
+  uint64_t sent;
+  uint64_t skipped;
+} replay_ctx;
+
+static uint64_t
+monotonic_nsec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Finds the socket for a recorded device, and opens one if not found */
+static int
+replay_socket (replay_ctx *replay, const coap_capture_record *rec)
+{
+  for (unsigned i = 0; i < replay->peer_count; i++)
+  {
+    replay_peer *peer = &replay->peers[i];
+    if (peer->port == rec->peer_port && !memcmp (peer->addr, rec->peer_addr, sizeof (peer->addr)))
+    {
+      return peer->fd;
+    }
+  }
+  if (replay->peer_count == CAPTURE_REPLAY_PEERS)
+  {
+    return replay->peers[(rec->peer_port + rec->peer_addr[15]) % CAPTURE_REPLAY_PEERS].fd;
+  }
+  int fd = socket (replay->server.ss_family, SOCK_DGRAM, 0);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  replay_peer *peer = &replay->peers[replay->peer_count++];
+  memcpy (peer->addr, rec->peer_addr, sizeof (peer->addr));
+  peer->port = rec->peer_port;
+  peer->fd = fd;
+  return fd;
+}
+
+static void
+replay_record (const coap_capture_record *rec, void *ctx)
+{
+  replay_ctx *replay = ctx;
+  if (rec->direction != CAPTURE_RECEIVED)
+  {
+    return;
+  }
+  if (rec->cap_len < rec->msg_len)
+  {
+    replay->skipped++;
+    return;
+  }
+
+  if (!replay->start_ns)
+  {
+    replay->first_ts = rec->timestamp;
+    replay->start_ns = monotonic_nsec ();
+  }
+  else if (replay->speed > 0 && rec->timestamp > replay->first_ts)
+  {
+    uint64_t due = replay->start_ns + (uint64_t)((rec->timestamp - replay->first_ts) / replay->speed);
+    uint64_t now = monotonic_nsec ();
+    if (due > now)
+    {
+      struct timespec wait = { .tv_sec = (due - now) / 1000000000, .tv_nsec = (due - now) % 1000000000 };
+      nanosleep (&wait, NULL);
+    }
+  }
+
+  int fd = replay_socket (replay, rec);
+  if (fd >= 0 && sendto (fd, rec->data, rec->cap_len, 0, (struct sockaddr *)&replay->server,
+                         replay->server_len) >= 0)
+  {
+    replay->sent++;
+  }
+  else
+  {
+    replay->skipped++;
+  }
+}
+
+int
+coap_capture_replay (const char *path, const char *host, const char *port, double speed)
+{
+  replay_ctx *replay = calloc (1, sizeof (*replay));
+  if (!replay)
+  {
+    fprintf (stderr, "memory not available\n");
+    return -1;
+  }
+  struct addrinfo hints = { .ai_socktype = SOCK_DGRAM };
+  struct addrinfo *info;
+  int rc = getaddrinfo (host, port, &hints, &info);
+  if (rc)
+  {
+    fprintf (stderr, "%s: %s\n", host, gai_strerror (rc));
+    free (replay);
+    return -1;
+  }
+  memcpy (&replay->server, info->ai_addr, info->ai_addrlen);
+  replay->server_len = info->ai_addrlen;
+  freeaddrinfo (info);
+  replay->speed = speed;
+
+  int result = read_records (path, replay_record, replay);
+  if (result == 0)
+  {
+    fprintf (stderr, "sent %lu requests from %u devices, skipped %lu\n", (unsigned long)replay->sent,
+             replay->peer_count, (unsigned long)replay->skipped);
+  }
+  for (unsigned i = 0; i < replay->peer_count; i++)
+  {
+    close (replay->peers[i].fd);
+  }
+  free (replay);
+  return result;
+}
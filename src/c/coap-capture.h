@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_CAPTURE_H_
+#define _COAP_CAPTURE_H_ 1
+
+/**
+ * @file
+ * @brief Sampled capture of CoAP requests and responses, after DTLS
+ * decryption, into a memory mapped ring file.
+ *
+ * A capture is armed when the ring file is open, and runs for a time once
+ * triggered, by a signal or the admin resource. While it runs, the server
+ * records one request in each 'sample', with its response. The ring
+ * overwrites the oldest record when full. A record is committed by writing its
+ * sequence number last, as in the dead letter ring, so a reader can detect a
+ * slot in the middle of an update.
+ *
+ * The ring is written out as pcapng, with IP and UDP headers made up from the
+ * recorded addresses, or replayed as load against a server.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "coap-metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Path for the CoAP resource that controls a capture */
+#define CAPTURE_RESOURCE_PATH "capture"
+/** Longest message prefix stored in a record */
+#define CAPTURE_SNAPLEN 448
+
+/** Direction of a captured message */
+typedef enum
+{
+  CAPTURE_RECEIVED = 0,        /**< request from a device */
+  CAPTURE_SENT = 1             /**< response to a device */
+} coap_capture_direction_t;
+
+/** One CoAP message; 512 bytes */
+typedef struct coap_capture_record
+{
+  uint64_t seq;                       /**< 1-based sequence; 0 if slot unused */
+  uint64_t timestamp;                 /**< time received or sent, ns since epoch */
+  uint8_t direction;                  /**< coap_capture_direction_t */
+  uint8_t ip_version;                 /**< 4 or 6 */
+  uint16_t peer_port;                 /**< device port */
+  uint16_t local_port;                /**< server port */
+  uint16_t msg_len;                   /**< length of full message */
+  uint16_t cap_len;                   /**< length of message stored in record */
+  uint8_t reserved[6];
+  uint8_t peer_addr[16];              /**< device address; IPv4 in first 4 bytes */
+  uint8_t local_addr[16];             /**< server address; IPv4 in first 4 bytes */
+  uint8_t data[CAPTURE_SNAPLEN];      /**< message prefix, from the CoAP header */
+} coap_capture_record;
+
+typedef struct coap_capture coap_capture;
+
+/**
+ * Opens the ring file, creating or resizing it if needed, and arms a capture.
+ * Existing records are kept if the file layout matches.
+ *
+ * @param path      file to open
+ * @param records   capacity in records
+ * @param sample    record one request in this many
+ * @param seconds   length of a triggered capture
+ * @return capture, or NULL on failure with errno set
+ */
+coap_capture *coap_capture_open (const char *path, uint32_t records, uint32_t sample,
+                                 uint32_t seconds);
+
+/** Unmaps and closes the ring file. */
+void coap_capture_close (coap_capture *capture);
+
+/**
+ * Asks for a capture to start at the next request. Async-signal-safe.
+ */
+void coap_capture_trigger (coap_capture *capture);
+
+/**
+ * Starts a capture, or extends one already running. Call only from the
+ * server thread.
+ *
+ * @param seconds  length of capture; 0 for the default
+ * @param now      monotonic time, in microseconds
+ */
+void coap_capture_start (coap_capture *capture, uint32_t seconds, uint64_t now);
+
+/** Stops a capture. Call only from the server thread. */
+void coap_capture_stop (coap_capture *capture);
+
+/**
+ * Checks whether to record a request. Cheap while no capture runs. Call only
+ * from the server thread.
+ *
+ * @param now  monotonic time, in microseconds
+ * @return true if the request and its response should be recorded
+ */
+bool coap_capture_sample (coap_capture *capture, uint64_t now);
+
+/**
+ * Reserves the next slot, filled in by the caller and committed with
+ * coap_capture_commit(). Does not block and does not allocate.
+ *
+ * @return record to fill in; its seq member must not be written
+ */
+coap_capture_record *coap_capture_reserve (coap_capture *capture, uint64_t *seq);
+
+/** Publishes a record reserved with coap_capture_reserve(). */
+void coap_capture_commit (coap_capture_record *rec, uint64_t seq);
+
+/**
+ * Renders capture state as a JSON object: whether a capture is active, its
+ * remaining seconds, the sample rate, and messages recorded of capacity.
+ *
+ * @param now  monotonic time, in microseconds
+ */
+void coap_capture_write_json (coap_capture *capture, uint64_t now, coap_metrics_buf *buf);
+
+/**
+ * Writes the records in a ring file as pcapng, oldest first.
+ *
+ * @param path   ring file
+ * @param out    output stream
+ * @return 0 on success, or -1 with a message written to stderr
+ */
+int coap_capture_dump (const char *path, FILE *out);
+
+/**
+ * Sends the requests in a ring file to a server over UDP, oldest first, at
+ * their recorded intervals divided by speed. Each recorded device has its own
+ * socket, so the server sees one peer per device. Truncated requests are
+ * skipped. Responses are not read. Messages are sent as plaintext CoAP, so
+ * the server must be in NoSec mode.
+ *
+ * @param path   ring file
+ * @param host   server host
+ * @param port   server port
+ * @param speed  replay rate relative to the recording; 0 to send at once
+ * @return 0 on success, or -1 with a message written to stderr
+ */
+int coap_capture_replay (const char *path, const char *host, const char *port, double speed);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
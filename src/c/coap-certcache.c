@@ -0,0 +1,348 @@
+/* Cache of verified client certificates
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "coap-certcache.h"
+
+#define CACHE_WAYS 4
+/* DER tags */
+#define DER_SEQUENCE 0x30
+#define DER_VERSION  0xA0
+
+/* Accepted identity; unused if expires is 0 */
+typedef struct cert_entry
+{
+  uint8_t identity[CERT_DIGEST_LEN];
+  uint32_t gen;                /* device metadata generation when verified */
+  uint64_t verified;           /* time verified, in seconds */
+  uint64_t expires;            /* time entry expires, in seconds */
+} cert_entry;
+
+struct coap_certcache
+{
+  cert_entry *entries;
+  uint32_t set_mask;           /* sets - 1; sets is a power of 2 */
+  uint32_t ttl_sec;
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t rejected;
+  uint64_t replaced;           /* live entries replaced in a full set */
+};
+
+coap_certcache *
+coap_certcache_new (uint32_t entries, uint32_t ttl_sec)
+{
+  if (!entries)
+  {
+    return NULL;
+  }
+  coap_certcache *cache = calloc (1, sizeof (*cache));
+  if (!cache)
+  {
+    return NULL;
+  }
+  uint32_t sets = 1;
+  while (sets * CACHE_WAYS < entries && sets < (UINT32_C (1) << 28))
+  {
+    sets <<= 1;
+  }
+  if (!(cache->entries = calloc (sets * CACHE_WAYS, sizeof (cert_entry))))
+  {
+    free (cache);
+    return NULL;
+  }
+  cache->set_mask = sets - 1;
+  cache->ttl_sec = ttl_sec;
+  return cache;
+}
+
+void
+coap_certcache_free (coap_certcache *cache)
+{
+  if (cache)
+  {
+    free (cache->entries);
+    free (cache);
+  }
+}
+
+/* SHA-256, from FIPS 180-4 */
+
+static const uint32_t sha256_k[64] =
+{
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void
+sha256_block (uint32_t state[8], const uint8_t *block)
+{
+  uint32_t w[64];
+  for (unsigned i = 0; i < 16; i++)
+  {
+    w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+           (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+  }
+  for (unsigned i = 16; i < 64; i++)
+  {
+    uint32_t s0 = ROTR (w[i - 15], 7) ^ ROTR (w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR (w[i - 2], 17) ^ ROTR (w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+  uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+  for (unsigned i = 0; i < 64; i++)
+  {
+    uint32_t t1 = h + (ROTR (e, 6) ^ ROTR (e, 11) ^ ROTR (e, 25)) + ((e & f) ^ (~e & g)) +
+                  sha256_k[i] + w[i];
+    uint32_t t2 = (ROTR (a, 2) ^ ROTR (a, 13) ^ ROTR (a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+    h = g;
+    g = f;
+    f = e;
+    e = d + t1;
+    d = c;
+    c = b;
+    b = a;
+    a = t1 + t2;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+  state[5] += f;
+  state[6] += g;
+  state[7] += h;
+}
+
+void
+coap_certcache_sha256 (const uint8_t *data, size_t len, uint8_t digest[CERT_DIGEST_LEN])
+{
+  uint32_t state[8] =
+  {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+  };
+  size_t done = 0;
+  for (; len - done >= 64; done += 64)
+  {
+    sha256_block (state, data + done);
+  }
+
+  /* final blocks: remaining data, 0x80, zeros, and length in bits */
+  uint8_t tail[128] = { 0 };
+  size_t rest = len - done;
+  memcpy (tail, data + done, rest);
+  tail[rest] = 0x80;
+  size_t tail_len = (rest < 56) ? 64 : 128;
+  uint64_t bits = (uint64_t)len * 8;
+  for (unsigned i = 0; i < 8; i++)
+  {
+    tail[tail_len - 1 - i] = (uint8_t)(bits >> (8 * i));
+  }
+  sha256_block (state, tail);
+  if (tail_len == 128)
+  {
+    sha256_block (state, tail + 64);
+  }
+
+  for (unsigned i = 0; i < 8; i++)
+  {
+    digest[4 * i] = state[i] >> 24;
+    digest[4 * i + 1] = state[i] >> 16;
+    digest[4 * i + 2] = state[i] >> 8;
+    digest[4 * i + 3] = state[i];
+  }
+}
+
+/*
+ * Reads a DER element at *pos, with a single byte tag, and moves *pos past it.
+ *
+ * @return start of its content, or NULL if not well formed
+ */
+static const uint8_t *
+der_read (const uint8_t **pos, const uint8_t *end, uint8_t *tag, size_t *len)
+{
+  const uint8_t *p = *pos;
+  if (end - p < 2)
+  {
+    return NULL;
+  }
+  *tag = *p++;
+  size_t n = *p++;
+  if (n & 0x80)
+  {
+    unsigned count = n & 0x7F;
+    if (count == 0 || count > 3 || end - p < count)
+    {
+      return NULL;
+    }
+    n = 0;
+    while (count--)
+    {
+      n = (n << 8) | *p++;
+    }
+  }
+  if ((size_t)(end - p) < n)
+  {
+    return NULL;
+  }
+  *len = n;
+  *pos = p + n;
+  return p;
+}
+
+bool
+coap_certcache_key_digest (const uint8_t *cert, size_t len, uint8_t digest[CERT_DIGEST_LEN])
+{
+  const uint8_t *pos = cert;
+  const uint8_t *end = cert + len;
+  uint8_t tag;
+  size_t n;
+
+  /* Certificate, then TBSCertificate */
+  const uint8_t *content = der_read (&pos, end, &tag, &n);
+  if (!content || tag != DER_SEQUENCE)
+  {
+    return false;
+  }
+  pos = content;
+  end = content + n;
+  if (!(content = der_read (&pos, end, &tag, &n)) || tag != DER_SEQUENCE)
+  {
+    return false;
+  }
+  pos = content;
+  end = content + n;
+
+  /* skip optional version, then serial, signature, issuer, validity and subject */
+  const uint8_t *start = pos;
+  if (!der_read (&pos, end, &tag, &n))
+  {
+    return false;
+  }
+  if (tag == DER_VERSION)
+  {
+    start = pos;
+    if (!der_read (&pos, end, &tag, &n))
+    {
+      return false;
+    }
+  }
+  for (unsigned i = 0; i < 5; i++)
+  {
+    start = pos;
+    if (!der_read (&pos, end, &tag, &n))
+    {
+      return false;
+    }
+  }
+  if (tag != DER_SEQUENCE)
+  {
+    return false;
+  }
+  coap_certcache_sha256 (start, pos - start, digest);
+  return true;
+}
+
+bool
+coap_certcache_lookup (coap_certcache *cache, const uint8_t identity[CERT_DIGEST_LEN],
+                       uint32_t gen, uint64_t now_sec)
+{
+  /* an identity is a digest, so any of its bytes index well */
+  uint32_t index;
+  memcpy (&index, identity, sizeof (index));
+  cert_entry *set = &cache->entries[(index & cache->set_mask) * CACHE_WAYS];
+  for (unsigned i = 0; i < CACHE_WAYS; i++)
+  {
+    if (set[i].expires > now_sec && set[i].gen == gen &&
+        !memcmp (set[i].identity, identity, CERT_DIGEST_LEN))
+    {
+      cache->hits++;
+      return true;
+    }
+  }
+  cache->misses++;
+  return false;
+}
+
+void
+coap_certcache_add (coap_certcache *cache, const uint8_t identity[CERT_DIGEST_LEN],
+                    uint32_t gen, uint64_t now_sec)
+{
+  uint32_t index;
+  memcpy (&index, identity, sizeof (index));
+  cert_entry *set = &cache->entries[(index & cache->set_mask) * CACHE_WAYS];
+
+  /* prefer the same identity, then an unused or stale entry, then the oldest */
+  cert_entry *entry = NULL;
+  for (unsigned i = 0; i < CACHE_WAYS && !entry; i++)
+  {
+    if (!memcmp (set[i].identity, identity, CERT_DIGEST_LEN))
+    {
+      entry = &set[i];
+    }
+  }
+  for (unsigned i = 0; i < CACHE_WAYS && !entry; i++)
+  {
+    if (set[i].expires <= now_sec || set[i].gen != gen)
+    {
+      entry = &set[i];
+    }
+  }
+  if (!entry)
+  {
+    entry = &set[0];
+    for (unsigned i = 1; i < CACHE_WAYS; i++)
+    {
+      if (set[i].verified < entry->verified)
+      {
+        entry = &set[i];
+      }
+    }
+    cache->replaced++;
+  }
+
+  memcpy (entry->identity, identity, CERT_DIGEST_LEN);
+  entry->gen = gen;
+  entry->verified = now_sec;
+  entry->expires = now_sec + cache->ttl_sec;
+}
+
+void
+coap_certcache_rejected (coap_certcache *cache)
+{
+  cache->rejected++;
+}
+
+void
+coap_certcache_write_json (coap_certcache *cache, uint64_t now_sec, coap_metrics_buf *buf)
+{
+  uint32_t capacity = (cache->set_mask + 1) * CACHE_WAYS;
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < capacity; i++)
+  {
+    if (cache->entries[i].expires > now_sec)
+    {
+      count++;
+    }
+  }
+  coap_metrics_printf (buf, ",\"certs\":{\"entries\":%u,\"capacity\":%u,\"hits\":%lu,"
+                       "\"misses\":%lu,\"certRejected\":%lu,\"replaced\":%lu}",
+                       count, capacity, (unsigned long)cache->hits, (unsigned long)cache->misses,
+                       (unsigned long)cache->rejected, (unsigned long)cache->replaced);
+}
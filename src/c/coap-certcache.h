@@ -0,0 +1,97 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_CERTCACHE_H_
+#define _COAP_CERTCACHE_H_ 1
+
+/**
+ * @file
+ * @brief Remembers client identities the server has verified, so a device
+ * that handshakes again is not checked again.
+ *
+ * An entry is keyed by the SHA-256 digest of the identity the server
+ * checked in the certificate, its common name in X509 mode, which the DTLS
+ * library has already extracted. A common name is a few bytes, so hashing it
+ * costs far less than the device lookup the cache saves; hashing the whole
+ * certificate would not. The cache holds only accepted identities, each for a
+ * limited time, and for one generation of device metadata, so a removed device is
+ * verified again. It is a fixed table of 4-way sets, so a lookup takes
+ * constant time and the cache never allocates after it is created. A full set
+ * replaces its oldest entry. The cache is used only by the server thread, so
+ * it is not locked.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "coap-metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Length of an identity or public key digest; SHA-256 */
+#define CERT_DIGEST_LEN 32
+
+typedef struct coap_certcache coap_certcache;
+
+/**
+ * Creates an empty cache.
+ *
+ * @param entries  capacity, rounded up to a power of 2
+ * @param ttl_sec  time an entry is valid after verification
+ * @return cache, or NULL if memory not available
+ */
+coap_certcache *coap_certcache_new (uint32_t entries, uint32_t ttl_sec);
+
+/** Frees a cache. */
+void coap_certcache_free (coap_certcache *cache);
+
+/** Computes the SHA-256 digest of data. */
+void coap_certcache_sha256 (const uint8_t *data, size_t len, uint8_t digest[CERT_DIGEST_LEN]);
+
+/**
+ * Computes the SHA-256 digest of the DER encoded SubjectPublicKeyInfo in a
+ * certificate, as used to pin a raw public key.
+ *
+ * @return false if the certificate cannot be parsed
+ */
+bool coap_certcache_key_digest (const uint8_t *cert, size_t len, uint8_t digest[CERT_DIGEST_LEN]);
+
+/**
+ * Looks up an identity, and counts a hit or miss.
+ *
+ * @param gen      current device metadata generation
+ * @param now_sec  monotonic time, in seconds
+ * @return true if the identity was accepted within the time to live, for
+ *         the same generation
+ */
+bool coap_certcache_lookup (coap_certcache *cache, const uint8_t identity[CERT_DIGEST_LEN],
+                            uint32_t gen, uint64_t now_sec);
+
+/**
+ * Adds an accepted identity, replacing the oldest in its set if full.
+ */
+void coap_certcache_add (coap_certcache *cache, const uint8_t identity[CERT_DIGEST_LEN],
+                         uint32_t gen, uint64_t now_sec);
+
+/** Counts a certificate that failed verification. */
+void coap_certcache_rejected (coap_certcache *cache);
+
+/**
+ * Renders cache state as a JSON member: entries in use of capacity, and
+ * counts of hits, misses, rejections and replaced entries.
+ */
+void coap_certcache_write_json (coap_certcache *cache, uint64_t now_sec, coap_metrics_buf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,240 @@
+/* Dead letter ring file for rejected requests
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "coap-deadletter.h"
+
+#define DEADLETTER_MAGIC "CDLR"
+#define DEADLETTER_VERSION 3   /* 2: peer 64 bytes, payload prefix 104; 3: flags, prefix 103 */
+
+/* File header; padded so records are cache line aligned */
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t capacity;
+  uint64_t head;                  /* sequence of most recent reservation */
+  uint8_t reserved[40];
+} deadletter_header;
+
+struct coap_deadletter
+{
+  int fd;
+  size_t map_len;
+  deadletter_header *header;
+  coap_deadletter_record *records;
+};
+
+_Static_assert (sizeof (deadletter_header) == 64, "header size");
+_Static_assert (sizeof (coap_deadletter_record) == 256, "record size");
+
+static size_t
+file_size (uint32_t records)
+{
+  return sizeof (deadletter_header) + (size_t)records * sizeof (coap_deadletter_record);
+}
+
+static bool
+header_valid (const deadletter_header *hdr)
+{
+  return !memcmp (hdr->magic, DEADLETTER_MAGIC, sizeof (hdr->magic))
+         && hdr->version == DEADLETTER_VERSION
+         && hdr->record_size == sizeof (coap_deadletter_record)
+         && hdr->capacity > 0;
+}
+
+coap_deadletter *
+coap_deadletter_open (const char *path, uint32_t records)
+{
+  if (records == 0)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  int fd = open (path, O_RDWR | O_CREAT, 0640);
+  if (fd < 0)
+  {
+    return NULL;
+  }
+
+  size_t len = file_size (records);
+  struct stat st;
+  bool reuse = (fstat (fd, &st) == 0) && ((size_t)st.st_size == len);
+  if (!reuse && ftruncate (fd, len) < 0)
+  {
+    goto fail;
+  }
+
+  void *map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    goto fail;
+  }
+
+  coap_deadletter *ring = malloc (sizeof (*ring));
+  if (!ring)
+  {
+    munmap (map, len);
+    goto fail;
+  }
+  ring->fd = fd;
+  ring->map_len = len;
+  ring->header = map;
+  ring->records = (coap_deadletter_record *)((uint8_t *)map + sizeof (deadletter_header));
+
+  if (!reuse || !header_valid (ring->header) || ring->header->capacity != records)
+  {
+    memset (map, 0, len);
+    memcpy (ring->header->magic, DEADLETTER_MAGIC, sizeof (ring->header->magic));
+    ring->header->version = DEADLETTER_VERSION;
+    ring->header->record_size = sizeof (coap_deadletter_record);
+    ring->header->capacity = records;
+  }
+  return ring;
+
+ fail:
+  {
+    int err = errno;
+    close (fd);
+    errno = err;
+  }
+  return NULL;
+}
+
+void
+coap_deadletter_close (coap_deadletter *ring)
+{
+  if (ring)
+  {
+    munmap (ring->header, ring->map_len);
+    close (ring->fd);
+    free (ring);
+  }
+}
+
+coap_deadletter_record *
+coap_deadletter_reserve (coap_deadletter *ring, uint64_t *seq)
+{
+  *seq = __atomic_add_fetch (&ring->header->head, 1, __ATOMIC_RELAXED);
+  coap_deadletter_record *rec = &ring->records[(*seq - 1) % ring->header->capacity];
+
+  /* mark slot in update until committed */
+  __atomic_store_n (&rec->seq, 0, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  return rec;
+}
+
+void
+coap_deadletter_commit (coap_deadletter_record *rec, uint64_t seq)
+{
+  __atomic_store_n (&rec->seq, seq, __ATOMIC_RELEASE);
+}
+
+/* Writes one record as a line of tab separated text. */
+static void
+dump_record (const coap_deadletter_record *rec, FILE *out)
+{
+  char time_text[32];
+  time_t secs = rec->timestamp / 1000000000;
+  struct tm tm;
+  gmtime_r (&secs, &tm);
+  strftime (time_text, sizeof (time_text), "%Y-%m-%dT%H:%M:%S", &tm);
+
+  fprintf (out, "%lu\t%s.%06luZ\t%u.%02u\t", (unsigned long)rec->seq, time_text,
+           (unsigned long)(rec->timestamp % 1000000000) / 1000, rec->code >> 5, rec->code & 0x1F);
+  if (rec->content_format == UINT16_MAX)
+  {
+    fputs ("-", out);
+  }
+  else
+  {
+    fprintf (out, "%u", rec->content_format);
+  }
+  fprintf (out, "\t%.*s\t/%.*s\t%s\t%u\t", DEADLETTER_PEER_MAXLEN, rec->peer, DEADLETTER_URI_MAXLEN,
+           rec->uri, (rec->flags & DEADLETTER_URI_TRUNCATED) ? "truncated" : "-", rec->payload_len);
+  for (unsigned i = 0; i < rec->prefix_len && i < DEADLETTER_PAYLOAD_MAXLEN; i++)
+  {
+    fprintf (out, "%02x", rec->payload[i]);
+  }
+  fputs ("\n", out);
+}
+
+int
+coap_deadletter_dump (const char *path, FILE *out)
+{
+  int fd = open (path, O_RDONLY);
+  if (fd < 0)
+  {
+    fprintf (stderr, "cannot open %s: %s\n", path, strerror (errno));
+    return -1;
+  }
+
+  int result = -1;
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat (fd, &st) < 0 || (size_t)st.st_size < sizeof (deadletter_header))
+  {
+    fprintf (stderr, "%s is not a dead letter file\n", path);
+    goto finish;
+  }
+  map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    fprintf (stderr, "cannot map %s: %s\n", path, strerror (errno));
+    goto finish;
+  }
+
+  const deadletter_header *hdr = map;
+  if (!header_valid (hdr) || (size_t)st.st_size != file_size (hdr->capacity))
+  {
+    fprintf (stderr, "%s is not a dead letter file\n", path);
+    goto finish;
+  }
+  const coap_deadletter_record *records =
+      (const coap_deadletter_record *)((const uint8_t *)map + sizeof (deadletter_header));
+
+  uint64_t head = __atomic_load_n (&hdr->head, __ATOMIC_ACQUIRE);
+  uint64_t first = (head > hdr->capacity) ? head - hdr->capacity + 1 : 1;
+  for (uint64_t seq = first; seq <= head; seq++)
+  {
+    const coap_deadletter_record *slot = &records[(seq - 1) % hdr->capacity];
+    coap_deadletter_record copy;
+
+    /* skip a slot that is mid-update, or was overwritten while copying */
+    if (__atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE) != seq)
+    {
+      continue;
+    }
+    memcpy (&copy, slot, sizeof (copy));
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) != seq)
+    {
+      continue;
+    }
+    dump_record (&copy, out);
+  }
+  result = 0;
+
+ finish:
+  if (map != MAP_FAILED)
+  {
+    munmap (map, st.st_size);
+  }
+  close (fd);
+  return result;
+}
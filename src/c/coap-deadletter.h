@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_DEADLETTER_H_
+#define _COAP_DEADLETTER_H_ 1
+
+/**
+ * @file
+ * @brief Memory mapped ring file of rejected requests, for diagnosis without
+ * debug logging.
+ *
+ * The server records each rejected request in a fixed size slot. The ring
+ * overwrites the oldest record when full. A record is committed by writing its
+ * sequence number last, so a reader can detect a slot in the middle of an
+ * update.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DEADLETTER_PEER_MAXLEN 64   /* "[" INET6_ADDRSTRLEN "]:65535" */
+#define DEADLETTER_URI_MAXLEN 64
+#define DEADLETTER_PAYLOAD_MAXLEN 103
+
+/** Record flag: the URI path did not fit, so uri holds its start */
+#define DEADLETTER_URI_TRUNCATED 0x01
+
+/** One rejected request; 256 bytes */
+typedef struct coap_deadletter_record
+{
+  uint64_t seq;                                /**< 1-based sequence; 0 if slot unused */
+  uint64_t timestamp;                          /**< receive time, ns since epoch */
+  uint16_t code;                               /**< response code, as class << 5 | detail */
+  uint16_t content_format;                     /**< request Content-Format, UINT16_MAX if none */
+  uint16_t payload_len;                        /**< length of full request payload */
+  uint16_t prefix_len;                         /**< length of payload stored in record */
+  char peer[DEADLETTER_PEER_MAXLEN];           /**< remote address, null terminated */
+  char uri[DEADLETTER_URI_MAXLEN];             /**< URI path, null terminated */
+  uint8_t flags;                               /**< DEADLETTER_URI_TRUNCATED */
+  uint8_t payload[DEADLETTER_PAYLOAD_MAXLEN];  /**< payload prefix */
+} coap_deadletter_record;
+
+typedef struct coap_deadletter coap_deadletter;
+
+/**
+ * Opens the ring file, creating or resizing it if needed. Existing records
+ * are kept if the file layout matches.
+ *
+ * @param path      file to open
+ * @param records   capacity in records
+ * @return ring, or NULL on failure with errno set
+ */
+coap_deadletter *coap_deadletter_open (const char *path, uint32_t records);
+
+/**
+ * Unmaps and closes the ring file.
+ */
+void coap_deadletter_close (coap_deadletter *ring);
+
+/**
+ * Reserves the next slot, filled in by the caller and committed with
+ * coap_deadletter_commit(). Does not block and does not allocate.
+ *
+ * @return record to fill in; its seq member must not be written
+ */
+coap_deadletter_record *coap_deadletter_reserve (coap_deadletter *ring, uint64_t *seq);
+
+/**
+ * Publishes a record reserved with coap_deadletter_reserve().
+ */
+void coap_deadletter_commit (coap_deadletter_record *rec, uint64_t seq);
+
+/**
+ * Writes the records in a ring file as tab separated text, oldest first.
+ * Columns are: seq, time, code, content format, peer, uri, whether the uri
+ * is truncated ('truncated' or '-'), payload length, payload prefix as hex.
+ *
+ * @param path   ring file
+ * @param out    output stream
+ * @return 0 on success, or -1 with a message written to stderr
+ */
+int coap_deadletter_dump (const char *path, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,216 @@
+/* Sequence number deduplication for device readings
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "coap-dedup.h"
+
+#define DEDUP_WINDOW 64
+
+/* Window for one device */
+typedef struct dedup_device
+{
+  struct dedup_device *next;   /* hash chain */
+  uint32_t highest;            /* highest sequence number seen */
+  uint64_t window;             /* bit n set if highest - n seen */
+  char name[];
+} dedup_device;
+
+struct coap_dedup
+{
+  dedup_device **buckets;
+  uint32_t bucket_mask;        /* buckets - 1; buckets is a power of 2 */
+  uint32_t count;
+  uint32_t max_devices;
+  uint64_t accepted;
+  uint64_t duplicates;
+  uint64_t stale;
+  uint64_t restarts;           /* windows restarted by sequence number 0 */
+  uint64_t untracked;          /* readings from devices beyond capacity */
+};
+
+/* FNV-1a */
+static uint32_t
+hash_name (const char *name)
+{
+  uint32_t hash = 2166136261u;
+  for (const uint8_t *p = (const uint8_t *)name; *p; p++)
+  {
+    hash = (hash ^ *p) * 16777619u;
+  }
+  return hash;
+}
+
+coap_dedup *
+coap_dedup_new (uint32_t max_devices)
+{
+  if (!max_devices)
+  {
+    return NULL;
+  }
+  coap_dedup *table = calloc (1, sizeof (*table));
+  if (!table)
+  {
+    return NULL;
+  }
+  uint32_t buckets = 1;
+  while (buckets < max_devices && buckets < (UINT32_C (1) << 31))
+  {
+    buckets <<= 1;
+  }
+  if (!(table->buckets = calloc (buckets, sizeof (dedup_device *))))
+  {
+    free (table);
+    return NULL;
+  }
+  table->bucket_mask = buckets - 1;
+  table->max_devices = max_devices;
+  return table;
+}
+
+void
+coap_dedup_free (coap_dedup *table)
+{
+  if (!table)
+  {
+    return;
+  }
+  for (uint32_t i = 0; i <= table->bucket_mask; i++)
+  {
+    dedup_device *dev = table->buckets[i];
+    while (dev)
+    {
+      dedup_device *next = dev->next;
+      free (dev);
+      dev = next;
+    }
+  }
+  free (table->buckets);
+  free (table);
+}
+
+/* Finds the window for a device; NULL if not tracked */
+static dedup_device *
+find_device (coap_dedup *table, const char *device)
+{
+  dedup_device *dev = table->buckets[hash_name (device) & table->bucket_mask];
+  while (dev && strcmp (dev->name, device))
+  {
+    dev = dev->next;
+  }
+  return dev;
+}
+
+/* Adds a window for a device; NULL if the table is full */
+static dedup_device *
+add_device (coap_dedup *table, const char *device)
+{
+  if (table->count == table->max_devices)
+  {
+    return NULL;
+  }
+  size_t name_len = strlen (device);
+  dedup_device *dev = calloc (1, sizeof (*dev) + name_len + 1);
+  if (!dev)
+  {
+    return NULL;
+  }
+  dedup_device **bucket = &table->buckets[hash_name (device) & table->bucket_mask];
+  memcpy (dev->name, device, name_len + 1);
+  dev->next = *bucket;
+  *bucket = dev;
+  table->count++;
+  return dev;
+}
+
+coap_dedup_result_t
+coap_dedup_check (coap_dedup *table, const char *device, uint32_t seq)
+{
+  dedup_device *dev = find_device (table, device);
+  if (!dev)
+  {
+    if (table->count == table->max_devices)
+    {
+      table->untracked++;
+      return DEDUP_UNTRACKED;
+    }
+    return DEDUP_NEW;
+  }
+  if (seq == 0 && dev->highest != 0)
+  {
+    return DEDUP_NEW;
+  }
+
+  /* serial number arithmetic, so the window follows a wrap */
+  uint32_t ahead = seq - dev->highest;
+  if (ahead && ahead < (UINT32_C (1) << 31))
+  {
+    return DEDUP_NEW;
+  }
+  uint32_t behind = dev->highest - seq;
+  if (behind >= DEDUP_WINDOW)
+  {
+    table->stale++;
+    return DEDUP_STALE;
+  }
+  if (dev->window & (UINT64_C (1) << behind))
+  {
+    table->duplicates++;
+    return DEDUP_DUPLICATE;
+  }
+  return DEDUP_NEW;
+}
+
+void
+coap_dedup_accept (coap_dedup *table, const char *device, uint32_t seq)
+{
+  dedup_device *dev = find_device (table, device);
+  bool added = false;
+  if (!dev)
+  {
+    if (!(dev = add_device (table, device)))
+    {
+      return;
+    }
+    added = true;
+  }
+  table->accepted++;
+
+  if (added || (seq == 0 && dev->highest != 0))
+  {
+    if (!added)
+    {
+      table->restarts++;
+    }
+    dev->highest = seq;
+    dev->window = 1;
+    return;
+  }
+  uint32_t ahead = seq - dev->highest;
+  if (ahead && ahead < (UINT32_C (1) << 31))
+  {
+    dev->window = (ahead < DEDUP_WINDOW) ? (dev->window << ahead) | 1 : 1;
+    dev->highest = seq;
+    return;
+  }
+  uint32_t behind = dev->highest - seq;
+  if (behind < DEDUP_WINDOW)
+  {
+    dev->window |= UINT64_C (1) << behind;
+  }
+}
+
+void
+coap_dedup_write_json (coap_dedup *table, coap_metrics_buf *buf)
+{
+  coap_metrics_printf (buf, ",\"dedup\":{\"devices\":%u,\"max\":%u,\"accepted\":%lu,"
+                       "\"duplicates\":%lu,\"stale\":%lu,\"restarts\":%lu,\"untracked\":%lu}",
+                       table->count, table->max_devices, (unsigned long)table->accepted,
+                       (unsigned long)table->duplicates, (unsigned long)table->stale,
+                       (unsigned long)table->restarts, (unsigned long)table->untracked);
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_DEDUP_H_
+#define _COAP_DEDUP_H_ 1
+
+/**
+ * @file
+ * @brief Detects readings a device sends more than once, from a sequence
+ * number the device includes with each POST.
+ *
+ * libcoap discards a retransmitted message only while the session remembers
+ * its message ID, so a reading retransmitted after a lost response and a new
+ * handshake is accepted again. Here each device has a sliding window of the
+ * last 64 sequence numbers, as a bitmap, like DTLS replay detection.
+ * Sequence numbers are 32 bits and wrap. A sequence number of 0 starts a new
+ * window, for a device that restarts without keeping its sequence. The table
+ * is bounded, and is used only by the server thread, so it is not locked.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "coap-metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Result of checking a sequence number */
+typedef enum
+{
+  DEDUP_NEW,                   /**< not seen before; record with coap_dedup_accept() */
+  DEDUP_DUPLICATE,             /**< seen within the window */
+  DEDUP_STALE,                 /**< older than the window, so assumed seen */
+  DEDUP_UNTRACKED              /**< table full; device not tracked */
+} coap_dedup_result_t;
+
+typedef struct coap_dedup coap_dedup;
+
+/**
+ * Creates an empty table.
+ *
+ * @param max_devices  capacity
+ * @return table, or NULL if memory not available
+ */
+coap_dedup *coap_dedup_new (uint32_t max_devices);
+
+/** Frees a table. */
+void coap_dedup_free (coap_dedup *table);
+
+/**
+ * Checks a sequence number from a device, without recording it, so a reading
+ * that is not then accepted may be sent again.
+ */
+coap_dedup_result_t coap_dedup_check (coap_dedup *table, const char *device, uint32_t seq);
+
+/**
+ * Records a sequence number checked as new, once its reading is accepted.
+ */
+void coap_dedup_accept (coap_dedup *table, const char *device, uint32_t seq);
+
+/**
+ * Renders table counters as a "dedup" member of a JSON object, preceded by a
+ * comma.
+ */
+void coap_dedup_write_json (coap_dedup *table, coap_metrics_buf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
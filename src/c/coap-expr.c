@@ -0,0 +1,513 @@
+/* Expression compiler and interpreter for resource rules
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <ctype.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "coap-expr.h"
+
+/* Limits on a compiled expression */
+#define EXPR_CODE_MAX 128
+#define EXPR_CONST_MAX 32
+#define EXPR_STACK_MAX 16
+
+typedef enum
+{
+  OP_CONST,                    /* push consts[next byte] */
+  OP_V,
+  OP_LAST,
+  OP_DT,
+  OP_NEG,
+  OP_NOT,
+  OP_ABS,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MIN,
+  OP_MAX,
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE,
+  OP_EQ,
+  OP_NE,
+  OP_AND,
+  OP_OR,
+  OP_END
+} expr_op;
+
+struct coap_expr
+{
+  uint8_t code[EXPR_CODE_MAX];
+  double consts[EXPR_CONST_MAX];
+  uint8_t nconsts;
+  bool uses_state;
+};
+
+/* Compiler state; a recursive descent parser that emits code as it goes */
+typedef struct expr_parser
+{
+  const char *text;
+  const char *pos;
+  coap_expr *expr;
+  uint32_t len;                /* bytes of code */
+  uint32_t depth;              /* stack depth after code so far */
+  char *error;
+  size_t errlen;
+  bool failed;
+} expr_parser;
+
+static void parse_or (expr_parser *p);
+
+static void
+fail (expr_parser *p, const char *msg)
+{
+  if (!p->failed)
+  {
+    snprintf (p->error, p->errlen, "%s at offset %u", msg, (unsigned)(p->pos - p->text));
+    p->failed = true;
+  }
+}
+
+static void
+skip_space (expr_parser *p)
+{
+  while (isspace ((unsigned char)*p->pos))
+  {
+    p->pos++;
+  }
+}
+
+/* Consumes a token if it is next */
+static bool
+accept (expr_parser *p, const char *token)
+{
+  skip_space (p);
+  size_t len = strlen (token);
+  if (strncmp (p->pos, token, len))
+  {
+    return false;
+  }
+  /* a name must not continue, so 'v' does not match 'val' */
+  if (isalpha ((unsigned char)token[0]) && (isalnum ((unsigned char)p->pos[len]) || p->pos[len] == '_'))
+  {
+    return false;
+  }
+  p->pos += len;
+  return true;
+}
+
+static void
+expect (expr_parser *p, const char *token)
+{
+  if (!accept (p, token))
+  {
+    char msg[32];
+    snprintf (msg, sizeof (msg), "expected '%s'", token);
+    fail (p, msg);
+  }
+}
+
+/*
+ * Emits an op, with its effect on stack depth: +1 for a push, 0 for a unary
+ * op, -1 for a binary op.
+ */
+static void
+emit (expr_parser *p, expr_op op, int effect)
+{
+  if (p->len == EXPR_CODE_MAX - 1)
+  {
+    fail (p, "expression too long");
+    return;
+  }
+  p->expr->code[p->len++] = op;
+  p->depth += effect;
+  if (p->depth > EXPR_STACK_MAX)
+  {
+    fail (p, "expression too deeply nested");
+  }
+}
+
+static void
+emit_const (expr_parser *p, double value)
+{
+  if (p->expr->nconsts == EXPR_CONST_MAX)
+  {
+    fail (p, "too many constants");
+    return;
+  }
+  emit (p, OP_CONST, 1);
+  if (p->len == EXPR_CODE_MAX - 1)
+  {
+    fail (p, "expression too long");
+    return;
+  }
+  p->expr->code[p->len++] = p->expr->nconsts;
+  p->expr->consts[p->expr->nconsts++] = value;
+}
+
+/* Parses a function's arguments, in parentheses */
+static void
+parse_args (expr_parser *p, unsigned count)
+{
+  expect (p, "(");
+  for (unsigned i = 0; i < count && !p->failed; i++)
+  {
+    if (i)
+    {
+      expect (p, ",");
+    }
+    parse_or (p);
+  }
+  expect (p, ")");
+}
+
+static void
+parse_primary (expr_parser *p)
+{
+  skip_space (p);
+  if (isdigit ((unsigned char)*p->pos) || *p->pos == '.')
+  {
+    char *end;
+    double value = strtod (p->pos, &end);
+    if (end == p->pos || !isfinite (value))
+    {
+      fail (p, "invalid number");
+      return;
+    }
+    p->pos = end;
+    emit_const (p, value);
+  }
+  else if (accept (p, "v"))
+  {
+    emit (p, OP_V, 1);
+  }
+  else if (accept (p, "last"))
+  {
+    emit (p, OP_LAST, 1);
+    p->expr->uses_state = true;
+  }
+  else if (accept (p, "dt"))
+  {
+    emit (p, OP_DT, 1);
+    p->expr->uses_state = true;
+  }
+  else if (accept (p, "abs"))
+  {
+    parse_args (p, 1);
+    emit (p, OP_ABS, 0);
+  }
+  else if (accept (p, "min"))
+  {
+    parse_args (p, 2);
+    emit (p, OP_MIN, -1);
+  }
+  else if (accept (p, "max"))
+  {
+    parse_args (p, 2);
+    emit (p, OP_MAX, -1);
+  }
+  else if (accept (p, "("))
+  {
+    parse_or (p);
+    expect (p, ")");
+  }
+  else
+  {
+    fail (p, *p->pos ? "unexpected character" : "unexpected end");
+  }
+}
+
+static void
+parse_unary (expr_parser *p)
+{
+  if (accept (p, "-"))
+  {
+    parse_unary (p);
+    emit (p, OP_NEG, 0);
+  }
+  else if (accept (p, "!"))
+  {
+    parse_unary (p);
+    emit (p, OP_NOT, 0);
+  }
+  else
+  {
+    parse_primary (p);
+  }
+}
+
+static void
+parse_term (expr_parser *p)
+{
+  parse_unary (p);
+  while (!p->failed)
+  {
+    expr_op op;
+    if (accept (p, "*"))
+    {
+      op = OP_MUL;
+    }
+    else if (accept (p, "/"))
+    {
+      op = OP_DIV;
+    }
+    else
+    {
+      break;
+    }
+    parse_unary (p);
+    emit (p, op, -1);
+  }
+}
+
+static void
+parse_sum (expr_parser *p)
+{
+  parse_term (p);
+  while (!p->failed)
+  {
+    expr_op op;
+    if (accept (p, "+"))
+    {
+      op = OP_ADD;
+    }
+    else if (accept (p, "-"))
+    {
+      op = OP_SUB;
+    }
+    else
+    {
+      break;
+    }
+    parse_term (p);
+    emit (p, op, -1);
+  }
+}
+
+static void
+parse_cmp (expr_parser *p)
+{
+  parse_sum (p);
+  /* two character operators first */
+  expr_op op;
+  if (accept (p, "<="))
+  {
+    op = OP_LE;
+  }
+  else if (accept (p, ">="))
+  {
+    op = OP_GE;
+  }
+  else if (accept (p, "=="))
+  {
+    op = OP_EQ;
+  }
+  else if (accept (p, "!="))
+  {
+    op = OP_NE;
+  }
+  else if (accept (p, "<"))
+  {
+    op = OP_LT;
+  }
+  else if (accept (p, ">"))
+  {
+    op = OP_GT;
+  }
+  else
+  {
+    return;
+  }
+  parse_sum (p);
+  emit (p, op, -1);
+}
+
+static void
+parse_and (expr_parser *p)
+{
+  parse_cmp (p);
+  while (!p->failed && accept (p, "&&"))
+  {
+    parse_cmp (p);
+    emit (p, OP_AND, -1);
+  }
+}
+
+static void
+parse_or (expr_parser *p)
+{
+  parse_and (p);
+  while (!p->failed && accept (p, "||"))
+  {
+    parse_and (p);
+    emit (p, OP_OR, -1);
+  }
+}
+
+coap_expr *
+coap_expr_compile (const char *text, char *error, size_t errlen)
+{
+  if (strlen (text) > EXPR_TEXT_MAXLEN)
+  {
+    snprintf (error, errlen, "expression longer than %u", EXPR_TEXT_MAXLEN);
+    return NULL;
+  }
+  coap_expr *expr = calloc (1, sizeof (*expr));
+  if (!expr)
+  {
+    snprintf (error, errlen, "memory not available");
+    return NULL;
+  }
+
+  expr_parser p = { .text = text, .pos = text, .expr = expr, .error = error, .errlen = errlen };
+  parse_or (&p);
+  skip_space (&p);
+  if (*p.pos)
+  {
+    fail (&p, "unexpected character");
+  }
+  if (p.failed)
+  {
+    free (expr);
+    return NULL;
+  }
+  /* room for OP_END is reserved by emit() */
+  expr->code[p.len] = OP_END;
+  return expr;
+}
+
+void
+coap_expr_free (coap_expr *expr)
+{
+  free (expr);
+}
+
+bool
+coap_expr_uses_state (const coap_expr *expr)
+{
+  return expr->uses_state;
+}
+
+double
+coap_expr_eval (const coap_expr *expr, const coap_expr_vars *vars)
+{
+  /* compiler verified the code stays within the stack */
+  double stack[EXPR_STACK_MAX];
+  double *top = stack - 1;
+  const uint8_t *pc = expr->code;
+
+  for (;;)
+  {
+    switch (*pc++)
+    {
+      case OP_CONST:
+        *++top = expr->consts[*pc++];
+        break;
+      case OP_V:
+        *++top = vars->v;
+        break;
+      case OP_LAST:
+        *++top = vars->last;
+        break;
+      case OP_DT:
+        *++top = vars->dt;
+        break;
+      case OP_NEG:
+        *top = -*top;
+        break;
+      case OP_NOT:
+        *top = !*top;
+        break;
+      case OP_ABS:
+        *top = fabs (*top);
+        break;
+      case OP_ADD:
+        top--;
+        *top += top[1];
+        break;
+      case OP_SUB:
+        top--;
+        *top -= top[1];
+        break;
+      case OP_MUL:
+        top--;
+        *top *= top[1];
+        break;
+      case OP_DIV:
+        top--;
+        *top /= top[1];
+        break;
+      case OP_MIN:
+        top--;
+        *top = fmin (*top, top[1]);
+        break;
+      case OP_MAX:
+        top--;
+        *top = fmax (*top, top[1]);
+        break;
+      case OP_LT:
+        top--;
+        *top = *top < top[1];
+        break;
+      case OP_LE:
+        top--;
+        *top = *top <= top[1];
+        break;
+      case OP_GT:
+        top--;
+        *top = *top > top[1];
+        break;
+      case OP_GE:
+        top--;
+        *top = *top >= top[1];
+        break;
+      case OP_EQ:
+        top--;
+        *top = *top == top[1];
+        break;
+      case OP_NE:
+        top--;
+        *top = *top != top[1];
+        break;
+      case OP_AND:
+        top--;
+        *top = *top && top[1];
+        break;
+      case OP_OR:
+        top--;
+        *top = *top || top[1];
+        break;
+      default:
+        return *top;
+    }
+  }
+}
+
+double
+coap_expr_bench (const coap_expr *expr, uint32_t iterations)
+{
+  coap_expr_vars vars = { .v = 0, .last = 20.0, .dt = 1.0 };
+  volatile double sink = 0;
+  struct timespec start, end;
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (uint32_t i = 0; i < iterations; i++)
+  {
+    /* vary the reading, so branches are not all predicted the same */
+    vars.v = (double)(i & 63);
+    sink += coap_expr_eval (expr, &vars);
+  }
+  clock_gettime (CLOCK_MONOTONIC, &end);
+  (void)sink;
+  double nsec = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  return iterations ? nsec / iterations : 0;
+}
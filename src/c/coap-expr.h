@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_EXPR_H_
+#define _COAP_EXPR_H_ 1
+
+/**
+ * @file
+ * @brief Arithmetic expressions over a numeric reading, for per-resource
+ * filter and transform rules.
+ *
+ * An expression is compiled once, when its device profile is loaded, into
+ * bytecode for a small stack machine. Evaluation runs the bytecode over a
+ * fixed size stack, without allocation. All values are doubles; a comparison
+ * or logical operator yields 1 or 0.
+ *
+ * Grammar, lowest precedence first:
+ *
+ *     expr    = and { "||" and }
+ *     and     = cmp { "&&" cmp }
+ *     cmp     = sum [ ( "<" | "<=" | ">" | ">=" | "==" | "!=" ) sum ]
+ *     sum     = term { ( "+" | "-" ) term }
+ *     term    = unary { ( "*" | "/" ) unary }
+ *     unary   = ( "-" | "!" ) unary | primary
+ *     primary = number | "v" | "last" | "dt" | "(" expr ")"
+ *             | ( "abs" ) "(" expr ")" | ( "min" | "max" ) "(" expr "," expr ")"
+ *
+ * Variable 'v' is the reading, 'last' the last value posted for the device
+ * resource, and 'dt' the seconds since then. Before the first post, 'last' is
+ * NaN and 'dt' is infinite.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Longest expression text */
+#define EXPR_TEXT_MAXLEN 256
+
+/** Variables for an evaluation */
+typedef struct coap_expr_vars
+{
+  double v;                    /**< reading */
+  double last;                 /**< last value posted; NaN if none */
+  double dt;                   /**< seconds since last post; infinite if none */
+} coap_expr_vars;
+
+typedef struct coap_expr coap_expr;
+
+/**
+ * Compiles expression text.
+ *
+ * @param text    expression
+ * @param error   buffer for a message if compilation fails
+ * @param errlen  size of error buffer
+ * @return compiled expression, or NULL with a message in error
+ */
+coap_expr *coap_expr_compile (const char *text, char *error, size_t errlen);
+
+/** Frees a compiled expression. */
+void coap_expr_free (coap_expr *expr);
+
+/** Evaluates a compiled expression. */
+double coap_expr_eval (const coap_expr *expr, const coap_expr_vars *vars);
+
+/** True if an expression uses 'last' or 'dt', so needs state per device. */
+bool coap_expr_uses_state (const coap_expr *expr);
+
+/**
+ * Times evaluation of an expression, for the --bench-expr option.
+ *
+ * @return mean nanoseconds per evaluation
+ */
+double coap_expr_bench (const coap_expr *expr, uint32_t iterations);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
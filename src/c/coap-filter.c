@@ -0,0 +1,618 @@
+/* In-kernel eBPF filter for the CoAP server socket
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <linux/bpf.h>
+#include <linux/filter.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "coap-filter.h"
+
+#ifndef SO_ATTACH_BPF
+#define SO_ATTACH_BPF 50
+#endif
+
+/* Room for the largest program: header checks plus a full IPv6 allowlist */
+#define FILTER_MAX_INSNS 512
+#define FILTER_MAX_LABELS (8 + 2 * FILTER_ALLOWLIST_MAX)
+
+/* Offsets in the datagram seen by a UDP socket filter, which starts at the UDP header */
+#define UDP_HDR_LEN 8
+#define COAP_HDR_LEN 4
+#define DTLS_HDR_LEN 13
+
+/* First Uri-Path option with value 'a1r': delta 11, length 3 */
+#define URI_OPT_A1R 0xB3
+#define URI_A1 0x6131
+#define URI_R 0x72
+
+/* First Uri-Path option with value 'capture': delta 11, length 7 */
+#define URI_OPT_CAPTURE 0xB7
+#define URI_CAPT 0x63617074
+#define URI_UR 0x7572
+#define URI_E 0x65
+
+struct coap_filter
+{
+  int sock_fd;
+  int prog_fd;
+  int map_fd;
+};
+
+/*
+ * Small assembler for the filter program. Jumps name a label, resolved when
+ * the program is complete.
+ */
+typedef struct
+{
+  struct bpf_insn insns[FILTER_MAX_INSNS];
+  int jump_label[FILTER_MAX_INSNS];      /* label for a jump, or -1 */
+  int label_pos[FILTER_MAX_LABELS];      /* insn index for a label, or -1 */
+  int len;
+  int next_label;
+  bool overflow;
+} filter_asm;
+
+enum
+{
+  LBL_PASS,
+  LBL_DROP_SHORT,
+  LBL_DROP_VERSION,
+  LBL_DROP_TOKEN,
+  LBL_DROP_CODE,
+  LBL_DROP_URI,
+  LBL_DROP_SOURCE,
+  LBL_COUNT,
+  LBL_FIXED                              /* first label from new_label() */
+};
+
+static void
+asm_init (filter_asm *a)
+{
+  memset (a, 0, sizeof (*a));
+  memset (a->jump_label, -1, sizeof (a->jump_label));
+  memset (a->label_pos, -1, sizeof (a->label_pos));
+  a->next_label = LBL_FIXED;
+}
+
+static int
+new_label (filter_asm *a)
+{
+  if (a->next_label == FILTER_MAX_LABELS)
+  {
+    a->overflow = true;
+    return 0;
+  }
+  return a->next_label++;
+}
+
+static void
+set_label (filter_asm *a, int label)
+{
+  a->label_pos[label] = a->len;
+}
+
+static void
+emit (filter_asm *a, uint8_t code, uint8_t dst, uint8_t src, int16_t off, int32_t imm, int label)
+{
+  if (a->len == FILTER_MAX_INSNS)
+  {
+    a->overflow = true;
+    return;
+  }
+  struct bpf_insn *insn = &a->insns[a->len];
+  insn->code = code;
+  insn->dst_reg = dst;
+  insn->src_reg = src;
+  insn->off = off;
+  insn->imm = imm;
+  a->jump_label[a->len] = label;
+  a->len++;
+}
+
+/* The verifier rejects unreachable code, so a label may be used only if a jump names it */
+static bool
+label_used (const filter_asm *a, int label)
+{
+  for (int i = 0; i < a->len; i++)
+  {
+    if (a->jump_label[i] == label)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Resolves jump offsets; false if a label is missing */
+static bool
+asm_finish (filter_asm *a)
+{
+  if (a->overflow)
+  {
+    return false;
+  }
+  for (int i = 0; i < a->len; i++)
+  {
+    int label = a->jump_label[i];
+    if (label >= 0)
+    {
+      if (a->label_pos[label] < 0)
+      {
+        return false;
+      }
+      a->insns[i].off = a->label_pos[label] - (i + 1);
+    }
+  }
+  return true;
+}
+
+#define ALU64_IMM(a, op, dst, imm)  emit (a, BPF_ALU64 | (op) | BPF_K, dst, 0, 0, imm, -1)
+#define ALU64_REG(a, op, dst, src)  emit (a, BPF_ALU64 | (op) | BPF_X, dst, src, 0, 0, -1)
+#define MOV64_IMM(a, dst, imm)      ALU64_IMM (a, BPF_MOV, dst, imm)
+#define MOV64_REG(a, dst, src)      ALU64_REG (a, BPF_MOV, dst, src)
+/* 32 bit move zero extends, so an immediate over INT32_MAX is not sign extended */
+#define MOV32_IMM(a, dst, imm)      emit (a, BPF_ALU | BPF_MOV | BPF_K, dst, 0, 0, (int32_t)(imm), -1)
+#define ALU32_IMM(a, op, dst, imm)  emit (a, BPF_ALU | (op) | BPF_K, dst, 0, 0, (int32_t)(imm), -1)
+#define LD_ABS(a, size, off)        emit (a, BPF_LD | (size) | BPF_ABS, 0, 0, 0, off, -1)
+#define LD_IND(a, size, src, off)   emit (a, BPF_LD | (size) | BPF_IND, 0, src, 0, off, -1)
+#define LDX_MEM(a, size, dst, src, off) emit (a, BPF_LDX | (size) | BPF_MEM, dst, src, off, 0, -1)
+#define STX_MEM(a, size, dst, src, off) emit (a, BPF_STX | (size) | BPF_MEM, dst, src, off, 0, -1)
+#define STX_XADD(a, size, dst, src, off) emit (a, BPF_STX | (size) | BPF_XADD, dst, src, off, 0, -1)
+#define JMP_IMM(a, op, dst, imm, lbl) emit (a, BPF_JMP | (op) | BPF_K, dst, 0, 0, imm, lbl)
+#define JMP_REG(a, op, dst, src, lbl) emit (a, BPF_JMP | (op) | BPF_X, dst, src, 0, 0, lbl)
+#define JA(a, lbl)                  emit (a, BPF_JMP | BPF_JA, 0, 0, 0, 0, lbl)
+#define CALL(a, func)               emit (a, BPF_JMP | BPF_CALL, 0, 0, 0, func, -1)
+#define EXIT(a)                     emit (a, BPF_JMP | BPF_EXIT, 0, 0, 0, 0, -1)
+
+static void
+ld_map_fd (filter_asm *a, uint8_t dst, int fd)
+{
+  emit (a, BPF_LD | BPF_DW | BPF_IMM, dst, BPF_PSEUDO_MAP_FD, 0, fd, -1);
+  emit (a, 0, 0, 0, 0, 0, -1);
+}
+
+/* Host order mask for a word of a prefix */
+static uint32_t
+prefix_word_mask (unsigned len, unsigned word)
+{
+  unsigned bits = (len > word * 32) ? len - word * 32 : 0;
+  if (bits >= 32)
+  {
+    return UINT32_MAX;
+  }
+  return bits ? ~(UINT32_MAX >> bits) : 0;
+}
+
+static uint32_t
+prefix_word (const coap_filter_prefix *prefix, unsigned word)
+{
+  uint32_t val;
+  memcpy (&val, prefix->addr + word * 4, 4);
+  return ntohl (val) & prefix_word_mask (prefix->len, word);
+}
+
+/*
+ * Checks the source address against the allowlist. Jumps to 'allowed' on a
+ * match, else to LBL_DROP_SOURCE. Uses the stack at r10-32 for an IPv6
+ * address. LD_ABS loads return host byte order.
+ */
+static void
+emit_allowlist (filter_asm *a, const coap_filter_prefix *prefixes, unsigned count, int allowed)
+{
+  int v6 = new_label (a);
+
+  LD_ABS (a, BPF_B, SKF_NET_OFF);
+  ALU64_IMM (a, BPF_RSH, BPF_REG_0, 4);
+  JMP_IMM (a, BPF_JEQ, BPF_REG_0, 6, v6);
+  JMP_IMM (a, BPF_JNE, BPF_REG_0, 4, LBL_DROP_SOURCE);
+
+  /* IPv4 source at offset 12 of IP header */
+  LD_ABS (a, BPF_W, SKF_NET_OFF + 12);
+  MOV64_REG (a, BPF_REG_9, BPF_REG_0);
+  for (unsigned i = 0; i < count; i++)
+  {
+    if (prefixes[i].family != AF_INET)
+    {
+      continue;
+    }
+    MOV64_REG (a, BPF_REG_2, BPF_REG_9);
+    ALU32_IMM (a, BPF_AND, BPF_REG_2, prefix_word_mask (prefixes[i].len, 0));
+    MOV32_IMM (a, BPF_REG_3, prefix_word (&prefixes[i], 0));
+    JMP_REG (a, BPF_JEQ, BPF_REG_2, BPF_REG_3, allowed);
+  }
+  JA (a, LBL_DROP_SOURCE);
+
+  /* IPv6 source at offset 8 of IP header; copy to stack by word */
+  set_label (a, v6);
+  for (unsigned word = 0; word < 4; word++)
+  {
+    LD_ABS (a, BPF_W, SKF_NET_OFF + 8 + word * 4);
+    STX_MEM (a, BPF_W, BPF_REG_10, BPF_REG_0, -32 + word * 4);
+  }
+  for (unsigned i = 0; i < count; i++)
+  {
+    if (prefixes[i].family != AF_INET6)
+    {
+      continue;
+    }
+    int next = new_label (a);
+    for (unsigned word = 0; word < 4; word++)
+    {
+      uint32_t mask = prefix_word_mask (prefixes[i].len, word);
+      if (!mask)
+      {
+        break;
+      }
+      LDX_MEM (a, BPF_W, BPF_REG_2, BPF_REG_10, -32 + word * 4);
+      ALU32_IMM (a, BPF_AND, BPF_REG_2, mask);
+      MOV32_IMM (a, BPF_REG_3, prefix_word (&prefixes[i], word));
+      JMP_REG (a, BPF_JNE, BPF_REG_2, BPF_REG_3, next);
+    }
+    JA (a, allowed);
+    set_label (a, next);
+  }
+  JA (a, LBL_DROP_SOURCE);
+}
+
+/*
+ * Checks the CoAP header. Registers: r7 datagram length, r8 message type,
+ * r9 token length.
+ */
+static void
+emit_coap_checks (filter_asm *a)
+{
+  int long_enough = new_label (a);
+  int check_uri = new_label (a);
+  int check_capture = new_label (a);
+
+  JMP_IMM (a, BPF_JGE, BPF_REG_7, UDP_HDR_LEN + COAP_HDR_LEN, long_enough);
+  JA (a, LBL_DROP_SHORT);
+  set_label (a, long_enough);
+
+  /* version (2 bits), type (2 bits), token length (4 bits) */
+  LD_ABS (a, BPF_B, UDP_HDR_LEN);
+  MOV64_REG (a, BPF_REG_2, BPF_REG_0);
+  ALU64_IMM (a, BPF_RSH, BPF_REG_2, 6);
+  JMP_IMM (a, BPF_JNE, BPF_REG_2, 1, LBL_DROP_VERSION);
+  MOV64_REG (a, BPF_REG_9, BPF_REG_0);
+  ALU64_IMM (a, BPF_AND, BPF_REG_9, 0x0F);
+  JMP_IMM (a, BPF_JGT, BPF_REG_9, 8, LBL_DROP_TOKEN);
+  MOV64_REG (a, BPF_REG_8, BPF_REG_0);
+  ALU64_IMM (a, BPF_RSH, BPF_REG_8, 4);
+  ALU64_IMM (a, BPF_AND, BPF_REG_8, 3);
+
+  /* ACK and RST may carry a response from a client */
+  LD_ABS (a, BPF_B, UDP_HDR_LEN + 1);
+  JMP_IMM (a, BPF_JGT, BPF_REG_8, 1, LBL_PASS);
+  /* CON and NON must be a request, or empty */
+  MOV64_REG (a, BPF_REG_2, BPF_REG_0);
+  ALU64_IMM (a, BPF_RSH, BPF_REG_2, 5);
+  JMP_IMM (a, BPF_JNE, BPF_REG_2, 0, LBL_DROP_CODE);
+
+  /* POST must start with Uri-Path 'a1r' or 'capture'; first option follows token */
+  JMP_IMM (a, BPF_JNE, BPF_REG_0, 2, LBL_PASS);
+  MOV64_REG (a, BPF_REG_2, BPF_REG_9);
+  ALU64_IMM (a, BPF_ADD, BPF_REG_2, UDP_HDR_LEN + COAP_HDR_LEN + 4);
+  JMP_REG (a, BPF_JGT, BPF_REG_2, BPF_REG_7, LBL_DROP_URI);
+  LD_IND (a, BPF_B, BPF_REG_9, UDP_HDR_LEN + COAP_HDR_LEN);
+  /* an earlier option, like Uri-Host, precludes a cheap check */
+  MOV64_REG (a, BPF_REG_2, BPF_REG_0);
+  ALU64_IMM (a, BPF_RSH, BPF_REG_2, 4);
+  JMP_IMM (a, BPF_JGE, BPF_REG_2, 11, check_uri);
+  JA (a, LBL_PASS);
+  set_label (a, check_uri);
+  JMP_IMM (a, BPF_JEQ, BPF_REG_0, URI_OPT_CAPTURE, check_capture);
+  JMP_IMM (a, BPF_JNE, BPF_REG_0, URI_OPT_A1R, LBL_DROP_URI);
+  LD_IND (a, BPF_H, BPF_REG_9, UDP_HDR_LEN + COAP_HDR_LEN + 1);
+  JMP_IMM (a, BPF_JNE, BPF_REG_0, URI_A1, LBL_DROP_URI);
+  LD_IND (a, BPF_B, BPF_REG_9, UDP_HDR_LEN + COAP_HDR_LEN + 3);
+  JMP_IMM (a, BPF_JNE, BPF_REG_0, URI_R, LBL_DROP_URI);
+  JA (a, LBL_PASS);
+
+  /* POST /capture starts or extends a capture */
+  set_label (a, check_capture);
+  MOV64_REG (a, BPF_REG_2, BPF_REG_9);
+  ALU64_IMM (a, BPF_ADD, BPF_REG_2, UDP_HDR_LEN + COAP_HDR_LEN + 8);
+  JMP_REG (a, BPF_JGT, BPF_REG_2, BPF_REG_7, LBL_DROP_URI);
+  LD_IND (a, BPF_W, BPF_REG_9, UDP_HDR_LEN + COAP_HDR_LEN + 1);
+  JMP_IMM (a, BPF_JNE, BPF_REG_0, URI_CAPT, LBL_DROP_URI);
+  LD_IND (a, BPF_H, BPF_REG_9, UDP_HDR_LEN + COAP_HDR_LEN + 5);
+  JMP_IMM (a, BPF_JNE, BPF_REG_0, URI_UR, LBL_DROP_URI);
+  LD_IND (a, BPF_B, BPF_REG_9, UDP_HDR_LEN + COAP_HDR_LEN + 7);
+  JMP_IMM (a, BPF_JNE, BPF_REG_0, URI_E, LBL_DROP_URI);
+  JA (a, LBL_PASS);
+}
+
+/*
+ * Checks the DTLS record header: content type from change_cipher_spec (20)
+ * to tls12_cid (25), and major version 0xFE. Register r7 is datagram length.
+ */
+static void
+emit_dtls_checks (filter_asm *a)
+{
+  int long_enough = new_label (a);
+
+  JMP_IMM (a, BPF_JGE, BPF_REG_7, UDP_HDR_LEN + DTLS_HDR_LEN, long_enough);
+  JA (a, LBL_DROP_SHORT);
+  set_label (a, long_enough);
+
+  LD_ABS (a, BPF_B, UDP_HDR_LEN);
+  JMP_IMM (a, BPF_JGT, BPF_REG_0, 25, LBL_DROP_VERSION);
+  JMP_IMM (a, BPF_JLT, BPF_REG_0, 20, LBL_DROP_VERSION);
+  LD_ABS (a, BPF_B, UDP_HDR_LEN + 1);
+  JMP_IMM (a, BPF_JNE, BPF_REG_0, 0xFE, LBL_DROP_VERSION);
+  JA (a, LBL_PASS);
+}
+
+/*
+ * Sets verdict in r8 and counts it in the map. Returns the full datagram
+ * length to accept, or 0 to drop.
+ */
+static void
+emit_verdicts (filter_asm *a, int map_fd)
+{
+  static const int labels[FILTER_VERDICTS] =
+  {
+    LBL_PASS, LBL_DROP_SHORT, LBL_DROP_VERSION, LBL_DROP_TOKEN, LBL_DROP_CODE,
+    LBL_DROP_URI, LBL_DROP_SOURCE
+  };
+  int done = new_label (a);
+  int out = new_label (a);
+
+  for (int verdict = 0; verdict < FILTER_VERDICTS; verdict++)
+  {
+    if (!label_used (a, labels[verdict]))
+    {
+      continue;
+    }
+    set_label (a, labels[verdict]);
+    MOV64_IMM (a, BPF_REG_8, verdict);
+    JA (a, LBL_COUNT);
+  }
+
+  set_label (a, LBL_COUNT);
+  STX_MEM (a, BPF_W, BPF_REG_10, BPF_REG_8, -4);
+  ld_map_fd (a, BPF_REG_1, map_fd);
+  MOV64_REG (a, BPF_REG_2, BPF_REG_10);
+  ALU64_IMM (a, BPF_ADD, BPF_REG_2, -4);
+  CALL (a, BPF_FUNC_map_lookup_elem);
+  JMP_IMM (a, BPF_JEQ, BPF_REG_0, 0, done);
+  MOV64_IMM (a, BPF_REG_1, 1);
+  STX_XADD (a, BPF_DW, BPF_REG_0, BPF_REG_1, 0);
+
+  set_label (a, done);
+  MOV64_IMM (a, BPF_REG_0, 0);
+  JMP_IMM (a, BPF_JNE, BPF_REG_8, FILTER_PASSED, out);
+  MOV64_REG (a, BPF_REG_0, BPF_REG_7);
+  set_label (a, out);
+  EXIT (a);
+}
+
+static int
+sys_bpf (int cmd, union bpf_attr *attr)
+{
+  return syscall (__NR_bpf, cmd, attr, sizeof (*attr));
+}
+
+/* Parses one prefix, like '10.0.0.0/8' or 'fd00::1' */
+static bool
+parse_prefix (char *text, coap_filter_prefix *prefix)
+{
+  char *slash = strchr (text, '/');
+  unsigned max_len;
+
+  if (slash)
+  {
+    *slash = '\0';
+  }
+  memset (prefix, 0, sizeof (*prefix));
+  if (inet_pton (AF_INET, text, prefix->addr) == 1)
+  {
+    prefix->family = AF_INET;
+    max_len = 32;
+  }
+  else if (inet_pton (AF_INET6, text, prefix->addr) == 1)
+  {
+    prefix->family = AF_INET6;
+    max_len = 128;
+  }
+  else
+  {
+    return false;
+  }
+
+  prefix->len = max_len;
+  if (slash)
+  {
+    char *endptr;
+    unsigned long len = strtoul (slash + 1, &endptr, 10);
+    if (endptr == slash + 1 || *endptr != '\0' || len > max_len)
+    {
+      return false;
+    }
+    prefix->len = len;
+  }
+  return true;
+}
+
+bool
+coap_filter_parse_allowlist (const char *text, coap_filter_prefix *prefixes, unsigned *count)
+{
+  char *copy = strdup (text);
+  char *save = NULL;
+  bool ok = true;
+
+  *count = 0;
+  for (char *tok = strtok_r (copy, ",", &save); tok; tok = strtok_r (NULL, ",", &save))
+  {
+    /* trim surrounding space */
+    while (*tok == ' ')
+    {
+      tok++;
+    }
+    char *end = tok + strlen (tok);
+    while (end > tok && end[-1] == ' ')
+    {
+      *--end = '\0';
+    }
+    if (!*tok)
+    {
+      continue;
+    }
+    if (*count == FILTER_ALLOWLIST_MAX || !parse_prefix (tok, &prefixes[*count]))
+    {
+      ok = false;
+      break;
+    }
+    (*count)++;
+  }
+  free (copy);
+  return ok;
+}
+
+coap_filter *
+coap_filter_attach (int fd, bool dtls, const coap_filter_prefix *prefixes, unsigned count)
+{
+  union bpf_attr attr;
+  filter_asm *a = NULL;
+  coap_filter *filter = calloc (1, sizeof (*filter));
+  int err;
+
+  if (!filter)
+  {
+    return NULL;
+  }
+  filter->sock_fd = fd;
+  filter->prog_fd = -1;
+
+  memset (&attr, 0, sizeof (attr));
+  attr.map_type = BPF_MAP_TYPE_ARRAY;
+  attr.key_size = sizeof (uint32_t);
+  attr.value_size = sizeof (uint64_t);
+  attr.max_entries = FILTER_VERDICTS;
+  if ((filter->map_fd = sys_bpf (BPF_MAP_CREATE, &attr)) < 0)
+  {
+    goto fail;
+  }
+
+  if (!(a = malloc (sizeof (*a))))
+  {
+    goto fail;
+  }
+  asm_init (a);
+  MOV64_REG (a, BPF_REG_6, BPF_REG_1);
+  LDX_MEM (a, BPF_W, BPF_REG_7, BPF_REG_6, offsetof (struct __sk_buff, len));
+  if (prefixes && count)
+  {
+    int allowed = new_label (a);
+    emit_allowlist (a, prefixes, count, allowed);
+    set_label (a, allowed);
+  }
+  if (dtls)
+  {
+    emit_dtls_checks (a);
+  }
+  else
+  {
+    emit_coap_checks (a);
+  }
+  emit_verdicts (a, filter->map_fd);
+
+  if (!asm_finish (a))
+  {
+    errno = E2BIG;
+    goto fail;
+  }
+
+  memset (&attr, 0, sizeof (attr));
+  attr.prog_type = BPF_PROG_TYPE_SOCKET_FILTER;
+  attr.insns = (uintptr_t)a->insns;
+  attr.insn_cnt = a->len;
+  attr.license = (uintptr_t)"Apache-2.0";
+  if ((filter->prog_fd = sys_bpf (BPF_PROG_LOAD, &attr)) < 0)
+  {
+    goto fail;
+  }
+  if (setsockopt (fd, SOL_SOCKET, SO_ATTACH_BPF, &filter->prog_fd, sizeof (filter->prog_fd)) < 0)
+  {
+    goto fail;
+  }
+  free (a);
+  return filter;
+
+ fail:
+  err = errno;
+  free (a);
+  if (filter->prog_fd >= 0)
+  {
+    close (filter->prog_fd);
+  }
+  if (filter->map_fd >= 0)
+  {
+    close (filter->map_fd);
+  }
+  free (filter);
+  errno = err;
+  return NULL;
+}
+
+void
+coap_filter_detach (coap_filter *filter)
+{
+  if (filter)
+  {
+    int unused = 0;
+    setsockopt (filter->sock_fd, SOL_SOCKET, SO_DETACH_FILTER, &unused, sizeof (unused));
+    close (filter->prog_fd);
+    close (filter->map_fd);
+    free (filter);
+  }
+}
+
+bool
+coap_filter_read_counts (coap_filter *filter, uint64_t counts[FILTER_VERDICTS])
+{
+  for (uint32_t key = 0; key < FILTER_VERDICTS; key++)
+  {
+    union bpf_attr attr;
+    memset (&attr, 0, sizeof (attr));
+    attr.map_fd = filter->map_fd;
+    attr.key = (uintptr_t)&key;
+    attr.value = (uintptr_t)&counts[key];
+    if (sys_bpf (BPF_MAP_LOOKUP_ELEM, &attr) < 0)
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+void
+coap_filter_write_json (coap_filter *filter, coap_metrics_buf *buf)
+{
+  uint64_t counts[FILTER_VERDICTS];
+  if (!coap_filter_read_counts (filter, counts))
+  {
+    return;
+  }
+  coap_metrics_printf (buf, ",\"filter\":{\"passed\":%lu,\"short\":%lu,\"version\":%lu,"
+                       "\"token\":%lu,\"code\":%lu,\"uri\":%lu,\"source\":%lu}",
+                       (unsigned long)counts[FILTER_PASSED],
+                       (unsigned long)counts[FILTER_DROP_SHORT],
+                       (unsigned long)counts[FILTER_DROP_VERSION],
+                       (unsigned long)counts[FILTER_DROP_TOKEN],
+                       (unsigned long)counts[FILTER_DROP_CODE],
+                       (unsigned long)counts[FILTER_DROP_URI],
+                       (unsigned long)counts[FILTER_DROP_SOURCE]);
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_FILTER_H_
+#define _COAP_FILTER_H_ 1
+
+/**
+ * @file
+ * @brief In-kernel eBPF filter for the server socket, which drops malformed
+ * and unauthorized datagrams before they reach libcoap.
+ *
+ * For a NoSec endpoint the filter checks the CoAP header: version, token
+ * length and code class. For a POST, it also checks that the first Uri-Path
+ * segment is 'a1r'. For a DTLS endpoint it checks the DTLS record header.
+ * An optional allowlist of source prefixes applies in both modes. The
+ * kernel counts each drop by reason in a BPF array map.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "coap-metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Maximum entries in a source allowlist */
+#define FILTER_ALLOWLIST_MAX 16
+
+/** Filter verdicts, as indexes into the counter map */
+typedef enum
+{
+  FILTER_PASSED,               /**< datagram accepted */
+  FILTER_DROP_SHORT,           /**< too short for a header */
+  FILTER_DROP_VERSION,         /**< CoAP version or DTLS record header invalid */
+  FILTER_DROP_TOKEN,           /**< token length over 8 */
+  FILTER_DROP_CODE,            /**< CON/NON message with response code class */
+  FILTER_DROP_URI,             /**< POST without /a1r or /capture path prefix */
+  FILTER_DROP_SOURCE,          /**< source address not in allowlist */
+  FILTER_VERDICTS              /**< not a verdict; count of verdicts */
+} coap_filter_verdict_t;
+
+/** Address prefix for a source allowlist */
+typedef struct coap_filter_prefix
+{
+  int family;                  /**< AF_INET or AF_INET6 */
+  uint8_t addr[16];            /**< network byte order; 4 bytes for AF_INET */
+  uint8_t len;                 /**< prefix length in bits */
+} coap_filter_prefix;
+
+typedef struct coap_filter coap_filter;
+
+/**
+ * Parses a comma separated list of prefixes, like '10.0.0.0/8, fd00::/8'.
+ * An address without a length matches only itself.
+ *
+ * @param text      list to parse
+ * @param[out] prefixes   parsed prefixes, up to FILTER_ALLOWLIST_MAX
+ * @param[out] count      number of prefixes
+ * @return false if the list is invalid or too long
+ */
+bool coap_filter_parse_allowlist (const char *text, coap_filter_prefix *prefixes, unsigned *count);
+
+/**
+ * Loads the filter and attaches it to a socket.
+ *
+ * @param fd          server socket
+ * @param dtls        true for a DTLS endpoint
+ * @param prefixes    source allowlist; NULL for none
+ * @param count       number of prefixes
+ * @return filter, or NULL with errno set, typically EPERM without
+ *         CAP_BPF or CAP_SYS_ADMIN
+ */
+coap_filter *coap_filter_attach (int fd, bool dtls, const coap_filter_prefix *prefixes,
+                                 unsigned count);
+
+/**
+ * Detaches the filter from its socket, and releases its program and map.
+ */
+void coap_filter_detach (coap_filter *filter);
+
+/**
+ * Reads counters from the kernel map.
+ *
+ * @param filter      filter to read
+ * @param[out] counts     count for each coap_filter_verdict_t
+ * @return false if map could not be read
+ */
+bool coap_filter_read_counts (coap_filter *filter, uint64_t counts[FILTER_VERDICTS]);
+
+/**
+ * Renders counters as a "filter" member of a JSON object, preceded by a comma.
+ */
+void coap_filter_write_json (coap_filter *filter, coap_metrics_buf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,378 @@
+/* Space-Saving summaries of the busiest devices, resources and peers
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "coap-hot.h"
+
+struct hot_group;
+
+/* Counter for one key */
+typedef struct hot_counter
+{
+  struct hot_counter *next;      /* hash chain */
+  struct hot_counter *prev_peer; /* counters in the same group */
+  struct hot_counter *next_peer;
+  struct hot_group *group;
+  uint64_t bytes;                /* since the key took the counter */
+  uint64_t error;                /* count inherited from the key replaced */
+  uint32_t hash;
+  char key[HOT_KEY_MAXLEN + 1];
+} hot_counter;
+
+/* Counters with equal count; groups are in ascending order of count */
+typedef struct hot_group
+{
+  struct hot_group *prev;        /* lower count */
+  struct hot_group *next;        /* higher count; also free list */
+  hot_counter *counters;
+  uint64_t count;
+} hot_group;
+
+/* Summary of one kind of key in one window */
+typedef struct hot_summary
+{
+  hot_counter *counters;         /* array of capacity */
+  hot_group *groups;             /* array of capacity; a group is never empty */
+  hot_group *free_groups;
+  hot_counter **buckets;
+  uint32_t used;                 /* counters with a key */
+  hot_group *min;                /* group with lowest count; NULL if none used */
+  uint64_t messages;             /* all messages in window, counted or not */
+  uint64_t bytes;
+} hot_summary;
+
+struct coap_hot
+{
+  hot_summary summaries[2][HOT_KINDS];
+  uint32_t current;              /* index of current window in summaries */
+  uint32_t capacity;
+  uint32_t bucket_mask;          /* buckets - 1; buckets is a power of 2 */
+  uint32_t window_sec;
+  uint64_t window_start;         /* s */
+};
+
+static const char *kind_names[HOT_KINDS] = { "devices", "resources", "peers" };
+
+/* FNV-1a, of at most HOT_KEY_MAXLEN bytes; sets len to the bytes hashed */
+static uint32_t
+hash_key (const char *key, size_t *len)
+{
+  uint32_t hash = 2166136261u;
+  size_t i = 0;
+  for (; i < HOT_KEY_MAXLEN && key[i]; i++)
+  {
+    hash = (hash ^ (uint8_t)key[i]) * 16777619u;
+  }
+  *len = i;
+  return hash;
+}
+
+/* Empties a summary */
+static void
+reset_summary (hot_summary *summary, uint32_t capacity, uint32_t buckets)
+{
+  memset (summary->buckets, 0, buckets * sizeof (hot_counter *));
+  summary->free_groups = NULL;
+  for (uint32_t i = 0; i < capacity; i++)
+  {
+    summary->groups[i].next = summary->free_groups;
+    summary->free_groups = &summary->groups[i];
+  }
+  summary->used = 0;
+  summary->min = NULL;
+  summary->messages = 0;
+  summary->bytes = 0;
+}
+
+coap_hot *
+coap_hot_new (uint32_t counters, uint32_t window_sec)
+{
+  if (!counters || !window_sec)
+  {
+    return NULL;
+  }
+  coap_hot *hot = calloc (1, sizeof (*hot));
+  if (!hot)
+  {
+    return NULL;
+  }
+  /* at most half full */
+  uint32_t buckets = 1;
+  while (buckets < counters * 2 && buckets < (UINT32_C (1) << 31))
+  {
+    buckets <<= 1;
+  }
+  hot->capacity = counters;
+  hot->bucket_mask = buckets - 1;
+  hot->window_sec = window_sec;
+  for (unsigned w = 0; w < 2; w++)
+  {
+    for (unsigned k = 0; k < HOT_KINDS; k++)
+    {
+      hot_summary *summary = &hot->summaries[w][k];
+      if (!(summary->counters = calloc (counters, sizeof (hot_counter)))
+          || !(summary->groups = calloc (counters, sizeof (hot_group)))
+          || !(summary->buckets = calloc (buckets, sizeof (hot_counter *))))
+      {
+        coap_hot_free (hot);
+        return NULL;
+      }
+      reset_summary (summary, counters, buckets);
+    }
+  }
+  return hot;
+}
+
+void
+coap_hot_free (coap_hot *hot)
+{
+  if (!hot)
+  {
+    return;
+  }
+  for (unsigned w = 0; w < 2; w++)
+  {
+    for (unsigned k = 0; k < HOT_KINDS; k++)
+    {
+      free (hot->summaries[w][k].counters);
+      free (hot->summaries[w][k].groups);
+      free (hot->summaries[w][k].buckets);
+    }
+  }
+  free (hot);
+}
+
+/* Starts a new window if the current one has ended */
+static void
+rotate (coap_hot *hot, uint64_t now)
+{
+  if (!hot->window_start)
+  {
+    hot->window_start = now;
+    return;
+  }
+  if (now < hot->window_start + hot->window_sec)
+  {
+    return;
+  }
+  uint64_t windows = (now - hot->window_start) / hot->window_sec;
+  hot->current ^= 1;
+  for (unsigned k = 0; k < HOT_KINDS; k++)
+  {
+    reset_summary (&hot->summaries[hot->current][k], hot->capacity, hot->bucket_mask + 1);
+    if (windows > 1)
+    {
+      /* no messages in the last complete window */
+      reset_summary (&hot->summaries[hot->current ^ 1][k], hot->capacity, hot->bucket_mask + 1);
+    }
+  }
+  hot->window_start += windows * hot->window_sec;
+}
+
+/* Removes a counter from its group, and frees the group if now empty */
+static void
+leave_group (hot_summary *summary, hot_counter *counter)
+{
+  hot_group *group = counter->group;
+  if (counter->prev_peer)
+  {
+    counter->prev_peer->next_peer = counter->next_peer;
+  }
+  else
+  {
+    group->counters = counter->next_peer;
+  }
+  if (counter->next_peer)
+  {
+    counter->next_peer->prev_peer = counter->prev_peer;
+  }
+  if (group->counters)
+  {
+    return;
+  }
+
+  if (group->prev)
+  {
+    group->prev->next = group->next;
+  }
+  else
+  {
+    summary->min = group->next;
+  }
+  if (group->next)
+  {
+    group->next->prev = group->prev;
+  }
+  group->next = summary->free_groups;
+  summary->free_groups = group;
+}
+
+static void
+join_group (hot_group *group, hot_counter *counter)
+{
+  counter->group = group;
+  counter->prev_peer = NULL;
+  counter->next_peer = group->counters;
+  if (group->counters)
+  {
+    group->counters->prev_peer = counter;
+  }
+  group->counters = counter;
+}
+
+/* Takes a free group with a count, and links it after prev, or first if prev is NULL */
+static hot_group *
+new_group (hot_summary *summary, hot_group *prev, uint64_t count)
+{
+  /* never empty: a group is in use only while it has a counter */
+  hot_group *group = summary->free_groups;
+  summary->free_groups = group->next;
+  group->count = count;
+  group->counters = NULL;
+  group->prev = prev;
+  group->next = prev ? prev->next : summary->min;
+  if (group->next)
+  {
+    group->next->prev = group;
+  }
+  if (prev)
+  {
+    prev->next = group;
+  }
+  else
+  {
+    summary->min = group;
+  }
+  return group;
+}
+
+/* Moves a counter to the group for its count plus one */
+static void
+increment (hot_summary *summary, hot_counter *counter)
+{
+  hot_group *group = counter->group;
+  uint64_t count = group->count + 1;
+  if (group->next && group->next->count == count)
+  {
+    hot_group *next = group->next;
+    leave_group (summary, counter);
+    join_group (next, counter);
+  }
+  else if (!counter->prev_peer && !counter->next_peer)
+  {
+    /* alone, so the group keeps its place */
+    group->count = count;
+  }
+  else
+  {
+    leave_group (summary, counter);
+    join_group (new_group (summary, group, count), counter);
+  }
+}
+
+void
+coap_hot_add (coap_hot *hot, coap_hot_kind_t kind, const char *key, uint32_t bytes, uint64_t now)
+{
+  rotate (hot, now);
+  hot_summary *summary = &hot->summaries[hot->current][kind];
+  summary->messages++;
+  summary->bytes += bytes;
+
+  size_t len;
+  uint32_t hash = hash_key (key, &len);
+  hot_counter **bucket = &summary->buckets[hash & hot->bucket_mask];
+  for (hot_counter *counter = *bucket; counter; counter = counter->next)
+  {
+    if (counter->hash == hash && !strncmp (counter->key, key, len) && !counter->key[len])
+    {
+      counter->bytes += bytes;
+      increment (summary, counter);
+      return;
+    }
+  }
+
+  hot_counter *counter;
+  if (summary->used < hot->capacity)
+  {
+    counter = &summary->counters[summary->used++];
+    counter->error = 0;
+    hot_group *min = summary->min;
+    join_group ((min && min->count == 1) ? min : new_group (summary, NULL, 1), counter);
+  }
+  else
+  {
+    /* replace a key with the lowest count */
+    counter = summary->min->counters;
+    hot_counter **prev = &summary->buckets[counter->hash & hot->bucket_mask];
+    while (*prev != counter)
+    {
+      prev = &(*prev)->next;
+    }
+    *prev = counter->next;
+    counter->error = summary->min->count;
+    increment (summary, counter);
+  }
+  memcpy (counter->key, key, len);
+  counter->key[len] = '\0';
+  counter->hash = hash;
+  /* not inherited, as the replaced key's bytes say nothing of this key's */
+  counter->bytes = bytes;
+  counter->next = *bucket;
+  *bucket = counter;
+}
+
+/* Renders the counters with the highest counts */
+static void
+write_summary (const hot_summary *summary, const char *name, coap_metrics_buf *buf)
+{
+  coap_metrics_printf (buf, "\"%s\":{\"messages\":%lu,\"bytes\":%lu,\"top\":[", name,
+                       (unsigned long)summary->messages, (unsigned long)summary->bytes);
+  const hot_group *group = summary->min;
+  while (group && group->next)
+  {
+    group = group->next;
+  }
+  unsigned written = 0;
+  for (; group && written < HOT_REPORT_TOP; group = group->prev)
+  {
+    for (const hot_counter *c = group->counters; c && written < HOT_REPORT_TOP; c = c->next_peer)
+    {
+      coap_metrics_printf (buf, "%s{\"key\":", written ? "," : "");
+      coap_metrics_write_string (buf, c->key);
+      coap_metrics_printf (buf, ",\"messages\":%lu,\"error\":%lu,\"bytes\":%lu}",
+                           (unsigned long)group->count, (unsigned long)c->error,
+                           (unsigned long)c->bytes);
+      written++;
+    }
+  }
+  coap_metrics_printf (buf, "]}");
+}
+
+static void
+write_window (const coap_hot *hot, unsigned window, const char *name, coap_metrics_buf *buf)
+{
+  coap_metrics_printf (buf, ",\"%s\":{", name);
+  for (unsigned k = 0; k < HOT_KINDS; k++)
+  {
+    coap_metrics_printf (buf, "%s", k ? "," : "");
+    write_summary (&hot->summaries[window][k], kind_names[k], buf);
+  }
+  coap_metrics_printf (buf, "}");
+}
+
+void
+coap_hot_write_json (coap_hot *hot, uint64_t now, coap_metrics_buf *buf)
+{
+  rotate (hot, now);
+  coap_metrics_printf (buf, ",\"hot\":{\"windowSec\":%u,\"counters\":%u,\"currentSec\":%lu",
+                       hot->window_sec, hot->capacity, (unsigned long)(now - hot->window_start));
+  write_window (hot, hot->current, "current", buf);
+  write_window (hot, hot->current ^ 1, "last", buf);
+  coap_metrics_printf (buf, "}");
+}
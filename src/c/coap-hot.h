@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_HOT_H_
+#define _COAP_HOT_H_ 1
+
+/**
+ * @file
+ * @brief Finds the devices, resources and peers that send the most messages,
+ * without a counter for each one.
+ *
+ * Each kind of key has a Space-Saving summary of a fixed number of counters.
+ * A key not counted takes over the counter with the lowest count, and
+ * inherits that count as its error, so a count is an upper bound and count
+ * minus error a lower bound. Any key with more than 1/counters of the
+ * messages in a window is sure to be counted. Counters are kept in groups of
+ * equal count, in ascending order, so a message is counted in constant time.
+ * Bytes are summed only from when a key takes its counter, so they are a
+ * lower bound, missing the bytes of at most error messages.
+ *
+ * Summaries cover rolling windows: the current window, and the last complete
+ * one. The summaries are used only by the server thread, so are not locked.
+ */
+
+#include <stdint.h>
+
+#include "coap-metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Longest key counted; a longer key is truncated */
+#define HOT_KEY_MAXLEN 63
+/** Keys of each kind reported per window */
+#define HOT_REPORT_TOP 8
+
+/** Kind of key */
+typedef enum
+{
+  HOT_DEVICE,                  /**< device name */
+  HOT_RESOURCE,                /**< device and resource name, as in the URI path */
+  HOT_PEER,                    /**< peer host address */
+  HOT_KINDS
+} coap_hot_kind_t;
+
+/**
+ * Longest rendering by coap_hot_write_json(), with every key at its longest
+ * and every byte of it escaped as \u00XX, and every count at 20 digits
+ */
+#define HOT_JSON_MAXLEN \
+  (96 + 2 * (16 + HOT_KINDS * (96 + HOT_REPORT_TOP * (6 * HOT_KEY_MAXLEN + 101))))
+
+typedef struct coap_hot coap_hot;
+
+/**
+ * Creates empty summaries.
+ *
+ * @param counters    counters per kind of key, per window
+ * @param window_sec  length of a window
+ * @return summaries, or NULL if memory not available
+ */
+coap_hot *coap_hot_new (uint32_t counters, uint32_t window_sec);
+
+/** Frees summaries. */
+void coap_hot_free (coap_hot *hot);
+
+/**
+ * Counts a message for a key.
+ *
+ * @param bytes  message size
+ * @param now    monotonic time, in seconds
+ */
+void coap_hot_add (coap_hot *hot, coap_hot_kind_t kind, const char *key, uint32_t bytes, uint64_t now);
+
+/**
+ * Renders the top keys of each kind in the current and last windows, as a
+ * "hot" member of a JSON object, preceded by a comma. Takes at most
+ * HOT_JSON_MAXLEN bytes of the buffer.
+ *
+ * @param now  monotonic time, in seconds
+ */
+void coap_hot_write_json (coap_hot *hot, uint64_t now, coap_metrics_buf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
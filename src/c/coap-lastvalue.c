@@ -0,0 +1,406 @@
+/* Shared memory table of last values
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "coap-lastvalue.h"
+
+#define LASTVALUE_MAGIC "CLVT"
+#define LASTVALUE_VERSION 1
+/* Longest path in the index file */
+#define LASTVALUE_PATH_MAXLEN 256
+
+/* Segment header; padded so slots are cache line aligned */
+typedef struct
+{
+  char magic[4];
+  uint32_t version;
+  uint32_t slot_size;
+  uint32_t capacity;
+  uint32_t used;                  /* slots assigned */
+  uint8_t reserved[44];
+} lastvalue_header;
+
+struct coap_lastvalue
+{
+  size_t map_len;
+  lastvalue_header *header;
+  coap_lastvalue_slot *slots;
+  FILE *index;
+  char **paths;                   /* path for each assigned slot */
+  uint32_t capacity;
+};
+
+_Static_assert (sizeof (lastvalue_header) == 64, "header size");
+_Static_assert (sizeof (coap_lastvalue_slot) == 128, "slot size");
+
+static size_t
+segment_size (uint32_t slots)
+{
+  return sizeof (lastvalue_header) + (size_t)slots * sizeof (coap_lastvalue_slot);
+}
+
+static bool
+header_valid (const lastvalue_header *hdr)
+{
+  return !memcmp (hdr->magic, LASTVALUE_MAGIC, sizeof (hdr->magic))
+         && hdr->version == LASTVALUE_VERSION
+         && hdr->slot_size == sizeof (coap_lastvalue_slot)
+         && hdr->capacity > 0
+         && hdr->used <= hdr->capacity;
+}
+
+/*
+ * Reads slot assignments from an index file into paths, which has room for
+ * 'capacity' entries.
+ *
+ * @return number of slots assigned, or -1 if the file is not consistent
+ */
+static int64_t
+read_index (FILE *index, char **paths, uint32_t capacity)
+{
+  char line[LASTVALUE_PATH_MAXLEN + 16];
+  uint32_t used = 0;
+  while (fgets (line, sizeof (line), index))
+  {
+    char *tab = strchr (line, '\t');
+    char *nl = strchr (line, '\n');
+    if (!nl)
+    {
+      /* partial line, from an interrupted write */
+      break;
+    }
+    *nl = '\0';
+    char *endptr;
+    unsigned long slot = strtoul (line, &endptr, 10);
+    if (!tab || endptr != tab || slot != used || slot >= capacity)
+    {
+      return -1;
+    }
+    if (!(paths[slot] = strdup (tab + 1)))
+    {
+      return -1;
+    }
+    used++;
+  }
+  return used;
+}
+
+coap_lastvalue *
+coap_lastvalue_open (const char *name, const char *index_path, uint32_t slots)
+{
+  if (slots == 0)
+  {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  coap_lastvalue *table = calloc (1, sizeof (*table));
+  if (!table || !(table->paths = calloc (slots, sizeof (char *))))
+  {
+    free (table);
+    errno = ENOMEM;
+    return NULL;
+  }
+  table->capacity = slots;
+
+  /* readers open the segment read only */
+  int fd = shm_open (name, O_RDWR | O_CREAT, 0644);
+  if (fd < 0)
+  {
+    goto fail;
+  }
+  size_t len = segment_size (slots);
+  struct stat st;
+  bool reuse = (fstat (fd, &st) == 0) && ((size_t)st.st_size == len);
+  if (!reuse && ftruncate (fd, len) < 0)
+  {
+    close (fd);
+    goto fail;
+  }
+  void *map = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close (fd);
+  if (map == MAP_FAILED)
+  {
+    goto fail;
+  }
+  table->map_len = len;
+  table->header = map;
+  table->slots = (coap_lastvalue_slot *)((uint8_t *)map + sizeof (lastvalue_header));
+
+  if (!(table->index = fopen (index_path, "a+")))
+  {
+    goto fail;
+  }
+  rewind (table->index);
+  reuse = reuse && header_valid (table->header) && table->header->capacity == slots
+          && read_index (table->index, table->paths, slots) == table->header->used;
+  if (!reuse)
+  {
+    /* start over, so the index and segment agree */
+    for (uint32_t i = 0; i < slots; i++)
+    {
+      free (table->paths[i]);
+      table->paths[i] = NULL;
+    }
+    if (ftruncate (fileno (table->index), 0) < 0)
+    {
+      goto fail;
+    }
+    rewind (table->index);
+    memset (map, 0, len);
+    memcpy (table->header->magic, LASTVALUE_MAGIC, sizeof (table->header->magic));
+    table->header->version = LASTVALUE_VERSION;
+    table->header->slot_size = sizeof (coap_lastvalue_slot);
+    table->header->capacity = slots;
+  }
+  return table;
+
+ fail:
+  {
+    int err = errno;
+    coap_lastvalue_close (table);
+    errno = err;
+  }
+  return NULL;
+}
+
+bool
+coap_lastvalue_default_index (const char *name, char *buf, size_t len)
+{
+  /* shm_open() names begin with a slash */
+  int n = snprintf (buf, len, "/dev/shm/%s.index", (name[0] == '/') ? name + 1 : name);
+  return n >= 0 && (size_t)n < len;
+}
+
+void
+coap_lastvalue_close (coap_lastvalue *table)
+{
+  if (!table)
+  {
+    return;
+  }
+  for (uint32_t i = 0; i < table->capacity; i++)
+  {
+    free (table->paths[i]);
+  }
+  if (table->header)
+  {
+    munmap (table->header, table->map_len);
+  }
+  if (table->index)
+  {
+    fclose (table->index);
+  }
+  free (table->paths);
+  free (table);
+}
+
+int32_t
+coap_lastvalue_assign (coap_lastvalue *table, const char *path)
+{
+  uint32_t used = table->header->used;
+  for (uint32_t i = 0; i < used; i++)
+  {
+    if (!strcmp (table->paths[i], path))
+    {
+      return i;
+    }
+  }
+  if (used == table->header->capacity || strlen (path) > LASTVALUE_PATH_MAXLEN)
+  {
+    return -1;
+  }
+  if (!(table->paths[used] = strdup (path)))
+  {
+    return -1;
+  }
+  /* index line is complete before the slot is counted as used */
+  if (fprintf (table->index, "%u\t%s\n", used, path) < 0 || fflush (table->index))
+  {
+    free (table->paths[used]);
+    table->paths[used] = NULL;
+    return -1;
+  }
+  __atomic_store_n (&table->header->used, used + 1, __ATOMIC_RELEASE);
+  return used;
+}
+
+/* Marks a slot as being written; readers retry until write_end() */
+static coap_lastvalue_slot *
+write_begin (coap_lastvalue *table, int32_t slot)
+{
+  coap_lastvalue_slot *s = &table->slots[slot];
+  __atomic_store_n (&s->seq, s->seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence (__ATOMIC_RELEASE);
+  return s;
+}
+
+static void
+write_end (coap_lastvalue_slot *s, uint8_t type, uint64_t timestamp)
+{
+  s->type = type;
+  s->timestamp = timestamp;
+  s->count++;
+  __atomic_store_n (&s->seq, s->seq + 1, __ATOMIC_RELEASE);
+}
+
+void
+coap_lastvalue_write_int32 (coap_lastvalue *table, int32_t slot, int32_t value, uint64_t timestamp)
+{
+  coap_lastvalue_slot *s = write_begin (table, slot);
+  s->value.i32 = value;
+  s->text_len = 0;
+  s->truncated = 0;
+  write_end (s, LASTVALUE_INT32, timestamp);
+}
+
+void
+coap_lastvalue_write_float64 (coap_lastvalue *table, int32_t slot, double value, uint64_t timestamp)
+{
+  coap_lastvalue_slot *s = write_begin (table, slot);
+  s->value.f64 = value;
+  s->text_len = 0;
+  s->truncated = 0;
+  write_end (s, LASTVALUE_FLOAT64, timestamp);
+}
+
+void
+coap_lastvalue_write_string (coap_lastvalue *table, int32_t slot, const char *value, size_t len,
+                             uint64_t timestamp)
+{
+  coap_lastvalue_slot *s = write_begin (table, slot);
+  s->truncated = len > LASTVALUE_TEXT_MAXLEN;
+  s->text_len = s->truncated ? LASTVALUE_TEXT_MAXLEN : len;
+  memcpy (s->text, value, s->text_len);
+  write_end (s, LASTVALUE_STRING, timestamp);
+}
+
+bool
+coap_lastvalue_read (const coap_lastvalue_slot *slot, coap_lastvalue_slot *copy)
+{
+  for (;;)
+  {
+    uint32_t seq = __atomic_load_n (&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq == 0)
+    {
+      return false;
+    }
+    if (seq & 1)
+    {
+      continue;
+    }
+    memcpy (copy, slot, sizeof (*copy));
+    __atomic_thread_fence (__ATOMIC_ACQUIRE);
+    if (__atomic_load_n (&slot->seq, __ATOMIC_RELAXED) == seq)
+    {
+      return true;
+    }
+  }
+}
+
+/* Writes one slot as a line of tab separated text. */
+static void
+dump_slot (uint32_t index, const char *path, const coap_lastvalue_slot *slot, FILE *out)
+{
+  char time_text[32];
+  time_t secs = slot->timestamp / 1000000000;
+  struct tm tm;
+  gmtime_r (&secs, &tm);
+  strftime (time_text, sizeof (time_text), "%Y-%m-%dT%H:%M:%S", &tm);
+
+  fprintf (out, "%u\t/%s\t%s.%06luZ\t", index, path, time_text,
+           (unsigned long)(slot->timestamp % 1000000000) / 1000);
+  switch (slot->type)
+  {
+    case LASTVALUE_INT32:
+      fprintf (out, "Int32\t%d\n", slot->value.i32);
+      break;
+    case LASTVALUE_FLOAT64:
+      fprintf (out, "Float64\t%.17g\n", slot->value.f64);
+      break;
+    case LASTVALUE_STRING:
+      fprintf (out, "String\t%.*s%s\n", slot->text_len, slot->text, slot->truncated ? "..." : "");
+      break;
+    default:
+      fprintf (out, "-\t-\n");
+  }
+}
+
+int
+coap_lastvalue_dump (const char *name, const char *index_path, FILE *out)
+{
+  int fd = shm_open (name, O_RDONLY, 0);
+  if (fd < 0)
+  {
+    fprintf (stderr, "cannot open %s: %s\n", name, strerror (errno));
+    return -1;
+  }
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fstat (fd, &st) == 0 && (size_t)st.st_size >= sizeof (lastvalue_header))
+  {
+    map = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  close (fd);
+  const lastvalue_header *hdr = map;
+  if (map == MAP_FAILED || !header_valid (hdr) || (size_t)st.st_size != segment_size (hdr->capacity))
+  {
+    fprintf (stderr, "%s is not a last value segment\n", name);
+    if (map != MAP_FAILED)
+    {
+      munmap (map, st.st_size);
+    }
+    return -1;
+  }
+
+  int result = -1;
+  char **paths = calloc (hdr->capacity, sizeof (char *));
+  FILE *index = fopen (index_path, "r");
+  int64_t used = (paths && index) ? read_index (index, paths, hdr->capacity) : -1;
+  if (used < 0)
+  {
+    fprintf (stderr, "cannot read index %s\n", index_path);
+    goto finish;
+  }
+
+  const coap_lastvalue_slot *slots =
+      (const coap_lastvalue_slot *)((const uint8_t *)map + sizeof (lastvalue_header));
+  for (uint32_t i = 0; i < used; i++)
+  {
+    coap_lastvalue_slot copy;
+    if (coap_lastvalue_read (&slots[i], &copy))
+    {
+      dump_slot (i, paths[i], &copy, out);
+    }
+  }
+  result = 0;
+
+ finish:
+  if (paths)
+  {
+    for (uint32_t i = 0; i < hdr->capacity; i++)
+    {
+      free (paths[i]);
+    }
+    free (paths);
+  }
+  if (index)
+  {
+    fclose (index);
+  }
+  munmap (map, st.st_size);
+  return result;
+}
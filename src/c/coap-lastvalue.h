@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_LASTVALUE_H_
+#define _COAP_LASTVALUE_H_ 1
+
+/**
+ * @file
+ * @brief Last value of each device resource, in a shared memory segment for
+ * local reader processes.
+ *
+ * The segment is a 64 byte header followed by fixed size slots, one per
+ * resource. The server is the only writer. Each slot is guarded by a seqlock:
+ * a reader copies the slot, and retries if its seq member was odd or changed
+ * during the copy. Slot assignments are listed in an index file, as lines of
+ * '<slot>\t<path>', like '0\ta1r/d1/int'. An assignment never changes while
+ * the segment exists, and is kept across a restart of the server, so a reader
+ * may cache it.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LASTVALUE_TEXT_MAXLEN 96
+
+/** Type of value in a slot */
+typedef enum
+{
+  LASTVALUE_EMPTY,             /**< no reading yet */
+  LASTVALUE_INT32,             /**< value.i32 */
+  LASTVALUE_FLOAT64,           /**< value.f64 */
+  LASTVALUE_STRING             /**< text, not null terminated */
+} coap_lastvalue_type_t;
+
+/** Last value of a resource; 128 bytes */
+typedef struct coap_lastvalue_slot
+{
+  uint32_t seq;                           /**< seqlock; odd while being written */
+  uint8_t type;                           /**< coap_lastvalue_type_t */
+  uint8_t truncated;                      /**< 1 if a string was longer than text */
+  uint16_t text_len;                      /**< bytes in text */
+  uint64_t timestamp;                     /**< receive time, ns since epoch */
+  uint64_t count;                         /**< readings written to the slot */
+  union
+  {
+    int32_t i32;
+    double f64;
+  } value;                                /**< numeric value */
+  char text[LASTVALUE_TEXT_MAXLEN];       /**< string value prefix */
+} coap_lastvalue_slot;
+
+typedef struct coap_lastvalue coap_lastvalue;
+
+/**
+ * Opens the shared memory segment and its index file, creating them if
+ * needed. Existing values and assignments are kept if the segment layout
+ * matches.
+ *
+ * @param name        segment name for shm_open(), like '/device-coap-lv'
+ * @param index_path  index file
+ * @param slots       capacity in slots
+ * @return table, or NULL on failure with errno set
+ */
+coap_lastvalue *coap_lastvalue_open (const char *name, const char *index_path, uint32_t slots);
+
+/**
+ * Writes the default index file path for a segment, which is alongside the
+ * segment in /dev/shm, like '/dev/shm/device-coap-lv.index'.
+ *
+ * @return false if the path does not fit in buf
+ */
+bool coap_lastvalue_default_index (const char *name, char *buf, size_t len);
+
+/**
+ * Unmaps the segment and closes the index file. The segment remains for
+ * readers.
+ */
+void coap_lastvalue_close (coap_lastvalue *table);
+
+/**
+ * Finds the slot for a resource path, and assigns the next free slot if not
+ * found.
+ *
+ * @return slot, or -1 if the table is full or the index cannot be written
+ */
+int32_t coap_lastvalue_assign (coap_lastvalue *table, const char *path);
+
+/** Writes an Int32 value to a slot. */
+void coap_lastvalue_write_int32 (coap_lastvalue *table, int32_t slot, int32_t value,
+                                 uint64_t timestamp);
+
+/** Writes a Float64 value to a slot. */
+void coap_lastvalue_write_float64 (coap_lastvalue *table, int32_t slot, double value,
+                                   uint64_t timestamp);
+
+/** Writes a String value to a slot, truncated to LASTVALUE_TEXT_MAXLEN. */
+void coap_lastvalue_write_string (coap_lastvalue *table, int32_t slot, const char *value,
+                                  size_t len, uint64_t timestamp);
+
+/**
+ * Copies a slot consistently, as a reader process would.
+ *
+ * @return false if the slot is not assigned
+ */
+bool coap_lastvalue_read (const coap_lastvalue_slot *slot, coap_lastvalue_slot *copy);
+
+/**
+ * Writes the values in a segment as tab separated text, in slot order.
+ * Columns are: slot, path, time, type, value.
+ *
+ * @param name        segment name
+ * @param index_path  index file
+ * @param out         output stream
+ * @return 0 on success, or -1 with a message written to stderr
+ */
+int coap_lastvalue_dump (const char *name, const char *index_path, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
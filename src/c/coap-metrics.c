@@ -0,0 +1,288 @@
+/* Metrics for the CoAP server
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <linux/sock_diag.h>
+
+#include "coap-metrics.h"
+
+void
+coap_metrics_printf (coap_metrics_buf *buf, const char *fmt, ...)
+{
+  if (buf->overflow)
+  {
+    return;
+  }
+
+  va_list args;
+  va_start (args, fmt);
+  int n = vsnprintf (buf->data + buf->len, buf->size - buf->len, fmt, args);
+  va_end (args);
+
+  if (n < 0 || (size_t)n >= buf->size - buf->len)
+  {
+    /* keep what fit, still null terminated by vsnprintf */
+    buf->len = buf->size - 1;
+    buf->overflow = true;
+  }
+  else
+  {
+    buf->len += n;
+  }
+}
+
+void
+coap_metrics_write_string (coap_metrics_buf *buf, const char *text)
+{
+  coap_metrics_printf (buf, "\"");
+  for (const char *c = text; *c && !buf->overflow; c++)
+  {
+    if (*c == '"' || *c == '\\')
+    {
+      coap_metrics_printf (buf, "\\%c", *c);
+    }
+    else if ((uint8_t)*c < 0x20)
+    {
+      coap_metrics_printf (buf, "\\u%04x", (unsigned)(uint8_t)*c);
+    }
+    else
+    {
+      coap_metrics_printf (buf, "%c", *c);
+    }
+  }
+  coap_metrics_printf (buf, "\"");
+}
+
+bool
+coap_metrics_read_socket (int fd, coap_socket_stats *stats)
+{
+  uint32_t meminfo[SK_MEMINFO_VARS];
+  socklen_t len = sizeof (meminfo);
+
+  memset (meminfo, 0, sizeof (meminfo));
+  if (getsockopt (fd, SOL_SOCKET, SO_MEMINFO, meminfo, &len) < 0)
+  {
+    return false;
+  }
+
+  stats->rx_queued = meminfo[SK_MEMINFO_RMEM_ALLOC];
+  stats->rcvbuf = meminfo[SK_MEMINFO_RCVBUF];
+  stats->tx_queued = meminfo[SK_MEMINFO_WMEM_ALLOC];
+  stats->sndbuf = meminfo[SK_MEMINFO_SNDBUF];
+  /* SK_MEMINFO_DROPS is present only in kernels from 4.7 */
+  stats->drops = (len > SK_MEMINFO_DROPS * sizeof (uint32_t)) ? meminfo[SK_MEMINFO_DROPS] : 0;
+  return true;
+}
+
+/* Histogram bucket for a value; see coap_histogram for layout */
+static unsigned
+histogram_bucket (uint64_t value)
+{
+  if (value < 4)
+  {
+    return value;
+  }
+  if (value >= ((uint64_t)1 << 32))
+  {
+    return HISTOGRAM_BUCKETS - 1;
+  }
+  unsigned msb = 63 - __builtin_clzll (value);
+  return 4 + (msb - 2) * 4 + ((value >> (msb - 2)) & 3);
+}
+
+/* Largest value in a histogram bucket */
+static uint64_t
+histogram_bucket_max (unsigned bucket)
+{
+  if (bucket < 4)
+  {
+    return bucket;
+  }
+  unsigned msb = (bucket - 4) / 4 + 2;
+  unsigned sub = (bucket - 4) % 4;
+  return (((uint64_t)5 + sub) << (msb - 2)) - 1;
+}
+
+/* Moves current window to last if it has expired. */
+static void
+histogram_rotate (coap_histogram *hist, uint64_t now)
+{
+  if (now - hist->window_start < HISTOGRAM_WINDOW_SEC)
+  {
+    return;
+  }
+  if (now - hist->window_start < 2 * HISTOGRAM_WINDOW_SEC)
+  {
+    memcpy (hist->last_counts, hist->counts, sizeof (hist->counts));
+    hist->last_total = hist->total;
+    hist->last_max = hist->max;
+  }
+  else
+  {
+    /* idle for a full window */
+    memset (hist->last_counts, 0, sizeof (hist->last_counts));
+    hist->last_total = 0;
+    hist->last_max = 0;
+  }
+  memset (hist->counts, 0, sizeof (hist->counts));
+  hist->total = 0;
+  hist->max = 0;
+  hist->window_start = now - (now - hist->window_start) % HISTOGRAM_WINDOW_SEC;
+}
+
+void
+coap_histogram_add (coap_histogram *hist, uint64_t value, uint64_t now)
+{
+  histogram_rotate (hist, now);
+  hist->counts[histogram_bucket (value)]++;
+  hist->total++;
+  if (value > hist->max)
+  {
+    hist->max = value;
+  }
+}
+
+/* Percentile of counts, as the upper bound of its bucket, capped at max */
+static uint64_t
+counts_percentile (const uint64_t *counts, uint64_t total, uint64_t max, unsigned pct)
+{
+  if (!total)
+  {
+    return 0;
+  }
+  uint64_t rank = (total * pct + 99) / 100;
+  uint64_t seen = 0;
+  for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    seen += counts[i];
+    if (seen >= rank)
+    {
+      uint64_t bound = histogram_bucket_max (i);
+      return bound < max ? bound : max;
+    }
+  }
+  return max;
+}
+
+/* Percentile from last window */
+static uint64_t
+histogram_percentile (const coap_histogram *hist, unsigned pct)
+{
+  return counts_percentile (hist->last_counts, hist->last_total, hist->last_max, pct);
+}
+
+uint64_t
+coap_histogram_recent_percentile (coap_histogram *hist, unsigned pct, uint64_t now)
+{
+  histogram_rotate (hist, now);
+  uint64_t counts[HISTOGRAM_BUCKETS];
+  for (unsigned i = 0; i < HISTOGRAM_BUCKETS; i++)
+  {
+    counts[i] = hist->counts[i] + hist->last_counts[i];
+  }
+  return counts_percentile (counts, hist->total + hist->last_total,
+                            hist->max > hist->last_max ? hist->max : hist->last_max, pct);
+}
+
+void
+coap_histogram_write_json (coap_histogram *hist, const char *name, uint64_t now,
+                           coap_metrics_buf *buf)
+{
+  histogram_rotate (hist, now);
+  coap_metrics_printf (buf, ",\"%s\":{\"count\":%lu,\"p50\":%lu,\"p90\":%lu,\"p99\":%lu,"
+                       "\"max\":%lu}", name, (unsigned long)hist->last_total,
+                       (unsigned long)histogram_percentile (hist, 50),
+                       (unsigned long)histogram_percentile (hist, 90),
+                       (unsigned long)histogram_percentile (hist, 99),
+                       (unsigned long)hist->last_max);
+}
+
+void
+coap_metrics_write_json (const coap_metrics *metrics, const coap_socket_stats *sock,
+                         coap_metrics_buf *buf)
+{
+  coap_metrics_printf (buf, "\"requests\":%lu,\"readings\":%lu,\"rejected\":%lu,\"filtered\":%lu",
+                       (unsigned long)metrics->requests, (unsigned long)metrics->readings,
+                       (unsigned long)metrics->rejected, (unsigned long)metrics->filtered);
+  if (sock)
+  {
+    coap_metrics_printf (buf, ",\"socket\":{\"rxQueued\":%u,\"rcvbuf\":%u,\"txQueued\":%u,"
+                         "\"sndbuf\":%u,\"drops\":%u}", sock->rx_queued, sock->rcvbuf,
+                         sock->tx_queued, sock->sndbuf, sock->drops);
+  }
+}
+
+void
+coap_metrics_write_memory_json (coap_metrics_buf *buf)
+{
+  unsigned long rss = 0;
+  unsigned long pages;
+  FILE *statm = fopen ("/proc/self/statm", "r");
+  if (statm)
+  {
+    if (fscanf (statm, "%lu %lu", &pages, &rss) != 2)
+    {
+      rss = 0;
+    }
+    fclose (statm);
+  }
+  rss *= sysconf (_SC_PAGESIZE);
+
+  /* ru_maxrss is in kilobytes */
+  struct rusage usage;
+  unsigned long peak_rss = 0;
+  if (getrusage (RUSAGE_SELF, &usage) == 0)
+  {
+    peak_rss = (unsigned long)usage.ru_maxrss * 1024;
+  }
+
+  coap_metrics_printf (buf, ",\"memory\":{\"rss\":%lu,\"peakRss\":%lu", rss, peak_rss);
+#ifdef __GLIBC__
+#if __GLIBC_PREREQ(2, 33)
+  struct mallinfo2 heap = mallinfo2 ();
+#else
+  struct mallinfo heap = mallinfo ();
+#endif
+  /* arena and mmap'd blocks are obtained from the OS; fordblks is free within arena */
+  coap_metrics_printf (buf, ",\"heap\":{\"arena\":%lu,\"mmapped\":%lu,\"inUse\":%lu,"
+                       "\"free\":%lu}", (unsigned long)heap.arena, (unsigned long)heap.hblkhd,
+                       (unsigned long)heap.uordblks, (unsigned long)heap.fordblks);
+#endif
+  coap_metrics_printf (buf, "}");
+}
+
+void
+coap_metrics_write_cpu_json (coap_metrics_buf *buf)
+{
+  struct rusage usage;
+  if (getrusage (RUSAGE_SELF, &usage) != 0)
+  {
+    return;
+  }
+  coap_metrics_printf (buf, ",\"cpu\":{\"userUsec\":%lu,\"systemUsec\":%lu}",
+                       (unsigned long)usage.ru_utime.tv_sec * 1000000 + usage.ru_utime.tv_usec,
+                       (unsigned long)usage.ru_stime.tv_sec * 1000000 + usage.ru_stime.tv_usec);
+}
+
+void
+coap_metrics_write_bench_json (const char *name, const double *nsec, uint32_t count,
+                               coap_metrics_buf *buf)
+{
+  coap_metrics_printf (buf, "{\"name\":\"%s\",\"unit\":\"ns\",\"samples\":[", name);
+  for (uint32_t i = 0; i < count; i++)
+  {
+    coap_metrics_printf (buf, "%s%.2f", i ? "," : "", nsec[i]);
+  }
+  coap_metrics_printf (buf, "]}");
+}
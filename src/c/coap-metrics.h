@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_METRICS_H_
+#define _COAP_METRICS_H_ 1
+
+/**
+ * @file
+ * @brief Counters for the CoAP server, rendered as JSON for the stats resource.
+ */
+
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Path for the CoAP resource that reports metrics */
+#define METRICS_RESOURCE_PATH "stats"
+
+/**
+ * Kernel view of the server socket, sampled on demand. Lets an operator tell
+ * whether datagrams are lost before the server sees them (drops) or are
+ * waiting on the server loop (rx_queued).
+ */
+typedef struct coap_socket_stats
+{
+  uint32_t rx_queued;          /**< bytes in the receive queue */
+  uint32_t rcvbuf;             /**< receive buffer size, as granted by kernel */
+  uint32_t tx_queued;          /**< bytes in the send queue */
+  uint32_t sndbuf;             /**< send buffer size, as granted by kernel */
+  uint32_t drops;              /**< datagrams dropped by kernel, since socket open */
+} coap_socket_stats;
+
+/** Buckets in a histogram; covers values up to 2^32 */
+#define HISTOGRAM_BUCKETS 124
+/** Period for a histogram window, in seconds */
+#define HISTOGRAM_WINDOW_SEC 60
+
+/**
+ * Histogram of values over fixed time windows, for percentiles that show
+ * drift over time. Buckets are log-linear, with four per power of two, so a
+ * percentile is within 25% of the true value. Not thread safe.
+ */
+typedef struct coap_histogram
+{
+  uint64_t window_start;                  /**< start of current window, seconds */
+  uint64_t counts[HISTOGRAM_BUCKETS];     /**< current window */
+  uint64_t total;                         /**< values in current window */
+  uint64_t max;                           /**< largest value in current window */
+  uint64_t last_counts[HISTOGRAM_BUCKETS];/**< last complete window */
+  uint64_t last_total;
+  uint64_t last_max;
+} coap_histogram;
+
+/**
+ * User space counters for the server. Updated only by the server thread.
+ */
+typedef struct coap_metrics
+{
+  uint64_t requests;           /**< requests passed to the data handler */
+  uint64_t readings;           /**< readings posted to EdgeX, or queued to post */
+  uint64_t rejected;           /**< requests answered with an error code */
+  uint64_t filtered;           /**< readings dropped by resource rules */
+  coap_histogram handler_usec; /**< data handler service time */
+} coap_metrics;
+
+/**
+ * Fixed size text buffer for rendering metrics. Appends past the end are
+ * truncated, and flagged by 'overflow'.
+ */
+typedef struct coap_metrics_buf
+{
+  char *data;
+  size_t size;
+  size_t len;
+  bool overflow;
+} coap_metrics_buf;
+
+/**
+ * Appends printf style text to the buffer.
+ */
+void coap_metrics_printf (coap_metrics_buf *buf, const char *fmt, ...)
+  __attribute__ ((format (printf, 2, 3)));
+
+/**
+ * Appends text as a quoted JSON string, escaping quotes, backslashes and
+ * control characters.
+ */
+void coap_metrics_write_string (coap_metrics_buf *buf, const char *text);
+
+/**
+ * Reads kernel socket statistics via SO_MEMINFO.
+ *
+ * @param fd      socket to read
+ * @param[out] stats  statistics read
+ * @return true if read successfully
+ */
+bool coap_metrics_read_socket (int fd, coap_socket_stats *stats);
+
+/**
+ * Adds a value to a histogram.
+ *
+ * @param hist     histogram
+ * @param value    value to add
+ * @param now      current monotonic time in seconds, to rotate windows
+ */
+void coap_histogram_add (coap_histogram *hist, uint64_t value, uint64_t now);
+
+/**
+ * Percentile over the current window and the last complete one, so it
+ * follows a change within a window yet rests on more than a few values.
+ *
+ * @param hist     histogram
+ * @param pct      percentile, 1 to 100
+ * @param now      current monotonic time in seconds, to rotate windows
+ * @return upper bound of the percentile's bucket, capped at the maximum; 0
+ *         if no values
+ */
+uint64_t coap_histogram_recent_percentile (coap_histogram *hist, unsigned pct, uint64_t now);
+
+/**
+ * Renders the last complete window of a histogram as a JSON object member,
+ * preceded by a comma, with count, p50, p90, p99 and max.
+ *
+ * @param hist     histogram
+ * @param name     member name
+ * @param now      current monotonic time in seconds, to rotate windows
+ * @param buf      buffer for output
+ */
+void coap_histogram_write_json (coap_histogram *hist, const char *name, uint64_t now,
+                                coap_metrics_buf *buf);
+
+/**
+ * Renders metrics and socket statistics as members of a JSON object, without
+ * the enclosing braces, so other components may add their own members.
+ *
+ * @param metrics  user space counters
+ * @param sock     socket statistics; NULL if not available
+ * @param buf      buffer for output
+ */
+void coap_metrics_write_json (const coap_metrics *metrics, const coap_socket_stats *sock,
+                              coap_metrics_buf *buf);
+
+/**
+ * Renders process memory use as a "memory" member of a JSON object, preceded
+ * by a comma. Includes resident set size now and at its peak, and, with
+ * glibc, heap statistics to gauge fragmentation.
+ *
+ * @param buf      buffer for output
+ */
+void coap_metrics_write_memory_json (coap_metrics_buf *buf);
+
+/**
+ * Renders process CPU time, user and system, as a "cpu" member of a JSON
+ * object, preceded by a comma. Includes all threads, so the cost of a reading
+ * can be measured from the change in CPU time and readings.
+ *
+ * @param buf      buffer for output
+ */
+void coap_metrics_write_cpu_json (coap_metrics_buf *buf);
+
+/**
+ * Renders benchmark samples as a JSON object, like
+ * {"name":"expr","unit":"ns","samples":[12.5,12.4]}, for comparison with a
+ * baseline by scripts/bench_compare.sh.
+ *
+ * @param name     benchmark name
+ * @param nsec     nanoseconds per operation, for each sample
+ * @param count    samples
+ * @param buf      buffer for output
+ */
+void coap_metrics_write_bench_json (const char *name, const double *nsec, uint32_t count,
+                                    coap_metrics_buf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,121 @@
+/* Fixed size block pool
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coap-pool.h"
+
+/* Alignment of blocks, enough for any scalar type */
+#define POOL_ALIGN 16
+
+/* Free blocks are linked through their first bytes. */
+typedef struct pool_block
+{
+  struct pool_block *next;
+} pool_block;
+
+struct coap_pool
+{
+  pthread_mutex_t lock;
+  uint8_t *memory;
+  pool_block *free_list;
+  size_t block_size;           /* usable size */
+  size_t stride;               /* block_size rounded for alignment */
+  coap_pool_stats stats;
+};
+
+coap_pool *
+coap_pool_new (size_t block_size, uint32_t blocks)
+{
+  if (!block_size || !blocks)
+  {
+    return NULL;
+  }
+  size_t stride = (block_size < sizeof (pool_block)) ? sizeof (pool_block) : block_size;
+  stride = (stride + POOL_ALIGN - 1) & ~(size_t)(POOL_ALIGN - 1);
+
+  coap_pool *pool = calloc (1, sizeof (*pool));
+  if (!pool)
+  {
+    return NULL;
+  }
+  if (!(pool->memory = malloc (stride * blocks)))
+  {
+    free (pool);
+    return NULL;
+  }
+  /* prefault, so the pool's memory is resident from startup */
+  memset (pool->memory, 0, stride * blocks);
+
+  pthread_mutex_init (&pool->lock, NULL);
+  pool->block_size = block_size;
+  pool->stride = stride;
+  pool->stats.block_size = block_size;
+  pool->stats.blocks = blocks;
+
+  for (uint32_t i = blocks; i > 0; i--)
+  {
+    pool_block *block = (pool_block *)(pool->memory + (i - 1) * stride);
+    block->next = pool->free_list;
+    pool->free_list = block;
+  }
+  return pool;
+}
+
+void
+coap_pool_free (coap_pool *pool)
+{
+  if (pool)
+  {
+    pthread_mutex_destroy (&pool->lock);
+    free (pool->memory);
+    free (pool);
+  }
+}
+
+void *
+coap_pool_alloc (coap_pool *pool)
+{
+  pthread_mutex_lock (&pool->lock);
+  pool_block *block = pool->free_list;
+  if (block)
+  {
+    pool->free_list = block->next;
+    if (++pool->stats.in_use > pool->stats.peak)
+    {
+      pool->stats.peak = pool->stats.in_use;
+    }
+  }
+  else
+  {
+    pool->stats.exhausted++;
+  }
+  pthread_mutex_unlock (&pool->lock);
+  return block;
+}
+
+void
+coap_pool_release (coap_pool *pool, void *ptr)
+{
+  pool_block *block = ptr;
+  pthread_mutex_lock (&pool->lock);
+  block->next = pool->free_list;
+  pool->free_list = block;
+  pool->stats.in_use--;
+  pthread_mutex_unlock (&pool->lock);
+}
+
+void
+coap_pool_get_stats (coap_pool *pool, coap_pool_stats *stats)
+{
+  pthread_mutex_lock (&pool->lock);
+  *stats = pool->stats;
+  pthread_mutex_unlock (&pool->lock);
+}
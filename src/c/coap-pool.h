@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_POOL_H_
+#define _COAP_POOL_H_ 1
+
+/**
+ * @file
+ * @brief Fixed size block pool, allocated and prefaulted when created.
+ *
+ * Allocation and release are thread safe and do not call the system
+ * allocator, so the pool never grows after startup.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct coap_pool coap_pool;
+
+/** Usage counters for a pool */
+typedef struct coap_pool_stats
+{
+  size_t block_size;           /**< usable bytes per block */
+  uint32_t blocks;             /**< total blocks */
+  uint32_t in_use;             /**< blocks allocated now */
+  uint32_t peak;               /**< most blocks allocated at once */
+  uint64_t exhausted;          /**< allocations refused for lack of a block */
+} coap_pool_stats;
+
+/**
+ * Creates a pool and touches all of its memory.
+ *
+ * @param block_size  usable bytes per block
+ * @param blocks      number of blocks
+ * @return pool, or NULL if memory not available
+ */
+coap_pool *coap_pool_new (size_t block_size, uint32_t blocks);
+
+/**
+ * Frees a pool. Blocks still allocated become invalid.
+ */
+void coap_pool_free (coap_pool *pool);
+
+/**
+ * Allocates a block.
+ *
+ * @return block, or NULL if pool exhausted
+ */
+void *coap_pool_alloc (coap_pool *pool);
+
+/**
+ * Returns a block to its pool.
+ */
+void coap_pool_release (coap_pool *pool, void *block);
+
+/**
+ * Reads usage counters.
+ */
+void coap_pool_get_stats (coap_pool *pool, coap_pool_stats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
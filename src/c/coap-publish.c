@@ -0,0 +1,543 @@
+/* Publish queue for accepted readings
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "coap-publish.h"
+
+/* Most readings taken from the queue at once, so the lock is not held while posting */
+#define PUBLISH_BATCH_MAX 64
+/* Linger added per batch while latency is well within target */
+#define LINGER_STEP_USEC 50
+
+typedef struct publish_entry
+{
+  iot_data_t *value;
+  void *buf;                   /* buffer the value references; NULL if none */
+  uint64_t queued_usec;        /* for a slot, when it became dirty */
+  uint16_t resource_offset;    /* of resource name in names */
+  char names[PUBLISH_NAMES_MAX];  /* device name, then resource name, each terminated */
+} publish_entry;
+
+struct coap_publish
+{
+  pthread_mutex_t lock;
+  pthread_cond_t ready;        /* signalled when the queue becomes non-empty, or to stop */
+  pthread_t thread;
+  devsdk_service_t *service;
+  coap_publish_release_fn release;
+  int pin_error;               /* from pinning the thread to a CPU; 0 if pinned or not asked */
+  bool stop;
+  publish_entry *ring;
+  uint32_t capacity;
+  uint32_t head;
+  uint32_t count;
+  publish_entry *slots;
+  uint64_t *dirty;             /* bit set if slot waits to be posted */
+  uint32_t max_slots;
+  uint32_t slots_used;
+  uint32_t dirty_count;
+  uint32_t dirty_cursor;       /* word to scan first, so slots are taken in turn */
+  uint64_t accepted;
+  uint64_t conflated;          /* queued readings overwritten by a newer one */
+  uint64_t published;
+  uint64_t overflow;           /* readings refused because the ring was full */
+  /* CoDel state, updated by the publisher thread */
+  uint32_t target_usec;
+  uint32_t interval_usec;
+  uint64_t first_above_usec;   /* when sojourn will have exceeded target for an interval; 0 if below */
+  bool shedding;               /* read by the server thread without lock */
+  coap_histogram sojourn_usec;
+  uint64_t shed;               /* requests shed; server thread only */
+  /* batch control, by the publisher thread */
+  uint32_t latency_target_usec;  /* p99 time from receipt to post; 0 for fixed batches */
+  uint32_t batch_size;
+  uint32_t linger_usec;        /* wait for a full batch once readings are waiting */
+  uint32_t turn;               /* alternates whether slots or ring fill an odd batch */
+  uint64_t latency_usec;       /* recent p99 of publish_usec, as last adapted */
+  coap_histogram publish_usec;
+};
+
+/* Monotonic time in microseconds */
+static uint64_t
+now_usec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Records the sojourn time of a reading taken from the queue. Enters the
+ * shedding state once sojourn has stayed above target for an interval, and
+ * leaves it at the first reading within target.
+ */
+static void
+sample_sojourn (coap_publish *queue, uint64_t queued_usec, uint64_t now)
+{
+  uint64_t sojourn = now > queued_usec ? now - queued_usec : 0;
+  coap_histogram_add (&queue->sojourn_usec, sojourn, now / 1000000);
+  if (!queue->target_usec)
+  {
+    return;
+  }
+  bool shedding = queue->shedding;
+  if (sojourn < queue->target_usec)
+  {
+    queue->first_above_usec = 0;
+    shedding = false;
+  }
+  else if (!queue->first_above_usec)
+  {
+    queue->first_above_usec = now + queue->interval_usec;
+  }
+  else if (now >= queue->first_above_usec)
+  {
+    shedding = true;
+  }
+  if (shedding != queue->shedding)
+  {
+    __atomic_store_n (&queue->shedding, shedding, __ATOMIC_RELAXED);
+  }
+}
+
+/* An empty queue is not delayed, even if its last reading was */
+static void
+reset_delay (coap_publish *queue)
+{
+  queue->first_above_usec = 0;
+  if (queue->shedding)
+  {
+    __atomic_store_n (&queue->shedding, false, __ATOMIC_RELAXED);
+  }
+}
+
+/* Copies device and resource names into an entry; lengths exclude terminators */
+static void
+copy_names (publish_entry *entry, const char *device, size_t device_len, const char *resource,
+            size_t resource_len)
+{
+  memcpy (entry->names, device, device_len + 1);
+  entry->resource_offset = (uint16_t)(device_len + 1);
+  memcpy (entry->names + device_len + 1, resource, resource_len + 1);
+}
+
+/* Frees a value, and releases the buffer it references */
+static void
+free_value (coap_publish *queue, iot_data_t *value, void *buf)
+{
+  iot_data_free (value);
+  if (buf)
+  {
+    queue->release (buf);
+  }
+}
+
+/* Takes up to max dirty slots, in turn from the cursor */
+static uint32_t
+take_slots (coap_publish *queue, publish_entry *batch, uint32_t max, uint64_t now)
+{
+  uint32_t words = (queue->max_slots + 63) / 64;
+  uint32_t n = 0;
+  for (uint32_t i = 0; i < words && n < max && queue->dirty_count; i++)
+  {
+    uint32_t word = (queue->dirty_cursor + i) % words;
+    while (queue->dirty[word] && n < max)
+    {
+      uint32_t slot = word * 64 + __builtin_ctzll (queue->dirty[word]);
+      queue->dirty[word] &= queue->dirty[word] - 1;
+      queue->dirty_count--;
+      batch[n] = queue->slots[slot];
+      queue->slots[slot].value = NULL;
+      queue->slots[slot].buf = NULL;
+      sample_sojourn (queue, batch[n].queued_usec, now);
+      n++;
+    }
+    if (n == max)
+    {
+      queue->dirty_cursor = word;
+    }
+  }
+  return n;
+}
+
+/* Takes up to max readings from the ring, oldest first */
+static uint32_t
+take_ring (coap_publish *queue, publish_entry *batch, uint32_t max, uint64_t now)
+{
+  uint32_t n = 0;
+  while (queue->count && n < max)
+  {
+    sample_sojourn (queue, queue->ring[queue->head].queued_usec, now);
+    batch[n++] = queue->ring[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+  }
+  return n;
+}
+
+/*
+ * Takes a batch, half from slots and half from the ring if both are
+ * waiting, so neither starves the other.
+ */
+static uint32_t
+take_batch (coap_publish *queue, publish_entry *batch)
+{
+  uint64_t now = now_usec ();
+  uint32_t size = queue->batch_size;
+  uint32_t n = take_slots (queue, batch, (size + queue->turn) / 2, now);
+  queue->turn ^= 1;
+  n += take_ring (queue, batch + n, size - n, now);
+  n += take_slots (queue, batch + n, size - n, now);
+  return n;
+}
+
+/*
+ * Waits up to the linger time for a full batch, so a busy queue is drained
+ * with fewer wakeups. Returns early to stop.
+ */
+static void
+linger (coap_publish *queue)
+{
+  if (!queue->linger_usec || queue->count + queue->dirty_count >= queue->batch_size)
+  {
+    return;
+  }
+  struct timespec deadline;
+  clock_gettime (CLOCK_MONOTONIC, &deadline);
+  deadline.tv_nsec += (long)queue->linger_usec * 1000;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000;
+  deadline.tv_nsec %= 1000000000;
+  while (queue->count + queue->dirty_count < queue->batch_size && !queue->stop)
+  {
+    if (pthread_cond_timedwait (&queue->ready, &queue->lock, &deadline) == ETIMEDOUT)
+    {
+      break;
+    }
+  }
+}
+
+/*
+ * Adjusts batch size and linger after a batch is posted. Posts are
+ * sequential, so batch size does not delay a reading, but a larger batch
+ * takes waiting readings with less locking: it doubles while batches fill,
+ * and shrinks by one when a batch does not. Lingering for a full batch saves
+ * wakeups but delays the first reading, so linger grows while latency is
+ * well within target and several readings arrive together, and halves when
+ * latency exceeds target or a single reading arrives, as when idle.
+ * Latency is the p99 of receipt to post time over the current and last
+ * histogram window, the measure the target is set for, so one slow post
+ * does not collapse the linger.
+ */
+static void
+adapt_batch (coap_publish *queue, uint32_t taken, uint64_t now_sec)
+{
+  queue->latency_usec = coap_histogram_recent_percentile (&queue->publish_usec, 99, now_sec);
+  uint32_t target = queue->latency_target_usec;
+  if (!target)
+  {
+    return;
+  }
+
+  if (taken == queue->batch_size)
+  {
+    queue->batch_size = (queue->batch_size * 2 < PUBLISH_BATCH_MAX) ? queue->batch_size * 2 : PUBLISH_BATCH_MAX;
+  }
+  else if (queue->batch_size > 1)
+  {
+    queue->batch_size--;
+  }
+
+  if (queue->latency_usec > target || taken <= 1)
+  {
+    queue->linger_usec /= 2;
+  }
+  else if (queue->latency_usec < target / 2 && queue->linger_usec + LINGER_STEP_USEC <= target / 4)
+  {
+    queue->linger_usec += LINGER_STEP_USEC;
+  }
+}
+
+static void *
+publish_thread (void *arg)
+{
+  coap_publish *queue = arg;
+  publish_entry batch[PUBLISH_BATCH_MAX];
+  uint64_t latency[PUBLISH_BATCH_MAX];
+
+  pthread_mutex_lock (&queue->lock);
+  for (;;)
+  {
+    if (!queue->count && !queue->dirty_count)
+    {
+      reset_delay (queue);
+    }
+    while (!queue->count && !queue->dirty_count && !queue->stop)
+    {
+      pthread_cond_wait (&queue->ready, &queue->lock);
+    }
+    linger (queue);
+    /* drains the queue before stopping */
+    uint32_t n = take_batch (queue, batch);
+    if (!n)
+    {
+      break;
+    }
+    pthread_mutex_unlock (&queue->lock);
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+      devsdk_commandresult results[1];
+      results[0].origin = 0;
+      results[0].value = batch[i].value;
+      devsdk_post_readings (queue->service, batch[i].names,
+                            batch[i].names + batch[i].resource_offset, results);
+      uint64_t now = now_usec ();
+      latency[i] = now > batch[i].queued_usec ? now - batch[i].queued_usec : 0;
+      free_value (queue, batch[i].value, batch[i].buf);
+    }
+
+    pthread_mutex_lock (&queue->lock);
+    queue->published += n;
+    uint64_t now_sec = now_usec () / 1000000;
+    for (uint32_t i = 0; i < n; i++)
+    {
+      coap_histogram_add (&queue->publish_usec, latency[i], now_sec);
+    }
+    adapt_batch (queue, n, now_sec);
+  }
+  pthread_mutex_unlock (&queue->lock);
+  return NULL;
+}
+
+size_t
+coap_publish_entry_size (void)
+{
+  return sizeof (publish_entry);
+}
+
+coap_publish *
+coap_publish_new (devsdk_service_t *service, coap_publish_release_fn release, uint32_t capacity,
+                  uint32_t slots, uint32_t target_usec, uint32_t interval_usec,
+                  uint32_t latency_target_usec, int cpu)
+{
+  if (!capacity)
+  {
+    return NULL;
+  }
+  coap_publish *queue = calloc (1, sizeof (*queue));
+  if (!queue)
+  {
+    return NULL;
+  }
+  queue->service = service;
+  queue->release = release;
+  queue->capacity = capacity;
+  queue->max_slots = slots;
+  queue->target_usec = target_usec;
+  queue->interval_usec = interval_usec;
+  queue->latency_target_usec = latency_target_usec;
+  /* without a target, batches are as large as possible and never linger */
+  queue->batch_size = latency_target_usec ? 1 : PUBLISH_BATCH_MAX;
+  queue->ring = calloc (capacity, sizeof (publish_entry));
+  queue->slots = calloc (slots ? slots : 1, sizeof (publish_entry));
+  queue->dirty = calloc ((slots + 63) / 64 + 1, sizeof (uint64_t));
+  if (!queue->ring || !queue->slots || !queue->dirty)
+  {
+    free (queue->ring);
+    free (queue->slots);
+    free (queue->dirty);
+    free (queue);
+    return NULL;
+  }
+  pthread_mutex_init (&queue->lock, NULL);
+  /* linger deadlines are monotonic */
+  pthread_condattr_t attr;
+  pthread_condattr_init (&attr);
+  pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+  pthread_cond_init (&queue->ready, &attr);
+  pthread_condattr_destroy (&attr);
+  if (pthread_create (&queue->thread, NULL, publish_thread, queue))
+  {
+    pthread_cond_destroy (&queue->ready);
+    pthread_mutex_destroy (&queue->lock);
+    free (queue->ring);
+    free (queue->slots);
+    free (queue->dirty);
+    free (queue);
+    return NULL;
+  }
+  if (cpu >= 0)
+  {
+    cpu_set_t cpus;
+    CPU_ZERO (&cpus);
+    CPU_SET (cpu, &cpus);
+    queue->pin_error = pthread_setaffinity_np (queue->thread, sizeof (cpus), &cpus);
+  }
+  return queue;
+}
+
+int
+coap_publish_pin_error (coap_publish *queue)
+{
+  return queue->pin_error;
+}
+
+void
+coap_publish_free (coap_publish *queue)
+{
+  if (!queue)
+  {
+    return;
+  }
+  pthread_mutex_lock (&queue->lock);
+  queue->stop = true;
+  pthread_cond_signal (&queue->ready);
+  pthread_mutex_unlock (&queue->lock);
+  pthread_join (queue->thread, NULL);
+
+  /* thread has posted all readings */
+  pthread_cond_destroy (&queue->ready);
+  pthread_mutex_destroy (&queue->lock);
+  free (queue->ring);
+  free (queue->slots);
+  free (queue->dirty);
+  free (queue);
+}
+
+int32_t
+coap_publish_assign (coap_publish *queue, const char *device, const char *resource)
+{
+  /* only the server thread assigns slots */
+  size_t device_len = strlen (device);
+  size_t resource_len = strlen (resource);
+  if (queue->slots_used == queue->max_slots || device_len + resource_len + 2 > PUBLISH_NAMES_MAX)
+  {
+    return -1;
+  }
+  /* the publisher thread reads slots under the lock */
+  pthread_mutex_lock (&queue->lock);
+  int32_t slot = (int32_t)queue->slots_used++;
+  copy_names (&queue->slots[slot], device, device_len, resource, resource_len);
+  pthread_mutex_unlock (&queue->lock);
+  return slot;
+}
+
+/*
+ * Wakes the publisher for the first reading in an empty queue, or for the
+ * reading that fills a batch while it lingers.
+ */
+static void
+notify (coap_publish *queue, bool was_empty)
+{
+  if (was_empty || queue->count + queue->dirty_count == queue->batch_size)
+  {
+    pthread_cond_signal (&queue->ready);
+  }
+}
+
+bool
+coap_publish_push (coap_publish *queue, int32_t slot, const char *device, const char *resource,
+                   iot_data_t *value, void *buf, uint64_t now)
+{
+  iot_data_t *replaced = NULL;
+  void *replaced_buf = NULL;
+  if (slot >= 0)
+  {
+    uint64_t bit = UINT64_C (1) << (slot % 64);
+    pthread_mutex_lock (&queue->lock);
+    bool wake = !queue->count && !queue->dirty_count;
+    publish_entry *entry = &queue->slots[slot];
+    if (queue->dirty[slot / 64] & bit)
+    {
+      /* keeps the time it became dirty, for the age of the backlog */
+      replaced = entry->value;
+      replaced_buf = entry->buf;
+      queue->conflated++;
+    }
+    else
+    {
+      queue->dirty[slot / 64] |= bit;
+      queue->dirty_count++;
+      entry->queued_usec = now;
+    }
+    entry->value = value;
+    entry->buf = buf;
+    queue->accepted++;
+    notify (queue, wake);
+    pthread_mutex_unlock (&queue->lock);
+    if (replaced)
+    {
+      free_value (queue, replaced, replaced_buf);
+    }
+    return true;
+  }
+
+  size_t device_len = strlen (device);
+  size_t resource_len = strlen (resource);
+  if (device_len + resource_len + 2 > PUBLISH_NAMES_MAX)
+  {
+    free_value (queue, value, buf);
+    return false;
+  }
+  pthread_mutex_lock (&queue->lock);
+  if (queue->count == queue->capacity)
+  {
+    queue->overflow++;
+    pthread_mutex_unlock (&queue->lock);
+    free_value (queue, value, buf);
+    return false;
+  }
+  bool wake = !queue->count && !queue->dirty_count;
+  publish_entry *entry = &queue->ring[(queue->head + queue->count) % queue->capacity];
+  entry->value = value;
+  entry->buf = buf;
+  entry->queued_usec = now;
+  copy_names (entry, device, device_len, resource, resource_len);
+  queue->count++;
+  queue->accepted++;
+  notify (queue, wake);
+  pthread_mutex_unlock (&queue->lock);
+  return true;
+}
+
+bool
+coap_publish_shed (coap_publish *queue)
+{
+  if (!__atomic_load_n (&queue->shedding, __ATOMIC_RELAXED))
+  {
+    return false;
+  }
+  queue->shed++;
+  return true;
+}
+
+void
+coap_publish_write_json (coap_publish *queue, coap_metrics_buf *buf)
+{
+  pthread_mutex_lock (&queue->lock);
+  coap_metrics_printf (buf, ",\"publish\":{\"queued\":%u,\"capacity\":%u,\"dirty\":%u,\"slots\":%u,"
+                       "\"maxSlots\":%u,\"accepted\":%lu,\"conflated\":%lu,\"published\":%lu,"
+                       "\"overflow\":%lu,\"shedding\":%s,\"shed\":%lu", queue->count, queue->capacity,
+                       queue->dirty_count, queue->slots_used, queue->max_slots,
+                       (unsigned long)queue->accepted, (unsigned long)queue->conflated,
+                       (unsigned long)queue->published, (unsigned long)queue->overflow,
+                       queue->shedding ? "true" : "false", (unsigned long)queue->shed);
+  coap_metrics_printf (buf, ",\"batchSize\":%u,\"lingerUsec\":%u,\"latencyTargetUsec\":%u,"
+                       "\"latencyUsec\":%lu", queue->batch_size, queue->linger_usec,
+                       queue->latency_target_usec, (unsigned long)queue->latency_usec);
+  uint64_t now = now_usec () / 1000000;
+  coap_histogram_write_json (&queue->sojourn_usec, "sojournUsec", now, buf);
+  coap_histogram_write_json (&queue->publish_usec, "publishUsec", now, buf);
+  coap_metrics_printf (buf, "}");
+  pthread_mutex_unlock (&queue->lock);
+}
@@ -0,0 +1,138 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_PUBLISH_H_
+#define _COAP_PUBLISH_H_ 1
+
+/**
+ * @file
+ * @brief Queue of accepted readings, posted to EdgeX by a publisher thread,
+ * so the server thread does not wait on the SDK.
+ *
+ * Most readings are queued in arrival order, in a bounded ring. A reading for
+ * a resource with the 'conflate' attribute instead goes into the slot for its
+ * resource, and overwrites a reading still waiting there, so a backlog holds
+ * at most one reading per conflated resource. A dirty bitmap marks the slots
+ * waiting to be posted. The queue is written by the server thread and read by
+ * the publisher thread, so it is locked.
+ *
+ * The queue also manages its delay in the manner of CoDel. The publisher
+ * measures the sojourn time of each reading it takes. When no reading in an
+ * interval was taken within the target time, the queue is persistently
+ * delayed rather than absorbing a burst, so the server sheds new requests
+ * until a reading is taken within the target again.
+ *
+ * Entries are preallocated, and hold the device and resource names inline, so
+ * queueing a reading does not allocate. A String value references a payload
+ * buffer, which the queue releases once the reading is posted, so it is not
+ * copied either.
+ *
+ * The publisher adapts how many readings it takes at once, and how long it
+ * lingers for a full batch, to the load. It aims for a p99 latency, from
+ * receipt to post, within a target: batches grow while they fill and shrink
+ * when they do not, and linger grows while latency is well within target
+ * and falls to zero when load is light.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "devsdk/devsdk.h"
+#include "coap-metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Room for device and resource names in an entry, including terminators */
+#define PUBLISH_NAMES_MAX 256
+
+typedef struct coap_publish coap_publish;
+
+/** Releases the buffer referenced by a queued value */
+typedef void (*coap_publish_release_fn) (void *buf);
+
+/**
+ * Bytes for each entry, in the ring or a slot, for the memory budget.
+ */
+size_t coap_publish_entry_size (void);
+
+/**
+ * Creates a queue, and starts its publisher thread.
+ *
+ * @param service        service to post readings to
+ * @param release        releases a buffer passed to coap_publish_push()
+ * @param capacity       readings in the ring
+ * @param slots          conflated resources
+ * @param target_usec    acceptable sojourn time; 0 to never shed
+ * @param interval_usec  time sojourn must exceed the target before shedding
+ * @param latency_target_usec  p99 time from receipt to post; 0 for fixed batches
+ * @param cpu            CPU to pin the publisher thread; -1 to not pin. Pinning
+ *                       is best effort; see coap_publish_pin_error()
+ * @return queue, or NULL if memory not available or the thread cannot start
+ */
+coap_publish *coap_publish_new (devsdk_service_t *service, coap_publish_release_fn release,
+                                uint32_t capacity, uint32_t slots, uint32_t target_usec,
+                                uint32_t interval_usec, uint32_t latency_target_usec, int cpu);
+
+/**
+ * Reads the result of pinning the publisher thread to a CPU.
+ *
+ * @return 0 if pinned or not asked to pin, else the error from
+ *         pthread_setaffinity_np()
+ */
+int coap_publish_pin_error (coap_publish *queue);
+
+/**
+ * Posts the readings still queued, then stops the publisher thread and frees
+ * the queue.
+ */
+void coap_publish_free (coap_publish *queue);
+
+/**
+ * Assigns a slot to a conflated resource. Call once per resource.
+ *
+ * @return slot, or -1 if all slots are assigned or the names do not fit
+ *         PUBLISH_NAMES_MAX
+ */
+int32_t coap_publish_assign (coap_publish *queue, const char *device, const char *resource);
+
+/**
+ * Queues a reading for the publisher thread.
+ *
+ * @param slot   slot for a conflated resource; -1 to queue in the ring
+ * @param value  reading; the queue takes ownership, also on failure
+ * @param buf    buffer the value references, released after the value is
+ *               freed; the queue takes ownership, also on failure. NULL if none
+ * @param now    monotonic time of receipt, in microseconds
+ * @return false if the ring is full, or the names do not fit PUBLISH_NAMES_MAX
+ */
+bool coap_publish_push (coap_publish *queue, int32_t slot, const char *device,
+                        const char *resource, iot_data_t *value, void *buf, uint64_t now);
+
+/**
+ * Checks whether to shed a new request, because the queue is persistently
+ * delayed. Cheap; does not lock. Call only from the server thread.
+ *
+ * @return true if the request should be shed; counts it
+ */
+bool coap_publish_shed (coap_publish *queue);
+
+/**
+ * Renders queue counters, batch control, and percentiles of sojourn time and
+ * publish latency, as a "publish" member of a JSON object, preceded by a
+ * comma.
+ */
+void coap_publish_write_json (coap_publish *queue, coap_metrics_buf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
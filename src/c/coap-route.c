@@ -0,0 +1,208 @@
+/* Route table for device resources
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "coap-route.h"
+#include "coap-series.h"
+
+struct coap_route_table
+{
+  coap_route **buckets;
+  uint32_t bucket_mask;        /* buckets - 1; buckets is a power of 2 */
+  uint32_t count;
+  uint32_t max_routes;
+  uint32_t history_size;       /* points of history per route; 0 for none */
+  uint64_t refused;            /* adds refused because table full */
+  uint64_t notified;           /* readings sent to observers */
+  uint64_t hits;               /* lookups with current metadata */
+  uint64_t misses;             /* lookups that resolved metadata again */
+  coap_route_release_fn release;
+};
+
+/* FNV-1a */
+static uint32_t
+hash_path (const char *path)
+{
+  uint32_t hash = 2166136261u;
+  for (const uint8_t *p = (const uint8_t *)path; *p; p++)
+  {
+    hash = (hash ^ *p) * 16777619u;
+  }
+  return hash;
+}
+
+coap_route_table *
+coap_route_table_new (uint32_t max_routes, uint32_t history_size, coap_route_release_fn release)
+{
+  if (!max_routes)
+  {
+    return NULL;
+  }
+  coap_route_table *table = calloc (1, sizeof (*table));
+  if (!table)
+  {
+    return NULL;
+  }
+  /* at least one bucket per route, so chains stay short */
+  uint32_t buckets = 1;
+  while (buckets < max_routes && buckets < (UINT32_C (1) << 31))
+  {
+    buckets <<= 1;
+  }
+  if (!(table->buckets = calloc (buckets, sizeof (coap_route *))))
+  {
+    free (table);
+    return NULL;
+  }
+  table->bucket_mask = buckets - 1;
+  table->max_routes = max_routes;
+  table->history_size = history_size;
+  table->release = release;
+  return table;
+}
+
+void
+coap_route_table_free (coap_route_table *table)
+{
+  if (!table)
+  {
+    return;
+  }
+  for (uint32_t i = 0; i <= table->bucket_mask; i++)
+  {
+    coap_route *route = table->buckets[i];
+    while (route)
+    {
+      coap_route *next = route->next;
+      if (route->device)
+      {
+        table->release (route->device);
+      }
+      free (route->value);
+      coap_series_free (route->history);
+      free (route);
+      route = next;
+    }
+  }
+  free (table->buckets);
+  free (table);
+}
+
+coap_route *
+coap_route_find (coap_route_table *table, const char *path)
+{
+  coap_route *route = table->buckets[hash_path (path) & table->bucket_mask];
+  for (; route; route = route->next)
+  {
+    if (!strcmp (route->path, path))
+    {
+      return route;
+    }
+  }
+  return NULL;
+}
+
+coap_route *
+coap_route_add (coap_route_table *table, const char *path)
+{
+  if (table->count == table->max_routes)
+  {
+    table->refused++;
+    return NULL;
+  }
+  size_t path_len = strlen (path);
+  /* path is stored after the route, in the same allocation */
+  coap_route *route = calloc (1, sizeof (*route) + path_len + 1);
+  if (!route)
+  {
+    return NULL;
+  }
+  /* history is allocated now rather than by the first reading, so appends do not allocate */
+  if (table->history_size && !(route->history = coap_series_new (table->history_size)))
+  {
+    free (route);
+    return NULL;
+  }
+  route->path = (char *)(route + 1);
+  memcpy (route->path, path, path_len + 1);
+  route->lastvalue_slot = -1;
+  route->publish_slot = -1;
+
+  coap_route **bucket = &table->buckets[hash_path (path) & table->bucket_mask];
+  route->next = *bucket;
+  *bucket = route;
+  table->count++;
+  return route;
+}
+
+bool
+coap_route_set_value (coap_route *route, const uint8_t *data, size_t len, uint16_t content_format)
+{
+  if (len > route->value_size)
+  {
+    uint8_t *value = realloc (route->value, len);
+    if (!value)
+    {
+      return false;
+    }
+    route->value = value;
+    route->value_size = len;
+  }
+  if (len)
+  {
+    memcpy (route->value, data, len);
+  }
+  route->value_len = len;
+  route->content_format = content_format;
+  route->has_value = true;
+  return true;
+}
+
+void
+coap_route_set_device (coap_route_table *table, coap_route *route, struct edgex_device *device,
+                       struct edgex_deviceresource *resource, uint32_t gen, uint64_t now_usec)
+{
+  if (route->device && route->device != device)
+  {
+    table->release (route->device);
+  }
+  route->device = device;
+  route->device_resource = device ? resource : NULL;
+  route->resolved_gen = gen;
+  route->resolved_usec = now_usec;
+}
+
+void
+coap_route_count_lookup (coap_route_table *table, bool hit)
+{
+  if (hit)
+  {
+    table->hits++;
+  }
+  else
+  {
+    table->misses++;
+  }
+}
+
+void
+coap_route_count_notify (coap_route_table *table)
+{
+  table->notified++;
+}
+
+void
+coap_route_write_json (coap_route_table *table, coap_metrics_buf *buf)
+{
+  coap_metrics_printf (buf, ",\"routes\":{\"count\":%u,\"max\":%u,\"refused\":%lu,\"notified\":%lu,"
+                       "\"cacheHits\":%lu,\"cacheMisses\":%lu}",
+                       table->count, table->max_routes, (unsigned long)table->refused,
+                       (unsigned long)table->notified, (unsigned long)table->hits,
+                       (unsigned long)table->misses);
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_ROUTE_H_
+#define _COAP_ROUTE_H_ 1
+
+/**
+ * @file
+ * @brief Table of routes, one per device resource, like 'a1r/d1/int', which
+ * holds per-resource state for the server.
+ *
+ * A route caches the device and resource metadata for its path, resolved
+ * once from the EdgeX device map, so a reading need not look them up again.
+ * A route also holds the last accepted reading, encoded once as the payload
+ * of a CoAP response and shared by all notifications to observers, and
+ * optionally a history of numeric readings, allocated with the route. The
+ * table is bounded; an add beyond its capacity is refused. The table is used only by the server
+ * thread, so it is not locked.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "coap-metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Longest route path, including terminator */
+#define ROUTE_PATH_MAX 256
+
+struct coap_resource_t;
+struct coap_series;
+struct edgex_device;
+struct edgex_deviceresource;
+
+/** State for a device resource */
+typedef struct coap_route
+{
+  struct coap_route *next;             /**< hash chain */
+  char *path;                          /**< URI path, without leading slash */
+  struct coap_resource_t *resource;    /**< observable libcoap resource; NULL if not created */
+  struct edgex_device *device;         /**< device, with a reference held; NULL if not resolved */
+  struct edgex_deviceresource *device_resource; /**< resource in device profile */
+  uint32_t resolved_gen;               /**< metadata generation when resolved */
+  uint64_t resolved_usec;              /**< monotonic time when resolved */
+  uint8_t *value;                      /**< last reading as response payload */
+  size_t value_len;                    /**< bytes in value */
+  size_t value_size;                   /**< bytes allocated for value */
+  uint16_t content_format;             /**< Content-Format of value */
+  bool has_value;                      /**< false until first reading */
+  struct coap_series *history;         /**< numeric readings; NULL if history not enabled */
+  int32_t lastvalue_slot;              /**< slot in shared last value table; -1 if none */
+  int32_t publish_slot;                /**< slot in publish queue, if conflated; -1 if none */
+} coap_route;
+
+typedef struct coap_route_table coap_route_table;
+
+/** Releases the reference to a device held by a route */
+typedef void (*coap_route_release_fn) (struct edgex_device *device);
+
+/**
+ * Creates an empty table.
+ *
+ * @param max_routes    capacity
+ * @param history_size  points of history per route; 0 for none
+ * @param release       releases a device cached by a route
+ * @return table, or NULL if memory not available
+ */
+coap_route_table *coap_route_table_new (uint32_t max_routes, uint32_t history_size,
+                                        coap_route_release_fn release);
+
+/**
+ * Frees a table and its routes, including history and cached devices. Does
+ * not free libcoap resources.
+ */
+void coap_route_table_free (coap_route_table *table);
+
+/**
+ * Finds a route by path.
+ *
+ * @return route, or NULL if not found
+ */
+coap_route *coap_route_find (coap_route_table *table, const char *path);
+
+/**
+ * Adds a route for a path not already in the table.
+ *
+ * @return new route, or NULL if the table is full or memory not available
+ */
+coap_route *coap_route_add (coap_route_table *table, const char *path);
+
+/**
+ * Replaces the value of a route.
+ *
+ * @return false if memory not available; the previous value is kept
+ */
+bool coap_route_set_value (coap_route *route, const uint8_t *data, size_t len,
+                           uint16_t content_format);
+
+/**
+ * Caches the metadata for a route, releasing any device cached before.
+ *
+ * @param device    device; the route takes ownership of the reference. NULL
+ *                  if the path no longer resolves
+ * @param resource  resource in device profile
+ * @param gen       metadata generation when resolved
+ * @param now_usec  monotonic time when resolved
+ */
+void coap_route_set_device (coap_route_table *table, coap_route *route, struct edgex_device *device,
+                            struct edgex_deviceresource *resource, uint32_t gen, uint64_t now_usec);
+
+/**
+ * Counts a lookup of cached metadata.
+ *
+ * @param hit  true if the cached metadata was current
+ */
+void coap_route_count_lookup (coap_route_table *table, bool hit);
+
+/**
+ * Counts a reading sent to observers.
+ */
+void coap_route_count_notify (coap_route_table *table);
+
+/**
+ * Renders table counters as a "routes" member of a JSON object, preceded by a
+ * comma.
+ */
+void coap_route_write_json (coap_route_table *table, coap_metrics_buf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
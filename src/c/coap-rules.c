@@ -0,0 +1,264 @@
+/* Filter and transform rules for device resources
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "coap-rules.h"
+#include "coap-expr.h"
+
+/* Initial buckets for device state; doubled as devices are added */
+#define RULES_STATE_BUCKETS 16
+
+/* Last posted value for a device */
+typedef struct rules_state
+{
+  struct rules_state *next;    /* hash chain */
+  double last;
+  uint64_t last_time;          /* ns */
+  char name[];
+} rules_state;
+
+struct coap_rules
+{
+  coap_expr *filter;
+  coap_expr *transform;
+  bool uses_state;
+  bool conflate;
+  rules_state **buckets;       /* NULL until first reading, if uses_state */
+  uint32_t bucket_mask;
+  uint32_t count;
+};
+
+/* FNV-1a */
+static uint32_t
+hash_name (const char *name)
+{
+  uint32_t hash = 2166136261u;
+  for (const uint8_t *p = (const uint8_t *)name; *p; p++)
+  {
+    hash = (hash ^ *p) * 16777619u;
+  }
+  return hash;
+}
+
+/* Compiles an attribute if present */
+static bool
+compile_attr (const iot_data_t *attributes, const char *name, coap_expr **expr,
+              iot_data_t **exception)
+{
+  const char *text = attributes ? iot_data_string_map_get_string (attributes, name) : NULL;
+  if (!text)
+  {
+    return true;
+  }
+  char error[96];
+  if (!(*expr = coap_expr_compile (text, error, sizeof (error))))
+  {
+    char msg[160];
+    snprintf (msg, sizeof (msg), "%s '%.32s' not valid: %s", name, text, error);
+    *exception = iot_data_alloc_string (msg, IOT_DATA_COPY);
+    return false;
+  }
+  return true;
+}
+
+coap_rules *
+coap_rules_new (const iot_data_t *attributes, iot_data_t **exception)
+{
+  coap_rules *rules = calloc (1, sizeof (*rules));
+  if (!rules)
+  {
+    *exception = iot_data_alloc_string ("memory not available", IOT_DATA_REF);
+    return NULL;
+  }
+  if (!compile_attr (attributes, RULES_TRANSFORM_ATTR, &rules->transform, exception)
+      || !compile_attr (attributes, RULES_FILTER_ATTR, &rules->filter, exception))
+  {
+    coap_rules_free (rules);
+    return NULL;
+  }
+  const char *conflate = attributes ? iot_data_string_map_get_string (attributes, RULES_CONFLATE_ATTR) : NULL;
+  if (conflate && strcmp (conflate, "true") && strcmp (conflate, "false"))
+  {
+    *exception = iot_data_alloc_string (RULES_CONFLATE_ATTR " must be true or false", IOT_DATA_REF);
+    coap_rules_free (rules);
+    return NULL;
+  }
+  rules->conflate = conflate && !strcmp (conflate, "true");
+  rules->uses_state = (rules->filter && coap_expr_uses_state (rules->filter))
+                      || (rules->transform && coap_expr_uses_state (rules->transform));
+  return rules;
+}
+
+void
+coap_rules_free (coap_rules *rules)
+{
+  if (!rules)
+  {
+    return;
+  }
+  if (rules->buckets)
+  {
+    for (uint32_t i = 0; i <= rules->bucket_mask; i++)
+    {
+      rules_state *state = rules->buckets[i];
+      while (state)
+      {
+        rules_state *next = state->next;
+        free (state);
+        state = next;
+      }
+    }
+    free (rules->buckets);
+  }
+  coap_expr_free (rules->filter);
+  coap_expr_free (rules->transform);
+  free (rules);
+}
+
+/* Doubles the buckets for device state; keeps the old ones if memory not available */
+static void
+grow_buckets (coap_rules *rules)
+{
+  uint32_t count = (rules->bucket_mask + 1) * 2;
+  rules_state **buckets = calloc (count, sizeof (rules_state *));
+  if (!buckets)
+  {
+    return;
+  }
+  for (uint32_t i = 0; i <= rules->bucket_mask; i++)
+  {
+    rules_state *state = rules->buckets[i];
+    while (state)
+    {
+      rules_state *next = state->next;
+      rules_state **bucket = &buckets[hash_name (state->name) & (count - 1)];
+      state->next = *bucket;
+      *bucket = state;
+      state = next;
+    }
+  }
+  free (rules->buckets);
+  rules->buckets = buckets;
+  rules->bucket_mask = count - 1;
+}
+
+/* Finds state for a device, and adds it if not found */
+static rules_state *
+get_state (coap_rules *rules, const char *device)
+{
+  if (!rules->buckets)
+  {
+    if (!(rules->buckets = calloc (RULES_STATE_BUCKETS, sizeof (rules_state *))))
+    {
+      return NULL;
+    }
+    rules->bucket_mask = RULES_STATE_BUCKETS - 1;
+  }
+  uint32_t hash = hash_name (device);
+  for (rules_state *state = rules->buckets[hash & rules->bucket_mask]; state; state = state->next)
+  {
+    if (!strcmp (state->name, device))
+    {
+      return state;
+    }
+  }
+
+  if (rules->count > rules->bucket_mask)
+  {
+    grow_buckets (rules);
+  }
+  size_t name_len = strlen (device);
+  rules_state *state = malloc (sizeof (*state) + name_len + 1);
+  if (!state)
+  {
+    return NULL;
+  }
+  memcpy (state->name, device, name_len + 1);
+  state->last = NAN;
+  state->last_time = 0;
+  rules_state **bucket = &rules->buckets[hash & rules->bucket_mask];
+  state->next = *bucket;
+  *bucket = state;
+  rules->count++;
+  return state;
+}
+
+bool
+coap_rules_has_transform (const coap_rules *rules)
+{
+  return rules->transform != NULL;
+}
+
+bool
+coap_rules_conflate (const coap_rules *rules)
+{
+  return rules->conflate;
+}
+
+coap_rules_result_t
+coap_rules_apply (coap_rules *rules, const char *device, iot_data_t **value, uint64_t now)
+{
+  if (!rules->filter && !rules->transform)
+  {
+    return RULES_POST;
+  }
+  iot_data_type_t type = iot_data_type (*value);
+  if (type != IOT_DATA_INT32 && type != IOT_DATA_FLOAT64)
+  {
+    return RULES_UNSUPPORTED;
+  }
+
+  coap_expr_vars vars = { .last = NAN, .dt = INFINITY };
+  vars.v = (type == IOT_DATA_INT32) ? iot_data_i32 (*value) : iot_data_f64 (*value);
+  rules_state *state = NULL;
+  if (rules->uses_state && (state = get_state (rules, device)) && state->last_time)
+  {
+    vars.last = state->last;
+    vars.dt = (now - state->last_time) / 1e9;
+  }
+
+  if (rules->transform)
+  {
+    double v = coap_expr_eval (rules->transform, &vars);
+    iot_data_t *result;
+    if (type == IOT_DATA_INT32)
+    {
+      v = nearbyint (v);
+      if (!(v >= INT32_MIN && v <= INT32_MAX))
+      {
+        return RULES_INVALID;
+      }
+      result = iot_data_alloc_i32 ((int32_t)v);
+    }
+    else
+    {
+      if (!isfinite (v))
+      {
+        return RULES_INVALID;
+      }
+      result = iot_data_alloc_f64 (v);
+    }
+    iot_data_free (*value);
+    *value = result;
+    vars.v = v;
+  }
+
+  if (rules->filter && !coap_expr_eval (rules->filter, &vars))
+  {
+    return RULES_FILTERED;
+  }
+  if (state)
+  {
+    state->last = vars.v;
+    state->last_time = now;
+  }
+  return RULES_POST;
+}
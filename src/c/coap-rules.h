@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_RULES_H_
+#define _COAP_RULES_H_ 1
+
+/**
+ * @file
+ * @brief Filter and transform rules for a device resource, from the
+ * 'filter' and 'transform' attributes in its device profile.
+ *
+ * Rules are compiled when the profile is loaded, and kept as the resource's
+ * driver specific attributes. A transform replaces a numeric reading with
+ * the value of its expression. A filter then drops the reading if its
+ * expression is 0. Rules that use 'last' or 'dt' keep the last posted value
+ * for each device. Rules are applied only by the server thread, so they are
+ * not locked.
+ *
+ * The 'conflate' attribute, "true" or "false", is kept with the rules,
+ * since it too is read for each reading.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "devsdk/devsdk.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/** Device profile attribute for a filter expression */
+#define RULES_FILTER_ATTR "filter"
+/** Device profile attribute for a transform expression */
+#define RULES_TRANSFORM_ATTR "transform"
+/** Device profile attribute to conflate queued readings */
+#define RULES_CONFLATE_ATTR "conflate"
+
+/** Result of applying rules to a reading */
+typedef enum
+{
+  RULES_POST,                  /**< post the reading */
+  RULES_FILTERED,              /**< drop; filter is 0 */
+  RULES_INVALID,               /**< drop; transform result not valid for the value type */
+  RULES_UNSUPPORTED            /**< refuse; filter or transform on a value that is not numeric */
+} coap_rules_result_t;
+
+typedef struct coap_rules coap_rules;
+
+/**
+ * Compiles the rules in resource attributes.
+ *
+ * @param attributes  resource attributes from the device profile
+ * @param exception   set to a message if an expression is not valid
+ * @return rules, possibly empty; NULL on failure
+ */
+coap_rules *coap_rules_new (const iot_data_t *attributes, iot_data_t **exception);
+
+/** Frees rules and their state. */
+void coap_rules_free (coap_rules *rules);
+
+/** True if the rules include a transform. */
+bool coap_rules_has_transform (const coap_rules *rules);
+
+/** True if a queued reading may be replaced by a newer one. */
+bool coap_rules_conflate (const coap_rules *rules);
+
+/**
+ * Applies rules to an Int32 or Float64 reading, which may be replaced by a
+ * transform. A reading of another type is posted as is if there is neither
+ * a filter nor a transform, and is otherwise unsupported. The SDK does not
+ * pass the value type when the rules are compiled, so this is the first
+ * point a profile with such a rule can be found.
+ *
+ * @param device  device name, for state
+ * @param value   reading; replaced with the transformed value
+ * @param now     receive time, ns
+ */
+coap_rules_result_t coap_rules_apply (coap_rules *rules, const char *device, iot_data_t **value,
+                                      uint64_t now);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,240 @@
+/* Ring of numeric readings for range queries
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "coap-series.h"
+
+struct coap_series
+{
+  int64_t *times;              /* milliseconds since the epoch */
+  double *values;
+  uint32_t capacity;
+  uint32_t head;               /* next index written */
+  uint32_t count;
+};
+
+/* Aggregate for a downsampled point */
+typedef struct series_bucket
+{
+  int64_t start;
+  double sum;
+  double min;
+  double max;
+  uint32_t count;
+} series_bucket;
+
+coap_series *
+coap_series_new (uint32_t capacity)
+{
+  if (!capacity)
+  {
+    return NULL;
+  }
+  coap_series *series = calloc (1, sizeof (*series));
+  if (!series)
+  {
+    return NULL;
+  }
+  series->times = calloc (capacity, sizeof (int64_t));
+  series->values = calloc (capacity, sizeof (double));
+  if (!series->times || !series->values)
+  {
+    coap_series_free (series);
+    return NULL;
+  }
+  /* prefault, so appends do not take page faults */
+  memset (series->times, 0, capacity * sizeof (int64_t));
+  memset (series->values, 0, capacity * sizeof (double));
+  series->capacity = capacity;
+  return series;
+}
+
+void
+coap_series_free (coap_series *series)
+{
+  if (series)
+  {
+    free (series->times);
+    free (series->values);
+    free (series);
+  }
+}
+
+void
+coap_series_append (coap_series *series, int64_t time_ms, double value)
+{
+  /* range queries search by time, so a step back of the clock must not reorder points */
+  if (series->count)
+  {
+    int64_t last = series->times[series->head ? series->head - 1 : series->capacity - 1];
+    if (time_ms < last)
+    {
+      time_ms = last;
+    }
+  }
+  series->times[series->head] = time_ms;
+  series->values[series->head] = value;
+  series->head = (series->head + 1 == series->capacity) ? 0 : series->head + 1;
+  if (series->count < series->capacity)
+  {
+    series->count++;
+  }
+}
+
+/* Array index for the nth oldest point */
+static uint32_t
+series_index (const coap_series *series, uint32_t nth)
+{
+  uint64_t index = (uint64_t)series->head + series->capacity - series->count + nth;
+  return index % series->capacity;
+}
+
+/* Position, oldest first, of the first point at or after a time */
+static uint32_t
+series_lower_bound (const coap_series *series, int64_t time_ms)
+{
+  uint32_t lo = 0;
+  uint32_t hi = series->count;
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    if (series->times[series_index (series, mid)] < time_ms)
+    {
+      lo = mid + 1;
+    }
+    else
+    {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/* Positions of the first point in range, and one past the last */
+static void
+series_range (const coap_series *series, int64_t since, int64_t until, uint32_t *first,
+              uint32_t *end)
+{
+  *first = series_lower_bound (series, since);
+  *end = (until == INT64_MAX) ? series->count : series_lower_bound (series, until + 1);
+  if (*end < *first)
+  {
+    *end = *first;
+  }
+}
+
+uint32_t
+coap_series_count (const coap_series *series, int64_t since, int64_t until)
+{
+  uint32_t first, end;
+  series_range (series, since, until, &first, &end);
+  return end - first;
+}
+
+/* Writes all points in range as arrays 't' and 'v' */
+static void
+write_points (const coap_series *series, uint32_t first, uint32_t end, coap_metrics_buf *buf)
+{
+  coap_metrics_printf (buf, "\"t\":[");
+  for (uint32_t n = first; n < end; n++)
+  {
+    coap_metrics_printf (buf, "%s%ld", n == first ? "" : ",",
+                         (long)series->times[series_index (series, n)]);
+  }
+  coap_metrics_printf (buf, "],\"v\":[");
+  for (uint32_t n = first; n < end; n++)
+  {
+    coap_metrics_printf (buf, "%s%.17g", n == first ? "" : ",",
+                         series->values[series_index (series, n)]);
+  }
+  coap_metrics_printf (buf, "]");
+}
+
+/* Writes one aggregate per step with points, as arrays 't', 'v', 'min' and 'max' */
+static void
+write_steps (const coap_series *series, uint32_t first, uint32_t end, int64_t since,
+             int64_t step, coap_metrics_buf *buf)
+{
+  /* at most one bucket per point */
+  series_bucket *buckets = malloc ((end - first) * sizeof (series_bucket) + 1);
+  uint32_t nbuckets = 0;
+  if (!buckets)
+  {
+    buf->overflow = true;
+    return;
+  }
+
+  for (uint32_t n = first; n < end; n++)
+  {
+    uint32_t index = series_index (series, n);
+    int64_t start = since + (series->times[index] - since) / step * step;
+    double value = series->values[index];
+    series_bucket *bucket = &buckets[nbuckets ? nbuckets - 1 : 0];
+    if (!nbuckets || bucket->start != start)
+    {
+      bucket = &buckets[nbuckets++];
+      bucket->start = start;
+      bucket->sum = 0;
+      bucket->min = value;
+      bucket->max = value;
+      bucket->count = 0;
+    }
+    bucket->sum += value;
+    bucket->min = value < bucket->min ? value : bucket->min;
+    bucket->max = value > bucket->max ? value : bucket->max;
+    bucket->count++;
+  }
+
+  coap_metrics_printf (buf, "\"t\":[");
+  for (uint32_t i = 0; i < nbuckets; i++)
+  {
+    coap_metrics_printf (buf, "%s%ld", i ? "," : "", (long)buckets[i].start);
+  }
+  coap_metrics_printf (buf, "],\"v\":[");
+  for (uint32_t i = 0; i < nbuckets; i++)
+  {
+    coap_metrics_printf (buf, "%s%.17g", i ? "," : "", buckets[i].sum / buckets[i].count);
+  }
+  coap_metrics_printf (buf, "],\"min\":[");
+  for (uint32_t i = 0; i < nbuckets; i++)
+  {
+    coap_metrics_printf (buf, "%s%.17g", i ? "," : "", buckets[i].min);
+  }
+  coap_metrics_printf (buf, "],\"max\":[");
+  for (uint32_t i = 0; i < nbuckets; i++)
+  {
+    coap_metrics_printf (buf, "%s%.17g", i ? "," : "", buckets[i].max);
+  }
+  coap_metrics_printf (buf, "]");
+  free (buckets);
+}
+
+void
+coap_series_write_json (const coap_series *series, int64_t since, int64_t until, int64_t step,
+                        coap_metrics_buf *buf)
+{
+  uint32_t first, end;
+  series_range (series, since, until, &first, &end);
+
+  coap_metrics_printf (buf, "{");
+  if (step > 0)
+  {
+    /* align steps to the first point if the range is open */
+    if (since == INT64_MIN && first < end)
+    {
+      since = series->times[series_index (series, first)];
+    }
+    write_steps (series, first, end, since, step, buf);
+  }
+  else
+  {
+    write_points (series, first, end, buf);
+  }
+  coap_metrics_printf (buf, "}");
+}
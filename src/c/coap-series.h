@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2020
+ * Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef _COAP_SERIES_H_
+#define _COAP_SERIES_H_ 1
+
+/**
+ * @file
+ * @brief Fixed size ring of numeric readings for a resource, for range
+ * queries of recent history.
+ *
+ * Timestamps and values are held in separate arrays, so a range scan reads
+ * contiguous memory. An append overwrites the oldest point when the ring is
+ * full. A series is used only by the server thread, so it is not locked.
+ */
+
+#include <stdint.h>
+
+#include "coap-metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct coap_series coap_series;
+
+/**
+ * Creates an empty series, and touches all of its memory.
+ *
+ * @param capacity  number of points
+ * @return series, or NULL if memory not available
+ */
+coap_series *coap_series_new (uint32_t capacity);
+
+/**
+ * Frees a series.
+ */
+void coap_series_free (coap_series *series);
+
+/**
+ * Appends a point. A timestamp earlier than the last point's, as when the
+ * wall clock steps back, is raised to the last point's, so points stay in
+ * time order.
+ *
+ * @param time_ms   milliseconds since the epoch
+ * @param value     reading
+ */
+void coap_series_append (coap_series *series, int64_t time_ms, double value);
+
+/**
+ * Counts points in a time range.
+ *
+ * @param since     first time included, milliseconds since the epoch
+ * @param until     last time included
+ */
+uint32_t coap_series_count (const coap_series *series, int64_t since, int64_t until);
+
+/**
+ * Renders points in a time range as a JSON object with time array 't' and
+ * value array 'v'. If step is positive, renders one point per step with
+ * readings, where 't' is the start of the step, 'v' the mean, and arrays
+ * 'min' and 'max' the extremes.
+ *
+ * @param since     first time included, milliseconds since the epoch
+ * @param until     last time included
+ * @param step      milliseconds per downsampled point; 0 for all points
+ */
+void coap_series_write_json (const coap_series *series, int64_t since, int64_t until,
+                             int64_t step, coap_metrics_buf *buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
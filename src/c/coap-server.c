@@ -8,19 +8,40 @@
 
 #include <errno.h>
 #include <float.h>
+#include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdbool.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #include <netdb.h>
+#include <arpa/inet.h>
+#include <time.h>
 
 #include <coap2/coap.h>
 #include "edgex/devices.h"
 #include "device-coap.h"
+#include "coap-metrics.h"
+#include "coap-deadletter.h"
+#include "coap-budget.h"
+#include "coap-pool.h"
+#include "coap-alloc.h"
+#include "coap-filter.h"
+#include "coap-route.h"
+#include "coap-series.h"
+#include "coap-lastvalue.h"
+#include "coap-actuation.h"
+#include "coap-dedup.h"
+#include "coap-rules.h"
+#include "coap-publish.h"
+#include "coap-hot.h"
+#include "coap-capture.h"
+#include "coap-certcache.h"
 
 /* Maximum length of a string containing numeric values. */
 #define INT32_STR_MAXLEN 11
@@ -31,8 +52,65 @@
 #define MEDIATYPE_TEXT_PLAIN "text/plain"
 #define MEDIATYPE_APP_JSON "application/json"
 #define CONTENT_FORMAT_UNDEFINED UINT16_MAX
+/* Elective option from the experimental range, for a reading's sequence number */
+#define COAP_OPTION_SEQUENCE 65000
+/* Size of buffer for stats resource response, apart from the hot keys */
+#define METRICS_BUF_SIZE 8192
+/* Max-Age for a 5.03 response, in seconds */
+#define UNAVAILABLE_MAX_AGE 2
+/* Longest payload for a capture request, in seconds */
+#define CAPTURE_SECONDS_MAXLEN 10
+/* Deepest client certificate chain verified, below the trusted CA */
+#define PKI_VERIFY_DEPTH 2
+/* Longest query for a history request */
+#define HISTORY_QUERY_MAXLEN 128
+/* Longest wait in the server loop, so new settings are applied promptly */
+#define RECONFIGURE_POLL_MSEC 500
+/* Stack prefaulted in low latency mode, for handler call chain */
+#define PREFAULT_STACK_SIZE (64 * 1024)
+/* Longest use of cached device metadata, since the SDK has no listener for a profile change */
+#define METADATA_MAX_AGE_USEC (10 * 1000000)
 
 static coap_driver *sdk_ctx;
+static coap_metrics metrics;
+/* Server endpoint and its socket, for kernel statistics; -1 if not open */
+static coap_endpoint_t *server_endpoint;
+static int server_fd = -1;
+/* Ring of rejected requests; NULL if not enabled */
+static coap_deadletter *dead_letters;
+/* Ring of sampled requests and responses; NULL if not enabled */
+static coap_capture *captures;
+/* Memory budget capacities, and payload buffers; budget is 0 if not enabled */
+static coap_budget_plan budget_plan;
+static coap_pool *payload_pool;
+/* eBPF filter on server socket; NULL if not attached */
+static coap_filter *packet_filter;
+/* Routes for device resources, which cache their metadata; NULL if the budget allows none */
+static coap_route_table *routes;
+/* Routes are served to observers, or keep history or last values */
+static bool serve_routes;
+/* Incremented when device metadata changes, so routes resolve it again */
+static uint32_t metadata_gen;
+/* Shared memory last value table; NULL if not enabled */
+static coap_lastvalue *last_values;
+/* Sequence windows for devices; NULL if deduplication not enabled */
+static coap_dedup *dedup;
+/* Readings waiting for the publisher thread; NULL if posted inline */
+static coap_publish *publisher;
+/* Summaries of the busiest devices, resources and peers; NULL if not enabled */
+static coap_hot *hot_keys;
+/* Client certificates verified; NULL if not X509 or RPK mode, or not enabled */
+static coap_certcache *cert_cache;
+/*
+ * Last stats response, kept so later blocks of a block-wise GET are
+ * consistent; from coap_alloc(), METRICS_BUF_SIZE bytes, and HOT_JSON_MAXLEN
+ * more if hot keys are enabled
+ */
+static char *stats_text;
+static size_t stats_len;
+
+/* Settings from a reconfiguration, not yet applied; NULL if none */
+static coap_live_config *pending_config;
 
 /* controls input loop */
 volatile sig_atomic_t quit = 0;
@@ -45,6 +123,17 @@ handle_sig (int signum)
   quit = 1;
 }
 
+/* signal handler to start a capture */
+static void
+handle_capture_sig (int signum)
+{
+  (void)signum;
+  if (captures)
+  {
+    coap_capture_trigger (captures);
+  }
+}
+
 /*
  * Builds libcoap address struct from host/port. Presently accepts only
  * internet addresses.
@@ -91,6 +180,203 @@ resolve_address (const char *host, const char *service, coap_address_t *lib_addr
   return len;
 }
 
+/* Reads Content-Format option; CONTENT_FORMAT_UNDEFINED if absent */
+static uint16_t
+get_content_format (coap_pdu_t *request)
+{
+  coap_opt_iterator_t it;
+  coap_opt_t *opt = coap_check_option (request, COAP_OPTION_CONTENT_FORMAT, &it);
+  if (opt)
+  {
+    return coap_decode_var_bytes (coap_opt_value (opt), coap_opt_length (opt));
+  }
+  return CONTENT_FORMAT_UNDEFINED;
+}
+
+/* Writes host address as text, like '192.0.2.1' or '2001:db8::1' */
+static void
+format_host (const coap_address_t *addr, char *buf, socklen_t len)
+{
+  switch (addr->addr.sa.sa_family)
+  {
+    case AF_INET:
+      inet_ntop (AF_INET, &addr->addr.sin.sin_addr, buf, len);
+      break;
+    case AF_INET6:
+      inet_ntop (AF_INET6, &addr->addr.sin6.sin6_addr, buf, len);
+      break;
+    default:
+      snprintf (buf, len, "unknown");
+  }
+}
+
+/* Writes address as text, like '192.0.2.1:5683' or '[2001:db8::1]:5683' */
+static void
+format_address (const coap_address_t *addr, char *buf, size_t len)
+{
+  char host[INET6_ADDRSTRLEN];
+  format_host (addr, host, sizeof (host));
+  switch (addr->addr.sa.sa_family)
+  {
+    case AF_INET:
+      snprintf (buf, len, "%s:%u", host, ntohs (addr->addr.sin.sin_port));
+      break;
+    case AF_INET6:
+      snprintf (buf, len, "[%s]:%u", host, ntohs (addr->addr.sin6.sin6_port));
+      break;
+    default:
+      snprintf (buf, len, "%s", host);
+  }
+}
+
+/* Monotonic time in microseconds */
+static uint64_t
+now_usec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Wall clock time in nanoseconds */
+static uint64_t
+now_nsec (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Writes the URI path of a request, like 'a1r/d1/int', from its Uri-Path
+ * options, without allocating.
+ *
+ * @return false if the path does not fit, or a segment includes a NUL byte;
+ *         buf then holds as much of the path as fits before that point
+ */
+static bool
+read_path (coap_pdu_t *request, char *buf, size_t size)
+{
+  coap_opt_filter_t filter;
+  coap_opt_iterator_t it;
+  coap_opt_t *opt;
+  size_t len = 0;
+
+  coap_option_filter_clear (filter);
+  coap_option_filter_set (filter, COAP_OPTION_URI_PATH);
+  coap_option_iterator_init (request, &it, filter);
+  while ((opt = coap_option_next (&it)))
+  {
+    size_t seg_len = coap_opt_length (opt);
+    /* room for separator and terminator */
+    if (len + seg_len + 2 > size || memchr (coap_opt_value (opt), '\0', seg_len))
+    {
+      /* keep what fits, for a caller that records the path */
+      if (len && len + 2 <= size)
+      {
+        buf[len++] = '/';
+      }
+      size_t part = strnlen ((const char *)coap_opt_value (opt), seg_len);
+      if (part > size - 1 - len)
+      {
+        part = size - 1 - len;
+      }
+      memcpy (buf + len, coap_opt_value (opt), part);
+      buf[len + part] = '\0';
+      return false;
+    }
+    if (len)
+    {
+      buf[len++] = '/';
+    }
+    memcpy (buf + len, coap_opt_value (opt), seg_len);
+    len += seg_len;
+  }
+  buf[len] = '\0';
+  return true;
+}
+
+/*
+ * Records a rejected request in the dead letter ring. Runs on the hot path, so
+ * neither logs nor allocates. A URI path too long for the record is truncated,
+ * and marked so.
+ */
+static void
+record_dead_letter (coap_session_t *session, coap_pdu_t *request, uint8_t code)
+{
+  uint64_t seq;
+  coap_deadletter_record *rec = coap_deadletter_reserve (dead_letters, &seq);
+
+  rec->timestamp = now_nsec ();
+  rec->code = code;
+  rec->content_format = get_content_format (request);
+  format_address (&session->remote_addr, rec->peer, sizeof (rec->peer));
+
+  rec->flags = read_path (request, rec->uri, sizeof (rec->uri)) ? 0 : DEADLETTER_URI_TRUNCATED;
+
+  size_t len = 0;
+  uint8_t *data;
+  if (!coap_get_data (request, &len, &data))
+  {
+    len = 0;
+  }
+  rec->payload_len = len > UINT16_MAX ? UINT16_MAX : len;
+  rec->prefix_len = len < sizeof (rec->payload) ? len : sizeof (rec->payload);
+  if (rec->prefix_len)
+  {
+    memcpy (rec->payload, data, rec->prefix_len);
+  }
+
+  coap_deadletter_commit (rec, seq);
+}
+
+/* Copies an address for a capture record; IPv4 in the first 4 bytes */
+static void
+copy_capture_address (const coap_address_t *addr, uint8_t *bytes, uint16_t *port)
+{
+  memset (bytes, 0, 16);
+  if (addr->addr.sa.sa_family == AF_INET6)
+  {
+    memcpy (bytes, &addr->addr.sin6.sin6_addr, 16);
+    *port = ntohs (addr->addr.sin6.sin6_port);
+  }
+  else
+  {
+    memcpy (bytes, &addr->addr.sin.sin_addr, 4);
+    *port = ntohs (addr->addr.sin.sin_port);
+  }
+}
+
+/*
+ * Records a request or response in the capture ring. The PDU holds the
+ * message after its header, so the 4 byte CoAP header is encoded from its
+ * fields. A response is recorded before libcoap sends it, so a NON response
+ * shows the request's message ID.
+ */
+static void
+record_capture (const coap_session_t *session, const coap_pdu_t *pdu,
+                coap_capture_direction_t direction)
+{
+  uint64_t seq;
+  coap_capture_record *rec = coap_capture_reserve (captures, &seq);
+  rec->timestamp = now_nsec ();
+  rec->direction = direction;
+  rec->ip_version = (session->remote_addr.addr.sa.sa_family == AF_INET6) ? 6 : 4;
+  copy_capture_address (&session->remote_addr, rec->peer_addr, &rec->peer_port);
+  copy_capture_address (&session->local_addr, rec->local_addr, &rec->local_port);
+
+  size_t len = 4 + pdu->used_size;
+  rec->msg_len = (len > UINT16_MAX) ? UINT16_MAX : len;
+  rec->cap_len = (len > CAPTURE_SNAPLEN) ? CAPTURE_SNAPLEN : len;
+  rec->data[0] = 0x40 | (pdu->type & 0x03) << 4 | (pdu->token_length & 0x0F);
+  rec->data[1] = pdu->code;
+  rec->data[2] = pdu->tid >> 8;
+  rec->data[3] = pdu->tid & 0xFF;
+  memcpy (rec->data + 4, pdu->token, rec->cap_len - 4);
+
+  coap_capture_commit (rec, seq);
+}
+
 /* Caller must free returned iot_data_t */
 static iot_data_t*
 read_data_float64 (uint8_t *data, size_t len)
@@ -146,20 +432,33 @@ read_data_int32 (uint8_t *data, size_t len)
   return iot_data_alloc_i32 ((int32_t) int_val);
 }
 
-/* Caller must free returned iot_data_t */
+/*
+ * Caller must free returned iot_data_t. The string is copied to buf, which must
+ * have room for a null terminator, and the returned iot_data_t only references
+ * it, so buf must outlive the iot_data_t.
+ */
 static iot_data_t*
-read_data_string (uint8_t *data, size_t len)
+read_data_string (uint8_t *data, size_t len, char *buf)
 {
   /* must copy request data to append null terminator */
-  char *str_data = malloc (len + 1);
-  memcpy (str_data, data, len);
-  str_data[len] = '\0';
+  memcpy (buf, data, len);
+  buf[len] = '\0';
 
-  iot_data_t *iot_data = iot_data_alloc_string(str_data, IOT_DATA_TAKE);
+  iot_data_t *iot_data = iot_data_alloc_string(buf, IOT_DATA_REF);
 
   return iot_data;
 }
 
+/* Sets 5.03 response, with Max-Age as a hint for when to retry. */
+static void
+set_unavailable (coap_pdu_t *response)
+{
+  uint8_t buf[4];
+  response->code = COAP_RESPONSE_CODE (503);
+  coap_add_option (response, COAP_OPTION_MAXAGE,
+                   coap_encode_var_safe (buf, sizeof (buf), UNAVAILABLE_MAX_AGE), buf);
+}
+
 /*
  * Parse URI path, expect 3 segments: /a1r/{device-name}/{resource-name}
  *
@@ -249,193 +548,1648 @@ parse_path (coap_pdu_t *request, edgex_device **device_ptr, edgex_deviceresource
   return res;
 }
 
+static void data_handler (coap_context_t *context, coap_resource_t *coap_resource,
+                          coap_session_t *session, coap_pdu_t *request, coap_binary_t *token,
+                          coap_string_t *query, coap_pdu_t *response);
+static void route_handler (coap_context_t *context, coap_resource_t *coap_resource,
+                           coap_session_t *session, coap_pdu_t *request, coap_binary_t *token,
+                           coap_string_t *query, coap_pdu_t *response);
+
 /*
- * Read data from device initiated CoAP POST to /a1r/{device-name}/{resource-name},
- * and post it via devsdk_post_readings().
+ * Finds the route for a device resource, and creates it if not found.
+ *
+ * @return route, or NULL if the table is full
  */
-static void
-data_handler (coap_context_t *context, coap_resource_t *coap_resource,
-              coap_session_t *session, coap_pdu_t *request, coap_binary_t *token,
-              coap_string_t *query, coap_pdu_t *response)
+static coap_route *
+get_route (const char *device_name, const char *resource_name)
 {
-  (void)context;
-  (void)coap_resource;
-  (void)session;
-  (void)request;
-  (void)token;
-  (void)query;
-
-  /* reject default PUT method */
-  if (request->code == COAP_REQUEST_PUT)
+  char path[ROUTE_PATH_MAX];
+  if (snprintf (path, sizeof (path), "%s/%s/%s", RESOURCE_SEG1, device_name, resource_name)
+      >= (int)sizeof (path))
   {
-    response->code = COAP_RESPONSE_CODE (405);
-    return;
+    return NULL;
   }
 
-  /* Validate URI, expect 3 segments: /a1r/{device-name}/{resource-name} */
-  edgex_device *device = NULL;
-  edgex_deviceresource *resource = NULL;
-  if (!parse_path (request, &device, &resource))
+  coap_route *route = coap_route_find (routes, path);
+  if (route)
   {
-    response->code = COAP_RESPONSE_CODE (404);
-    goto finish;
+    return route;
+  }
+  if (!(route = coap_route_add (routes, path)))
+  {
+    iot_log_debug (sdk_ctx->lc, "route table full; %s not cached", path);
   }
+  return route;
+}
 
-  iot_data_t *iot_data = NULL;
-  size_t len;
-  uint8_t *data;
-  if (!coap_get_data (request, &len, &data))
+/*
+ * Finds the device and resource for a request path, from the metadata cached
+ * by the path's route. Metadata is current if no device has changed since it
+ * was cached, and it is younger than METADATA_MAX_AGE_USEC. Otherwise parses
+ * the path, and caches the result in its route.
+ *
+ * @param now        monotonic time of request, in microseconds
+ * @param route_ptr  route for the path, which holds the device reference; NULL
+ *                   if no route, so caller must free the device
+ * @return true if device and resource found
+ */
+static bool
+lookup_path (coap_pdu_t *request, uint64_t now, coap_route **route_ptr,
+             edgex_device **device_ptr, edgex_deviceresource **resource_ptr)
+{
+  *route_ptr = NULL;
+  if (!routes)
   {
-    iot_log_info (sdk_ctx->lc, "invalid data of len %u", len);
-    /* finalized after else clause */
+    return parse_path (request, device_ptr, resource_ptr);
   }
-  else
+
+  /* read before resolving, so a change while resolving is seen next time */
+  uint32_t gen = __atomic_load_n (&metadata_gen, __ATOMIC_ACQUIRE);
+  char path[ROUTE_PATH_MAX];
+  coap_route *route = NULL;
+  if (read_path (request, path, sizeof (path)) && (route = coap_route_find (routes, path)))
   {
-    /* Read CoAP content format option for validation below. */
-    uint16_t cf = CONTENT_FORMAT_UNDEFINED;
-    coap_opt_iterator_t it;
-    coap_opt_t *opt = coap_check_option (request, COAP_OPTION_CONTENT_FORMAT, &it);
-    if (opt)
+    if (route->device && route->resolved_gen == gen
+        && now - route->resolved_usec < METADATA_MAX_AGE_USEC)
     {
-      cf = coap_decode_var_bytes (coap_opt_value (opt), coap_opt_length (opt));
+      coap_route_count_lookup (routes, true);
+      *route_ptr = route;
+      *device_ptr = route->device;
+      *resource_ptr = route->device_resource;
+      return true;
     }
+  }
+  coap_route_count_lookup (routes, false);
 
-    /* Validate and read payload. Content format from option must be acceptable
-     * for resource value type. */
-    switch (resource->properties->type)
+  if (!parse_path (request, device_ptr, resource_ptr))
+  {
+    if (route)
     {
-      case Edgex_Float64:
-        if (cf != COAP_MEDIATYPE_TEXT_PLAIN)
-        {
-          response->code = COAP_RESPONSE_CODE (415);
-          goto finish;
-        }
-        iot_data = read_data_float64 (data, len);
-        break;
-
-      case Edgex_Int32:
-        if (cf != COAP_MEDIATYPE_TEXT_PLAIN)
-        {
-          response->code = COAP_RESPONSE_CODE (415);
-          goto finish;
-        }
-        iot_data = read_data_int32 (data, len);
-        break;
-
-      case Edgex_String:
-        if (cf != COAP_MEDIATYPE_TEXT_PLAIN && cf != COAP_MEDIATYPE_APPLICATION_JSON)
-        {
-          response->code = COAP_RESPONSE_CODE (415);
-          goto finish;
-        }
-        iot_data = read_data_string (data, len);
-        break;
-
-      default:
-        iot_log_error (sdk_ctx->lc, "unsupported resource type %d", resource->properties->type);
-        response->code = COAP_RESPONSE_CODE (500);
-        goto finish;
+      /* device or resource removed */
+      coap_route_set_device (routes, route, NULL, NULL, gen, now);
     }
+    return false;
   }
-  if (!iot_data)
+  /* path as requested may differ, like 'a1r//d1/int'; cache only the canonical path */
+  if ((route = get_route ((*device_ptr)->name, (*resource_ptr)->name)))
   {
-    response->code = COAP_RESPONSE_CODE (400);
-    coap_add_data (response, strlen (MSG_PAYLOAD_INVALID), (uint8_t *)MSG_PAYLOAD_INVALID);
-    goto finish;
+    coap_route_set_device (routes, route, *device_ptr, *resource_ptr, gen, now);
+    *route_ptr = route;
   }
+  return true;
+}
 
-  /* generate and post an event with the data */
-  devsdk_commandresult results[1];
-  results[0].origin = 0;
-  results[0].value = iot_data;
-
-  devsdk_post_readings (sdk_ctx->service, device->name, resource->name, results);
-  iot_data_free (results[0].value);
-
-  response->code = COAP_RESPONSE_CODE (204);
+void
+coap_server_metadata_changed (void)
+{
+  __atomic_add_fetch (&metadata_gen, 1, __ATOMIC_RELEASE);
+}
 
- finish:
+/* Releases a device cached by a route */
+static void
+release_device (edgex_device *device)
+{
   edgex_free_device (sdk_ctx->service, device);
 }
 
-int
-run_server (coap_driver *driver)
+/*
+ * Creates the libcoap resource for a route if not created yet. Requests for
+ * the path then reach this resource rather than the unknown one. The resource
+ * is observable in Observe mode.
+ */
+static void
+serve_route (coap_context_t *context, coap_route *route)
 {
-  coap_context_t  *ctx = NULL;
-  coap_address_t bind_addr;
-  coap_resource_t *resource = NULL;
-  int result = EXIT_FAILURE;
-  sdk_ctx = driver;
-  struct sigaction sa;
-
-  coap_startup ();
-
-  /* Use EdgeX log level */
-  coap_log_t log_level;
-  switch (sdk_ctx->lc->level)
+  if (route->resource)
   {
-    case IOT_LOG_ERROR:
-      log_level = LOG_ERR;
-      break;
-    case IOT_LOG_WARN:
-      log_level = LOG_WARNING;
-      break;
-    case IOT_LOG_DEBUG:
-      log_level = LOG_DEBUG;
-      break;
-    default:
-      log_level = LOG_INFO;
+    return;
   }
-  coap_set_log_level (log_level);
-  /* workaround for tinydtls log level mismatch to avoid excessive debug logging */
-  coap_tls_version_t *ver = coap_get_tls_library_version ();
-  if (ver->type == COAP_TLS_LIBRARY_TINYDTLS && log_level == LOG_INFO)
+  route->resource = coap_resource_init (coap_make_str_const (route->path), 0);
+  coap_register_handler (route->resource, COAP_REQUEST_POST, &data_handler);
+  /* so PUT is rejected, and counted, as for the unknown resource */
+  coap_register_handler (route->resource, COAP_REQUEST_PUT, &data_handler);
+  coap_register_handler (route->resource, COAP_REQUEST_GET, &route_handler);
+  coap_resource_set_get_observable (route->resource, sdk_ctx->observe);
+  coap_resource_set_userdata (route->resource, route);
+  coap_add_resource (context, route->resource);
+}
+
+/*
+ * Saves an accepted reading as its route's value, and notifies observers.
+ * Also appends a numeric reading to the route's history, and writes the
+ * reading to the shared last value table, if enabled.
+ *
+ * @param value  reading as posted to EdgeX
+ */
+static void
+update_route (coap_context_t *context, coap_route *route, const uint8_t *data, size_t len,
+              uint16_t cf, const iot_data_t *value)
+{
+  serve_route (context, route);
+  uint64_t timestamp = now_nsec ();
+  iot_data_type_t type = iot_data_type (value);
+
+  if (route->history && (type == IOT_DATA_INT32 || type == IOT_DATA_FLOAT64))
   {
-    coap_dtls_set_log_level (log_level - 1);
+    coap_series_append (route->history, timestamp / 1000000,
+                        (type == IOT_DATA_INT32) ? iot_data_i32 (value) : iot_data_f64 (value));
   }
-  else
+
+  if (last_values)
   {
-    coap_dtls_set_log_level (log_level);
+    if (route->lastvalue_slot < 0)
+    {
+      route->lastvalue_slot = coap_lastvalue_assign (last_values, route->path);
+    }
+    if (route->lastvalue_slot < 0)
+    {
+      iot_log_debug (sdk_ctx->lc, "last value table full; %s not shared", route->path);
+    }
+    else if (type == IOT_DATA_INT32)
+    {
+      coap_lastvalue_write_int32 (last_values, route->lastvalue_slot, iot_data_i32 (value), timestamp);
+    }
+    else if (type == IOT_DATA_FLOAT64)
+    {
+      coap_lastvalue_write_float64 (last_values, route->lastvalue_slot, iot_data_f64 (value), timestamp);
+    }
+    else
+    {
+      coap_lastvalue_write_string (last_values, route->lastvalue_slot, (const char *)data, len, timestamp);
+    }
   }
 
-  /* Resolve destination address where server should be sent. Use CoAP default ports. */
-  coap_proto_t proto = COAP_PROTO_UDP;
-  char *port = "5683";
-  if (driver->security_mode != SECURITY_MODE_NOSEC)
+  if (!coap_route_set_value (route, data, len, cf))
   {
-    proto = COAP_PROTO_DTLS;
-    port = "5684";
-  }
-  if (resolve_address (iot_data_string (driver->coap_bind_addr), port, &bind_addr) < 0) {
-    iot_log_error (sdk_ctx->lc, "failed to resolve CoAP bind address");
-    goto finish;
+    return;
   }
-
-  /* setup libcoap for a server */
-  if (!(ctx = coap_new_context (NULL)))
+  /* libcoap sends the notifications from its I/O loop, with depth 1 per observer */
+  if (coap_resource_notify_observers (route->resource, NULL))
   {
-    iot_log_error (sdk_ctx->lc, "cannot initialize context");
-    goto finish;
+    coap_route_count_notify (routes);
+  }
+}
+
+/*
+ * Parses a history query, like 'since=-60000&step=1000'. Times are
+ * milliseconds since the epoch, or relative to now if negative. Absent
+ * parameters select all points.
+ *
+ * @return false if a parameter is unknown or invalid
+ */
+static bool
+parse_history_query (const coap_string_t *query, int64_t *since, int64_t *until, int64_t *step)
+{
+  char text[HISTORY_QUERY_MAXLEN + 1];
+  if (query->length > HISTORY_QUERY_MAXLEN)
+  {
+    return false;
+  }
+  memcpy (text, query->s, query->length);
+  text[query->length] = '\0';
+
+  int64_t now_ms = now_nsec () / 1000000;
+  *since = INT64_MIN;
+  *until = INT64_MAX;
+  *step = 0;
+
+  char *save = NULL;
+  for (char *param = strtok_r (text, "&", &save); param; param = strtok_r (NULL, "&", &save))
+  {
+    char *value = strchr (param, '=');
+    if (!value)
+    {
+      return false;
+    }
+    *value++ = '\0';
+
+    char *endptr;
+    errno = 0;
+    long long num = strtoll (value, &endptr, 10);
+    if (errno || endptr == value || *endptr != '\0')
+    {
+      return false;
+    }
+    if (!strcmp (param, "since"))
+    {
+      *since = (num < 0) ? now_ms + num : num;
+    }
+    else if (!strcmp (param, "until"))
+    {
+      *until = (num < 0) ? now_ms + num : num;
+    }
+    else if (!strcmp (param, "step") && num >= 0)
+    {
+      *step = num;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/* Responds with the route's history in a time range, as JSON */
+static void
+send_route_history (coap_route *route, coap_session_t *session, coap_pdu_t *request,
+                    coap_binary_t *token, coap_string_t *query, coap_pdu_t *response)
+{
+  int64_t since, until, step;
+  if (!parse_history_query (query, &since, &until, &step))
+  {
+    response->code = COAP_RESPONSE_CODE (400);
+    return;
+  }
+  /* every route has a history, but only numeric readings fill it */
+  if (!route->history || !coap_series_count (route->history, INT64_MIN, INT64_MAX))
+  {
+    response->code = COAP_RESPONSE_CODE (404);
+    return;
+  }
+
+  /* room for a time, and a value for each array */
+  size_t size = 64 + (size_t)coap_series_count (route->history, since, until) * (24 + 4 * 26);
+  coap_metrics_buf buf = { .data = coap_alloc (size), .size = size, .len = 0, .overflow = false };
+  if (!buf.data)
+  {
+    set_unavailable (response);
+    return;
+  }
+  coap_series_write_json (route->history, since, until, step, &buf);
+  if (buf.overflow)
+  {
+    response->code = COAP_RESPONSE_CODE (500);
+  }
+  else
+  {
+    coap_add_data_blocked_response (route->resource, session, request, response, token,
+                                    COAP_MEDIATYPE_APPLICATION_JSON, -1, buf.len,
+                                    (uint8_t *)buf.data);
+  }
+  coap_free (buf.data);
+}
+
+/*
+ * Responds with the last value of a route, empty until the first reading. If
+ * the request has a query, responds with history instead.
+ */
+static void
+send_route_value (coap_route *route, coap_session_t *session, coap_pdu_t *request,
+                  coap_binary_t *token, coap_string_t *query, coap_pdu_t *response)
+{
+  if (query && query->length)
+  {
+    send_route_history (route, session, request, token, query, response);
+  }
+  else if (route->has_value)
+  {
+    coap_add_data_blocked_response (route->resource, session, request, response, token,
+                                    route->content_format, -1, route->value_len, route->value);
+  }
+  else
+  {
+    coap_add_data_blocked_response (route->resource, session, request, response, token,
+                                    COAP_MEDIATYPE_TEXT_PLAIN, -1, 0, NULL);
+  }
+}
+
+/*
+ * Responds to GET or Observe of /a1r/{device-name}/{resource-name} with the
+ * last accepted reading, or history. libcoap calls this handler also to build
+ * each notification, which copies the route's shared value.
+ */
+static void
+route_handler (coap_context_t *context, coap_resource_t *coap_resource,
+               coap_session_t *session, coap_pdu_t *request, coap_binary_t *token,
+               coap_string_t *query, coap_pdu_t *response)
+{
+  (void)context;
+
+  send_route_value (coap_resource_get_userdata (coap_resource), session, request, token, query,
+                    response);
+}
+
+/*
+ * Responds to GET of a device resource path with no route yet. Creates the
+ * route, and registers an observer if requested, since libcoap registers
+ * observers only for an observable resource.
+ */
+static void
+unknown_get_handler (coap_context_t *context, coap_resource_t *coap_resource,
+                     coap_session_t *session, coap_pdu_t *request, coap_binary_t *token,
+                     coap_string_t *query, coap_pdu_t *response)
+{
+  (void)coap_resource;
+
+  coap_route *route;
+  edgex_device *device = NULL;
+  edgex_deviceresource *resource = NULL;
+  if (!lookup_path (request, now_usec (), &route, &device, &resource))
+  {
+    response->code = COAP_RESPONSE_CODE (404);
+    return;
+  }
+  if (!route)
+  {
+    edgex_free_device (sdk_ctx->service, device);
+    set_unavailable (response);
+    return;
+  }
+  serve_route (context, route);
+
+  coap_opt_iterator_t it;
+  coap_opt_t *opt = coap_check_option (request, COAP_OPTION_OBSERVE, &it);
+  if (sdk_ctx->observe && opt && coap_decode_var_bytes (coap_opt_value (opt), coap_opt_length (opt)) == 0)
+  {
+    coap_block_t block2;
+    int has_block2 = coap_get_block (request, COAP_OPTION_BLOCK2, &block2);
+    coap_add_observer (route->resource, session, token, NULL, has_block2, block2);
+  }
+  send_route_value (route, session, request, token, query, response);
+}
+
+/* Counts a request for its device, and for its device resource as in the URI path */
+static void
+count_hot_keys (const coap_pdu_t *request, const char *device_name, const char *resource_name,
+                uint64_t now)
+{
+  uint32_t bytes = request->hdr_size + request->used_size;
+  char key[HOT_KEY_MAXLEN + 1];
+  snprintf (key, sizeof (key), "%s/%s", device_name, resource_name);
+  coap_hot_add (hot_keys, HOT_DEVICE, device_name, bytes, now);
+  coap_hot_add (hot_keys, HOT_RESOURCE, key, bytes, now);
+}
+
+/*
+ * Checks the Sequence option of a request, if present, for a reading already
+ * accepted from the device. Sets the response code if the reading must not be
+ * posted: 2.04 for a duplicate, so the device stops retransmitting, or 4.00
+ * for an invalid option. The sequence number is not recorded here; the caller
+ * records it with coap_dedup_accept() only once the reading is accepted, so a
+ * reading refused for now, like with 5.03, is not a duplicate when sent again.
+ *
+ * @param seq  set to the sequence number to record, or -1 if none
+ * @return true if the reading should be posted
+ */
+static bool
+check_sequence (coap_pdu_t *request, const char *device_name, coap_pdu_t *response, int64_t *seq_ptr)
+{
+  coap_opt_iterator_t it;
+  coap_opt_t *opt = coap_check_option (request, COAP_OPTION_SEQUENCE, &it);
+  *seq_ptr = -1;
+  if (!opt)
+  {
+    return true;
+  }
+  if (coap_opt_length (opt) > sizeof (uint32_t))
+  {
+    response->code = COAP_RESPONSE_CODE (400);
+    return false;
+  }
+
+  uint32_t seq = coap_decode_var_bytes (coap_opt_value (opt), coap_opt_length (opt));
+  switch (coap_dedup_check (dedup, device_name, seq))
+  {
+    case DEDUP_DUPLICATE:
+    case DEDUP_STALE:
+      iot_log_debug (sdk_ctx->lc, "duplicate reading %u from %s", seq, device_name);
+      response->code = COAP_RESPONSE_CODE (204);
+      return false;
+    case DEDUP_NEW:
+      *seq_ptr = seq;
+      return true;
+    default:
+      return true;
+  }
+}
+
+/*
+ * Adds writes queued for a device to the response to its POST, as a JSON
+ * object, and posts the written values as readings so EdgeX sees the new
+ * state of the device.
+ */
+static void
+deliver_writes (const char *device_name, coap_pdu_t *response)
+{
+  char text[ACTUATION_PAYLOAD_MAX + 1];
+  coap_metrics_buf buf = { .data = text, .size = sizeof (text), .len = 0, .overflow = false };
+  coap_actuation_write *writes = coap_actuation_take (sdk_ctx->writes, device_name, &buf);
+  if (!writes)
+  {
+    return;
+  }
+
+  uint8_t cf_buf[2];
+  coap_add_option (response, COAP_OPTION_CONTENT_FORMAT,
+                   coap_encode_var_safe (cf_buf, sizeof (cf_buf), COAP_MEDIATYPE_APPLICATION_JSON),
+                   cf_buf);
+  coap_add_data (response, buf.len, (uint8_t *)buf.data);
+  iot_log_debug (sdk_ctx->lc, "delivered writes to %s: %s", device_name, buf.data);
+
+  for (coap_actuation_write *w = writes; w; w = w->next)
+  {
+    devsdk_commandresult results[1];
+    results[0].origin = 0;
+    results[0].value = w->value;
+    devsdk_post_readings (sdk_ctx->service, device_name, w->resource, results);
+  }
+  coap_actuation_write_free (writes);
+}
+
+/* Releases a String payload buffer, from the budget's pool or coap_alloc() */
+static void
+release_payload (void *buf)
+{
+  if (payload_pool)
+  {
+    coap_pool_release (payload_pool, buf);
+  }
+  else
+  {
+    coap_free (buf);
+  }
+}
+
+/*
+ * Posts a reading to EdgeX, or queues it for the publisher thread if
+ * enabled. A reading for a resource with the 'conflate' attribute replaces
+ * one still queued for the resource.
+ *
+ * @param payload_buf  buffer a String value references; NULL if none. If the
+ *                     reading is queued, the queue releases it, also on
+ *                     failure
+ * @param now  monotonic time of receipt, in microseconds
+ * @return false if the queue is full
+ */
+static bool
+publish_reading (coap_route *route, const char *device_name, const edgex_deviceresource *resource,
+                 iot_data_t *value, char *payload_buf, uint64_t now)
+{
+  if (!publisher)
+  {
+    devsdk_commandresult results[1];
+    results[0].origin = 0;
+    results[0].value = value;
+    devsdk_post_readings (sdk_ctx->service, device_name, resource->name, results);
+    return true;
+  }
+
+  int32_t slot = -1;
+  coap_rules *rules = (coap_rules *)resource->attrs;
+  if (route && rules && coap_rules_conflate (rules))
+  {
+    if (route->publish_slot < 0)
+    {
+      route->publish_slot = coap_publish_assign (publisher, device_name, resource->name);
+    }
+    slot = route->publish_slot;
+  }
+  return coap_publish_push (publisher, slot, device_name, resource->name, iot_data_add_ref (value),
+                            payload_buf, now);
+}
+
+/*
+ * Read data from device initiated CoAP POST to /a1r/{device-name}/{resource-name},
+ * and post it via devsdk_post_readings().
+ */
+static void
+data_handler (coap_context_t *context, coap_resource_t *coap_resource,
+              coap_session_t *session, coap_pdu_t *request, coap_binary_t *token,
+              coap_string_t *query, coap_pdu_t *response)
+{
+  (void)coap_resource;
+  (void)request;
+  (void)token;
+  (void)query;
+
+  /* device is released at finish, unless held by its route */
+  coap_route *route = NULL;
+  edgex_device *device = NULL;
+  edgex_deviceresource *resource = NULL;
+  char *payload_buf = NULL;
+  /* sequence number to record once the reading is accepted; -1 if none */
+  int64_t seq = -1;
+  uint64_t start_usec = now_usec ();
+  metrics.requests++;
+  bool capture = captures && coap_capture_sample (captures, start_usec);
+  if (capture)
+  {
+    record_capture (session, request, CAPTURE_RECEIVED);
+  }
+  /* counted before shedding, which is when the busiest peers matter most */
+  if (hot_keys)
+  {
+    char host[INET6_ADDRSTRLEN];
+    format_host (&session->remote_addr, host, sizeof (host));
+    coap_hot_add (hot_keys, HOT_PEER, host, request->hdr_size + request->used_size,
+                  start_usec / 1000000);
+  }
+
+  /* reject default PUT method */
+  if (request->code == COAP_REQUEST_PUT)
+  {
+    response->code = COAP_RESPONSE_CODE (405);
+    goto finish;
+  }
+
+  /*
+   * Shed load while the publish queue is persistently delayed; the device
+   * retries after Max-Age. Not recorded as rejected, so shedding stays cheap.
+   * A NON request cannot be asked to retry, so is accepted if the queue has room.
+   */
+  if (publisher && request->type == COAP_MESSAGE_CON && coap_publish_shed (publisher))
+  {
+    set_unavailable (response);
+    if (capture)
+    {
+      record_capture (session, response, CAPTURE_SENT);
+    }
+    return;
+  }
+
+  /* Validate URI, expect 3 segments: /a1r/{device-name}/{resource-name} */
+  if (!lookup_path (request, start_usec, &route, &device, &resource))
+  {
+    response->code = COAP_RESPONSE_CODE (404);
+    goto finish;
+  }
+  if (hot_keys)
+  {
+    count_hot_keys (request, device->name, resource->name, start_usec / 1000000);
+  }
+
+  iot_data_t *iot_data = NULL;
+  size_t len;
+  uint8_t *data;
+  uint16_t cf = CONTENT_FORMAT_UNDEFINED;
+  if (!coap_get_data (request, &len, &data))
+  {
+    iot_log_info (sdk_ctx->lc, "invalid data of len %u", len);
+    /* finalized after else clause */
+  }
+  else
+  {
+    /* Read CoAP content format option for validation below. */
+    cf = get_content_format (request);
+
+    /* Validate and read payload. Content format from option must be acceptable
+     * for resource value type. */
+    switch (resource->properties->type)
+    {
+      case Edgex_Float64:
+        if (cf != COAP_MEDIATYPE_TEXT_PLAIN)
+        {
+          response->code = COAP_RESPONSE_CODE (415);
+          goto finish;
+        }
+        iot_data = read_data_float64 (data, len);
+        break;
+
+      case Edgex_Int32:
+        if (cf != COAP_MEDIATYPE_TEXT_PLAIN)
+        {
+          response->code = COAP_RESPONSE_CODE (415);
+          goto finish;
+        }
+        iot_data = read_data_int32 (data, len);
+        break;
+
+      case Edgex_String:
+        if (cf != COAP_MEDIATYPE_TEXT_PLAIN && cf != COAP_MEDIATYPE_APPLICATION_JSON)
+        {
+          response->code = COAP_RESPONSE_CODE (415);
+          goto finish;
+        }
+        if (payload_pool)
+        {
+          /* budget mode; never allocate beyond the pool */
+          if (len >= BUDGET_PAYLOAD_BUF_SIZE)
+          {
+            response->code = COAP_RESPONSE_CODE (413);
+            goto finish;
+          }
+          if (!(payload_buf = coap_pool_alloc (payload_pool)))
+          {
+            set_unavailable (response);
+            goto finish;
+          }
+        }
+        else if (!(payload_buf = coap_alloc (len + 1)))
+        {
+          set_unavailable (response);
+          goto finish;
+        }
+        iot_data = read_data_string (data, len, payload_buf);
+        break;
+
+      default:
+        iot_log_error (sdk_ctx->lc, "unsupported resource type %d", resource->properties->type);
+        response->code = COAP_RESPONSE_CODE (500);
+        goto finish;
+    }
+  }
+  if (!iot_data)
+  {
+    response->code = COAP_RESPONSE_CODE (400);
+    coap_add_data (response, strlen (MSG_PAYLOAD_INVALID), (uint8_t *)MSG_PAYLOAD_INVALID);
+    goto finish;
+  }
+  if (dedup && !check_sequence (request, device->name, response, &seq))
+  {
+    iot_data_free (iot_data);
+    goto finish;
+  }
+
+  /* apply filter and transform from the device profile */
+  char value_text[FLOAT64_STR_MAXLEN + 8];
+  coap_rules *rules = (coap_rules *)resource->attrs;
+  if (rules)
+  {
+    coap_rules_result_t result = coap_rules_apply (rules, device->name, &iot_data, now_nsec ());
+    if (result == RULES_UNSUPPORTED)
+    {
+      /* an error in the device profile, so not acknowledged */
+      iot_log_error (sdk_ctx->lc, "filter or transform on %s/%s, which is not Int32 or Float64",
+                     device->name, resource->name);
+      iot_data_free (iot_data);
+      response->code = COAP_RESPONSE_CODE (500);
+      goto finish;
+    }
+    if (result != RULES_POST)
+    {
+      if (result == RULES_INVALID)
+      {
+        iot_log_debug (sdk_ctx->lc, "transform result not valid for %s/%s", device->name, resource->name);
+      }
+      /* not an error by the device, so acknowledge it */
+      metrics.filtered++;
+      if (seq >= 0)
+      {
+        coap_dedup_accept (dedup, device->name, (uint32_t)seq);
+      }
+      iot_data_free (iot_data);
+      response->code = COAP_RESPONSE_CODE (204);
+      goto finish;
+    }
+    if (coap_rules_has_transform (rules))
+    {
+      /* observers and history see the transformed value */
+      if (iot_data_type (iot_data) == IOT_DATA_INT32)
+      {
+        len = snprintf (value_text, sizeof (value_text), "%d", iot_data_i32 (iot_data));
+        data = (uint8_t *)value_text;
+      }
+      else if (iot_data_type (iot_data) == IOT_DATA_FLOAT64)
+      {
+        len = snprintf (value_text, sizeof (value_text), "%.17g", iot_data_f64 (iot_data));
+        data = (uint8_t *)value_text;
+      }
+    }
+  }
+
+  /* generate and post an event with the data; a queued String keeps its buffer */
+  bool published = publish_reading (route, device->name, resource, iot_data, payload_buf, start_usec);
+  if (publisher)
+  {
+    payload_buf = NULL;
+  }
+  if (!published)
+  {
+    iot_data_free (iot_data);
+    set_unavailable (response);
+    goto finish;
+  }
+  metrics.readings++;
+  if (seq >= 0)
+  {
+    coap_dedup_accept (dedup, device->name, (uint32_t)seq);
+  }
+  if (serve_routes && route)
+  {
+    update_route (context, route, data, len, cf, iot_data);
+  }
+  iot_data_free (iot_data);
+
+  response->code = COAP_RESPONSE_CODE (204);
+  if (sdk_ctx->writes)
+  {
+    deliver_writes (device->name, response);
+  }
+
+ finish:
+  if (capture)
+  {
+    record_capture (session, response, CAPTURE_SENT);
+  }
+  if (response->code >= COAP_RESPONSE_CODE (400))
+  {
+    metrics.rejected++;
+    if (dead_letters)
+    {
+      record_dead_letter (session, request, response->code);
+    }
+  }
+  if (payload_buf)
+  {
+    release_payload (payload_buf);
+  }
+  if (!route)
+  {
+    edgex_free_device (sdk_ctx->service, device);
+  }
+
+  uint64_t end_usec = now_usec ();
+  coap_histogram_add (&metrics.handler_usec, end_usec - start_usec, end_usec / 1000000);
+}
+
+/*
+ * Controls a capture. GET responds with its state as JSON. POST starts a
+ * capture, for the seconds in the payload if any, or extends one running.
+ * DELETE stops it.
+ */
+static void
+capture_handler (coap_context_t *context, coap_resource_t *coap_resource,
+                 coap_session_t *session, coap_pdu_t *request, coap_binary_t *token,
+                 coap_string_t *query, coap_pdu_t *response)
+{
+  (void)context;
+  (void)coap_resource;
+  (void)session;
+  (void)token;
+  (void)query;
+  uint64_t now = now_usec ();
+
+  if (request->code == COAP_REQUEST_POST)
+  {
+    size_t len = 0;
+    uint8_t *data;
+    unsigned long seconds = 0;
+    if (coap_get_data (request, &len, &data) && len)
+    {
+      char text[CAPTURE_SECONDS_MAXLEN + 1];
+      char *end;
+      if (len > CAPTURE_SECONDS_MAXLEN)
+      {
+        response->code = COAP_RESPONSE_CODE (400);
+        return;
+      }
+      memcpy (text, data, len);
+      text[len] = '\0';
+      errno = 0;
+      seconds = strtoul (text, &end, 10);
+      if (errno || *end || seconds == 0 || seconds > UINT32_MAX)
+      {
+        response->code = COAP_RESPONSE_CODE (400);
+        return;
+      }
+    }
+    coap_capture_start (captures, (uint32_t)seconds, now);
+    iot_log_info (sdk_ctx->lc, "capture started");
+    response->code = COAP_RESPONSE_CODE (204);
+    return;
+  }
+  if (request->code == COAP_REQUEST_DELETE)
+  {
+    coap_capture_stop (captures);
+    iot_log_info (sdk_ctx->lc, "capture stopped");
+    response->code = COAP_RESPONSE_CODE (202);
+    return;
+  }
+
+  char text[256];
+  coap_metrics_buf buf = { .data = text, .size = sizeof (text), .len = 0, .overflow = false };
+  coap_capture_write_json (captures, now, &buf);
+  uint8_t cf_buf[2];
+  response->code = COAP_RESPONSE_CODE (205);
+  coap_add_option (response, COAP_OPTION_CONTENT_FORMAT,
+                   coap_encode_var_safe (cf_buf, sizeof (cf_buf), COAP_MEDIATYPE_APPLICATION_JSON),
+                   cf_buf);
+  coap_add_data (response, buf.len, (uint8_t *)buf.data);
+}
+
+/*
+ * Responds to GET /stats with server metrics as JSON, including kernel
+ * statistics for the server socket. The response may take several blocks;
+ * stats are rendered for the first, and later blocks are taken from the same
+ * rendering.
+ */
+static void
+stats_handler (coap_context_t *context, coap_resource_t *coap_resource,
+               coap_session_t *session, coap_pdu_t *request, coap_binary_t *token,
+               coap_string_t *query, coap_pdu_t *response)
+{
+  (void)context;
+  (void)query;
+
+  coap_block_t block2;
+  if (stats_len && coap_get_block (request, COAP_OPTION_BLOCK2, &block2) && block2.num > 0)
+  {
+    coap_add_data_blocked_response (coap_resource, session, request, response, token,
+                                    COAP_MEDIATYPE_APPLICATION_JSON, -1, stats_len,
+                                    (uint8_t *)stats_text);
+    return;
+  }
+
+  /* a fresh rendering replaces the one kept for block-wise transfer */
+  coap_free (stats_text);
+  stats_len = 0;
+  size_t stats_size = METRICS_BUF_SIZE + (hot_keys ? HOT_JSON_MAXLEN : 0);
+  if (!(stats_text = coap_alloc (stats_size)))
+  {
+    set_unavailable (response);
+    return;
+  }
+  coap_metrics_buf buf = { .data = stats_text, .size = stats_size, .len = 0, .overflow = false };
+  coap_socket_stats sock_stats;
+  bool has_sock = (server_fd >= 0) && coap_metrics_read_socket (server_fd, &sock_stats);
+
+  coap_metrics_printf (&buf, "{");
+  coap_metrics_write_json (&metrics, has_sock ? &sock_stats : NULL, &buf);
+  coap_histogram_write_json (&metrics.handler_usec, "handlerUsec", now_usec () / 1000000, &buf);
+  coap_metrics_write_memory_json (&buf);
+  coap_metrics_write_cpu_json (&buf);
+  coap_alloc_write_json (&buf);
+  if (sdk_ctx->writes)
+  {
+    coap_actuation_write_json (sdk_ctx->writes, &buf);
+  }
+  if (routes)
+  {
+    coap_route_write_json (routes, &buf);
+  }
+  if (publisher)
+  {
+    coap_publish_write_json (publisher, &buf);
+  }
+  if (dedup)
+  {
+    coap_dedup_write_json (dedup, &buf);
+  }
+  if (packet_filter)
+  {
+    coap_filter_write_json (packet_filter, &buf);
+  }
+  if (hot_keys)
+  {
+    coap_hot_write_json (hot_keys, now_usec () / 1000000, &buf);
+  }
+  if (cert_cache)
+  {
+    coap_certcache_write_json (cert_cache, now_usec () / 1000000, &buf);
+  }
+  if (budget_plan.budget)
+  {
+    coap_pool_stats pool_stats;
+    coap_pool_get_stats (payload_pool, &pool_stats);
+    coap_metrics_printf (&buf, ",\"budget\":{\"bytes\":%lu,\"sessions\":%u,\"handshakes\":%u,"
+                         "\"publishBytes\":%lu,\"payloadBuffers\":{\"size\":%u,\"inUse\":%u,"
+                         "\"peak\":%u,\"exhausted\":%lu}}", (unsigned long)budget_plan.budget,
+                         budget_plan.sessions, budget_plan.handshakes,
+                         (unsigned long)budget_plan.publish_bytes, pool_stats.blocks,
+                         pool_stats.in_use, pool_stats.peak, (unsigned long)pool_stats.exhausted);
+  }
+  coap_metrics_printf (&buf, "}");
+
+  if (buf.overflow)
+  {
+    iot_log_error (sdk_ctx->lc, "stats exceed buffer of %zu bytes", stats_size);
+    stats_len = 0;
+    response->code = COAP_RESPONSE_CODE (500);
+    return;
+  }
+
+  stats_len = buf.len;
+  coap_add_data_blocked_response (coap_resource, session, request, response, token,
+                                  COAP_MEDIATYPE_APPLICATION_JSON, -1, stats_len,
+                                  (uint8_t *)stats_text);
+}
+
+/*
+ * Sets a socket buffer size and logs the size granted by the kernel, which
+ * doubles the request and caps it at net.core.[rw]mem_max.
+ */
+static void
+set_socket_buffer (int fd, int optname, const char *name, uint32_t size)
+{
+  int val = (int)size;
+  if (setsockopt (fd, SOL_SOCKET, optname, &val, sizeof (val)) < 0)
+  {
+    iot_log_warn (sdk_ctx->lc, "cannot set %s to %u: %s", name, size, strerror (errno));
+    return;
+  }
+
+  socklen_t len = sizeof (val);
+  if (getsockopt (fd, SOL_SOCKET, optname, &val, &len) == 0)
+  {
+    if ((uint32_t)val < size)
+    {
+      iot_log_warn (sdk_ctx->lc, "%s limited to %d by kernel; see net.core.%s_max", name, val,
+                    optname == SO_RCVBUF ? "rmem" : "wmem");
+    }
+    else
+    {
+      iot_log_info (sdk_ctx->lc, "%s set to %d", name, val);
+    }
+  }
+}
+
+/* Touches stack pages so they are resident before the first request. */
+static void
+prefault_stack (void)
+{
+  volatile uint8_t stack[PREFAULT_STACK_SIZE];
+  for (size_t i = 0; i < sizeof (stack); i += 4096)
+  {
+    stack[i] = 0;
+  }
+}
+
+/*
+ * Prepares the server thread and socket for low latency mode. Each step is
+ * best effort, since it may require privileges the service lacks.
+ */
+static void
+setup_low_latency (coap_driver *driver)
+{
+  /* SO_BUSY_POLL is a socket option, so is set by open_endpoint() */
+  if (driver->io_cpu >= 0)
+  {
+    cpu_set_t cpus;
+    CPU_ZERO (&cpus);
+    CPU_SET (driver->io_cpu, &cpus);
+    int err = pthread_setaffinity_np (pthread_self (), sizeof (cpus), &cpus);
+    if (err)
+    {
+      iot_log_warn (sdk_ctx->lc, "cannot pin server to CPU %d: %s", driver->io_cpu, strerror (err));
+    }
+  }
+
+  if (driver->lock_memory)
+  {
+    if (mlockall (MCL_CURRENT | MCL_FUTURE) < 0)
+    {
+      iot_log_warn (sdk_ctx->lc, "cannot lock memory: %s", strerror (errno));
+    }
+    prefault_stack ();
+  }
+
+  iot_log_info (sdk_ctx->lc, "low latency mode; busy poll %u us, spin %u us, CPU %d%s",
+                driver->busy_poll_usec, driver->spin_budget_usec, driver->io_cpu,
+                driver->lock_memory ? ", memory locked" : "");
+}
+
+/*
+ * Attaches the packet filter to the server socket, if enabled, replacing any
+ * filter attached.
+ */
+static void
+attach_filter (void)
+{
+  coap_filter_detach (packet_filter);
+  packet_filter = NULL;
+  if (!sdk_ctx->packet_filter)
+  {
+    return;
+  }
+  /* not fatal; the server validates every request anyway */
+  packet_filter = coap_filter_attach (server_fd, sdk_ctx->security_mode != SECURITY_MODE_NOSEC,
+                                      sdk_ctx->allowlist,
+                                      sdk_ctx->allowlist_len);
+  if (packet_filter)
+  {
+    iot_log_info (sdk_ctx->lc, "packet filter attached, with %u source prefixes",
+                  sdk_ctx->allowlist_len);
+  }
+  else
+  {
+    iot_log_warn (sdk_ctx->lc, "cannot attach packet filter: %s", strerror (errno));
+  }
+}
+
+/* Sets socket buffers, and busy polling in low latency mode, on a new server socket */
+static void
+set_socket_options (int fd)
+{
+  if (sdk_ctx->socket_rcvbuf)
+  {
+    set_socket_buffer (fd, SO_RCVBUF, "SO_RCVBUF", sdk_ctx->socket_rcvbuf);
+  }
+  if (sdk_ctx->socket_sndbuf)
+  {
+    set_socket_buffer (fd, SO_SNDBUF, "SO_SNDBUF", sdk_ctx->socket_sndbuf);
+  }
+  if (sdk_ctx->low_latency && sdk_ctx->busy_poll_usec)
+  {
+    int val = (int)sdk_ctx->busy_poll_usec;
+    if (setsockopt (fd, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof (val)) < 0)
+    {
+      iot_log_warn (sdk_ctx->lc, "cannot set SO_BUSY_POLL: %s", strerror (errno));
+    }
+  }
+}
+
+/*
+ * Opens the server endpoint on a bind address, with socket options and packet
+ * filter as configured. Then closes the endpoint previously open, if any,
+ * which also closes its sessions.
+ *
+ * @return false if the endpoint cannot be opened; a previous endpoint is kept
+ */
+static bool
+open_endpoint (coap_context_t *ctx, const char *bind_text)
+{
+  /* Resolve destination address where server should be sent. Use CoAP default ports. */
+  coap_address_t bind_addr;
+  coap_proto_t proto = COAP_PROTO_UDP;
+  char *port = "5683";
+  if (sdk_ctx->security_mode != SECURITY_MODE_NOSEC)
+  {
+    proto = COAP_PROTO_DTLS;
+    port = "5684";
+  }
+  if (resolve_address (bind_text, port, &bind_addr) < 0) {
+    iot_log_error (sdk_ctx->lc, "failed to resolve CoAP bind address");
+    return false;
+  }
+
+  coap_endpoint_t *endpoint = coap_new_endpoint (ctx, &bind_addr, proto);
+  if (!endpoint)
+  {
+    iot_log_error (sdk_ctx->lc, "cannot initialize listen endpoint");
+    return false;
+  }
+  /* detach while the old descriptor is still open, since its number may be reused */
+  coap_filter_detach (packet_filter);
+  packet_filter = NULL;
+  if (server_endpoint)
+  {
+    coap_free_endpoint (server_endpoint);
+  }
+  server_endpoint = endpoint;
+  server_fd = endpoint->sock.fd;
+  set_socket_options (server_fd);
+  attach_filter ();
+  return true;
+}
+
+/* Checks whether a certificate's public key is trusted, for RPK mode */
+static bool
+trusted_key (const uint8_t *cert, size_t len)
+{
+  uint8_t digest[CERT_DIGEST_LEN];
+  if (!coap_certcache_key_digest (cert, len, digest))
+  {
+    return false;
+  }
+  /* sorted when read from configuration */
+  uint32_t lo = 0;
+  uint32_t hi = sdk_ctx->trusted_key_count;
+  while (lo < hi)
+  {
+    uint32_t mid = lo + (hi - lo) / 2;
+    int cmp = memcmp (digest, sdk_ctx->trusted_keys + mid * CERT_DIGEST_LEN, CERT_DIGEST_LEN);
+    if (cmp == 0)
+    {
+      return true;
+    }
+    if (cmp < 0)
+    {
+      hi = mid;
+    }
+    else
+    {
+      lo = mid + 1;
+    }
+  }
+  return false;
+}
+
+/*
+ * Checks the identity in a client certificate: in X509 mode its common name
+ * must name a known device, and in RPK mode its public key must be trusted.
+ *
+ * @return NULL if accepted, or the reason for rejection
+ */
+static const char *
+check_peer_identity (const char *cn, const uint8_t *cert, size_t cert_len)
+{
+  if (sdk_ctx->security_mode == SECURITY_MODE_RPK)
+  {
+    return trusted_key (cert, cert_len) ? NULL : "public key not trusted";
+  }
+  edgex_device *device = cn ? edgex_get_device_byname (sdk_ctx->service, cn) : NULL;
+  if (!device)
+  {
+    return "common name not a device";
+  }
+  edgex_free_device (sdk_ctx->service, device);
+  return NULL;
+}
+
+/*
+ * Verifies a client certificate in a DTLS handshake. The DTLS library has
+ * already checked the chain, and the client's possession of the private key,
+ * and calls this for each certificate in the chain. The client's own
+ * certificate, at depth 0, must also pass check_peer_identity(). In X509 mode
+ * an accepted common name is cached, so when the device handshakes again the
+ * device lookup is skipped. RPK mode has no cache, since its check, a digest
+ * of the public key and a search of the trusted keys, costs no more than a
+ * cache lookup would.
+ *
+ * @return 1 to accept the certificate
+ */
+static int
+verify_peer_cert (const char *cn, const uint8_t *cert, size_t cert_len, coap_session_t *session,
+                  unsigned depth, int validated, void *arg)
+{
+  (void)arg;
+  if (depth > 0)
+  {
+    return validated;
+  }
+
+  const char *reason = "certificate not valid";
+  uint8_t identity[CERT_DIGEST_LEN];
+  uint64_t now = now_usec () / 1000000;
+  uint32_t gen = __atomic_load_n (&metadata_gen, __ATOMIC_ACQUIRE);
+  if (validated)
+  {
+    /* without a common name the check fails, so is not cached */
+    if (cert_cache && cn)
+    {
+      coap_certcache_sha256 ((const uint8_t *)cn, strlen (cn), identity);
+      if (coap_certcache_lookup (cert_cache, identity, gen, now))
+      {
+        return 1;
+      }
+    }
+    reason = check_peer_identity (cn, cert, cert_len);
+  }
+
+  if (reason)
+  {
+    char host[INET6_ADDRSTRLEN];
+    format_host (&session->remote_addr, host, sizeof (host));
+    iot_log_info (sdk_ctx->lc, "rejected certificate from %s for %s: %s", host, cn ? cn : "-",
+                  reason);
+    if (cert_cache)
+    {
+      coap_certcache_rejected (cert_cache);
+    }
+    return 0;
+  }
+  if (cert_cache)
+  {
+    coap_certcache_add (cert_cache, identity, gen, now);
+  }
+  return 1;
+}
+
+/*
+ * Sets the server certificate for new DTLS sessions, and requires a client
+ * certificate. In RPK mode a device presents its public key in a self-signed
+ * certificate, since libcoap 4.2 does not support raw public keys as such.
+ */
+static bool
+set_pki (coap_context_t *ctx)
+{
+  coap_dtls_pki_t pki;
+  memset (&pki, 0, sizeof (pki));
+  pki.version = COAP_DTLS_PKI_SETUP_VERSION;
+  pki.verify_peer_cert = 1;
+  pki.require_peer_cert = 1;
+  pki.allow_self_signed = (sdk_ctx->security_mode == SECURITY_MODE_RPK);
+  pki.cert_chain_validation = 1;
+  pki.cert_chain_verify_depth = PKI_VERIFY_DEPTH;
+  pki.validate_cn_call_back = verify_peer_cert;
+  pki.pki_key.key_type = COAP_PKI_KEY_PEM;
+  pki.pki_key.key.pem.public_cert = iot_data_string (sdk_ctx->cert_file);
+  pki.pki_key.key.pem.private_key = iot_data_string (sdk_ctx->key_file);
+  pki.pki_key.key.pem.ca_file = sdk_ctx->ca_file ? iot_data_string (sdk_ctx->ca_file) : NULL;
+  return coap_context_set_pki (ctx, &pki);
+}
+
+/* Name of a security mode, as in configuration */
+static const char *
+security_mode_name (coap_security_mode_t mode)
+{
+  switch (mode)
+  {
+    case SECURITY_MODE_PSK:
+      return "PSK";
+    case SECURITY_MODE_X509:
+      return "X509";
+    case SECURITY_MODE_RPK:
+      return "RPK";
+    default:
+      return "NoSec";
+  }
+}
+
+/* Sets the PSK key for new DTLS sessions; libcoap keeps a copy */
+static bool
+set_psk_key (coap_context_t *ctx, const iot_data_t *key)
+{
+  /* use iterator just to get address of PSK key data */
+  iot_data_array_iter_t array_iter;
+  iot_data_array_iter (key, &array_iter);
+  iot_data_array_iter_next(&array_iter);
+
+  return coap_context_set_psk (ctx, "", (uint8_t *)iot_data_array_iter_value (&array_iter),
+                               iot_data_array_length (key));
+}
+
+void
+coap_server_reconfigure (coap_live_config *live)
+{
+  live->received_usec = now_usec ();
+  coap_live_config_free (__atomic_exchange_n (&pending_config, live, __ATOMIC_ACQ_REL));
+}
+
+/* Appends the name of a changed setting to a list for the log */
+static void
+add_change (char *list, size_t len, const char *name)
+{
+  size_t used = strlen (list);
+  snprintf (list + used, len - used, "%s%s", used ? ", " : "", name);
+}
+
+/*
+ * Applies new settings to the running server. Established sessions keep
+ * their state, except those on an endpoint that is closed. Takes ownership of
+ * the key and bind address from 'live' if they are applied.
+ */
+static void
+apply_config (coap_context_t *ctx, coap_live_config *live)
+{
+  coap_driver *driver = sdk_ctx;
+  char changes[128] = "";
+  bool reopen = strcmp (iot_data_string (live->coap_bind_addr), iot_data_string (driver->coap_bind_addr));
+
+  if (live->psk_key && !iot_data_equal (live->psk_key, driver->psk_key))
+  {
+    /* used for new handshakes only */
+    if (set_psk_key (ctx, live->psk_key))
+    {
+      iot_data_free (driver->psk_key);
+      driver->psk_key = live->psk_key;
+      live->psk_key = NULL;
+      add_change (changes, sizeof (changes), "PskKey");
+    }
+    else
+    {
+      iot_log_error (sdk_ctx->lc, "cannot set new PSK key; keeping previous key");
+    }
+  }
+
+  if (live->spin_budget_usec != driver->spin_budget_usec)
+  {
+    driver->spin_budget_usec = live->spin_budget_usec;
+    add_change (changes, sizeof (changes), "SpinBudgetUsec");
+  }
+
+  /* 0 means OS default, which applies only to a new socket */
+  if (live->socket_rcvbuf != driver->socket_rcvbuf)
+  {
+    driver->socket_rcvbuf = live->socket_rcvbuf;
+    if (!reopen && driver->socket_rcvbuf)
+    {
+      set_socket_buffer (server_fd, SO_RCVBUF, "SO_RCVBUF", driver->socket_rcvbuf);
+    }
+    add_change (changes, sizeof (changes), "SocketRecvBuffer");
+  }
+  if (live->socket_sndbuf != driver->socket_sndbuf)
+  {
+    driver->socket_sndbuf = live->socket_sndbuf;
+    if (!reopen && driver->socket_sndbuf)
+    {
+      set_socket_buffer (server_fd, SO_SNDBUF, "SO_SNDBUF", driver->socket_sndbuf);
+    }
+    add_change (changes, sizeof (changes), "SocketSendBuffer");
+  }
+
+  if (live->allowlist_len != driver->allowlist_len
+      || memcmp (live->allowlist, driver->allowlist, live->allowlist_len * sizeof (coap_filter_prefix)))
+  {
+    memcpy (driver->allowlist, live->allowlist, sizeof (driver->allowlist));
+    driver->allowlist_len = live->allowlist_len;
+    if (!reopen)
+    {
+      attach_filter ();
+    }
+    add_change (changes, sizeof (changes), "SourceAllowlist");
+  }
+
+  /* new endpoint is open before the old one closes, so no datagram is refused */
+  if (reopen && open_endpoint (ctx, iot_data_string (live->coap_bind_addr)))
+  {
+    iot_data_free (driver->coap_bind_addr);
+    driver->coap_bind_addr = live->coap_bind_addr;
+    live->coap_bind_addr = NULL;
+    add_change (changes, sizeof (changes), "CoapBindAddr");
+  }
+
+  if (changes[0])
+  {
+    iot_log_info (sdk_ctx->lc, "reconfigured %s in %lu usec", changes,
+                  (unsigned long)(now_usec () - live->received_usec));
+  }
+}
+
+/*
+ * Processes CoAP messages until quit. In low latency mode, polls without
+ * blocking for the spin budget after each request, so a request that follows
+ * closely does not pay for a wakeup from the blocked state. Applies new
+ * settings between requests, so handlers see a consistent configuration.
+ */
+static void
+run_loop (coap_context_t *ctx, coap_driver *driver)
+{
+  uint64_t spin_until = 0;
+  uint64_t last_requests = metrics.requests;
+
+  while (!quit)
+  {
+    if (driver->low_latency && now_usec () < spin_until)
+    {
+      coap_io_process (ctx, COAP_IO_NO_WAIT);
+    }
+    else
+    {
+      coap_io_process (ctx, RECONFIGURE_POLL_MSEC);
+    }
+
+    if (__atomic_load_n (&pending_config, __ATOMIC_RELAXED))
+    {
+      coap_live_config *live = __atomic_exchange_n (&pending_config, NULL, __ATOMIC_ACQ_REL);
+      apply_config (ctx, live);
+      coap_live_config_free (live);
+    }
+
+    if (driver->low_latency && metrics.requests != last_requests)
+    {
+      last_requests = metrics.requests;
+      spin_until = now_usec () + driver->spin_budget_usec;
+    }
+  }
+}
+
+/* Request decoded by each benchmark iteration */
+static coap_pdu_t *bench_request;
+
+static void
+bench_read_path (void)
+{
+  char path[ROUTE_PATH_MAX];
+  read_path (bench_request, path, sizeof (path));
+}
+
+static void
+bench_read_int32 (void)
+{
+  iot_data_free (read_data_int32 ((uint8_t *)"-1234567", 8));
+}
+
+static void
+bench_read_float64 (void)
+{
+  iot_data_free (read_data_float64 ((uint8_t *)"23.456789", 9));
+}
+
+static void
+bench_read_string (void)
+{
+  char buf[32];
+  iot_data_free (read_data_string ((uint8_t *)"{\"door\":\"open\"}", 15, buf));
+}
+
+void
+coap_server_bench (uint32_t samples, uint32_t iterations)
+{
+  static const struct
+  {
+    const char *name;
+    void (*step) (void);
+  } steps[] =
+  {
+    { "read_path", bench_read_path },
+    { "read_data_int32", bench_read_int32 },
+    { "read_data_float64", bench_read_float64 },
+    { "read_data_string", bench_read_string }
+  };
+
+  coap_startup ();
+  double *nsec = coap_alloc (samples * sizeof (double));
+  char *text = coap_alloc (METRICS_BUF_SIZE);
+  bench_request = coap_pdu_init (COAP_MESSAGE_CON, COAP_REQUEST_POST, 1, 256);
+  if (!nsec || !text || !bench_request)
+  {
+    fprintf (stderr, "memory not available\n");
+    goto finish;
+  }
+  coap_add_option (bench_request, COAP_OPTION_URI_PATH, 3, (const uint8_t *)RESOURCE_SEG1);
+  coap_add_option (bench_request, COAP_OPTION_URI_PATH, 2, (const uint8_t *)"d1");
+  coap_add_option (bench_request, COAP_OPTION_URI_PATH, 11, (const uint8_t *)"temperature");
+
+  for (unsigned i = 0; i < sizeof (steps) / sizeof (steps[0]); i++)
+  {
+    /* warm caches and branch predictors before the first sample */
+    for (uint32_t n = 0; n < iterations / 10; n++)
+    {
+      steps[i].step ();
+    }
+    for (uint32_t s = 0; s < samples; s++)
+    {
+      struct timespec start, end;
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      for (uint32_t n = 0; n < iterations; n++)
+      {
+        steps[i].step ();
+      }
+      clock_gettime (CLOCK_MONOTONIC, &end);
+      nsec[s] = ((end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec)) / iterations;
+    }
+    coap_metrics_buf buf = { .data = text, .size = METRICS_BUF_SIZE, .len = 0, .overflow = false };
+    coap_metrics_write_bench_json (steps[i].name, nsec, samples, &buf);
+    printf ("%s\n", text);
+  }
+
+ finish:
+  coap_delete_pdu (bench_request);
+  bench_request = NULL;
+  coap_free (text);
+  coap_free (nsec);
+  coap_cleanup ();
+}
+
+int
+run_server (coap_driver *driver)
+{
+  coap_context_t  *ctx = NULL;
+  coap_resource_t *resource = NULL;
+  int result = EXIT_FAILURE;
+  sdk_ctx = driver;
+  struct sigaction sa;
+
+  if (!coap_alloc_init (driver->allocator))
+  {
+    iot_log_error (sdk_ctx->lc, "cannot initialize allocator");
+    return EXIT_FAILURE;
+  }
+  coap_startup ();
+
+  /* Use EdgeX log level */
+  coap_log_t log_level;
+  switch (sdk_ctx->lc->level)
+  {
+    case IOT_LOG_ERROR:
+      log_level = LOG_ERR;
+      break;
+    case IOT_LOG_WARN:
+      log_level = LOG_WARNING;
+      break;
+    case IOT_LOG_DEBUG:
+      log_level = LOG_DEBUG;
+      break;
+    default:
+      log_level = LOG_INFO;
+  }
+  coap_set_log_level (log_level);
+  /* workaround for tinydtls log level mismatch to avoid excessive debug logging */
+  coap_tls_version_t *ver = coap_get_tls_library_version ();
+  if (ver->type == COAP_TLS_LIBRARY_TINYDTLS && log_level == LOG_INFO)
+  {
+    coap_dtls_set_log_level (log_level - 1);
+  }
+  else
+  {
+    coap_dtls_set_log_level (log_level);
+  }
+
+  /* setup libcoap for a server */
+  if (!(ctx = coap_new_context (NULL)))
+  {
+    iot_log_error (sdk_ctx->lc, "cannot initialize context");
+    goto finish;
+  }
+
+  if (driver->memory_budget)
+  {
+    size_t route_extra = (size_t)driver->history_size * (sizeof (int64_t) + sizeof (double));
+    if (driver->lastvalue_segment)
+    {
+      route_extra += sizeof (coap_lastvalue_slot);
+    }
+    /* a route may have a slot in the publish queue, for conflated readings */
+    uint64_t publish_bytes = 0;
+    if (driver->publish_queue)
+    {
+      route_extra += coap_publish_entry_size ();
+      publish_bytes = (uint64_t)driver->publish_queue * coap_publish_entry_size ();
+    }
+    if (!coap_budget_plan_init (driver->memory_budget, driver->deadletter_file != NULL,
+                                route_extra, publish_bytes, &budget_plan))
+    {
+      iot_log_error (sdk_ctx->lc, "memory budget must be at least %lu bytes",
+                     (unsigned long)(BUDGET_MIN + publish_bytes));
+      goto finish;
+    }
+    if (!(payload_pool = coap_pool_new (BUDGET_PAYLOAD_BUF_SIZE, budget_plan.payload_buffers)))
+    {
+      iot_log_error (sdk_ctx->lc, "cannot allocate payload buffers");
+      goto finish;
+    }
+    coap_context_set_max_idle_sessions (ctx, budget_plan.sessions);
+    coap_context_set_max_handshake_sessions (ctx, budget_plan.handshakes);
+    iot_log_info (sdk_ctx->lc, "memory budget %lu bytes; %u sessions, %u handshakes, %u payload buffers",
+                  (unsigned long)budget_plan.budget, budget_plan.sessions, budget_plan.handshakes,
+                  budget_plan.payload_buffers);
   }
 
-  if (driver->security_mode == SECURITY_MODE_PSK)
+  serve_routes = driver->observe || driver->history_size || driver->lastvalue_segment;
+  uint32_t max_routes = budget_plan.budget ? budget_plan.routes : driver->max_routes;
+  if (max_routes && !(routes = coap_route_table_new (max_routes, driver->history_size, release_device)))
   {
-    /* use iterator just to get address of PSK key data */
-    iot_data_array_iter_t array_iter;
-    iot_data_array_iter (driver->psk_key, &array_iter);
-    iot_data_array_iter_next(&array_iter);
+    iot_log_error (sdk_ctx->lc, "cannot allocate route table for %u routes", max_routes);
+    goto finish;
+  }
 
-    if (!(coap_context_set_psk (ctx, "", (uint8_t *)iot_data_array_iter_value (&array_iter),
-                                iot_data_array_length (driver->psk_key))))
+  if (driver->lastvalue_segment)
+  {
+    const char *name = iot_data_string (driver->lastvalue_segment);
+    const char *index = iot_data_string (driver->lastvalue_index);
+    uint32_t slots = budget_plan.budget ? budget_plan.routes : driver->lastvalue_slots;
+    if (!(last_values = coap_lastvalue_open (name, index, slots)))
     {
-      iot_log_error (sdk_ctx->lc, "cannot initialize PSK");
+      iot_log_error (sdk_ctx->lc, "cannot open last value segment %s: %s", name, strerror (errno));
       goto finish;
     }
+    iot_log_info (sdk_ctx->lc, "sharing last values in %s, indexed by %s", name, index);
   }
 
-  if (!(coap_new_endpoint (ctx, &bind_addr, proto)))
+  if (driver->deduplicate && !(dedup = coap_dedup_new (driver->dedup_devices)))
+  {
+    iot_log_error (sdk_ctx->lc, "cannot allocate sequence windows for %u devices", driver->dedup_devices);
+    goto finish;
+  }
+
+  if (driver->hot_counters && !(hot_keys = coap_hot_new (driver->hot_counters, driver->hot_window_sec)))
+  {
+    iot_log_error (sdk_ctx->lc, "cannot allocate %u counters for busiest keys", driver->hot_counters);
+    goto finish;
+  }
+
+  if (driver->publish_queue)
+  {
+    if (!(publisher = coap_publish_new (driver->service, release_payload, driver->publish_queue,
+                                        routes ? max_routes : 0,
+                                        driver->shed_target_usec, driver->shed_interval_usec,
+                                        driver->latency_target_usec, driver->publish_cpu)))
+    {
+      iot_log_error (sdk_ctx->lc, "cannot start publisher for %u readings", driver->publish_queue);
+      goto finish;
+    }
+    int err = coap_publish_pin_error (publisher);
+    if (err)
+    {
+      iot_log_warn (sdk_ctx->lc, "cannot pin publisher to CPU %d: %s", driver->publish_cpu, strerror (err));
+    }
+    iot_log_info (sdk_ctx->lc, "publishing from a queue of %u readings", driver->publish_queue);
+  }
+
+  if (driver->security_mode == SECURITY_MODE_PSK && !set_psk_key (ctx, driver->psk_key))
+  {
+    iot_log_error (sdk_ctx->lc, "cannot initialize PSK");
+    goto finish;
+  }
+
+  if (driver->security_mode == SECURITY_MODE_X509 || driver->security_mode == SECURITY_MODE_RPK)
+  {
+    if (coap_get_tls_library_version ()->type == COAP_TLS_LIBRARY_TINYDTLS)
+    {
+      iot_log_error (sdk_ctx->lc, "libcoap is built with tinydtls, which does not support "
+                     "certificates; use OpenSSL or GnuTLS for %s",
+                     security_mode_name (driver->security_mode));
+      goto finish;
+    }
+    if (!set_pki (ctx))
+    {
+      iot_log_error (sdk_ctx->lc, "cannot initialize certificates");
+      goto finish;
+    }
+    /* in RPK mode the check is as cheap as the cache */
+    if (driver->security_mode == SECURITY_MODE_X509 && driver->cert_cache_entries &&
+        !(cert_cache = coap_certcache_new (driver->cert_cache_entries, driver->cert_cache_sec)))
+    {
+      iot_log_error (sdk_ctx->lc, "cannot allocate %u entries for verified certificates",
+                     driver->cert_cache_entries);
+      goto finish;
+    }
+  }
+
+  if (!open_endpoint (ctx, iot_data_string (driver->coap_bind_addr)))
   {
-    iot_log_error (sdk_ctx->lc, "cannot initialize listen endpoint");
     goto finish;
   }
 
@@ -443,6 +2197,14 @@ run_server (coap_driver *driver)
   resource = coap_resource_unknown_init (&data_handler);
   /* ... so add POST handler also. */
   coap_register_handler (resource, COAP_REQUEST_POST, &data_handler);
+  if (serve_routes && routes)
+  {
+    coap_register_handler (resource, COAP_REQUEST_GET, &unknown_get_handler);
+  }
+  coap_add_resource (ctx, resource);
+
+  resource = coap_resource_init (coap_make_str_const (METRICS_RESOURCE_PATH), 0);
+  coap_register_handler (resource, COAP_REQUEST_GET, &stats_handler);
   coap_add_resource (ctx, resource);
 
   /* setup signal handling for input loop */
@@ -452,20 +2214,87 @@ run_server (coap_driver *driver)
   sigaction (SIGINT, &sa, NULL);
   sigaction (SIGTERM, &sa, NULL);
 
-  iot_log_info (sdk_ctx->lc, "CoAP %s server started on %s", driver->psk_key ? "PSK" : "NoSec",
+  iot_log_info (sdk_ctx->lc, "CoAP %s server started on %s", security_mode_name (driver->security_mode),
                 iot_data_string (driver->coap_bind_addr));
 
-  while (!quit)
+  if (driver->deadletter_file)
+  {
+    const char *path = iot_data_string (driver->deadletter_file);
+    uint32_t records = budget_plan.budget ? budget_plan.deadletter_records : driver->deadletter_records;
+    if (!(dead_letters = coap_deadletter_open (path, records)))
+    {
+      iot_log_error (sdk_ctx->lc, "cannot open dead letter file %s: %s", path, strerror (errno));
+      goto finish;
+    }
+    iot_log_info (sdk_ctx->lc, "recording rejected requests to %s", path);
+  }
+
+  if (driver->capture_file)
   {
-    coap_io_process (ctx, COAP_IO_WAIT);
+    const char *path = iot_data_string (driver->capture_file);
+    if (!(captures = coap_capture_open (path, driver->capture_records, driver->capture_sample,
+                                        driver->capture_seconds)))
+    {
+      iot_log_error (sdk_ctx->lc, "cannot open capture file %s: %s", path, strerror (errno));
+      goto finish;
+    }
+    resource = coap_resource_init (coap_make_str_const (CAPTURE_RESOURCE_PATH), 0);
+    coap_register_handler (resource, COAP_REQUEST_GET, &capture_handler);
+    coap_register_handler (resource, COAP_REQUEST_POST, &capture_handler);
+    coap_register_handler (resource, COAP_REQUEST_DELETE, &capture_handler);
+    coap_add_resource (ctx, resource);
+    sa.sa_handler = handle_capture_sig;
+    sigaction (SIGUSR1, &sa, NULL);
+    iot_log_info (sdk_ctx->lc, "capture armed in %s; start with SIGUSR1 or POST /%s", path,
+                  CAPTURE_RESOURCE_PATH);
+  }
+
+  if (driver->low_latency)
+  {
+    setup_low_latency (driver);
   }
+  run_loop (ctx, driver);
 
   result = EXIT_SUCCESS;
 
  finish:
+  /* posts the readings still queued */
+  coap_publish_free (publisher);
+  publisher = NULL;
+  coap_filter_detach (packet_filter);
+  packet_filter = NULL;
+  server_endpoint = NULL;
+  server_fd = -1;
+  coap_deadletter_close (dead_letters);
+  dead_letters = NULL;
+  if (captures)
+  {
+    signal (SIGUSR1, SIG_IGN);
+  }
+  coap_capture_close (captures);
+  captures = NULL;
+  coap_pool_free (payload_pool);
+  payload_pool = NULL;
+  memset (&budget_plan, 0, sizeof (budget_plan));
 
+  /* frees route resources before their routes */
   coap_free_context (ctx);
+  coap_route_table_free (routes);
+  routes = NULL;
+  coap_lastvalue_close (last_values);
+  last_values = NULL;
+  coap_dedup_free (dedup);
+  dedup = NULL;
+  coap_hot_free (hot_keys);
+  hot_keys = NULL;
+  coap_certcache_free (cert_cache);
+  cert_cache = NULL;
+  coap_free (stats_text);
+  stats_text = NULL;
+  stats_len = 0;
+  coap_live_config_free (__atomic_exchange_n (&pending_config, NULL, __ATOMIC_ACQ_REL));
   coap_cleanup ();
+  coap_alloc_fini ();
 
   return result;
 }
@@ -7,18 +7,91 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <errno.h>
+#include <limits.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <strings.h>
 
 #include "devsdk/devsdk.h"
 #include "device-coap.h"
+#include "coap-deadletter.h"
+#include "coap-capture.h"
+#include "coap-certcache.h"
+#include "coap-lastvalue.h"
+#include "coap-rules.h"
+#include "coap-expr.h"
 
 #define ERR_CHECK(x) if (x.code) { fprintf (stderr, "Error: %d: %s\n", x.code, x.reason); devsdk_service_free (service); free (impl); return x.code; }
 
 #define COAP_BIND_ADDR_KEY "CoapBindAddr"
 #define SECURITY_MODE_KEY  "SecurityMode"
 #define PSK_KEY_KEY        "PskKey"
+#define CERT_FILE_KEY      "CertFile"
+#define KEY_FILE_KEY       "KeyFile"
+#define CA_FILE_KEY        "CaFile"
+#define TRUSTED_KEYS_KEY   "TrustedKeys"
+#define CERT_CACHE_KEY     "CertCacheEntries"
+#define CERT_CACHE_SEC_KEY "CertCacheSec"
+#define SOCKET_RCVBUF_KEY  "SocketRecvBuffer"
+#define SOCKET_SNDBUF_KEY  "SocketSendBuffer"
+#define LOW_LATENCY_KEY    "LowLatency"
+#define BUSY_POLL_KEY      "BusyPollUsec"
+#define SPIN_BUDGET_KEY    "SpinBudgetUsec"
+#define IO_CPU_KEY         "IoCpu"
+#define LOCK_MEMORY_KEY    "LockMemory"
+#define DEADLETTER_FILE_KEY    "DeadLetterFile"
+#define DEADLETTER_RECORDS_KEY "DeadLetterRecords"
+#define MEMORY_BUDGET_KEY      "MemoryBudget"
+#define ALLOCATOR_KEY          "Allocator"
+#define PACKET_FILTER_KEY      "PacketFilter"
+#define SOURCE_ALLOWLIST_KEY   "SourceAllowlist"
+#define OBSERVE_KEY            "Observe"
+#define MAX_ROUTES_KEY         "MaxRoutes"
+#define HISTORY_SIZE_KEY       "HistorySize"
+#define LASTVALUE_SEGMENT_KEY  "LastValueSegment"
+#define LASTVALUE_INDEX_KEY    "LastValueIndex"
+#define LASTVALUE_SLOTS_KEY    "LastValueSlots"
+#define DEDUPLICATE_KEY        "Deduplicate"
+#define DEDUP_DEVICES_KEY      "DedupDevices"
+#define QUEUED_WRITES_KEY      "QueuedWrites"
+#define PUBLISH_QUEUE_KEY      "PublishQueue"
+#define SHED_TARGET_KEY        "ShedTargetUsec"
+#define SHED_INTERVAL_KEY      "ShedIntervalUsec"
+#define LATENCY_TARGET_KEY     "PublishLatencyTargetUsec"
+#define PUBLISH_CPU_KEY        "PublishCpu"
+#define HOT_COUNTERS_KEY       "HotCounters"
+#define HOT_WINDOW_KEY         "HotWindowSec"
+#define CAPTURE_FILE_KEY       "CaptureFile"
+#define CAPTURE_RECORDS_KEY    "CaptureRecords"
+#define CAPTURE_SAMPLE_KEY     "CaptureSample"
+#define CAPTURE_SECONDS_KEY    "CaptureSeconds"
+
+#define DEFAULT_BUSY_POLL_USEC   50
+#define DEFAULT_SPIN_BUDGET_USEC 1000
+#define DEFAULT_DEADLETTER_RECORDS 1024
+#define DEFAULT_MAX_ROUTES 1024
+#define DEFAULT_LASTVALUE_SLOTS 1024
+#define DEFAULT_DEDUP_DEVICES 1024
+#define DEFAULT_SHED_TARGET_USEC 5000
+#define DEFAULT_SHED_INTERVAL_USEC 100000
+#define DEFAULT_LATENCY_TARGET_USEC 20000
+#define DEFAULT_HOT_COUNTERS 64
+#define DEFAULT_HOT_WINDOW_SEC 10
+#define DEFAULT_CAPTURE_RECORDS 4096
+#define DEFAULT_CAPTURE_SAMPLE 1
+#define DEFAULT_CAPTURE_SECONDS 60
+#define DEFAULT_REPLAY_PORT "5683"
+#define DEFAULT_CERT_CACHE_ENTRIES 1024
+#define DEFAULT_CERT_CACHE_SEC 3600
+#define BENCH_EXPR_ITERATIONS 10000000
+#define BENCH_SAMPLES 20
+#define BENCH_DECODE_ITERATIONS 100000
+#define BENCH_ALLOC_ITERATIONS 200000
+#define BENCH_ALLOC_THREADS 4
+#define BENCH_DEFAULT_EXPR "v * 1.8 + 32"
 #define NOT_SUPPORTED_TEXT "Request not supported; CoAP devices are push-only"
+#define WRITE_QUEUE_FULL_TEXT "Write not queued; queue for device is full"
 
 
 /* Looks up security mode enum value from configuration text value */
@@ -36,12 +109,257 @@ static coap_security_mode_t find_security_mode
   {
     return SECURITY_MODE_NOSEC;
   }
+  else if (!strcmp (mode_text, "X509"))
+  {
+    return SECURITY_MODE_X509;
+  }
+  else if (!strcmp (mode_text, "RPK"))
+  {
+    return SECURITY_MODE_RPK;
+  }
   else
   {
     return SECURITY_MODE_UNKNOWN;
   }
 }
 
+/*
+ * Reads an unsigned integer config value. An absent or empty value yields the
+ * provided default.
+ *
+ * @return false if value is not a valid unsigned integer
+ */
+static bool read_uint_config
+(
+  iot_logger_t *lc,
+  const iot_data_t *config,
+  const char *key,
+  uint32_t def,
+  uint32_t *value
+)
+{
+  const char *text = iot_data_string_map_get_string (config, key);
+  *value = def;
+  if (!text || !strlen (text))
+  {
+    return true;
+  }
+
+  char *endptr;
+  errno = 0;
+  unsigned long val = strtoul (text, &endptr, 10);
+  if (errno || (*endptr != '\0') || (val > UINT32_MAX) || strchr (text, '-'))
+  {
+    iot_log_error (lc, "Invalid value for %s: %s", key, text);
+    return false;
+  }
+  *value = (uint32_t) val;
+  return true;
+}
+
+/*
+ * Reads a byte size config value, with an optional K, M or G suffix for
+ * powers of 1024. An absent or empty value yields 0.
+ *
+ * @return false if value is not a valid size
+ */
+static bool read_size_config
+(
+  iot_logger_t *lc,
+  const iot_data_t *config,
+  const char *key,
+  uint64_t *value
+)
+{
+  const char *text = iot_data_string_map_get_string (config, key);
+  *value = 0;
+  if (!text || !strlen (text))
+  {
+    return true;
+  }
+
+  char *endptr;
+  errno = 0;
+  unsigned long long val = strtoull (text, &endptr, 10);
+  unsigned shift = 0;
+  switch (*endptr)
+  {
+    case 'K': case 'k': shift = 10; endptr++; break;
+    case 'M': case 'm': shift = 20; endptr++; break;
+    case 'G': case 'g': shift = 30; endptr++; break;
+    default: break;
+  }
+  if (errno || (endptr == text) || (*endptr != '\0') || strchr (text, '-') || (val > (UINT64_MAX >> shift)))
+  {
+    iot_log_error (lc, "Invalid value for %s: %s", key, text);
+    return false;
+  }
+  *value = (uint64_t) val << shift;
+  return true;
+}
+
+/*
+ * Reads a boolean config value, 'true' or 'false'. An absent or empty value
+ * yields false.
+ *
+ * @return false if value is not a valid boolean
+ */
+static bool read_bool_config
+(
+  iot_logger_t *lc,
+  const iot_data_t *config,
+  const char *key,
+  bool *value
+)
+{
+  const char *text = iot_data_string_map_get_string (config, key);
+  *value = false;
+  if (!text || !strlen (text) || !strcasecmp (text, "false"))
+  {
+    return true;
+  }
+  if (!strcasecmp (text, "true"))
+  {
+    *value = true;
+    return true;
+  }
+  iot_log_error (lc, "Invalid value for %s: %s", key, text);
+  return false;
+}
+
+/* Reads PSK key, as a uint8_t array; NULL if not in configuration */
+static iot_data_t *read_psk_key (iot_logger_t *lc, const iot_data_t *config)
+{
+  const char *conf_psk_key = iot_data_string_map_get_string (config, PSK_KEY_KEY);
+  if (!conf_psk_key || !strlen (conf_psk_key))
+  {
+    iot_log_error (lc, "PSK key not in configuration");
+    return NULL;
+  }
+  iot_data_t *key_array = iot_data_alloc_array_from_base64 (conf_psk_key);
+  iot_log_info (lc, "PSK key len %u", iot_data_array_length (key_array));
+  return key_array;
+}
+
+/* Reads a file name config value; NULL if absent or empty */
+static iot_data_t *read_file_config (const iot_data_t *config, const char *key)
+{
+  const char *text = iot_data_string_map_get_string (config, key);
+  return (text && strlen (text)) ? iot_data_alloc_string (text, IOT_DATA_COPY) : NULL;
+}
+
+static int compare_key_digests (const void *a, const void *b)
+{
+  return memcmp (a, b, CERT_DIGEST_LEN);
+}
+
+/*
+ * Reads the trusted client keys for RPK mode: a comma separated list of base64
+ * SHA-256 digests of DER encoded public keys. Sorts the digests for lookup.
+ *
+ * @return false if a digest is not valid
+ */
+static bool read_trusted_keys (iot_logger_t *lc, const iot_data_t *config, coap_driver *driver)
+{
+  const char *text = iot_data_string_map_get_string (config, TRUSTED_KEYS_KEY);
+  if (!text || !strlen (text))
+  {
+    iot_log_error (lc, "%s must list at least one key for RPK", TRUSTED_KEYS_KEY);
+    return false;
+  }
+
+  char *copy = strdup (text);
+  char *save = NULL;
+  bool ok = true;
+  size_t capacity = strlen (text) / 44 + 1;   /* 44 bytes of base64 per digest */
+  driver->trusted_keys = malloc (capacity * CERT_DIGEST_LEN);
+  driver->trusted_key_count = 0;
+  for (char *tok = strtok_r (copy, ",", &save); tok; tok = strtok_r (NULL, ",", &save))
+  {
+    /* trim surrounding space */
+    while (*tok == ' ')
+    {
+      tok++;
+    }
+    char *end = tok + strlen (tok);
+    while (end > tok && end[-1] == ' ')
+    {
+      *--end = '\0';
+    }
+    if (!*tok)
+    {
+      continue;
+    }
+    iot_data_t *digest = iot_data_alloc_array_from_base64 (tok);
+    if (!digest || iot_data_array_length (digest) != CERT_DIGEST_LEN ||
+        driver->trusted_key_count == capacity)
+    {
+      iot_log_error (lc, "Invalid key digest in %s: %s", TRUSTED_KEYS_KEY, tok);
+      iot_data_free (digest);
+      ok = false;
+      break;
+    }
+    /* use iterator just to get address of digest data */
+    iot_data_array_iter_t array_iter;
+    iot_data_array_iter (digest, &array_iter);
+    iot_data_array_iter_next (&array_iter);
+    memcpy (driver->trusted_keys + driver->trusted_key_count * CERT_DIGEST_LEN,
+            iot_data_array_iter_value (&array_iter), CERT_DIGEST_LEN);
+    driver->trusted_key_count++;
+    iot_data_free (digest);
+  }
+  free (copy);
+  if (ok && driver->trusted_key_count == 0)
+  {
+    iot_log_error (lc, "%s must list at least one key for RPK", TRUSTED_KEYS_KEY);
+    ok = false;
+  }
+  if (ok)
+  {
+    qsort (driver->trusted_keys, driver->trusted_key_count, CERT_DIGEST_LEN, compare_key_digests);
+  }
+  return ok;
+}
+
+/* Reads the certificate settings for X509 and RPK modes */
+static bool read_pki_config (iot_logger_t *lc, const iot_data_t *config, coap_driver *driver)
+{
+  driver->cert_file = read_file_config (config, CERT_FILE_KEY);
+  driver->key_file = read_file_config (config, KEY_FILE_KEY);
+  if (!driver->cert_file || !driver->key_file)
+  {
+    iot_log_error (lc, "%s and %s must name the server certificate and key", CERT_FILE_KEY,
+                   KEY_FILE_KEY);
+    return false;
+  }
+  if (driver->security_mode == SECURITY_MODE_X509)
+  {
+    if (!(driver->ca_file = read_file_config (config, CA_FILE_KEY)))
+    {
+      iot_log_error (lc, "%s must name the CA certificates for X509", CA_FILE_KEY);
+      return false;
+    }
+  }
+  else if (!read_trusted_keys (lc, config, driver))
+  {
+    return false;
+  }
+
+  if (!read_uint_config (lc, config, CERT_CACHE_KEY, DEFAULT_CERT_CACHE_ENTRIES,
+                         &driver->cert_cache_entries) ||
+      !read_uint_config (lc, config, CERT_CACHE_SEC_KEY, DEFAULT_CERT_CACHE_SEC,
+                         &driver->cert_cache_sec))
+  {
+    return false;
+  }
+  if (driver->cert_cache_entries && driver->cert_cache_sec == 0)
+  {
+    iot_log_error (lc, "%s must be greater than 0", CERT_CACHE_SEC_KEY);
+    return false;
+  }
+  return true;
+}
+
 /* Init callback; reads in config values to device driver */
 static bool coap_init
 (
@@ -62,22 +380,19 @@ static bool coap_init
       return false;
 
     case SECURITY_MODE_PSK:
-    {
-      const char *conf_psk_key = iot_data_string_map_get_string (config, PSK_KEY_KEY);
-      if (strlen (conf_psk_key))
+      if (!(driver->psk_key = read_psk_key (lc, config)))
       {
-        iot_data_t *key_array = iot_data_alloc_array_from_base64 (conf_psk_key);
-        driver->psk_key = key_array;
-        iot_log_info (lc, "PSK key len %u", iot_data_array_length (key_array));
+        return false;
       }
-      else
+      break;
+    case SECURITY_MODE_X509:
+    case SECURITY_MODE_RPK:
+      driver->psk_key = NULL;
+      if (!read_pki_config (lc, config, driver))
       {
-        iot_log_error (lc, "PSK key not in configuration");
-        driver->psk_key = NULL;
         return false;
       }
       break;
-    }
     default:
       driver->psk_key = NULL;
   }
@@ -95,10 +410,249 @@ static bool coap_init
     return false;
   }
 
+  if (!read_uint_config (lc, config, SOCKET_RCVBUF_KEY, 0, &driver->socket_rcvbuf) ||
+      !read_uint_config (lc, config, SOCKET_SNDBUF_KEY, 0, &driver->socket_sndbuf))
+  {
+    return false;
+  }
+
+  /* Low latency mode; IoCpu is empty when not pinned */
+  uint32_t io_cpu;
+  if (!read_bool_config (lc, config, LOW_LATENCY_KEY, &driver->low_latency) ||
+      !read_uint_config (lc, config, BUSY_POLL_KEY, DEFAULT_BUSY_POLL_USEC, &driver->busy_poll_usec) ||
+      !read_uint_config (lc, config, SPIN_BUDGET_KEY, DEFAULT_SPIN_BUDGET_USEC, &driver->spin_budget_usec) ||
+      !read_uint_config (lc, config, IO_CPU_KEY, UINT32_MAX, &io_cpu) ||
+      !read_bool_config (lc, config, LOCK_MEMORY_KEY, &driver->lock_memory))
+  {
+    return false;
+  }
+  driver->io_cpu = (io_cpu == UINT32_MAX) ? -1 : (int)io_cpu;
+
+  /* Dead letter ring is enabled by file name */
+  const char *deadletter_file = iot_data_string_map_get_string (config, DEADLETTER_FILE_KEY);
+  if (deadletter_file && strlen (deadletter_file))
+  {
+    driver->deadletter_file = iot_data_alloc_string (deadletter_file, IOT_DATA_COPY);
+  }
+  if (!read_uint_config (lc, config, DEADLETTER_RECORDS_KEY, DEFAULT_DEADLETTER_RECORDS,
+                         &driver->deadletter_records))
+  {
+    return false;
+  }
+  if (driver->deadletter_records == 0)
+  {
+    iot_log_error (lc, "%s must be greater than 0", DEADLETTER_RECORDS_KEY);
+    return false;
+  }
+
+  if (!read_size_config (lc, config, MEMORY_BUDGET_KEY, &driver->memory_budget))
+  {
+    return false;
+  }
+
+  const char *allocator = iot_data_string_map_get_string (config, ALLOCATOR_KEY);
+  driver->allocator = coap_alloc_find_backend ((allocator && strlen (allocator)) ? allocator : "libc");
+  if (driver->allocator == ALLOC_BACKEND_UNKNOWN)
+  {
+    iot_log_error (lc, "Unknown allocator %s", allocator);
+    return false;
+  }
+
+  if (!read_bool_config (lc, config, PACKET_FILTER_KEY, &driver->packet_filter))
+  {
+    return false;
+  }
+  const char *allowlist = iot_data_string_map_get_string (config, SOURCE_ALLOWLIST_KEY);
+  if (allowlist && !coap_filter_parse_allowlist (allowlist, driver->allowlist, &driver->allowlist_len))
+  {
+    iot_log_error (lc, "Invalid %s; expecting up to %u address prefixes, like 10.0.0.0/8",
+                   SOURCE_ALLOWLIST_KEY, FILTER_ALLOWLIST_MAX);
+    return false;
+  }
+  if (driver->allowlist_len && !driver->packet_filter)
+  {
+    iot_log_warn (lc, "%s ignored; requires %s", SOURCE_ALLOWLIST_KEY, PACKET_FILTER_KEY);
+  }
+
+  if (!read_bool_config (lc, config, OBSERVE_KEY, &driver->observe) ||
+      !read_uint_config (lc, config, MAX_ROUTES_KEY, DEFAULT_MAX_ROUTES, &driver->max_routes) ||
+      !read_uint_config (lc, config, HISTORY_SIZE_KEY, 0, &driver->history_size))
+  {
+    return false;
+  }
+  if (driver->max_routes == 0)
+  {
+    iot_log_error (lc, "%s must be greater than 0", MAX_ROUTES_KEY);
+    return false;
+  }
+
+  /* Last value segment is enabled by name; index defaults to alongside it */
+  const char *segment = iot_data_string_map_get_string (config, LASTVALUE_SEGMENT_KEY);
+  if (segment && strlen (segment))
+  {
+    const char *index = iot_data_string_map_get_string (config, LASTVALUE_INDEX_KEY);
+    char default_index[PATH_MAX];
+    if (!index || !strlen (index))
+    {
+      if (!coap_lastvalue_default_index (segment, default_index, sizeof (default_index)))
+      {
+        iot_log_error (lc, "%s too long", LASTVALUE_SEGMENT_KEY);
+        return false;
+      }
+      index = default_index;
+    }
+    driver->lastvalue_segment = iot_data_alloc_string (segment, IOT_DATA_COPY);
+    driver->lastvalue_index = iot_data_alloc_string (index, IOT_DATA_COPY);
+  }
+  if (!read_uint_config (lc, config, LASTVALUE_SLOTS_KEY, DEFAULT_LASTVALUE_SLOTS,
+                         &driver->lastvalue_slots))
+  {
+    return false;
+  }
+  if (driver->lastvalue_slots == 0)
+  {
+    iot_log_error (lc, "%s must be greater than 0", LASTVALUE_SLOTS_KEY);
+    return false;
+  }
+
+  if (!read_bool_config (lc, config, DEDUPLICATE_KEY, &driver->deduplicate))
+  {
+    return false;
+  }
+  if (!read_uint_config (lc, config, DEDUP_DEVICES_KEY, DEFAULT_DEDUP_DEVICES, &driver->dedup_devices))
+  {
+    return false;
+  }
+  if (driver->dedup_devices == 0)
+  {
+    iot_log_error (lc, "%s must be greater than 0", DEDUP_DEVICES_KEY);
+    return false;
+  }
+
+  if (!read_uint_config (lc, config, QUEUED_WRITES_KEY, 0, &driver->queued_writes))
+  {
+    return false;
+  }
+  /* created here, since a write may arrive before the server starts */
+  if (driver->queued_writes && !(driver->writes = coap_actuation_new (driver->queued_writes)))
+  {
+    iot_log_error (lc, "cannot allocate write queue");
+    return false;
+  }
+
+  /* PublishCpu is empty when not pinned */
+  uint32_t publish_cpu;
+  if (!read_uint_config (lc, config, PUBLISH_QUEUE_KEY, 0, &driver->publish_queue) ||
+      !read_uint_config (lc, config, SHED_TARGET_KEY, DEFAULT_SHED_TARGET_USEC, &driver->shed_target_usec) ||
+      !read_uint_config (lc, config, SHED_INTERVAL_KEY, DEFAULT_SHED_INTERVAL_USEC, &driver->shed_interval_usec) ||
+      !read_uint_config (lc, config, LATENCY_TARGET_KEY, DEFAULT_LATENCY_TARGET_USEC,
+                         &driver->latency_target_usec) ||
+      !read_uint_config (lc, config, PUBLISH_CPU_KEY, UINT32_MAX, &publish_cpu))
+  {
+    return false;
+  }
+  driver->publish_cpu = (publish_cpu == UINT32_MAX) ? -1 : (int)publish_cpu;
+  if (driver->shed_target_usec && driver->shed_interval_usec == 0)
+  {
+    iot_log_error (lc, "%s must be greater than 0", SHED_INTERVAL_KEY);
+    return false;
+  }
+
+  if (!read_uint_config (lc, config, HOT_COUNTERS_KEY, DEFAULT_HOT_COUNTERS, &driver->hot_counters) ||
+      !read_uint_config (lc, config, HOT_WINDOW_KEY, DEFAULT_HOT_WINDOW_SEC, &driver->hot_window_sec))
+  {
+    return false;
+  }
+  if (driver->hot_counters && driver->hot_window_sec == 0)
+  {
+    iot_log_error (lc, "%s must be greater than 0", HOT_WINDOW_KEY);
+    return false;
+  }
+
+  /* Capture ring is enabled by file name */
+  const char *capture_file = iot_data_string_map_get_string (config, CAPTURE_FILE_KEY);
+  if (capture_file && strlen (capture_file))
+  {
+    driver->capture_file = iot_data_alloc_string (capture_file, IOT_DATA_COPY);
+  }
+  if (!read_uint_config (lc, config, CAPTURE_RECORDS_KEY, DEFAULT_CAPTURE_RECORDS,
+                         &driver->capture_records) ||
+      !read_uint_config (lc, config, CAPTURE_SAMPLE_KEY, DEFAULT_CAPTURE_SAMPLE,
+                         &driver->capture_sample) ||
+      !read_uint_config (lc, config, CAPTURE_SECONDS_KEY, DEFAULT_CAPTURE_SECONDS,
+                         &driver->capture_seconds))
+  {
+    return false;
+  }
+  if (driver->capture_records == 0 || driver->capture_sample == 0 || driver->capture_seconds == 0)
+  {
+    iot_log_error (lc, "%s, %s and %s must be greater than 0", CAPTURE_RECORDS_KEY,
+                   CAPTURE_SAMPLE_KEY, CAPTURE_SECONDS_KEY);
+    return false;
+  }
+
   iot_log_debug (lc, "Init complete");
   return true;
 }
 
+void coap_live_config_free (coap_live_config *live)
+{
+  if (live)
+  {
+    iot_data_free (live->coap_bind_addr);
+    iot_data_free (live->psk_key);
+    free (live);
+  }
+}
+
+/*
+ * Reconfiguration callback; passes the settings that may change to the
+ * running server. Other settings take effect on restart.
+ */
+static void coap_reconfigure (void *impl, const iot_data_t *config)
+{
+  coap_driver *driver = (coap_driver *) impl;
+  iot_logger_t *lc = driver->lc;
+  coap_live_config *live = calloc (1, sizeof (*live));
+  if (!live)
+  {
+    iot_log_error (lc, "cannot allocate new configuration");
+    return;
+  }
+
+  /* security mode itself does not change, so neither does the key's presence */
+  if (driver->security_mode == SECURITY_MODE_PSK && !(live->psk_key = read_psk_key (lc, config)))
+  {
+    goto fail;
+  }
+  const char *bind_addr = iot_data_string_map_get_string (config, COAP_BIND_ADDR_KEY);
+  if (!bind_addr)
+  {
+    iot_log_error (lc, "CoAP bind address not in configuration");
+    goto fail;
+  }
+  live->coap_bind_addr = iot_data_alloc_string (bind_addr, IOT_DATA_COPY);
+  if (!read_uint_config (lc, config, SOCKET_RCVBUF_KEY, 0, &live->socket_rcvbuf) ||
+      !read_uint_config (lc, config, SOCKET_SNDBUF_KEY, 0, &live->socket_sndbuf) ||
+      !read_uint_config (lc, config, SPIN_BUDGET_KEY, DEFAULT_SPIN_BUDGET_USEC, &live->spin_budget_usec))
+  {
+    goto fail;
+  }
+  const char *allowlist = iot_data_string_map_get_string (config, SOURCE_ALLOWLIST_KEY);
+  if (allowlist && !coap_filter_parse_allowlist (allowlist, live->allowlist, &live->allowlist_len))
+  {
+    iot_log_error (lc, "Invalid %s", SOURCE_ALLOWLIST_KEY);
+    goto fail;
+  }
+
+  coap_server_reconfigure (live);
+  return;
+
+ fail:
+  iot_log_error (lc, "new configuration not applied");
+  coap_live_config_free (live);
+}
+
 static bool coap_get_handler
 (
   void *impl,
@@ -132,15 +686,27 @@ static bool coap_put_handler
   iot_data_t **exception
 )
 {
-  (void) impl;
-  (void) device;
-  (void) nvalues;
-  (void) requests;
-  (void) values;
   (void) options;
+  coap_driver *driver = (coap_driver *) impl;
 
-  *exception = iot_data_alloc_string (NOT_SUPPORTED_TEXT, IOT_DATA_REF);
-  return false;
+  if (!driver->writes)
+  {
+    *exception = iot_data_alloc_string (NOT_SUPPORTED_TEXT, IOT_DATA_REF);
+    return false;
+  }
+
+  /* device is not reachable now; deliver on its next POST */
+  for (uint32_t i = 0; i < nvalues; i++)
+  {
+    if (!coap_actuation_queue (driver->writes, device->name, requests[i].resource->name, values[i]))
+    {
+      iot_log_warn (driver->lc, "cannot queue write to %s/%s", device->name, requests[i].resource->name);
+      *exception = iot_data_alloc_string (WRITE_QUEUE_FULL_TEXT, IOT_DATA_REF);
+      return false;
+    }
+  }
+  iot_log_debug (driver->lc, "queued %u writes to %s", nvalues, device->name);
+  return true;
 }
 
 static void coap_stop (void *impl, bool force) {}
@@ -154,13 +720,117 @@ static void coap_free_address (void *impl, devsdk_address_t address)
 {
 }
 
+/* Compiles filter and transform rules once, when the profile is loaded */
 static devsdk_resource_attr_t coap_create_resource_attr (void *impl, const iot_data_t *attributes, iot_data_t **exception)
 {
-  return (devsdk_resource_attr_t)attributes;
+  return (devsdk_resource_attr_t)coap_rules_new (attributes, exception);
 }
 
 static void coap_free_resource_attr (void *impl, devsdk_resource_attr_t attr)
 {
+  coap_rules_free ((coap_rules *)attr);
+}
+
+/* Metadata cached by the server may be stale after a device changes */
+static void coap_device_updated (void *impl, const char *devname, const devsdk_protocols *protocols, bool adminEnabled)
+{
+  coap_server_metadata_changed ();
+}
+
+static void coap_device_removed (void *impl, const char *devname, const devsdk_protocols *protocols)
+{
+  coap_server_metadata_changed ();
+}
+
+/* Prints the cost to evaluate an expression, as for each reading */
+static int bench_expr (const char *text)
+{
+  char error[96];
+  coap_expr *expr = coap_expr_compile (text, error, sizeof (error));
+  if (!expr)
+  {
+    fprintf (stderr, "%s\n", error);
+    return EXIT_FAILURE;
+  }
+  coap_expr_bench (expr, BENCH_EXPR_ITERATIONS / 10);
+  printf ("%.1f ns per evaluation\n", coap_expr_bench (expr, BENCH_EXPR_ITERATIONS));
+  coap_expr_free (expr);
+  return 0;
+}
+
+/* Replays the requests in a capture file against a server */
+static int replay_capture (int argc, char *argv[], int n)
+{
+  const char *port = (n + 3 < argc) ? argv[n + 3] : DEFAULT_REPLAY_PORT;
+  double speed = 1.0;
+  if (n + 4 < argc)
+  {
+    char *end;
+    errno = 0;
+    speed = strtod (argv[n + 4], &end);
+    if (errno || *end || speed < 0)
+    {
+      fprintf (stderr, "invalid speed: %s\n", argv[n + 4]);
+      return EXIT_FAILURE;
+    }
+  }
+  return coap_capture_replay (argv[n + 1], argv[n + 2], port, speed) ? EXIT_FAILURE : 0;
+}
+
+/*
+ * Prints samples of each microbenchmark as a JSON line, for comparison with a
+ * baseline by scripts/bench_compare.sh.
+ */
+static int bench_json (const char *text)
+{
+  char error[96];
+  coap_expr *expr = coap_expr_compile (text, error, sizeof (error));
+  if (!expr)
+  {
+    fprintf (stderr, "%s\n", error);
+    return EXIT_FAILURE;
+  }
+  double nsec[BENCH_SAMPLES];
+  coap_expr_bench (expr, BENCH_EXPR_ITERATIONS / 10);
+  for (unsigned s = 0; s < BENCH_SAMPLES; s++)
+  {
+    nsec[s] = coap_expr_bench (expr, BENCH_EXPR_ITERATIONS / BENCH_SAMPLES);
+  }
+  coap_expr_free (expr);
+
+  char json[1024];
+  coap_metrics_buf buf = { .data = json, .size = sizeof (json), .len = 0, .overflow = false };
+  coap_metrics_write_bench_json ("expr", nsec, BENCH_SAMPLES, &buf);
+  printf ("%s\n", json);
+
+  /* each allocator backend, under several workers at once */
+  static const char *backends[] = { "libc", "tcache", "slab" };
+  for (unsigned i = 0; i < sizeof (backends) / sizeof (backends[0]); i++)
+  {
+    if (!coap_alloc_init (coap_alloc_find_backend (backends[i])))
+    {
+      fprintf (stderr, "cannot initialize allocator %s\n", backends[i]);
+      return EXIT_FAILURE;
+    }
+    coap_alloc_bench (BENCH_ALLOC_THREADS, BENCH_ALLOC_ITERATIONS / 10);
+    for (unsigned s = 0; s < BENCH_SAMPLES; s++)
+    {
+      if ((nsec[s] = coap_alloc_bench (BENCH_ALLOC_THREADS, BENCH_ALLOC_ITERATIONS)) < 0)
+      {
+        fprintf (stderr, "cannot start benchmark threads\n");
+        coap_alloc_fini ();
+        return EXIT_FAILURE;
+      }
+    }
+    coap_alloc_fini ();
+    char name[32];
+    snprintf (name, sizeof (name), "alloc_%s", backends[i]);
+    buf.len = 0;
+    coap_metrics_write_bench_json (name, nsec, BENCH_SAMPLES, &buf);
+    printf ("%s\n", json);
+  }
+  coap_server_bench (BENCH_SAMPLES, BENCH_DECODE_ITERATIONS);
+  return 0;
 }
 
 int main (int argc, char *argv[])
@@ -184,6 +854,9 @@ int main (int argc, char *argv[])
     coap_free_resource_attr
   );
 
+  devsdk_callbacks_set_reconfiguration (coapImpls, coap_reconfigure);
+  devsdk_callbacks_set_listeners (coapImpls, NULL, coap_device_updated, coap_device_removed);
+
   /* Initialize a new device service */
   devsdk_service_t *service = devsdk_service_new
     ("device-coap", VERSION, impl, coapImpls, &argc, argv, &e);
@@ -197,9 +870,49 @@ int main (int argc, char *argv[])
     {
       printf ("Options:\n");
       printf ("  -h, --help\t\t\tShow this text\n");
+      printf ("  --dead-letter-dump <file>\tPrint rejected requests from a dead letter file\n");
+      printf ("  --last-value-dump <segment> [<index>]\tPrint values from a last value segment\n");
+      printf ("  --capture-dump <file>\t\tWrite messages from a capture file as pcapng\n");
+      printf ("  --capture-replay <file> <host> [<port> [<speed>]]\tSend requests from a capture file to a NoSec server\n");
+      printf ("  --bench-expr <expression>\tTime evaluation of a filter or transform expression\n");
+      printf ("  --bench-json [<expression>]\tPrint microbenchmark samples as JSON lines\n");
       devsdk_usage ();
       return 0;
     }
+    else if (strcmp (argv[n], "--dead-letter-dump") == 0 && n + 1 < argc)
+    {
+      return coap_deadletter_dump (argv[n + 1], stdout) ? EXIT_FAILURE : 0;
+    }
+    else if (strcmp (argv[n], "--capture-dump") == 0 && n + 1 < argc)
+    {
+      return coap_capture_dump (argv[n + 1], stdout) ? EXIT_FAILURE : 0;
+    }
+    else if (strcmp (argv[n], "--capture-replay") == 0 && n + 2 < argc)
+    {
+      return replay_capture (argc, argv, n);
+    }
+    else if (strcmp (argv[n], "--last-value-dump") == 0 && n + 1 < argc)
+    {
+      char index[PATH_MAX];
+      if (n + 2 < argc)
+      {
+        snprintf (index, sizeof (index), "%s", argv[n + 2]);
+      }
+      else if (!coap_lastvalue_default_index (argv[n + 1], index, sizeof (index)))
+      {
+        fprintf (stderr, "segment name too long\n");
+        return EXIT_FAILURE;
+      }
+      return coap_lastvalue_dump (argv[n + 1], index, stdout) ? EXIT_FAILURE : 0;
+    }
+    else if (strcmp (argv[n], "--bench-expr") == 0 && n + 1 < argc)
+    {
+      return bench_expr (argv[n + 1]);
+    }
+    else if (strcmp (argv[n], "--bench-json") == 0)
+    {
+      return bench_json (n + 1 < argc ? argv[n + 1] : BENCH_DEFAULT_EXPR);
+    }
     else
     {
       printf ("%s: Unrecognized option %s\n", argv[0], argv[n]);
@@ -212,6 +925,45 @@ int main (int argc, char *argv[])
   iot_data_string_map_add (driver_map, COAP_BIND_ADDR_KEY, iot_data_alloc_string ("0.0.0.0", IOT_DATA_REF));
   iot_data_string_map_add (driver_map, SECURITY_MODE_KEY, iot_data_alloc_string ("NoSec", IOT_DATA_REF));
   iot_data_string_map_add (driver_map, PSK_KEY_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, CERT_FILE_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, KEY_FILE_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, CA_FILE_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, TRUSTED_KEYS_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, CERT_CACHE_KEY, iot_data_alloc_string ("1024", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, CERT_CACHE_SEC_KEY, iot_data_alloc_string ("3600", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, SOCKET_RCVBUF_KEY, iot_data_alloc_string ("0", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, SOCKET_SNDBUF_KEY, iot_data_alloc_string ("0", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, LOW_LATENCY_KEY, iot_data_alloc_string ("false", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, BUSY_POLL_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, SPIN_BUDGET_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, IO_CPU_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, LOCK_MEMORY_KEY, iot_data_alloc_string ("false", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, DEADLETTER_FILE_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, DEADLETTER_RECORDS_KEY, iot_data_alloc_string ("1024", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, MEMORY_BUDGET_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, ALLOCATOR_KEY, iot_data_alloc_string ("libc", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, PACKET_FILTER_KEY, iot_data_alloc_string ("false", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, SOURCE_ALLOWLIST_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, OBSERVE_KEY, iot_data_alloc_string ("false", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, MAX_ROUTES_KEY, iot_data_alloc_string ("1024", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, HISTORY_SIZE_KEY, iot_data_alloc_string ("0", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, LASTVALUE_SEGMENT_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, LASTVALUE_INDEX_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, LASTVALUE_SLOTS_KEY, iot_data_alloc_string ("1024", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, DEDUPLICATE_KEY, iot_data_alloc_string ("false", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, DEDUP_DEVICES_KEY, iot_data_alloc_string ("1024", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, QUEUED_WRITES_KEY, iot_data_alloc_string ("0", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, PUBLISH_QUEUE_KEY, iot_data_alloc_string ("0", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, SHED_TARGET_KEY, iot_data_alloc_string ("5000", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, SHED_INTERVAL_KEY, iot_data_alloc_string ("100000", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, LATENCY_TARGET_KEY, iot_data_alloc_string ("20000", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, PUBLISH_CPU_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, HOT_COUNTERS_KEY, iot_data_alloc_string ("64", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, HOT_WINDOW_KEY, iot_data_alloc_string ("10", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, CAPTURE_FILE_KEY, iot_data_alloc_string ("", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, CAPTURE_RECORDS_KEY, iot_data_alloc_string ("4096", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, CAPTURE_SAMPLE_KEY, iot_data_alloc_string ("1", IOT_DATA_REF));
+  iot_data_string_map_add (driver_map, CAPTURE_SECONDS_KEY, iot_data_alloc_string ("60", IOT_DATA_REF));
 
   devsdk_service_start (service, driver_map, &e);
   ERR_CHECK (e);
@@ -226,6 +978,15 @@ int main (int argc, char *argv[])
   iot_data_free (driver_map);
   iot_data_free (impl->coap_bind_addr);
   iot_data_free (impl->psk_key);
+  iot_data_free (impl->cert_file);
+  iot_data_free (impl->key_file);
+  iot_data_free (impl->ca_file);
+  free (impl->trusted_keys);
+  iot_data_free (impl->deadletter_file);
+  iot_data_free (impl->capture_file);
+  iot_data_free (impl->lastvalue_segment);
+  iot_data_free (impl->lastvalue_index);
+  coap_actuation_free (impl->writes);
   free (impl);
   puts ("Exiting gracefully");
   return 0;
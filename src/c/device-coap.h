@@ -15,6 +15,9 @@
  */
 
 #include "devsdk/devsdk.h"
+#include "coap-alloc.h"
+#include "coap-filter.h"
+#include "coap-actuation.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -25,6 +28,8 @@ typedef enum
 {
   SECURITY_MODE_PSK,        /**< pre-shared key */
   SECURITY_MODE_NOSEC,      /**< no security */
+  SECURITY_MODE_X509,       /**< client certificate from a trusted CA */
+  SECURITY_MODE_RPK,        /**< client public key from a trusted list */
   SECURITY_MODE_UNKNOWN     /**< not a security mode; just means mode not known */
 } coap_security_mode_t;
 
@@ -39,8 +44,93 @@ typedef struct coap_driver
   iot_data_t *coap_bind_addr;           /**< Address server binds to, for incoming data */
   coap_security_mode_t security_mode;   /**< CoAP transport security mode */
   iot_data_t *psk_key;                  /**< PSK key as uint8_t array; unused if not PSK mode */
+  iot_data_t *cert_file;                /**< Server certificate PEM file; unused if not X509 or RPK */
+  iot_data_t *key_file;                 /**< Server private key PEM file; unused if not X509 or RPK */
+  iot_data_t *ca_file;                  /**< CA certificates PEM file for clients; unused if not X509 */
+  uint8_t *trusted_keys;                /**< Sorted SHA-256 digests of trusted client keys, for RPK */
+  uint32_t trusted_key_count;           /**< Count of trusted_keys */
+  uint32_t cert_cache_entries;          /**< Capacity of accepted common name cache, X509 only; 0 if disabled */
+  uint32_t cert_cache_sec;              /**< Time an accepted common name is cached */
+  uint32_t socket_rcvbuf;               /**< Server socket receive buffer bytes; 0 for OS default */
+  uint32_t socket_sndbuf;               /**< Server socket send buffer bytes; 0 for OS default */
+  bool low_latency;                     /**< Spin on the socket rather than block; see below */
+  uint32_t busy_poll_usec;              /**< SO_BUSY_POLL time in low latency mode */
+  uint32_t spin_budget_usec;            /**< Spin time after last request in low latency mode */
+  int io_cpu;                           /**< CPU for server I/O thread in low latency mode; -1 if not pinned */
+  bool lock_memory;                     /**< Lock and prefault memory in low latency mode */
+  iot_data_t *deadletter_file;          /**< Ring file for rejected requests; NULL if disabled */
+  uint32_t deadletter_records;          /**< Capacity of dead letter ring */
+  uint64_t memory_budget;               /**< Bytes for all pools and tables; 0 if not limited */
+  coap_alloc_backend_t allocator;       /**< Allocator for transient objects */
+  bool packet_filter;                   /**< Attach eBPF filter to server socket */
+  coap_filter_prefix allowlist[FILTER_ALLOWLIST_MAX]; /**< Source prefixes accepted by filter */
+  unsigned allowlist_len;               /**< Prefixes in allowlist; 0 accepts any source */
+  bool observe;                         /**< Serve device resources to local observers */
+  uint32_t max_routes;                  /**< Capacity of route table for device resources */
+  uint32_t history_size;                /**< Numeric readings kept per resource; 0 if disabled */
+  iot_data_t *lastvalue_segment;        /**< Shared memory segment for last values; NULL if disabled */
+  iot_data_t *lastvalue_index;          /**< Index file for last value segment */
+  uint32_t lastvalue_slots;             /**< Capacity of last value segment */
+  bool deduplicate;                     /**< Drop readings with a sequence number already seen */
+  uint32_t dedup_devices;               /**< Devices with a sequence window */
+  uint32_t queued_writes;               /**< Writes queued per device; 0 if writes not supported */
+  coap_actuation *writes;               /**< Writes pending delivery; NULL if not supported */
+  uint32_t publish_queue;               /**< Readings queued for the publisher thread; 0 to post inline */
+  uint32_t shed_target_usec;            /**< Acceptable publish queue delay; 0 to never shed */
+  uint32_t shed_interval_usec;          /**< Time queue delay exceeds target before shedding */
+  uint32_t latency_target_usec;         /**< p99 publish latency for batch control; 0 for fixed batches */
+  int publish_cpu;                      /**< CPU for publisher thread; -1 if not pinned */
+  uint32_t hot_counters;                /**< Counters per kind of key for busiest keys; 0 if disabled */
+  uint32_t hot_window_sec;              /**< Length of a window for busiest keys */
+  iot_data_t *capture_file;             /**< Ring file for captured messages; NULL if disabled */
+  uint32_t capture_records;             /**< Capacity of capture ring */
+  uint32_t capture_sample;              /**< Capture one request in this many */
+  uint32_t capture_seconds;             /**< Default length of a capture */
 } coap_driver;
 
+/**
+ * Driver settings that may change while the server runs, from a
+ * reconfiguration.
+ */
+typedef struct coap_live_config
+{
+  iot_data_t *coap_bind_addr;           /**< Address server binds to */
+  iot_data_t *psk_key;                  /**< PSK key; NULL if not PSK mode */
+  uint32_t socket_rcvbuf;               /**< Server socket receive buffer bytes */
+  uint32_t socket_sndbuf;               /**< Server socket send buffer bytes */
+  uint32_t spin_budget_usec;            /**< Spin time after last request in low latency mode */
+  coap_filter_prefix allowlist[FILTER_ALLOWLIST_MAX]; /**< Source prefixes accepted by filter */
+  unsigned allowlist_len;               /**< Prefixes in allowlist */
+  uint64_t received_usec;               /**< Time passed to server, for apply latency */
+} coap_live_config;
+
+/** Frees settings from a reconfiguration. */
+void coap_live_config_free (coap_live_config *live);
+
+/**
+ * Passes new settings to the server, which applies them between requests.
+ * Replaces settings not yet applied. May be called from any thread.
+ *
+ * @param live  settings; the server takes ownership
+ */
+void coap_server_reconfigure (coap_live_config *live);
+
+/**
+ * Notes that device metadata has changed, so the server resolves devices and
+ * resources cached by its routes again. May be called from any thread.
+ */
+void coap_server_metadata_changed (void);
+
+/**
+ * Times the server's request decoding steps, for the --bench-json option:
+ * reading the URI path, and decoding Int32, Float64 and String payloads.
+ * Prints a JSON line of samples for each. Does not start the server.
+ *
+ * @param samples     samples per step
+ * @param iterations  operations timed per sample
+ */
+void coap_server_bench (uint32_t samples, uint32_t iterations);
+
 /**
  * Runs a CoAP server until a SIGINT or SIGTERM event.
  *
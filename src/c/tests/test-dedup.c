@@ -0,0 +1,190 @@
+/* Unit tests for detection of duplicate readings
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "coap-dedup.h"
+
+static unsigned failures;
+
+#define CHECK(cond)                                                    \
+  do                                                                   \
+  {                                                                    \
+    if (!(cond))                                                       \
+    {                                                                  \
+      fprintf (stderr, "%s:%d: %s: check failed: %s\n", __FILE__,      \
+               __LINE__, __func__, #cond);                             \
+      failures++;                                                      \
+    }                                                                  \
+  } while (0)
+
+/* Checks a sequence number, and accepts it if new, as the server does */
+static coap_dedup_result_t
+receive (coap_dedup *table, const char *device, uint32_t seq)
+{
+  coap_dedup_result_t result = coap_dedup_check (table, device, seq);
+  if (result == DEDUP_NEW)
+  {
+    coap_dedup_accept (table, device, seq);
+  }
+  return result;
+}
+
+/* Renders the table's counters, for checks of their values */
+static const char *
+counters (coap_dedup *table)
+{
+  static char text[256];
+  coap_metrics_buf buf = { .data = text, .size = sizeof (text), .len = 0, .overflow = false };
+  coap_dedup_write_json (table, &buf);
+  return text;
+}
+
+static void
+test_window (void)
+{
+  coap_dedup *table = coap_dedup_new (4);
+  CHECK (receive (table, "d1", 10) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 10) == DEDUP_DUPLICATE);
+  CHECK (receive (table, "d1", 12) == DEDUP_NEW);
+
+  /* out of order, within the window */
+  CHECK (receive (table, "d1", 11) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 11) == DEDUP_DUPLICATE);
+
+  /* 12 is now the oldest number in the window, and 11 just beyond it */
+  CHECK (receive (table, "d1", 75) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 12) == DEDUP_DUPLICATE);
+  CHECK (receive (table, "d1", 11) == DEDUP_STALE);
+
+  /* devices have separate windows */
+  CHECK (receive (table, "d2", 10) == DEDUP_NEW);
+  CHECK (receive (table, "d2", 10) == DEDUP_DUPLICATE);
+  CHECK (strstr (counters (table), "\"devices\":2"));
+  coap_dedup_free (table);
+}
+
+static void
+test_wrap (void)
+{
+  coap_dedup *table = coap_dedup_new (4);
+  CHECK (receive (table, "d1", UINT32_MAX - 1) == DEDUP_NEW);
+  CHECK (receive (table, "d1", UINT32_MAX) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 1) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 2) == DEDUP_NEW);
+
+  /* numbers from before the wrap are still in the window */
+  CHECK (receive (table, "d1", UINT32_MAX) == DEDUP_DUPLICATE);
+  CHECK (receive (table, "d1", UINT32_MAX - 1) == DEDUP_DUPLICATE);
+  CHECK (receive (table, "d1", UINT32_MAX - 2) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 2) == DEDUP_DUPLICATE);
+
+  /* a jump beyond the window leaves only the new number in it */
+  CHECK (receive (table, "d1", 1000) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 999) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 2) == DEDUP_STALE);
+  coap_dedup_free (table);
+}
+
+static void
+test_stale (void)
+{
+  coap_dedup *table = coap_dedup_new (4);
+  CHECK (receive (table, "d1", 100) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 36) == DEDUP_STALE);
+  CHECK (receive (table, "d1", 1) == DEDUP_STALE);
+  CHECK (receive (table, "d1", 37) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 37) == DEDUP_DUPLICATE);
+
+  /* more than half the number space behind is stale, not ahead */
+  CHECK (receive (table, "d1", 100 + (UINT32_C (1) << 31)) == DEDUP_STALE);
+  CHECK (strstr (counters (table), "\"stale\":3"));
+  coap_dedup_free (table);
+}
+
+static void
+test_duplicate (void)
+{
+  coap_dedup *table = coap_dedup_new (4);
+  CHECK (receive (table, "d1", 5) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 5) == DEDUP_DUPLICATE);
+  CHECK (receive (table, "d1", 5) == DEDUP_DUPLICATE);
+  CHECK (strstr (counters (table), "\"accepted\":1,\"duplicates\":2"));
+
+  /* a number checked but not accepted, as when its post fails, may be sent again */
+  CHECK (coap_dedup_check (table, "d1", 6) == DEDUP_NEW);
+  CHECK (coap_dedup_check (table, "d1", 6) == DEDUP_NEW);
+  coap_dedup_accept (table, "d1", 6);
+  CHECK (coap_dedup_check (table, "d1", 6) == DEDUP_DUPLICATE);
+
+  /* likewise for the first number from a device */
+  CHECK (coap_dedup_check (table, "d2", 1) == DEDUP_NEW);
+  CHECK (coap_dedup_check (table, "d2", 1) == DEDUP_NEW);
+  CHECK (strstr (counters (table), "\"devices\":1"));
+  coap_dedup_free (table);
+}
+
+static void
+test_restart (void)
+{
+  coap_dedup *table = coap_dedup_new (4);
+  CHECK (receive (table, "d1", 500) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 501) == DEDUP_NEW);
+
+  /* 0 starts a new window, so low numbers are new again */
+  CHECK (receive (table, "d1", 0) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 0) == DEDUP_DUPLICATE);
+  CHECK (receive (table, "d1", 1) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 1) == DEDUP_DUPLICATE);
+  CHECK (receive (table, "d1", 501) == DEDUP_NEW);
+  CHECK (strstr (counters (table), "\"restarts\":1"));
+
+  /* a restart is not recorded until accepted */
+  CHECK (coap_dedup_check (table, "d1", 0) == DEDUP_NEW);
+  CHECK (receive (table, "d1", 501) == DEDUP_DUPLICATE);
+  CHECK (strstr (counters (table), "\"restarts\":1"));
+
+  /* a first number of 0 is not a restart */
+  CHECK (receive (table, "d2", 0) == DEDUP_NEW);
+  CHECK (receive (table, "d2", 0) == DEDUP_DUPLICATE);
+  CHECK (strstr (counters (table), "\"restarts\":1"));
+  coap_dedup_free (table);
+}
+
+static void
+test_capacity (void)
+{
+  coap_dedup *table = coap_dedup_new (2);
+  CHECK (receive (table, "d1", 1) == DEDUP_NEW);
+  CHECK (receive (table, "d2", 1) == DEDUP_NEW);
+  CHECK (receive (table, "d3", 1) == DEDUP_UNTRACKED);
+  CHECK (receive (table, "d3", 1) == DEDUP_UNTRACKED);
+  CHECK (receive (table, "d1", 1) == DEDUP_DUPLICATE);
+  CHECK (strstr (counters (table), "\"devices\":2,\"max\":2"));
+  CHECK (strstr (counters (table), "\"untracked\":2"));
+  coap_dedup_free (table);
+
+  CHECK (coap_dedup_new (0) == NULL);
+}
+
+int
+main (void)
+{
+  test_window ();
+  test_wrap ();
+  test_stale ();
+  test_duplicate ();
+  test_restart ();
+  test_capacity ();
+  if (failures)
+  {
+    fprintf (stderr, "%u checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}
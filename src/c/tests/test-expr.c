@@ -0,0 +1,165 @@
+/* Unit tests for reading expressions
+ *
+ * Copyright (c) 2020 Ken Bannister
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "coap-expr.h"
+
+static unsigned failures;
+
+#define CHECK(cond)                                                    \
+  do                                                                   \
+  {                                                                    \
+    if (!(cond))                                                       \
+    {                                                                  \
+      fprintf (stderr, "%s:%d: %s: check failed: %s\n", __FILE__,      \
+               __LINE__, __func__, #cond);                             \
+      failures++;                                                      \
+    }                                                                  \
+  } while (0)
+
+/* Compiles and evaluates text for a reading; NaN if it does not compile */
+static double
+eval (const char *text, double v)
+{
+  char error[96];
+  coap_expr *expr = coap_expr_compile (text, error, sizeof (error));
+  if (!expr)
+  {
+    fprintf (stderr, "'%s': %s\n", text, error);
+    return NAN;
+  }
+  coap_expr_vars vars = { .v = v, .last = 20.0, .dt = 2.0 };
+  double result = coap_expr_eval (expr, &vars);
+  coap_expr_free (expr);
+  return result;
+}
+
+/* True if text does not compile, with an error message starting with prefix */
+static bool
+fails_with (const char *text, const char *prefix)
+{
+  char error[96] = "";
+  coap_expr *expr = coap_expr_compile (text, error, sizeof (error));
+  coap_expr_free (expr);
+  return !expr && !strncmp (error, prefix, strlen (prefix));
+}
+
+static void
+test_precedence (void)
+{
+  CHECK (eval ("1 + 2 * 3", 0) == 7);
+  CHECK (eval ("(1 + 2) * 3", 0) == 9);
+  CHECK (eval ("10 - 4 - 3", 0) == 3);
+  CHECK (eval ("24 / 4 / 2", 0) == 3);
+  CHECK (eval ("-2 * 3", 0) == -6);
+  CHECK (eval ("--v", 5) == 5);
+  CHECK (eval ("v * 1.8 + 32", 100) == 212);
+
+  /* arithmetic binds tighter than comparison, and comparison than logic */
+  CHECK (eval ("1 + 1 == 2", 0) == 1);
+  CHECK (eval ("v > 1 && v < 10", 5) == 1);
+  CHECK (eval ("v > 1 && v < 10", 10) == 0);
+  CHECK (eval ("v < 1 || v > 9 && v < 20", 0) == 1);
+  CHECK (eval ("v < 1 || v > 9 && v < 20", 25) == 0);
+  CHECK (eval ("0 && 1 || 1", 0) == 1);
+  CHECK (eval ("!v == 0", 3) == 1);
+  CHECK (eval ("!(v == 0)", 0) == 0);
+}
+
+static void
+test_values (void)
+{
+  CHECK (eval ("abs(v - 30)", 10) == 20);
+  CHECK (eval ("min(v, 5) + max(v, 5)", 2) == 7);
+  CHECK (eval ("abs(v - last) > 1", 22) == 1);
+  CHECK (eval ("(v - last) / dt", 30) == 5);
+  CHECK (eval ("v != v", NAN) == 1);
+  CHECK (eval (".5 + 1e1", 0) == 10.5);
+  CHECK (isinf (eval ("1 / 0", 0)));
+
+  char error[96];
+  coap_expr *expr = coap_expr_compile ("v", error, sizeof (error));
+  CHECK (expr && !coap_expr_uses_state (expr));
+  coap_expr_free (expr);
+  expr = coap_expr_compile ("dt > 60", error, sizeof (error));
+  CHECK (expr && coap_expr_uses_state (expr));
+  coap_expr_free (expr);
+}
+
+static void
+test_errors (void)
+{
+  CHECK (fails_with ("", "unexpected end at offset 0"));
+  CHECK (fails_with ("1 +", "unexpected end at offset 3"));
+  CHECK (fails_with ("(v", "expected ')' at offset 2"));
+  CHECK (fails_with ("v)", "unexpected character at offset 1"));
+  CHECK (fails_with ("v $ 2", "unexpected character at offset 2"));
+  CHECK (fails_with ("val", "unexpected character at offset 0"));
+  CHECK (fails_with ("min(v)", "expected ','"));
+  CHECK (fails_with ("1e999", "invalid number"));
+  CHECK (fails_with ("v v", "unexpected character"));
+
+  char text[EXPR_TEXT_MAXLEN + 2];
+  memset (text, ' ', sizeof (text) - 1);
+  text[0] = 'v';
+  text[sizeof (text) - 1] = '\0';
+  CHECK (fails_with (text, "expression longer than"));
+
+  /* 33 distinct constants */
+  CHECK (fails_with ("1+2+3+4+5+6+7+8+9+10+11+12+13+14+15+16+17+18+19+20+21+22+23+24+25+26+27+28+29+"
+                     "30+31+32+33", "too many constants"));
+}
+
+static void
+test_stack_depth (void)
+{
+  /* each open parenthesis holds one value on the stack until it closes */
+  char text[EXPR_TEXT_MAXLEN + 1] = "";
+  for (unsigned i = 0; i < 15; i++)
+  {
+    strcat (text, "v+(");
+  }
+  strcat (text, "v");
+  for (unsigned i = 0; i < 15; i++)
+  {
+    strcat (text, ")");
+  }
+  CHECK (eval (text, 1) == 16);
+
+  strcpy (text, "v+(");
+  for (unsigned i = 0; i < 15; i++)
+  {
+    strcat (text, "v+(");
+  }
+  strcat (text, "v");
+  for (unsigned i = 0; i < 16; i++)
+  {
+    strcat (text, ")");
+  }
+  CHECK (fails_with (text, "expression too deeply nested"));
+
+  /* nesting that does not hold values is not limited by the stack */
+  CHECK (eval ("((((((((((((((((((((v))))))))))))))))))))", 3) == 3);
+}
+
+int
+main (void)
+{
+  test_precedence ();
+  test_values ();
+  test_errors ();
+  test_stack_depth ();
+  if (failures)
+  {
+    fprintf (stderr, "%u checks failed\n", failures);
+    return 1;
+  }
+  return 0;
+}